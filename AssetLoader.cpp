@@ -0,0 +1,117 @@
+#include "AssetLoader.h"
+#include "ThreadPool.h"
+
+#include <cstdio>
+
+// --------------------------------------------------------
+// Starts the clock for this batch of assets
+// --------------------------------------------------------
+AssetLoader::AssetLoader() :
+	startTime(std::chrono::steady_clock::now()),
+	totalTimeMs(0)
+{
+}
+
+
+// --------------------------------------------------------
+// Queues all CPU work for the given mesh on the thread pool
+// and returns a handle to the eventual result.  The handle
+// can be waited on (get()) from any thread that isn't one
+// of the pool's workers.
+// --------------------------------------------------------
+MeshLoadHandle AssetLoader::LoadMeshAsync(const std::wstring& objFile, const MeshLoadOptions& options)
+{
+	MeshLoadHandle handle = ThreadPool::GetInstance().Submit([objFile, options]()
+		{
+			std::shared_ptr<MeshLoadResult> result = std::make_shared<MeshLoadResult>();
+			LoadMesh(objFile, *result, options);
+			return result;
+		}).share();
+
+	meshRequests.push_back(handle);
+	return handle;
+}
+
+
+// --------------------------------------------------------
+// Same as above, but for a mesh that's already been
+// processed and stored in an asset pack
+// --------------------------------------------------------
+MeshLoadHandle AssetLoader::LoadMeshAsync(AssetPack& pack, const std::string& name)
+{
+	AssetPack* packPtr = &pack;
+	MeshLoadHandle handle = ThreadPool::GetInstance().Submit([packPtr, name]()
+		{
+			std::shared_ptr<MeshLoadResult> result = std::make_shared<MeshLoadResult>();
+			LoadMesh(*packPtr, name, *result);
+			return result;
+		}).share();
+
+	meshRequests.push_back(handle);
+	return handle;
+}
+
+
+// --------------------------------------------------------
+// Waits for every outstanding request
+// --------------------------------------------------------
+void AssetLoader::WaitForAll()
+{
+	for (MeshLoadHandle& handle : meshRequests)
+		handle.wait();
+
+	totalTimeMs = std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - startTime).count();
+}
+
+
+// --------------------------------------------------------
+// Prints how long each phase took for every mesh, along
+// with welding, optimization, LOD and meshlet stats.  Phase
+// times are per mesh and their sum is usually well over
+// the wall clock time, since the meshes load in parallel.
+// --------------------------------------------------------
+void AssetLoader::PrintReport()
+{
+	printf("Loaded %zu meshes in %.2f ms:\n", meshRequests.size(), totalTimeMs);
+	for (MeshLoadHandle& handle : meshRequests)
+	{
+		const MeshLoadResult& result = *handle.get();
+		const MeshLoadTimings& t = result.Timings;
+
+		if (!result.Success)
+		{
+			printf("  %ls: FAILED\n", result.SourceFile.c_str());
+			continue;
+		}
+
+		printf("  %ls: %s, %zu -> %zu verts, %zu indices\n",
+			result.SourceFile.c_str(),
+			result.FromCache ? "cached" : "parsed",
+			result.Weld.InputVertices,
+			result.Weld.OutputVertices,
+			result.IndexCount);
+		printf("    read %.2f | parse %.2f | weld %.2f | optimize %.2f | tangents %.2f | lods %.2f | meshlets %.2f | cache %.2f | total %.2f ms\n",
+			t.Read, t.Parse, t.Weld, t.Optimize, t.Tangents, t.Lods, t.Meshlets, t.Cache, t.Total);
+
+		const MeshOptimizeStats& o = result.Optimize;
+		if (!result.FromCache && o.CacheAfter.ACMR > 0)
+		{
+			printf("    ACMR %.3f -> %.3f | ATVR %.3f -> %.3f | overfetch %.3f -> %.3f\n",
+				o.CacheBefore.ACMR, o.CacheAfter.ACMR,
+				o.CacheBefore.ATVR, o.CacheAfter.ATVR,
+				o.OverfetchBefore, o.OverfetchAfter);
+		}
+
+		if (result.LodCount > 0)
+		{
+			printf("    LODs: %zu", result.IndexCount / 3);
+			for (unsigned int i = 0; i < result.LodCount; i++)
+				printf(" -> %zu (error %.4f)", result.LodIndexCounts[i] / 3, result.LodErrors[i]);
+			printf(" tris\n");
+		}
+
+		if (result.MeshletCount > 0)
+			printf("    meshlets: %zu\n", result.MeshletCount);
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MeshLoader.h"
+
+// Handle to a mesh that is (or will soon be) loaded on the CPU
+typedef std::shared_future<std::shared_ptr<MeshLoadResult>> MeshLoadHandle;
+
+// --------------------------------------------------------
+// Loads a group of assets in parallel on the thread pool.
+//
+// Only the CPU side of loading happens here, so it has no
+// D3D dependencies.  Once everything is ready, the results
+// can be turned into GPU resources in a single batch.
+// --------------------------------------------------------
+class AssetLoader
+{
+public:
+	AssetLoader();
+
+	// Starts loading a mesh in the background
+	MeshLoadHandle LoadMeshAsync(const std::wstring& objFile, const MeshLoadOptions& options = MeshLoadOptions());
+
+	// Starts loading a mesh from a pack (which must outlive the result)
+	MeshLoadHandle LoadMeshAsync(AssetPack& pack, const std::string& name);
+
+	// Blocks until every requested asset has finished loading
+	void WaitForAll();
+
+	// Prints per-asset, per-phase timings (after WaitForAll)
+	void PrintReport();
+
+private:
+	std::vector<MeshLoadHandle> meshRequests;
+
+	// Wall clock time from construction to WaitForAll()
+	std::chrono::steady_clock::time_point startTime;
+	double totalTimeMs;
+};
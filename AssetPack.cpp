@@ -0,0 +1,299 @@
+#include "AssetPack.h"
+#include "AssetLoader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#define ALIGN(value, alignment) (((value + alignment - 1) / alignment) * alignment)
+
+// --------------------------------------------------------
+// Maps the pack and checks that its header and table of
+// contents make sense.  If not, IsOpen() returns false.
+// --------------------------------------------------------
+AssetPack::AssetPack(const std::wstring& packFile) :
+	file(packFile),
+	header(0),
+	entries(0),
+	names(0)
+{
+	if (!file.IsOpen() || file.GetSize() < sizeof(AssetPackHeader))
+		return;
+
+	const char* data = file.GetData();
+	size_t size = file.GetSize();
+	const AssetPackHeader* h = (const AssetPackHeader*)data;
+	if (memcmp(h->Magic, "APAK", 4) != 0 ||
+		h->Version != ASSET_PACK_VERSION ||
+		h->FileSize != size ||
+		h->TocOffset < sizeof(AssetPackHeader) ||
+		h->TocOffset % ASSET_PACK_ALIGNMENT != 0 ||
+		h->NamesOffset > size ||
+		h->TocOffset > h->NamesOffset ||
+		(uint64_t)h->EntryCount * sizeof(AssetPackEntry) > h->NamesOffset - h->TocOffset)
+		return;
+
+	// Every asset (and its name) needs to be inside the file,
+	// and the hashes need to be sorted for the lookup in Find()
+	const AssetPackEntry* toc = (const AssetPackEntry*)(data + h->TocOffset);
+	for (uint32_t i = 0; i < h->EntryCount; i++)
+	{
+		if (toc[i].DataOffset > size ||
+			toc[i].DataSize > size - toc[i].DataOffset ||
+			h->NamesOffset + toc[i].NameOffset + toc[i].NameLength > toc[i].DataOffset ||
+			(i > 0 && toc[i].NameHash < toc[i - 1].NameHash))
+			return;
+	}
+
+	header = h;
+	entries = toc;
+	names = data + h->NamesOffset;
+}
+
+
+// --------------------------------------------------------
+// Finds an asset with a binary search over the (sorted)
+// name hashes, then checks the actual name in case of
+// collisions
+// --------------------------------------------------------
+AssetView AssetPack::Find(const std::string& name)
+{
+	AssetView view = {};
+	if (!header)
+		return view;
+
+	std::string assetName = GetAssetName(name);
+	uint64_t hash = MeshCache::HashData(assetName.data(), assetName.size());
+
+	const AssetPackEntry* end = entries + header->EntryCount;
+	const AssetPackEntry* entry = std::lower_bound(entries, end, hash,
+		[](const AssetPackEntry& e, uint64_t h) { return e.NameHash < h; });
+
+	for (; entry != end && entry->NameHash == hash; entry++)
+	{
+		if (entry->NameLength == assetName.size() &&
+			memcmp(names + entry->NameOffset, assetName.data(), assetName.size()) == 0)
+		{
+			view.Data = file.GetData() + entry->DataOffset;
+			view.Size = (size_t)entry->DataSize;
+			view.Type = entry->Type;
+			break;
+		}
+	}
+
+	return view;
+}
+
+
+// --------------------------------------------------------
+// Names use forward slashes and never start with "./" or
+// a slash, so "Models\cube.obj" and "./Models/cube.obj"
+// both become "Models/cube.obj"
+// --------------------------------------------------------
+std::string AssetPack::GetAssetName(const std::string& relativePath)
+{
+	std::string name = relativePath;
+	std::replace(name.begin(), name.end(), '\\', '/');
+
+	while (name.compare(0, 2, "./") == 0)
+		name.erase(0, 2);
+	while (!name.empty() && name[0] == '/')
+		name.erase(0, 1);
+
+	return name;
+}
+
+
+// --------------------------------------------------------
+// Builds a pack file from every asset in a folder (and its
+// subfolders).  This is meant to be run offline, ahead of
+// shipping, rather than every time the game starts.
+//
+// - .obj files are fully processed (using the given
+//    options) and stored in .meshbin format
+// - Images and anything else are stored as-is
+// - Caches (.meshbin, .bvhbin), temporary files and other
+//    packs in the folder are skipped
+// - Assets are laid out in name order, each aligned, and
+//    the whole file is written to a temporary file first
+//
+// assetFolder - Root folder, which asset names are relative to
+// packFile    - Pack file to (over)write
+// options     - Processing steps for meshes
+//
+// Returns false if any asset couldn't be loaded or written
+// --------------------------------------------------------
+bool AssetPack::Build(const std::wstring& assetFolder, const std::wstring& packFile, const MeshLoadOptions& options)
+{
+	struct PackItem
+	{
+		std::string Name;
+		std::filesystem::path Path;
+		AssetType Type;
+		MeshLoadHandle Mesh;
+	};
+
+	// Find everything worth packing
+	std::vector<PackItem> items;
+	std::error_code error;
+	std::filesystem::path root(assetFolder);
+	for (std::filesystem::recursive_directory_iterator it(root, error), end; !error && it != end; it.increment(error))
+	{
+		if (!it->is_regular_file())
+			continue;
+
+		std::string extension = it->path().extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)tolower(c); });
+		if (extension == ".meshbin" || extension == ".bvhbin" || extension == ".pak" || extension == ".tmp")
+			continue;
+
+		PackItem item;
+		item.Name = GetAssetName(std::filesystem::relative(it->path(), root).generic_string());
+		item.Path = it->path();
+		item.Type = AssetType::Raw;
+		if (extension == ".obj")
+			item.Type = AssetType::Mesh;
+		else if (extension == ".png" || extension == ".jpg" || extension == ".jpeg" || extension == ".bmp" ||
+			extension == ".tga" || extension == ".dds" || extension == ".tif" || extension == ".tiff")
+			item.Type = AssetType::Texture;
+		items.push_back(item);
+	}
+	if (error)
+		return false;
+
+	std::sort(items.begin(), items.end(),
+		[](const PackItem& a, const PackItem& b) { return a.Name < b.Name; });
+
+	// Process all of the meshes in parallel up front
+	AssetLoader assetLoader;
+	for (PackItem& item : items)
+	{
+		if (item.Type == AssetType::Mesh)
+			item.Mesh = assetLoader.LoadMeshAsync(item.Path.wstring(), options);
+	}
+	assetLoader.WaitForAll();
+
+	// Table of contents and names come first, and we know
+	// their sizes already
+	std::vector<AssetPackEntry> toc(items.size());
+	std::string allNames;
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		toc[i].NameHash = MeshCache::HashData(items[i].Name.data(), items[i].Name.size());
+		toc[i].NameOffset = (uint32_t)allNames.size();
+		toc[i].NameLength = (uint32_t)items[i].Name.size();
+		toc[i].Type = items[i].Type;
+		allNames += items[i].Name;
+	}
+
+	AssetPackHeader header = {};
+	memcpy(header.Magic, "APAK", 4);
+	header.Version = ASSET_PACK_VERSION;
+	header.EntryCount = (uint32_t)items.size();
+	header.MeshFlags = GetMeshCacheFlags(options);
+	header.TocOffset = ALIGN(sizeof(AssetPackHeader), ASSET_PACK_ALIGNMENT);
+	header.NamesOffset = header.TocOffset + toc.size() * sizeof(AssetPackEntry);
+
+	std::filesystem::path finalPath(packFile);
+	std::filesystem::path tempPath(packFile + L".tmp");
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if (!out.is_open())
+			return false;
+
+		// Skip over the header and table of contents for now
+		const char zeros[ASSET_PACK_ALIGNMENT] = {};
+		uint64_t offset = header.NamesOffset + allNames.size();
+		out.seekp(header.NamesOffset);
+		out.write(allNames.data(), allNames.size());
+
+		// Then each asset in turn
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			std::vector<char> bytes;
+			if (items[i].Type == AssetType::Mesh)
+			{
+				const MeshLoadResult& result = *items[i].Mesh.get();
+				if (!result.Success)
+					return false;
+
+				// Whether it was just processed or came from its
+				// cache, the result has everything we need
+				MeshData meshData;
+				meshData.Vertices.assign(result.Vertices, result.Vertices + result.VertexCount);
+				meshData.Indices.assign(result.Indices, result.Indices + result.IndexCount);
+				meshData.Lods.resize(result.LodCount);
+				for (unsigned int l = 0; l < result.LodCount; l++)
+				{
+					meshData.Lods[l].Indices.assign(result.LodIndices[l], result.LodIndices[l] + result.LodIndexCounts[l]);
+					meshData.Lods[l].Error = result.LodErrors[l];
+				}
+				if (result.MeshletCount > 0)
+				{
+					MeshletData& meshlets = meshData.Meshlets;
+					meshlets.Meshlets.assign(result.Meshlets, result.Meshlets + result.MeshletCount);
+					meshlets.Bounds.assign(result.MeshletCullBounds, result.MeshletCullBounds + result.MeshletCount);
+
+					// The arrays are as long as the furthest any meshlet reaches
+					size_t vertexCount = 0;
+					size_t triangleCount = 0;
+					for (const Meshlet& meshlet : meshlets.Meshlets)
+					{
+						vertexCount = (std::max)(vertexCount, (size_t)meshlet.VertexOffset + meshlet.VertexCount);
+						triangleCount = (std::max)(triangleCount, (size_t)meshlet.TriangleOffset + meshlet.TriangleCount);
+					}
+					meshlets.Vertices.assign(result.MeshletVertices, result.MeshletVertices + vertexCount);
+					meshlets.Triangles.assign(result.MeshletTriangles, result.MeshletTriangles + triangleCount * 3);
+				}
+
+				// Keeping the source's hash lets meshes from the pack be
+				// matched up with the same mesh loaded any other way
+				bytes = MeshCache::Serialize(meshData, result.SourceHash, result.SourceSize, header.MeshFlags, result.BoundsMin, result.BoundsMax);
+			}
+			else
+			{
+				// Empty files can't be mapped, but are fine to pack
+				MappedFile source(items[i].Path.wstring());
+				if (source.IsOpen())
+					bytes.assign(source.GetData(), source.GetData() + source.GetSize());
+				else if (std::filesystem::file_size(items[i].Path, error) != 0 || error)
+					return false;
+			}
+
+			uint64_t aligned = ALIGN(offset, ASSET_PACK_ALIGNMENT);
+			out.write(zeros, aligned - offset);
+			out.write(bytes.data(), bytes.size());
+
+			toc[i].DataOffset = aligned;
+			toc[i].DataSize = bytes.size();
+			offset = aligned + bytes.size();
+		}
+		header.FileSize = offset;
+
+		// Now the header and (sorted) table of contents can go in
+		std::sort(toc.begin(), toc.end(), [&](const AssetPackEntry& a, const AssetPackEntry& b)
+			{
+				return a.NameHash != b.NameHash ? a.NameHash < b.NameHash : a.NameOffset < b.NameOffset;
+			});
+
+		out.seekp(0);
+		out.write((const char*)&header, sizeof(AssetPackHeader));
+		out.write(zeros, header.TocOffset - sizeof(AssetPackHeader));
+		out.write((const char*)toc.data(), toc.size() * sizeof(AssetPackEntry));
+
+		if (!out.good())
+			return false;
+	}
+
+	std::filesystem::rename(tempPath, finalPath, error);
+	if (error)
+	{
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "MappedFile.h"
+#include "MeshLoader.h"
+
+// Bump this whenever the layout of a pack file changes
+#define ASSET_PACK_VERSION 1
+
+// Every section and asset starts on a multiple of this
+#define ASSET_PACK_ALIGNMENT 64
+
+// What kind of data an asset holds
+enum class AssetType : uint32_t
+{
+	Raw,		// Copied as-is
+	Mesh,		// A processed mesh, in .meshbin format
+	Texture		// An image file (.png, .jpg, etc.), as-is
+};
+
+// --------------------------------------------------------
+// Header at the start of every pack file.  It's followed by
+// the table of contents (sorted by name hash), then all of
+// the asset names, then the assets themselves.
+// --------------------------------------------------------
+struct AssetPackHeader
+{
+	char Magic[4];			// Always "APAK"
+	uint32_t Version;		// ASSET_PACK_VERSION when written
+	uint32_t EntryCount;
+	uint32_t MeshFlags;		// MESH_CACHE_FLAG_ values for every mesh
+	uint64_t TocOffset;		// Byte offsets from start of file
+	uint64_t NamesOffset;
+	uint64_t FileSize;
+};
+
+// One asset in the table of contents
+struct AssetPackEntry
+{
+	uint64_t NameHash;
+	uint64_t DataOffset;	// From start of file
+	uint64_t DataSize;
+	uint32_t NameOffset;	// From start of the names
+	uint32_t NameLength;
+	AssetType Type;
+	uint32_t Padding;
+};
+
+// --------------------------------------------------------
+// An asset's data, pointing straight into the pack (only
+// valid while the pack is alive)
+// --------------------------------------------------------
+struct AssetView
+{
+	const char* Data;
+	size_t Size;
+	AssetType Type;
+
+	bool IsValid() { return Data != 0; }
+};
+
+// --------------------------------------------------------
+// A single file holding every asset the game needs, mapped
+// once so that loading needs no more file opens.
+//
+// Assets are found by their path relative to the Assets
+// folder, using forward slashes (like "Models/cube.obj").
+// Meshes are stored already processed, so they load just
+// like a .meshbin cache hit.
+// --------------------------------------------------------
+class AssetPack
+{
+public:
+	AssetPack(const std::wstring& packFile);
+
+	bool IsOpen() { return header != 0; }
+	uint32_t GetAssetCount() { return header ? header->EntryCount : 0; }
+	uint32_t GetMeshFlags() { return header ? header->MeshFlags : 0; }
+
+	// Looks up an asset by name (returns an invalid view if missing)
+	AssetView Find(const std::string& name);
+
+	// Builds a pack from everything in a folder (offline step)
+	static bool Build(
+		const std::wstring& assetFolder,
+		const std::wstring& packFile,
+		const MeshLoadOptions& options = MeshLoadOptions());
+
+	// Turns a relative path into the name used inside packs
+	static std::string GetAssetName(const std::string& relativePath);
+
+private:
+	MappedFile file;
+	const AssetPackHeader* header;
+	const AssetPackEntry* entries;
+	const char* names;
+};
@@ -9,6 +9,8 @@ struct VertexShaderExternalData
 	DirectX::XMFLOAT4X4 worldInverseTranspose;
 	DirectX::XMFLOAT4X4 view;
 	DirectX::XMFLOAT4X4 projection;
+	DirectX::XMFLOAT4 positionCenter;		// Vertex quantization (w unused)
+	DirectX::XMFLOAT4 positionHalfExtent;
 };
 
 struct PixelShaderExternalData
@@ -32,5 +34,7 @@ struct RaytracingSceneData
 struct RaytracingEntityData
 {
 	DirectX::XMFLOAT4 color[MAX_INSTANCES_PER_BLAS];
+	DirectX::XMFLOAT4 positionCenter;		// Vertex quantization (w unused)
+	DirectX::XMFLOAT4 positionHalfExtent;
 	int type;
 };
\ No newline at end of file
@@ -0,0 +1,2139 @@
+#include "Bvh.h"
+#include "BvhCache.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+
+using namespace DirectX;
+
+// --------------------------------------------------------
+// Axis aligned box used while building (the w components
+// are along for the ride)
+// --------------------------------------------------------
+struct BuildBounds
+{
+	XMVECTOR Min;
+	XMVECTOR Max;
+
+	void Reset()
+	{
+		Min = XMVectorReplicate(FLT_MAX);
+		Max = XMVectorReplicate(-FLT_MAX);
+	}
+
+	void Grow(XMVECTOR point)
+	{
+		Min = XMVectorMin(Min, point);
+		Max = XMVectorMax(Max, point);
+	}
+
+	void Grow(const BuildBounds& bounds)
+	{
+		Min = XMVectorMin(Min, bounds.Min);
+		Max = XMVectorMax(Max, bounds.Max);
+	}
+
+	XMVECTOR Centroid() const
+	{
+		return XMVectorScale(XMVectorAdd(Min, Max), 0.5f);
+	}
+
+	// Surface area (zero for empty boxes)
+	float Area() const
+	{
+		XMFLOAT3 size;
+		XMStoreFloat3(&size, XMVectorSubtract(Max, Min));
+		if (size.x < 0 || size.y < 0 || size.z < 0)
+			return 0;
+		return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+};
+
+// Surface area of a finished node's box
+static float NodeArea(const BvhNode& node)
+{
+	float x = node.BoundsMax.x - node.BoundsMin.x;
+	float y = node.BoundsMax.y - node.BoundsMin.y;
+	float z = node.BoundsMax.z - node.BoundsMin.z;
+	return 2.0f * (x * y + y * z + z * x);
+}
+
+// --------------------------------------------------------
+// What to multiply a centroid's offset from the min corner
+// of the centroid bounds by to get its bin on each axis
+// (axes with no extent put everything in the first bin)
+// --------------------------------------------------------
+static XMVECTOR BinScale(const BuildBounds& centroidBounds, uint32_t binCount)
+{
+	XMVECTOR extent = XMVectorSubtract(centroidBounds.Max, centroidBounds.Min);
+	XMVECTOR scale = XMVectorDivide(XMVectorReplicate((float)binCount), extent);
+	return XMVectorSelect(scale, XMVectorZero(), XMVectorLessOrEqual(extent, XMVectorZero()));
+}
+
+// One SAH bucket along one axis
+struct BuildBin
+{
+	BuildBounds Bounds;
+	uint32_t Count;
+};
+
+// --------------------------------------------------------
+// Does the actual work of building a tree.  Nodes are built
+// into a scratch array where every subtree has its own range
+// of slots (a subtree over n triangles needs at most 2n - 1
+// nodes), so parallel subtrees never touch the same memory
+// and the result doesn't depend on which thread did what.
+// The finished tree is then packed down into depth first
+// order.
+//
+// Trees can also be built over plain boxes (like instances),
+// in which case each box is treated just like a triangle.
+// --------------------------------------------------------
+class BvhBuilder
+{
+public:
+	BvhBuilder(const Vertex* verts, const unsigned int* indices, size_t triangleCount);
+	BvhBuilder(const BvhBounds* boxes, size_t boxCount, uint32_t maxLeafSize);
+
+	void Build(std::vector<BvhNode>& nodes, std::vector<uint32_t>& triangleOrder, uint32_t& maxDepth);
+
+private:
+	uint32_t triangleCount;
+	uint32_t maxLeafSize;
+
+	// Per-triangle bounds
+	std::vector<BuildBounds> triangleBounds;
+
+	// Triangles, partitioned in place as the tree is built
+	std::vector<uint32_t> order;
+
+	// Nodes, with gaps, in the order they were reserved
+	std::vector<BvhNode> scratchNodes;
+
+	void BuildNode(uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t childBase, uint32_t depth);
+	void CalculateBounds(uint32_t first, uint32_t count, BuildBounds& bounds, BuildBounds& centroidBounds);
+	void FillBins(uint32_t first, uint32_t count, const BuildBounds& centroidBounds, uint32_t binCount, BuildBin bins[3][BVH_SAH_BINS]);
+};
+
+
+// --------------------------------------------------------
+// Grabs the bounds of every triangle up front
+// --------------------------------------------------------
+BvhBuilder::BvhBuilder(const Vertex* verts, const unsigned int* indices, size_t triangleCount) :
+	triangleCount((uint32_t)triangleCount),
+	maxLeafSize(BVH_MAX_LEAF_TRIANGLES)
+{
+	triangleBounds.resize(triangleCount);
+	order.resize(triangleCount);
+
+	size_t jobs = (triangleCount + BVH_PARALLEL_THRESHOLD - 1) / BVH_PARALLEL_THRESHOLD;
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * BVH_PARALLEL_THRESHOLD, triangleCount);
+			for (size_t t = job * BVH_PARALLEL_THRESHOLD; t < end; t++)
+			{
+				BuildBounds& bounds = triangleBounds[t];
+				bounds.Reset();
+				for (int c = 0; c < 3; c++)
+					bounds.Grow(XMLoadFloat3(&verts[indices[t * 3 + c]].Position));
+
+				order[t] = (uint32_t)t;
+			}
+		});
+}
+
+
+// --------------------------------------------------------
+// Same as above, for boxes that are already known
+// --------------------------------------------------------
+BvhBuilder::BvhBuilder(const BvhBounds* boxes, size_t boxCount, uint32_t maxLeafSize) :
+	triangleCount((uint32_t)boxCount),
+	maxLeafSize((std::max)(maxLeafSize, 1u))
+{
+	triangleBounds.resize(boxCount);
+	order.resize(boxCount);
+	for (size_t b = 0; b < boxCount; b++)
+	{
+		triangleBounds[b].Min = XMLoadFloat3(&boxes[b].Min);
+		triangleBounds[b].Max = XMLoadFloat3(&boxes[b].Max);
+		order[b] = (uint32_t)b;
+	}
+}
+
+
+// --------------------------------------------------------
+// Builds the whole tree, then packs the nodes so that the
+// root is first and every pair of children is adjacent
+// --------------------------------------------------------
+void BvhBuilder::Build(std::vector<BvhNode>& nodes, std::vector<uint32_t>& triangleOrder, uint32_t& maxDepth)
+{
+	scratchNodes.resize((size_t)triangleCount * 2 - 1);
+	BuildNode(0, 0, triangleCount, 1, 1);
+
+	// Walk the tree depth first, giving each pair of children
+	// the next two slots in the final array
+	nodes.clear();
+	nodes.push_back(scratchNodes[0]);
+	maxDepth = 0;
+
+	struct PackEntry { uint32_t Node; uint32_t ScratchNode; uint32_t Depth; };
+	std::vector<PackEntry> stack;
+	stack.push_back({ 0, 0, 1 });
+	while (!stack.empty())
+	{
+		PackEntry entry = stack.back();
+		stack.pop_back();
+		maxDepth = (std::max)(maxDepth, entry.Depth);
+
+		const BvhNode& scratch = scratchNodes[entry.ScratchNode];
+		if (scratch.IsLeaf())
+			continue;
+
+		uint32_t left = (uint32_t)nodes.size();
+		nodes.push_back(scratchNodes[scratch.LeftFirst]);
+		nodes.push_back(scratchNodes[scratch.LeftFirst + 1]);
+		nodes[entry.Node].LeftFirst = left;
+
+		// Right first, so the left subtree comes out first
+		stack.push_back({ left + 1, scratch.LeftFirst + 1, entry.Depth + 1 });
+		stack.push_back({ left, scratch.LeftFirst, entry.Depth + 1 });
+	}
+
+	triangleOrder.swap(order);
+}
+
+
+// --------------------------------------------------------
+// Turns a range of triangles into a leaf, or splits it in
+// two with the SAH and recurses.
+//
+// nodeIndex - Scratch slot for this node
+// first     - First triangle (in order) under this node
+// count     - Number of triangles under this node
+// childBase - First scratch slot reserved for descendants
+// depth     - Depth of this node (the root is 1)
+// --------------------------------------------------------
+void BvhBuilder::BuildNode(uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t childBase, uint32_t depth)
+{
+	BuildBounds bounds, centroidBounds;
+	CalculateBounds(first, count, bounds, centroidBounds);
+
+	BvhNode& node = scratchNodes[nodeIndex];
+	XMStoreFloat3(&node.BoundsMin, bounds.Min);
+	XMStoreFloat3(&node.BoundsMax, bounds.Max);
+	node.LeftFirst = first;
+	node.TriangleCount = count;
+	if (count == 1)
+		return;
+
+	// Would halving from here on still fit under the depth
+	// limit?  If not, stop trusting the SAH and just halve.
+	uint32_t levelsNeeded = 1;
+	for (uint32_t leaves = (count + maxLeafSize - 1) / maxLeafSize; leaves > 1; leaves = (leaves + 1) / 2)
+		levelsNeeded++;
+	bool forceMedian = depth + levelsNeeded >= BVH_MAX_DEPTH;
+
+	// Two things that can't share a leaf only split one way
+	if (count == 2 && maxLeafSize < 2)
+		forceMedian = true;
+
+	// Find the cheapest split over every axis's bins
+	int bestAxis = -1;
+	uint32_t bestBin = 0;
+	float bestCost = FLT_MAX;
+	XMFLOAT3 centroidMin, centroidMax;
+	XMStoreFloat3(&centroidMin, centroidBounds.Min);
+	XMStoreFloat3(&centroidMax, centroidBounds.Max);
+	// Small nodes don't need as many bins, and the sweeps
+	// below are a big part of their cost
+	uint32_t binCount = (std::min)(count, (uint32_t)BVH_SAH_BINS);
+	if (!forceMedian)
+	{
+		BuildBin bins[3][BVH_SAH_BINS];
+		FillBins(first, count, centroidBounds, binCount, bins);
+
+		for (int a = 0; a < 3; a++)
+		{
+			if ((&centroidMax.x)[a] <= (&centroidMin.x)[a])
+				continue;
+
+			// Sweep from the right to get the cost of everything
+			// to the right of each split, then from the left
+			float rightCosts[BVH_SAH_BINS];
+			BuildBounds rightBounds;
+			rightBounds.Reset();
+			uint32_t rightCount = 0;
+			for (uint32_t b = binCount - 1; b > 0; b--)
+			{
+				rightBounds.Grow(bins[a][b].Bounds);
+				rightCount += bins[a][b].Count;
+				rightCosts[b] = rightCount > 0 ? rightBounds.Area() * rightCount : FLT_MAX;
+			}
+
+			BuildBounds leftBounds;
+			leftBounds.Reset();
+			uint32_t leftCount = 0;
+			for (uint32_t b = 1; b < binCount; b++)
+			{
+				leftBounds.Grow(bins[a][b - 1].Bounds);
+				leftCount += bins[a][b - 1].Count;
+				if (leftCount == 0 || leftCount == count)
+					continue;
+
+				float cost = leftBounds.Area() * leftCount + rightCosts[b];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = a;
+					bestBin = b;
+				}
+			}
+		}
+	}
+
+	// Is a leaf cheaper than the best split?
+	float area = bounds.Area();
+	if (bestAxis >= 0 && area > 0)
+		bestCost = BVH_TRAVERSAL_COST + BVH_TRIANGLE_COST * bestCost / area;
+	if (count <= maxLeafSize && (bestAxis < 0 || BVH_TRIANGLE_COST * count <= bestCost))
+		return;
+
+	// Split the triangles, falling back to halving them if
+	// the centroids are all in the same spot (or the SAH is
+	// out of the picture)
+	uint32_t* begin = order.data() + first;
+	uint32_t* end = begin + count;
+	uint32_t* mid = begin + count / 2;
+	if (bestAxis >= 0)
+	{
+		// Same math as FillBins, so triangles land on the same side
+		XMVECTOR scale = BinScale(centroidBounds, binCount);
+		XMVECTOR lastBin = XMVectorReplicate((float)(binCount - 1));
+		mid = std::partition(begin, end, [&](uint32_t t)
+			{
+				XMVECTOR binF = XMVectorMin(XMVectorMultiply(XMVectorSubtract(triangleBounds[t].Centroid(), centroidBounds.Min), scale), lastBin);
+				uint32_t bin[3];
+				XMStoreInt3(bin, XMConvertVectorFloatToInt(binF, 0));
+				return bin[bestAxis] < bestBin;
+			});
+
+		if (mid == begin || mid == end)
+			mid = begin + count / 2;
+	}
+
+	uint32_t leftCount = (uint32_t)(mid - begin);
+	uint32_t rightCount = count - leftCount;
+	node.LeftFirst = childBase;
+	node.TriangleCount = 0;
+
+	// Each child gets room for its own descendants (up to
+	// 2n - 2 of them for n triangles) right after the pair
+	uint32_t leftChildBase = childBase + 2;
+	uint32_t rightChildBase = leftChildBase + leftCount * 2 - 2;
+
+	if (count >= BVH_PARALLEL_THRESHOLD)
+	{
+		ThreadPool::GetInstance().ParallelFor(2, [&](size_t child)
+			{
+				if (child == 0)
+					BuildNode(childBase, first, leftCount, leftChildBase, depth + 1);
+				else
+					BuildNode(childBase + 1, first + leftCount, rightCount, rightChildBase, depth + 1);
+			});
+	}
+	else
+	{
+		BuildNode(childBase, first, leftCount, leftChildBase, depth + 1);
+		BuildNode(childBase + 1, first + leftCount, rightCount, rightChildBase, depth + 1);
+	}
+}
+
+
+// --------------------------------------------------------
+// Bounds of a range of triangles, and of their centroids
+// --------------------------------------------------------
+void BvhBuilder::CalculateBounds(uint32_t first, uint32_t count, BuildBounds& bounds, BuildBounds& centroidBounds)
+{
+	bounds.Reset();
+	centroidBounds.Reset();
+
+	// Small ranges aren't worth splitting up
+	const uint32_t jobSize = BVH_PARALLEL_THRESHOLD * 8;
+	if (count <= jobSize)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			uint32_t t = order[i];
+			bounds.Grow(triangleBounds[t]);
+			centroidBounds.Grow(triangleBounds[t].Centroid());
+		}
+		return;
+	}
+
+	uint32_t jobs = (count + jobSize - 1) / jobSize;
+	std::vector<BuildBounds> jobBounds(jobs * 2);
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t j)
+		{
+			BuildBounds& b = jobBounds[j * 2];
+			BuildBounds& c = jobBounds[j * 2 + 1];
+			b.Reset();
+			c.Reset();
+
+			uint32_t end = first + (std::min)((uint32_t)(j + 1) * jobSize, count);
+			for (uint32_t i = first + (uint32_t)j * jobSize; i < end; i++)
+			{
+				uint32_t t = order[i];
+				b.Grow(triangleBounds[t]);
+				c.Grow(triangleBounds[t].Centroid());
+			}
+		});
+
+	for (uint32_t j = 0; j < jobs; j++)
+	{
+		bounds.Grow(jobBounds[j * 2]);
+		centroidBounds.Grow(jobBounds[j * 2 + 1]);
+	}
+}
+
+
+// --------------------------------------------------------
+// Sorts a range of triangles into bins along each axis by
+// their centroids, tracking the bounds and count of each
+// --------------------------------------------------------
+void BvhBuilder::FillBins(uint32_t first, uint32_t count, const BuildBounds& centroidBounds, uint32_t binCount, BuildBin bins[3][BVH_SAH_BINS])
+{
+	XMVECTOR scale = BinScale(centroidBounds, binCount);
+	XMVECTOR lastBin = XMVectorReplicate((float)(binCount - 1));
+
+	// Bins a range of triangles into 3 axes' worth of bins
+	auto fill = [&](uint32_t start, uint32_t end, BuildBin* out)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				for (uint32_t b = 0; b < binCount; b++)
+				{
+					out[a * BVH_SAH_BINS + b].Bounds.Reset();
+					out[a * BVH_SAH_BINS + b].Count = 0;
+				}
+			}
+
+			for (uint32_t i = start; i < end; i++)
+			{
+				uint32_t t = order[i];
+				XMVECTOR binF = XMVectorMin(XMVectorMultiply(XMVectorSubtract(triangleBounds[t].Centroid(), centroidBounds.Min), scale), lastBin);
+				uint32_t bin[3];
+				XMStoreInt3(bin, XMConvertVectorFloatToInt(binF, 0));
+				for (int a = 0; a < 3; a++)
+				{
+					BuildBin& target = out[a * BVH_SAH_BINS + bin[a]];
+					target.Bounds.Grow(triangleBounds[t]);
+					target.Count++;
+				}
+			}
+		};
+
+	const uint32_t jobSize = BVH_PARALLEL_THRESHOLD * 8;
+	if (count <= jobSize)
+	{
+		fill(first, first + count, &bins[0][0]);
+		return;
+	}
+
+	uint32_t jobs = (count + jobSize - 1) / jobSize;
+	std::vector<BuildBin> jobBins((size_t)jobs * 3 * BVH_SAH_BINS);
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t j)
+		{
+			uint32_t start = first + (uint32_t)j * jobSize;
+			uint32_t end = first + (std::min)((uint32_t)(j + 1) * jobSize, count);
+			fill(start, end, &jobBins[j * 3 * BVH_SAH_BINS]);
+		});
+
+	// Merging in job order keeps this deterministic
+	for (int a = 0; a < 3; a++)
+	{
+		for (uint32_t b = 0; b < binCount; b++)
+		{
+			bins[a][b].Bounds.Reset();
+			bins[a][b].Count = 0;
+			for (uint32_t j = 0; j < jobs; j++)
+			{
+				const BuildBin& local = jobBins[(j * 3 + a) * BVH_SAH_BINS + b];
+				bins[a][b].Bounds.Grow(local.Bounds);
+				bins[a][b].Count += local.Count;
+			}
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// A triangle as a spatial split build sees it: just the part
+// of it inside some box.  A triangle that's been split has a
+// reference on each side, each with its own (smaller) box.
+// --------------------------------------------------------
+struct SplitReference
+{
+	BuildBounds Bounds;
+	uint32_t Triangle;
+};
+
+// --------------------------------------------------------
+// Builds a tree with spatial splits (Stich et al.'s SBVH).
+// Each node tries the usual binned object split, and, where
+// that split's children overlap, also a binned split of the
+// node's space, which clips the triangles straddling each
+// plane into both sides.  Straddling triangles that would
+// be cheaper kept whole on one side are "unsplit".
+//
+// References are duplicated, so a node's can't be split in
+// place like BvhBuilder's, and the build is single threaded.
+// Nodes come out already packed (root first, children in
+// adjacent pairs, left subtrees first).
+// --------------------------------------------------------
+class SpatialSplitBuilder
+{
+public:
+	SpatialSplitBuilder(const Vertex* verts, const unsigned int* indices, size_t triangleCount, const BvhBuildOptions& options);
+
+	void Build(std::vector<BvhNode>& nodes, std::vector<uint32_t>& triangleOrder, uint32_t& maxDepth, uint32_t& spatialSplits);
+
+private:
+	const Vertex* verts;
+	const unsigned int* indices;
+	uint32_t triangleCount;
+	BvhBuildOptions options;
+
+	// References can't grow past the budget
+	size_t referenceCount;
+	size_t referenceBudget;
+	float minOverlapArea;
+
+	// Output
+	std::vector<BvhNode>* nodes;
+	std::vector<uint32_t>* triangleOrder;
+	uint32_t maxDepth;
+	uint32_t spatialSplits;
+
+	void BuildNode(uint32_t nodeIndex, std::vector<SplitReference>& references, uint32_t depth);
+	void SplitReferenceAt(const SplitReference& reference, int axis, float position, SplitReference& left, SplitReference& right) const;
+};
+
+
+// --------------------------------------------------------
+// Just holds onto the mesh, since the bounds of each
+// triangle are only needed for the root
+// --------------------------------------------------------
+SpatialSplitBuilder::SpatialSplitBuilder(const Vertex* verts, const unsigned int* indices, size_t triangleCount, const BvhBuildOptions& options) :
+	verts(verts),
+	indices(indices),
+	triangleCount((uint32_t)triangleCount),
+	options(options),
+	referenceCount(triangleCount),
+	referenceBudget(triangleCount + (size_t)(triangleCount * (std::max)(options.MaxReferenceGrowth, 0.0f))),
+	minOverlapArea(0),
+	nodes(0),
+	triangleOrder(0),
+	maxDepth(0),
+	spatialSplits(0)
+{
+}
+
+
+// --------------------------------------------------------
+// Builds the whole tree, starting from one reference for
+// each triangle
+// --------------------------------------------------------
+void SpatialSplitBuilder::Build(std::vector<BvhNode>& nodes, std::vector<uint32_t>& triangleOrder, uint32_t& maxDepth, uint32_t& spatialSplits)
+{
+	this->nodes = &nodes;
+	this->triangleOrder = &triangleOrder;
+	this->maxDepth = 0;
+	this->spatialSplits = 0;
+
+	std::vector<SplitReference> references(triangleCount);
+	BuildBounds rootBounds;
+	rootBounds.Reset();
+	for (uint32_t t = 0; t < triangleCount; t++)
+	{
+		references[t].Triangle = t;
+		references[t].Bounds.Reset();
+		for (int c = 0; c < 3; c++)
+			references[t].Bounds.Grow(XMLoadFloat3(&verts[indices[t * 3 + c]].Position));
+		rootBounds.Grow(references[t].Bounds);
+	}
+	minOverlapArea = options.MinSpatialSplitOverlap * rootBounds.Area();
+
+	nodes.clear();
+	nodes.reserve((size_t)referenceBudget * 2);
+	nodes.push_back({});
+	triangleOrder.clear();
+	triangleOrder.reserve(referenceBudget);
+	BuildNode(0, references, 1);
+
+	maxDepth = this->maxDepth;
+	spatialSplits = this->spatialSplits;
+}
+
+
+// --------------------------------------------------------
+// Turns a node's references into a leaf, or splits them in
+// two, by object or by space, whichever the SAH likes best,
+// and recurses.  The references are used up either way.
+//
+// nodeIndex  - Where this node goes
+// references - Everything under this node
+// depth      - Depth of this node (the root is 1)
+// --------------------------------------------------------
+void SpatialSplitBuilder::BuildNode(uint32_t nodeIndex, std::vector<SplitReference>& references, uint32_t depth)
+{
+	maxDepth = (std::max)(maxDepth, depth);
+	uint32_t count = (uint32_t)references.size();
+
+	BuildBounds bounds, centroidBounds;
+	bounds.Reset();
+	centroidBounds.Reset();
+	for (const SplitReference& reference : references)
+	{
+		bounds.Grow(reference.Bounds);
+		centroidBounds.Grow(reference.Bounds.Centroid());
+	}
+
+	BvhNode& node = (*nodes)[nodeIndex];
+	XMStoreFloat3(&node.BoundsMin, bounds.Min);
+	XMStoreFloat3(&node.BoundsMax, bounds.Max);
+
+	auto makeLeaf = [&]()
+		{
+			BvhNode& leaf = (*nodes)[nodeIndex];
+			leaf.LeftFirst = (uint32_t)triangleOrder->size();
+			leaf.TriangleCount = count;
+			for (const SplitReference& reference : references)
+				triangleOrder->push_back(reference.Triangle);
+		};
+	if (count == 1)
+	{
+		makeLeaf();
+		return;
+	}
+
+	// Same depth limit as BvhBuilder
+	uint32_t levelsNeeded = 1;
+	for (uint32_t leaves = (count + BVH_MAX_LEAF_TRIANGLES - 1) / BVH_MAX_LEAF_TRIANGLES; leaves > 1; leaves = (leaves + 1) / 2)
+		levelsNeeded++;
+	bool forceMedian = depth + levelsNeeded >= BVH_MAX_DEPTH;
+
+	// Object split, binned by centroid, keeping the bounds of
+	// each side of the best one to see how much they overlap
+	int objectAxis = -1;
+	uint32_t objectBin = 0;
+	float objectCost = FLT_MAX;
+	BuildBounds objectLeft, objectRight;
+	uint32_t binCount = (std::min)(count, (uint32_t)BVH_SAH_BINS);
+	XMVECTOR scale = BinScale(centroidBounds, binCount);
+	XMVECTOR lastBin = XMVectorReplicate((float)(binCount - 1));
+	auto centroidBin = [&](const SplitReference& reference, uint32_t bin[3])
+		{
+			XMVECTOR binF = XMVectorMin(XMVectorMultiply(XMVectorSubtract(reference.Bounds.Centroid(), centroidBounds.Min), scale), lastBin);
+			XMStoreInt3(bin, XMConvertVectorFloatToInt(binF, 0));
+		};
+
+	XMFLOAT3 centroidMin, centroidMax;
+	XMStoreFloat3(&centroidMin, centroidBounds.Min);
+	XMStoreFloat3(&centroidMax, centroidBounds.Max);
+	if (!forceMedian)
+	{
+		BuildBin bins[3][BVH_SAH_BINS];
+		for (int a = 0; a < 3; a++)
+		{
+			for (uint32_t b = 0; b < binCount; b++)
+			{
+				bins[a][b].Bounds.Reset();
+				bins[a][b].Count = 0;
+			}
+		}
+		for (const SplitReference& reference : references)
+		{
+			uint32_t bin[3];
+			centroidBin(reference, bin);
+			for (int a = 0; a < 3; a++)
+			{
+				bins[a][bin[a]].Bounds.Grow(reference.Bounds);
+				bins[a][bin[a]].Count++;
+			}
+		}
+
+		for (int a = 0; a < 3; a++)
+		{
+			if ((&centroidMax.x)[a] <= (&centroidMin.x)[a])
+				continue;
+
+			float rightCosts[BVH_SAH_BINS];
+			BuildBounds rightBounds[BVH_SAH_BINS];
+			BuildBounds right;
+			right.Reset();
+			uint32_t rightCount = 0;
+			for (uint32_t b = binCount - 1; b > 0; b--)
+			{
+				right.Grow(bins[a][b].Bounds);
+				rightCount += bins[a][b].Count;
+				rightBounds[b] = right;
+				rightCosts[b] = rightCount > 0 ? right.Area() * rightCount : FLT_MAX;
+			}
+
+			BuildBounds left;
+			left.Reset();
+			uint32_t leftCount = 0;
+			for (uint32_t b = 1; b < binCount; b++)
+			{
+				left.Grow(bins[a][b - 1].Bounds);
+				leftCount += bins[a][b - 1].Count;
+				if (leftCount == 0 || leftCount == count)
+					continue;
+
+				float cost = left.Area() * leftCount + rightCosts[b];
+				if (cost < objectCost)
+				{
+					objectCost = cost;
+					objectAxis = a;
+					objectBin = b;
+					objectLeft = left;
+					objectRight = rightBounds[b];
+				}
+			}
+		}
+	}
+
+	// Spatial split, binned over the node's own bounds.  Only
+	// worth a look when the object split's children overlap,
+	// and while there's room left for more references.
+	int spatialAxis = -1;
+	uint32_t spatialBin = 0;
+	float spatialCost = FLT_MAX;
+	BuildBounds spatialLeft, spatialRight;
+	uint32_t spatialLeftCount = 0;
+	uint32_t spatialRightCount = 0;
+	XMFLOAT3 boundsMin, boundsMax;
+	XMStoreFloat3(&boundsMin, bounds.Min);
+	XMStoreFloat3(&boundsMax, bounds.Max);
+	auto planePosition = [&](int axis, uint32_t plane)
+		{
+			float extent = (&boundsMax.x)[axis] - (&boundsMin.x)[axis];
+			return (&boundsMin.x)[axis] + extent * plane / BVH_SAH_BINS;
+		};
+
+	if (options.SpatialSplits && objectAxis >= 0 && referenceCount < referenceBudget)
+	{
+		BuildBounds overlap;
+		overlap.Min = XMVectorMax(objectLeft.Min, objectRight.Min);
+		overlap.Max = XMVectorMin(objectLeft.Max, objectRight.Max);
+		if (overlap.Area() > minOverlapArea)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				float axisMin = (&boundsMin.x)[a];
+				float extent = (&boundsMax.x)[a] - axisMin;
+				if (extent <= 0)
+					continue;
+
+				// Each reference enters the bin its box starts in and exits
+				// the one it ends in, and is chopped up across every bin in
+				// between, so the bins' bounds are as tight as they can be
+				BuildBounds bins[BVH_SAH_BINS];
+				uint32_t entries[BVH_SAH_BINS] = {};
+				uint32_t exits[BVH_SAH_BINS] = {};
+				for (uint32_t b = 0; b < BVH_SAH_BINS; b++)
+					bins[b].Reset();
+
+				float binScale = BVH_SAH_BINS / extent;
+				for (const SplitReference& reference : references)
+				{
+					XMFLOAT3 referenceMin, referenceMax;
+					XMStoreFloat3(&referenceMin, reference.Bounds.Min);
+					XMStoreFloat3(&referenceMax, reference.Bounds.Max);
+					uint32_t firstBin = (uint32_t)(std::min)((std::max)(((&referenceMin.x)[a] - axisMin) * binScale, 0.0f), BVH_SAH_BINS - 1.0f);
+					uint32_t lastBin = (uint32_t)(std::min)((std::max)(((&referenceMax.x)[a] - axisMin) * binScale, 0.0f), BVH_SAH_BINS - 1.0f);
+					lastBin = (std::max)(lastBin, firstBin);
+
+					SplitReference rest = reference;
+					for (uint32_t b = firstBin; b < lastBin; b++)
+					{
+						SplitReference left, right;
+						SplitReferenceAt(rest, a, planePosition(a, b + 1), left, right);
+						bins[b].Grow(left.Bounds);
+						rest = right;
+					}
+					bins[lastBin].Grow(rest.Bounds);
+					entries[firstBin]++;
+					exits[lastBin]++;
+				}
+
+				float rightCosts[BVH_SAH_BINS];
+				BuildBounds rightBounds[BVH_SAH_BINS];
+				uint32_t rightCounts[BVH_SAH_BINS];
+				BuildBounds right;
+				right.Reset();
+				uint32_t rightCount = 0;
+				for (uint32_t b = BVH_SAH_BINS - 1; b > 0; b--)
+				{
+					right.Grow(bins[b]);
+					rightCount += exits[b];
+					rightBounds[b] = right;
+					rightCounts[b] = rightCount;
+					rightCosts[b] = right.Area() * rightCount;
+				}
+
+				BuildBounds left;
+				left.Reset();
+				uint32_t leftCount = 0;
+				for (uint32_t b = 1; b < BVH_SAH_BINS; b++)
+				{
+					left.Grow(bins[b - 1]);
+					leftCount += entries[b - 1];
+					if (leftCount == 0 || rightCounts[b] == 0)
+						continue;
+					if (referenceCount + leftCount + rightCounts[b] - count > referenceBudget)
+						continue;
+
+					float cost = left.Area() * leftCount + rightCosts[b];
+					if (cost < spatialCost)
+					{
+						spatialCost = cost;
+						spatialAxis = a;
+						spatialBin = b;
+						spatialLeft = left;
+						spatialRight = rightBounds[b];
+						spatialLeftCount = leftCount;
+						spatialRightCount = rightCounts[b];
+					}
+				}
+			}
+		}
+	}
+
+	// Is a leaf cheaper than the best split?
+	float bestCost = (std::min)(objectCost, spatialCost);
+	float area = bounds.Area();
+	if (bestCost != FLT_MAX && area > 0)
+		bestCost = BVH_TRAVERSAL_COST + BVH_TRIANGLE_COST * bestCost / area;
+	if (count <= BVH_MAX_LEAF_TRIANGLES && (bestCost == FLT_MAX || BVH_TRIANGLE_COST * count <= bestCost))
+	{
+		makeLeaf();
+		return;
+	}
+
+	std::vector<SplitReference> leftReferences;
+	std::vector<SplitReference> rightReferences;
+	if (spatialCost < objectCost)
+	{
+		// Whatever's entirely on one side of the plane stays
+		// whole, and the rest is either split or, if that's
+		// cheaper, kept whole on whichever side costs less
+		float position = planePosition(spatialAxis, spatialBin);
+		float leftArea = spatialLeft.Area();
+		float rightArea = spatialRight.Area();
+		for (const SplitReference& reference : references)
+		{
+			XMFLOAT3 referenceMin, referenceMax;
+			XMStoreFloat3(&referenceMin, reference.Bounds.Min);
+			XMStoreFloat3(&referenceMax, reference.Bounds.Max);
+			if ((&referenceMax.x)[spatialAxis] <= position)
+			{
+				leftReferences.push_back(reference);
+				continue;
+			}
+			if ((&referenceMin.x)[spatialAxis] >= position)
+			{
+				rightReferences.push_back(reference);
+				continue;
+			}
+
+			BuildBounds grownLeft = spatialLeft;
+			BuildBounds grownRight = spatialRight;
+			grownLeft.Grow(reference.Bounds);
+			grownRight.Grow(reference.Bounds);
+			float splitCost = leftArea * spatialLeftCount + rightArea * spatialRightCount;
+			float leftOnlyCost = grownLeft.Area() * spatialLeftCount + rightArea * (spatialRightCount - 1);
+			float rightOnlyCost = leftArea * (spatialLeftCount - 1) + grownRight.Area() * spatialRightCount;
+			if (leftOnlyCost < splitCost && leftOnlyCost <= rightOnlyCost)
+			{
+				leftReferences.push_back(reference);
+				spatialLeft = grownLeft;
+				leftArea = spatialLeft.Area();
+				spatialRightCount--;
+			}
+			else if (rightOnlyCost < splitCost)
+			{
+				rightReferences.push_back(reference);
+				spatialRight = grownRight;
+				rightArea = spatialRight.Area();
+				spatialLeftCount--;
+			}
+			else
+			{
+				// Clipping can leave nothing on a side when the
+				// triangle only just touches the plane
+				SplitReference left, right;
+				SplitReferenceAt(reference, spatialAxis, position, left, right);
+				if (XMVector3LessOrEqual(left.Bounds.Min, left.Bounds.Max))
+					leftReferences.push_back(left);
+				if (XMVector3LessOrEqual(right.Bounds.Min, right.Bounds.Max))
+					rightReferences.push_back(right);
+			}
+		}
+
+		if (leftReferences.empty() || rightReferences.empty())
+		{
+			leftReferences.clear();
+			rightReferences.clear();
+		}
+		else
+		{
+			spatialSplits++;
+		}
+	}
+
+	if (leftReferences.empty())
+	{
+		// Object split, falling back to halving the references
+		// if the centroids are all in the same spot (or the SAH
+		// is out of the picture)
+		auto begin = references.begin();
+		auto end = references.end();
+		auto mid = begin + count / 2;
+		if (objectAxis >= 0)
+		{
+			mid = std::partition(begin, end, [&](const SplitReference& reference)
+				{
+					uint32_t bin[3];
+					centroidBin(reference, bin);
+					return bin[objectAxis] < objectBin;
+				});
+
+			if (mid == begin || mid == end)
+				mid = begin + count / 2;
+		}
+		leftReferences.assign(begin, mid);
+		rightReferences.assign(mid, end);
+	}
+
+	referenceCount += leftReferences.size() + rightReferences.size() - count;
+	std::vector<SplitReference>().swap(references);
+
+	uint32_t childIndex = (uint32_t)nodes->size();
+	nodes->push_back({});
+	nodes->push_back({});
+	(*nodes)[nodeIndex].LeftFirst = childIndex;
+	(*nodes)[nodeIndex].TriangleCount = 0;
+
+	BuildNode(childIndex, leftReferences, depth + 1);
+	BuildNode(childIndex + 1, rightReferences, depth + 1);
+}
+
+
+// --------------------------------------------------------
+// Clips a reference's triangle against a plane, giving the
+// bounds of the parts on each side (within the reference's
+// own bounds, since it may already have been clipped).
+//
+// axis     - Which axis the plane is perpendicular to
+// position - Where the plane is along that axis
+// --------------------------------------------------------
+void SpatialSplitBuilder::SplitReferenceAt(const SplitReference& reference, int axis, float position, SplitReference& left, SplitReference& right) const
+{
+	left.Triangle = reference.Triangle;
+	right.Triangle = reference.Triangle;
+	left.Bounds.Reset();
+	right.Bounds.Reset();
+
+	// Each vertex goes on its side (or both, right on the
+	// plane), and each edge crossing the plane adds the point
+	// where it crosses to both
+	const unsigned int* triangle = &indices[reference.Triangle * 3];
+	for (int c = 0; c < 3; c++)
+	{
+		XMFLOAT3 v0 = verts[triangle[c]].Position;
+		XMFLOAT3 v1 = verts[triangle[(c + 1) % 3]].Position;
+		float p0 = (&v0.x)[axis];
+		float p1 = (&v1.x)[axis];
+		XMVECTOR start = XMLoadFloat3(&v0);
+		if (p0 <= position)
+			left.Bounds.Grow(start);
+		if (p0 >= position)
+			right.Bounds.Grow(start);
+
+		if ((p0 < position && position < p1) || (p1 < position && position < p0))
+		{
+			float t = (position - p0) / (p1 - p0);
+			XMFLOAT3 crossing;
+			XMStoreFloat3(&crossing, XMVectorLerp(start, XMLoadFloat3(&v1), t));
+			(&crossing.x)[axis] = position;
+			left.Bounds.Grow(XMLoadFloat3(&crossing));
+			right.Bounds.Grow(XMLoadFloat3(&crossing));
+		}
+	}
+
+	// Neither side goes past the plane or the original bounds
+	XMFLOAT3 leftMax, rightMin;
+	XMStoreFloat3(&leftMax, left.Bounds.Max);
+	XMStoreFloat3(&rightMin, right.Bounds.Min);
+	(&leftMax.x)[axis] = (std::min)((&leftMax.x)[axis], position);
+	(&rightMin.x)[axis] = (std::max)((&rightMin.x)[axis], position);
+	left.Bounds.Max = XMVectorMin(XMLoadFloat3(&leftMax), reference.Bounds.Max);
+	left.Bounds.Min = XMVectorMax(left.Bounds.Min, reference.Bounds.Min);
+	right.Bounds.Min = XMVectorMax(XMLoadFloat3(&rightMin), reference.Bounds.Min);
+	right.Bounds.Max = XMVectorMin(right.Bounds.Max, reference.Bounds.Max);
+}
+
+
+// --------------------------------------------------------
+// Spreads the bits of a cell coordinate out so that there
+// are two zeros between each of them, then interleaves the
+// three axes (x highest) into a Morton code.  Nearby codes
+// mean nearby cells.
+// --------------------------------------------------------
+template<typename Code>
+static Code MortonCode(uint32_t x, uint32_t y, uint32_t z);
+
+template<>
+uint32_t MortonCode<uint32_t>(uint32_t x, uint32_t y, uint32_t z)
+{
+	auto spread = [](uint32_t v)
+		{
+			v &= 0x3FF;
+			v = (v | (v << 16)) & 0x030000FF;
+			v = (v | (v << 8)) & 0x0300F00F;
+			v = (v | (v << 4)) & 0x030C30C3;
+			v = (v | (v << 2)) & 0x09249249;
+			return v;
+		};
+	return (spread(x) << 2) | (spread(y) << 1) | spread(z);
+}
+
+template<>
+uint64_t MortonCode<uint64_t>(uint32_t x, uint32_t y, uint32_t z)
+{
+	auto spread = [](uint64_t v)
+		{
+			v &= 0x1FFFFF;
+			v = (v | (v << 32)) & 0x001F00000000FFFFull;
+			v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+			v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+			v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+			v = (v | (v << 2)) & 0x1249249249249249ull;
+			return v;
+		};
+	return (spread(x) << 2) | (spread(y) << 1) | spread(z);
+}
+
+// A triangle's place along the Morton curve
+template<typename Code>
+struct MortonEntry
+{
+	Code Key;
+	uint32_t Triangle;
+};
+
+// --------------------------------------------------------
+// Sorts entries by key with a parallel radix sort, 11 bits
+// at a time from the lowest (three passes for 30-bit codes,
+// six for 63-bit).  Each pass, every job counts the digits
+// in its own chunk, the counts are turned into where each
+// job writes each digit, and the jobs scatter.  Stable, so
+// equal keys stay in triangle order and the result doesn't
+// depend on the number of threads.  Passes where every key
+// has the same digit are skipped.
+// --------------------------------------------------------
+template<typename Code>
+static void RadixSort(std::vector<MortonEntry<Code>>& entries)
+{
+	const unsigned int digitBits = 11;
+	const uint32_t digits = 1u << digitBits;
+	const size_t count = entries.size();
+	const size_t chunk = BVH_PARALLEL_THRESHOLD * 16;
+	const size_t jobs = (count + chunk - 1) / chunk;
+	std::vector<MortonEntry<Code>> sorted(count);
+	std::vector<uint32_t> offsets(jobs * digits);
+
+	for (unsigned int shift = 0; shift < sizeof(Code) * 8; shift += digitBits)
+	{
+		ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+			{
+				uint32_t* counts = &offsets[job * digits];
+				std::fill(counts, counts + digits, 0);
+				size_t end = (std::min)((job + 1) * chunk, count);
+				for (size_t i = job * chunk; i < end; i++)
+					counts[(entries[i].Key >> shift) & (digits - 1)]++;
+			});
+
+		// Every job's entries with a smaller digit come first,
+		// then earlier jobs' entries with the same digit
+		uint32_t total = 0;
+		bool sameForAll = false;
+		for (uint32_t digit = 0; digit < digits && !sameForAll; digit++)
+		{
+			uint32_t digitStart = total;
+			for (size_t job = 0; job < jobs; job++)
+			{
+				uint32_t digitCount = offsets[job * digits + digit];
+				offsets[job * digits + digit] = total;
+				total += digitCount;
+			}
+			sameForAll = total - digitStart == count;
+		}
+		if (sameForAll)
+			continue;
+
+		ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+			{
+				uint32_t* next = &offsets[job * digits];
+				size_t end = (std::min)((job + 1) * chunk, count);
+				for (size_t i = job * chunk; i < end; i++)
+					sorted[next[(entries[i].Key >> shift) & (digits - 1)]++] = entries[i];
+			});
+		entries.swap(sorted);
+	}
+}
+
+// Children of a linear build's nodes with this bit set are
+// single triangles (by position in Morton order)
+#define LINEAR_TRIANGLE_BIT 0x80000000
+
+// --------------------------------------------------------
+// Builds a linear BVH (LBVH).  Triangles are sorted by the
+// Morton codes of their centroids, and the tree over them is
+// then just where neighboring codes differ, so the whole
+// hierarchy (boxes included) comes together in one parallel
+// pass over the sorted triangles.
+//
+// The tree starts with one triangle per leaf, and subtrees
+// are collapsed into leaves wherever the SAH says that's
+// cheaper.  Optionally, the top of the tree is then reshaped
+// a treelet at a time (Karras and Aila's TRBVH): the best
+// shape over a handful of subtrees is found exactly, with
+// the SAH, and swapped in if it's better.
+//
+// Every step is deterministic, so the tree is the same no
+// matter how many threads there are.
+// --------------------------------------------------------
+class LinearBuilder
+{
+public:
+	LinearBuilder(const Vertex* verts, const unsigned int* indices, size_t triangleCount, uint32_t treeletPasses);
+
+	// False if the tree would be too deep to traverse
+	bool Build(std::vector<BvhNode>& nodes, std::vector<uint32_t>& triangleOrder, uint32_t& maxDepth);
+
+private:
+	// An interior node, before packing
+	struct LinearNode
+	{
+		BuildBounds Bounds;
+		uint32_t Children[2];	// Node index, or triangle (see LINEAR_TRIANGLE_BIT)
+		uint32_t Count;			// Triangles underneath
+		float Cost;				// SAH cost of the subtree, times its area
+		bool Collapse;			// Cheaper as one leaf
+	};
+
+	uint32_t triangleCount;
+	uint32_t treeletPasses;
+
+	// Per-triangle bounds (in Morton order once sorted, so the
+	// rest of the build reads them front to back), and the
+	// bounds of every centroid
+	std::vector<BuildBounds> triangleBounds;
+	BuildBounds centroidBounds;
+
+	// Triangles in Morton order
+	std::vector<uint32_t> sorted;
+
+	// The n - 1 interior nodes (node i splits sorted triangles
+	// i and i + 1 apart, so the root could be any of them)
+	std::vector<LinearNode> linearNodes;
+	uint32_t root;
+
+	template<typename Code>
+	void EmitHierarchy();
+	void CombineChildren(uint32_t nodeIndex);
+	void GetChild(uint32_t child, BuildBounds& bounds, uint32_t& count, float& cost) const;
+	void OptimizeTreelet(uint32_t treeletRoot);
+	bool Pack(std::vector<BvhNode>& nodes, std::vector<uint32_t>& triangleOrder, uint32_t& maxDepth);
+};
+
+
+// --------------------------------------------------------
+// Grabs the bounds of every triangle up front, along with
+// the bounds of their centroids (which the codes span)
+// --------------------------------------------------------
+LinearBuilder::LinearBuilder(const Vertex* verts, const unsigned int* indices, size_t triangleCount, uint32_t treeletPasses) :
+	triangleCount((uint32_t)triangleCount),
+	treeletPasses(treeletPasses),
+	root(0)
+{
+	triangleBounds.resize(triangleCount);
+
+	size_t jobs = (triangleCount + BVH_PARALLEL_THRESHOLD - 1) / BVH_PARALLEL_THRESHOLD;
+	std::vector<BuildBounds> jobCentroids(jobs);
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+		{
+			BuildBounds& centroids = jobCentroids[job];
+			centroids.Reset();
+			size_t end = (std::min)((job + 1) * BVH_PARALLEL_THRESHOLD, triangleCount);
+			for (size_t t = job * BVH_PARALLEL_THRESHOLD; t < end; t++)
+			{
+				BuildBounds& bounds = triangleBounds[t];
+				bounds.Reset();
+				for (int c = 0; c < 3; c++)
+					bounds.Grow(XMLoadFloat3(&verts[indices[t * 3 + c]].Position));
+				centroids.Grow(bounds.Centroid());
+			}
+		});
+
+	centroidBounds.Reset();
+	for (const BuildBounds& centroids : jobCentroids)
+		centroidBounds.Grow(centroids);
+}
+
+
+// --------------------------------------------------------
+// Builds the whole tree, then packs it into the usual
+// layout (root first, children in adjacent pairs)
+// --------------------------------------------------------
+bool LinearBuilder::Build(std::vector<BvhNode>& nodes, std::vector<uint32_t>& triangleOrder, uint32_t& maxDepth)
+{
+	sorted.resize(triangleCount);
+	if (triangleCount == 1)
+	{
+		sorted[0] = 0;
+		return Pack(nodes, triangleOrder, maxDepth);
+	}
+
+	linearNodes.resize((size_t)triangleCount - 1);
+
+	if (triangleCount <= BVH_LINEAR_WIDE_CODE_TRIANGLES)
+		EmitHierarchy<uint32_t>();
+	else
+		EmitHierarchy<uint64_t>();
+
+	// Parents have more triangles than their children, so going
+	// backwards over a top down list reshapes children first
+	std::vector<uint32_t> roots;
+	std::vector<uint32_t> stack;
+	for (uint32_t pass = 0; pass < treeletPasses && triangleCount >= BVH_TREELET_MIN_TRIANGLES; pass++)
+	{
+		roots.clear();
+		stack.push_back(root);
+		while (!stack.empty())
+		{
+			uint32_t nodeIndex = stack.back();
+			stack.pop_back();
+			if (linearNodes[nodeIndex].Count < BVH_TREELET_MIN_TRIANGLES)
+				continue;
+
+			roots.push_back(nodeIndex);
+			for (uint32_t child : linearNodes[nodeIndex].Children)
+			{
+				if (!(child & LINEAR_TRIANGLE_BIT))
+					stack.push_back(child);
+			}
+		}
+
+		for (size_t i = roots.size(); i > 0; i--)
+			OptimizeTreelet(roots[i - 1]);
+	}
+
+	return Pack(nodes, triangleOrder, maxDepth);
+}
+
+
+// --------------------------------------------------------
+// Sorts the triangles along the Morton curve, then puts the
+// tree together bottom up, in parallel (Apetrei, "Fast and
+// Simple Agglomerative LBVH Construction").  Each triangle
+// climbs from its leaf, always joining its range up with
+// whichever neighbor's code is more similar, which gives
+// exactly the tree that splitting every range where its
+// codes first differ would.  The first of a node's two
+// children to arrive leaves the other end of its range
+// behind and stops, and the second (which then knows both
+// children are done) fills the node in and keeps going.
+//
+// Equal codes are told apart by their positions in the
+// order, so they still end up in a balanced subtree.
+// --------------------------------------------------------
+template<typename Code>
+void LinearBuilder::EmitHierarchy()
+{
+	const uint32_t cellsPerAxis = sizeof(Code) == 4 ? 1u << 10 : 1u << 21;
+	XMVECTOR scale = BinScale(centroidBounds, cellsPerAxis);
+	XMVECTOR lastCell = XMVectorReplicate((float)(cellsPerAxis - 1));
+
+	std::vector<MortonEntry<Code>> entries(triangleCount);
+	size_t jobs = (triangleCount + BVH_PARALLEL_THRESHOLD - 1) / BVH_PARALLEL_THRESHOLD;
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * BVH_PARALLEL_THRESHOLD, (size_t)triangleCount);
+			for (size_t t = job * BVH_PARALLEL_THRESHOLD; t < end; t++)
+			{
+				XMVECTOR offset = XMVectorSubtract(triangleBounds[t].Centroid(), centroidBounds.Min);
+				XMFLOAT3 cell;
+				XMStoreFloat3(&cell, XMVectorClamp(XMVectorMultiply(offset, scale), XMVectorZero(), lastCell));
+				entries[t].Key = MortonCode<Code>((uint32_t)cell.x, (uint32_t)cell.y, (uint32_t)cell.z);
+				entries[t].Triangle = (uint32_t)t;
+			}
+		});
+
+	RadixSort(entries);
+
+	// Node i is the parent of the ranges ending at i and starting
+	// at i + 1, and holds the far end of whichever got there first
+	// (plus one, so zero means nothing's there yet)
+	const uint32_t last = triangleCount - 1;
+	std::vector<std::atomic<uint32_t>> otherEnds(last);
+
+	std::vector<BuildBounds> sortedBounds(triangleCount);
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * BVH_PARALLEL_THRESHOLD, (size_t)triangleCount);
+			for (size_t t = job * BVH_PARALLEL_THRESHOLD; t < end; t++)
+			{
+				sorted[t] = entries[t].Triangle;
+				sortedBounds[t] = triangleBounds[entries[t].Triangle];
+				if (t < last)
+					otherEnds[t].store(0, std::memory_order_relaxed);
+			}
+		});
+	triangleBounds.swap(sortedBounds);
+
+	// Whether sorted triangles a and a + 1 are more alike than b
+	// and b + 1 (ties go to the pair further right)
+	auto moreAlike = [&](uint32_t a, uint32_t b)
+		{
+			Code differenceA = entries[a].Key ^ entries[a + 1].Key;
+			Code differenceB = entries[b].Key ^ entries[b + 1].Key;
+			if (differenceA != differenceB)
+				return differenceA < differenceB;
+			return (a ^ (a + 1)) < (b ^ (b + 1));
+		};
+
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * BVH_PARALLEL_THRESHOLD, (size_t)triangleCount);
+			for (size_t t = job * BVH_PARALLEL_THRESHOLD; t < end; t++)
+			{
+				uint32_t rangeFirst = (uint32_t)t;
+				uint32_t rangeLast = (uint32_t)t;
+				uint32_t child = LINEAR_TRIANGLE_BIT | (uint32_t)t;
+				while (true)
+				{
+					uint32_t parent;
+					uint32_t otherEnd;
+					if (rangeFirst == 0 || (rangeLast != last && moreAlike(rangeLast, rangeFirst - 1)))
+					{
+						parent = rangeLast;
+						linearNodes[parent].Children[0] = child;
+						otherEnd = otherEnds[parent].exchange(rangeFirst + 1, std::memory_order_acq_rel);
+						if (otherEnd == 0)
+							break;
+						rangeLast = otherEnd - 1;
+					}
+					else
+					{
+						parent = rangeFirst - 1;
+						linearNodes[parent].Children[1] = child;
+						otherEnd = otherEnds[parent].exchange(rangeLast + 1, std::memory_order_acq_rel);
+						if (otherEnd == 0)
+							break;
+						rangeFirst = otherEnd - 1;
+					}
+
+					CombineChildren(parent);
+					child = parent;
+					if (rangeFirst == 0 && rangeLast == last)
+					{
+						root = parent;
+						break;
+					}
+				}
+			}
+		});
+}
+
+
+// --------------------------------------------------------
+// Works out a node's box, triangle count and cost from its
+// children, and whether the subtree would be cheaper as a
+// single leaf.  Costs are left multiplied by the node's
+// area, so they add up without any dividing.
+// --------------------------------------------------------
+void LinearBuilder::CombineChildren(uint32_t nodeIndex)
+{
+	LinearNode& node = linearNodes[nodeIndex];
+	node.Bounds.Reset();
+	node.Count = 0;
+	float childCost = 0;
+	for (uint32_t child : node.Children)
+	{
+		BuildBounds bounds;
+		uint32_t count;
+		float cost;
+		GetChild(child, bounds, count, cost);
+		node.Bounds.Grow(bounds);
+		node.Count += count;
+		childCost += cost;
+	}
+
+	float area = node.Bounds.Area();
+	float splitCost = BVH_TRAVERSAL_COST * area + childCost;
+	float leafCost = node.Count <= BVH_MAX_LEAF_TRIANGLES ? BVH_TRIANGLE_COST * area * node.Count : FLT_MAX;
+	node.Collapse = leafCost <= splitCost;
+	node.Cost = (std::min)(leafCost, splitCost);
+}
+
+
+// --------------------------------------------------------
+// A child's box, triangle count and (area weighted) cost,
+// whether it's a node or a single triangle
+// --------------------------------------------------------
+void LinearBuilder::GetChild(uint32_t child, BuildBounds& bounds, uint32_t& count, float& cost) const
+{
+	if (child & LINEAR_TRIANGLE_BIT)
+	{
+		bounds = triangleBounds[child & ~LINEAR_TRIANGLE_BIT];
+		count = 1;
+		cost = BVH_TRIANGLE_COST * bounds.Area();
+	}
+	else
+	{
+		const LinearNode& node = linearNodes[child];
+		bounds = node.Bounds;
+		count = node.Count;
+		cost = node.Cost;
+	}
+}
+
+
+// --------------------------------------------------------
+// Finds the best shape for the treelet under a node: the
+// node and the interior nodes below it are opened up,
+// largest area first, until there are BVH_TREELET_SIZE
+// subtrees hanging off of them.  Every way of putting
+// those subtrees back together is then costed, smallest
+// groups first, and the cheapest (which may collapse some
+// groups into leaves) replaces the old one, reusing its
+// interior nodes.  The node's own box never changes.
+// --------------------------------------------------------
+void LinearBuilder::OptimizeTreelet(uint32_t treeletRoot)
+{
+	// Its children may have been reshaped already
+	CombineChildren(treeletRoot);
+
+	uint32_t leaves[BVH_TREELET_SIZE];
+	uint32_t interiors[BVH_TREELET_SIZE - 1];
+	uint32_t leafCount = 0;
+	uint32_t interiorCount = 0;
+	interiors[interiorCount++] = treeletRoot;
+	leaves[leafCount++] = linearNodes[treeletRoot].Children[0];
+	leaves[leafCount++] = linearNodes[treeletRoot].Children[1];
+	while (leafCount < BVH_TREELET_SIZE)
+	{
+		int largest = -1;
+		float largestArea = -1;
+		for (uint32_t i = 0; i < leafCount; i++)
+		{
+			if (leaves[i] & LINEAR_TRIANGLE_BIT)
+				continue;
+
+			float area = linearNodes[leaves[i]].Bounds.Area();
+			if (area > largestArea)
+			{
+				largest = i;
+				largestArea = area;
+			}
+		}
+		if (largest < 0)
+			break;
+
+		const LinearNode& opened = linearNodes[leaves[largest]];
+		interiors[interiorCount++] = leaves[largest];
+		leaves[largest] = opened.Children[0];
+		leaves[leafCount++] = opened.Children[1];
+	}
+
+	// Three subtrees is the fewest with more than one shape
+	if (leafCount < 3)
+		return;
+
+	// Every group of subtrees (a bit for each), with its best
+	// cost and the group its left half should be
+	const uint32_t groupCount = 1u << leafCount;
+	BuildBounds bounds[1 << BVH_TREELET_SIZE];
+	uint32_t counts[1 << BVH_TREELET_SIZE];
+	float costs[1 << BVH_TREELET_SIZE];
+	uint8_t lefts[1 << BVH_TREELET_SIZE];
+	bool collapse[1 << BVH_TREELET_SIZE];
+	for (uint32_t i = 0; i < leafCount; i++)
+	{
+		uint32_t group = 1u << i;
+		GetChild(leaves[i], bounds[group], counts[group], costs[group]);
+		lefts[group] = 0;
+		collapse[group] = false;
+	}
+
+	for (uint32_t group = 3; group < groupCount; group++)
+	{
+		// Groups of one were done above
+		uint32_t lowest = group & (0u - group);
+		if (group == lowest)
+			continue;
+
+		bounds[group] = bounds[lowest];
+		bounds[group].Grow(bounds[group ^ lowest]);
+		counts[group] = counts[lowest] + counts[group ^ lowest];
+
+		// Every split into two halves, once each (the half with
+		// the lowest bit goes left, along with any of the rest
+		// but not all of it)
+		float bestChildCost = FLT_MAX;
+		uint32_t rest = group ^ lowest;
+		for (uint32_t others = (rest - 1) & rest; ; others = (others - 1) & rest)
+		{
+			uint32_t left = lowest | others;
+			float childCost = costs[left] + costs[group ^ left];
+			if (childCost < bestChildCost)
+			{
+				bestChildCost = childCost;
+				lefts[group] = (uint8_t)left;
+			}
+			if (others == 0)
+				break;
+		}
+
+		float area = bounds[group].Area();
+		float splitCost = BVH_TRAVERSAL_COST * area + bestChildCost;
+		float leafCost = counts[group] <= BVH_MAX_LEAF_TRIANGLES ? BVH_TRIANGLE_COST * area * counts[group] : FLT_MAX;
+		collapse[group] = leafCost <= splitCost;
+		costs[group] = (std::min)(leafCost, splitCost);
+	}
+
+	// Only worth changing if it's actually better
+	uint32_t all = groupCount - 1;
+	if (costs[all] >= linearNodes[treeletRoot].Cost * 0.9999f)
+		return;
+
+	// Rebuild top down, handing out the old interior nodes
+	struct Rebuild { uint32_t Group; uint32_t Node; };
+	Rebuild stack[BVH_TREELET_SIZE];
+	uint32_t stackSize = 0;
+	uint32_t nextInterior = 1;
+	stack[stackSize++] = { all, treeletRoot };
+	while (stackSize > 0)
+	{
+		Rebuild entry = stack[--stackSize];
+		LinearNode& node = linearNodes[entry.Node];
+		node.Bounds = bounds[entry.Group];
+		node.Count = counts[entry.Group];
+		node.Cost = costs[entry.Group];
+		node.Collapse = collapse[entry.Group];
+
+		uint32_t halves[2] = { lefts[entry.Group], entry.Group ^ lefts[entry.Group] };
+		for (int c = 0; c < 2; c++)
+		{
+			uint32_t half = halves[c];
+			if ((half & (half - 1)) == 0)
+			{
+				uint32_t leaf = 0;
+				while (half >> (leaf + 1))
+					leaf++;
+				node.Children[c] = leaves[leaf];
+			}
+			else
+			{
+				uint32_t interior = interiors[nextInterior++];
+				node.Children[c] = interior;
+				stack[stackSize++] = { half, interior };
+			}
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Walks the tree depth first, giving each pair of children
+// the next two slots in the final array, and laying out each
+// leaf's triangles as it goes.  Collapsed subtrees become a
+// single leaf with every triangle under them.
+//
+// Returns false if the tree is deeper than BVH_MAX_DEPTH
+// --------------------------------------------------------
+bool LinearBuilder::Pack(std::vector<BvhNode>& nodes, std::vector<uint32_t>& triangleOrder, uint32_t& maxDepth)
+{
+	nodes.clear();
+	nodes.reserve((size_t)triangleCount * 2 - 1);
+	triangleOrder.clear();
+	triangleOrder.reserve(triangleCount);
+	maxDepth = 0;
+
+	struct PackEntry { uint32_t Node; uint32_t Child; uint32_t Depth; };
+	std::vector<PackEntry> stack;
+	nodes.emplace_back();
+	stack.push_back({ 0, triangleCount > 1 ? root : LINEAR_TRIANGLE_BIT, 1 });
+	while (!stack.empty())
+	{
+		PackEntry entry = stack.back();
+		stack.pop_back();
+		maxDepth = (std::max)(maxDepth, entry.Depth);
+		if (maxDepth > BVH_MAX_DEPTH)
+			return false;
+
+		BuildBounds bounds;
+		uint32_t count;
+		float cost;
+		GetChild(entry.Child, bounds, count, cost);
+
+		BvhNode& node = nodes[entry.Node];
+		XMStoreFloat3(&node.BoundsMin, bounds.Min);
+		XMStoreFloat3(&node.BoundsMax, bounds.Max);
+		if (entry.Child & LINEAR_TRIANGLE_BIT)
+		{
+			node.LeftFirst = (uint32_t)triangleOrder.size();
+			node.TriangleCount = 1;
+			triangleOrder.push_back(sorted[entry.Child & ~LINEAR_TRIANGLE_BIT]);
+		}
+		else if (linearNodes[entry.Child].Collapse)
+		{
+			// At most BVH_MAX_LEAF_TRIANGLES triangles, so only a
+			// few nodes to go through
+			node.LeftFirst = (uint32_t)triangleOrder.size();
+			node.TriangleCount = count;
+			uint32_t pending[BVH_MAX_LEAF_TRIANGLES];
+			uint32_t pendingCount = 0;
+			pending[pendingCount++] = entry.Child;
+			while (pendingCount > 0)
+			{
+				uint32_t child = pending[--pendingCount];
+				if (child & LINEAR_TRIANGLE_BIT)
+				{
+					triangleOrder.push_back(sorted[child & ~LINEAR_TRIANGLE_BIT]);
+					continue;
+				}
+				pending[pendingCount++] = linearNodes[child].Children[1];
+				pending[pendingCount++] = linearNodes[child].Children[0];
+			}
+		}
+		else
+		{
+			const LinearNode& linear = linearNodes[entry.Child];
+			uint32_t left = (uint32_t)nodes.size();
+			node.LeftFirst = left;
+			node.TriangleCount = 0;
+			nodes.emplace_back();
+			nodes.emplace_back();
+
+			// Right first, so the left subtree comes out first
+			stack.push_back({ left + 1, linear.Children[1], entry.Depth + 1 });
+			stack.push_back({ left, linear.Children[0], entry.Depth + 1 });
+		}
+	}
+
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Starts out empty
+// --------------------------------------------------------
+Bvh::Bvh() :
+	refitAreaCost(0),
+	buildStats{}
+{
+}
+
+
+// --------------------------------------------------------
+// Builds the tree over a mesh's triangles.  Everything the
+// tree needs is copied, so the mesh data can go away after.
+//
+// verts      - The mesh's vertices (only positions are used)
+// numVerts   - Number of vertices
+// indices    - Three indices per triangle
+// numIndices - Number of indices
+// options    - How to build it (plain SAH splits by default)
+// --------------------------------------------------------
+void Bvh::Build(const Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices, const BvhBuildOptions& options)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	nodes.clear();
+	triangles.clear();
+	triangleIndices.clear();
+	cache.reset();
+	nodeParents.clear();
+	boxLeaves.clear();
+	refitAreaCost = 0;
+	buildStats = {};
+
+	size_t triangleCount = numIndices / 3;
+	if (triangleCount == 0 || numVerts == 0)
+		return;
+
+	if (options.Linear)
+	{
+		// Falls back on the SAH for the odd mesh whose linear
+		// tree would be too deep to traverse
+		LinearBuilder builder(verts, indices, triangleCount, options.TreeletPasses);
+		if (!builder.Build(nodes, triangleIndices, buildStats.MaxDepth))
+		{
+			BvhBuilder fallback(verts, indices, triangleCount);
+			fallback.Build(nodes, triangleIndices, buildStats.MaxDepth);
+		}
+	}
+	else if (options.SpatialSplits)
+	{
+		SpatialSplitBuilder builder(verts, indices, triangleCount, options);
+		builder.Build(nodes, triangleIndices, buildStats.MaxDepth, buildStats.SpatialSplits);
+	}
+	else
+	{
+		BvhBuilder builder(verts, indices, triangleCount);
+		builder.Build(nodes, triangleIndices, buildStats.MaxDepth);
+	}
+
+	// Copy out the triangles in leaf order, so each leaf's
+	// triangles are contiguous in memory (spatial splits can
+	// put a triangle in more than one leaf)
+	size_t referenceCount = triangleIndices.size();
+	triangles.resize(referenceCount);
+	for (size_t i = 0; i < referenceCount; i++)
+	{
+		const unsigned int* tri = &indices[triangleIndices[i] * 3];
+		triangles[i].V0 = verts[tri[0]].Position;
+		triangles[i].V1 = verts[tri[1]].Position;
+		triangles[i].V2 = verts[tri[2]].Position;
+	}
+
+	buildStats.BuildTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	buildStats.SahCost = CalculateSahCost();
+	buildStats.NodeCount = (uint32_t)nodes.size();
+	buildStats.LeafCount = (uint32_t)(nodes.size() + 1) / 2;
+	buildStats.AverageLeafTriangles = (float)referenceCount / buildStats.LeafCount;
+	buildStats.ReferenceCount = (uint32_t)referenceCount;
+	buildStats.MemorySize = GetMemorySize();
+}
+
+
+// --------------------------------------------------------
+// Maps a tree that was saved to a cache file, and uses it
+// right where it is: there's nothing to build, copy or fix
+// up, since the file holds the exact arrays a build makes.
+//
+// cacheFile    - A .bvhbin written by BvhCache::Write()
+// geometryHash - BvhCache::HashGeometry() of the mesh
+// options      - How the tree would have been built
+// --------------------------------------------------------
+bool Bvh::Load(const std::wstring& cacheFile, uint64_t geometryHash, const BvhBuildOptions& options)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	nodes.clear();
+	triangles.clear();
+	triangleIndices.clear();
+	cache.reset();
+	nodeParents.clear();
+	boxLeaves.clear();
+	refitAreaCost = 0;
+	buildStats = {};
+
+	std::shared_ptr<BvhCache> file = std::make_shared<BvhCache>(cacheFile, geometryHash, options);
+	if (!file->IsValid())
+		return false;
+	cache = file;
+
+	const BvhCacheHeader* header = cache->GetHeader();
+	buildStats.BuildTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	buildStats.SahCost = header->SahCost;
+	buildStats.NodeCount = header->NodeCount;
+	buildStats.LeafCount = header->LeafCount;
+	buildStats.MaxDepth = header->MaxDepth;
+	buildStats.AverageLeafTriangles = header->LeafCount > 0 ? (float)header->ReferenceCount / header->LeafCount : 0;
+	buildStats.ReferenceCount = header->ReferenceCount;
+	buildStats.SpatialSplits = header->SpatialSplitCount;
+	buildStats.MemorySize = GetMemorySize();
+	buildStats.FromCache = true;
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Builds the tree over boxes instead of triangles, like the
+// instances in a scene.  The tree has no triangles, and its
+// leaves index into the boxes through GetTriangleIndices().
+//
+// boxes       - Bounds of each thing in the tree
+// count       - Number of boxes
+// maxLeafSize - Most boxes a leaf can hold
+// --------------------------------------------------------
+void Bvh::Build(const BvhBounds* boxes, size_t count, uint32_t maxLeafSize)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	nodes.clear();
+	triangles.clear();
+	triangleIndices.clear();
+	cache.reset();
+	nodeParents.clear();
+	boxLeaves.clear();
+	refitAreaCost = 0;
+	buildStats = {};
+	if (count == 0)
+		return;
+
+	BvhBuilder builder(boxes, count, maxLeafSize);
+	builder.Build(nodes, triangleIndices, buildStats.MaxDepth);
+
+	// Refits walk up from the leaves, so every node needs to
+	// know its parent, and every box its leaf
+	nodeParents.resize(nodes.size());
+	boxLeaves.resize(count);
+	nodeParents[0] = 0;
+	for (uint32_t n = 0; n < (uint32_t)nodes.size(); n++)
+	{
+		const BvhNode& node = nodes[n];
+		if (node.IsLeaf())
+		{
+			for (uint32_t i = node.LeftFirst; i < node.LeftFirst + node.TriangleCount; i++)
+				boxLeaves[triangleIndices[i]] = n;
+		}
+		else
+		{
+			nodeParents[node.LeftFirst] = n;
+			nodeParents[node.LeftFirst + 1] = n;
+		}
+	}
+
+	buildStats.BuildTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	buildStats.SahCost = CalculateSahCost();
+	buildStats.NodeCount = (uint32_t)nodes.size();
+	buildStats.LeafCount = (uint32_t)(nodes.size() + 1) / 2;
+	buildStats.AverageLeafTriangles = (float)count / buildStats.LeafCount;
+	buildStats.ReferenceCount = (uint32_t)count;
+	buildStats.MemorySize = GetMemorySize();
+	refitAreaCost = (double)buildStats.SahCost * NodeArea(nodes[0]);
+}
+
+
+// --------------------------------------------------------
+// Refits a tree built over boxes, after some of them moved.
+// Each changed box's leaf is refit, then its parents, up to
+// the first one that didn't change (everything above it is
+// still right).  When most of the tree would be touched, a
+// single pass over every node, children before parents, is
+// cheaper than all of those walks.
+//
+// The tree keeps its shape, so this is much faster than a
+// rebuild, but the shape can get worse and worse as boxes
+// move away from where they were built.  The SAH cost that
+// comes back (kept up to date with each node that changes)
+// is how to tell when a rebuild is due.
+//
+// boxes        - Every box, in the same order as the build
+// changedBoxes - Indices of the boxes that changed
+// changedCount - Number of changed boxes
+// --------------------------------------------------------
+float Bvh::Refit(const BvhBounds* boxes, const uint32_t* changedBoxes, size_t changedCount)
+{
+	if (nodes.empty() || boxLeaves.empty())
+		return 0;
+
+	uint32_t nodeCount = (uint32_t)nodes.size();
+	if (changedCount * buildStats.MaxDepth >= nodeCount)
+	{
+		for (uint32_t n = nodeCount; n > 0; n--)
+			RefitNode(boxes, n - 1);
+	}
+	else
+	{
+		for (size_t i = 0; i < changedCount; i++)
+		{
+			uint32_t n = boxLeaves[changedBoxes[i]];
+			while (RefitNode(boxes, n) && n != 0)
+				n = nodeParents[n];
+		}
+	}
+
+	float rootArea = NodeArea(nodes[0]);
+	if (rootArea <= 0)
+		return BVH_TRIANGLE_COST * triangleIndices.size();
+	return (float)(refitAreaCost / rootArea);
+}
+
+
+// --------------------------------------------------------
+// Fits one node of a box tree around its boxes (for leaves)
+// or its children, keeping the refit SAH cost up to date.
+// Returns whether its bounds changed.
+// --------------------------------------------------------
+bool Bvh::RefitNode(const BvhBounds* boxes, uint32_t nodeIndex)
+{
+	BvhNode& node = nodes[nodeIndex];
+	BuildBounds bounds;
+	bounds.Reset();
+	if (node.IsLeaf())
+	{
+		for (uint32_t i = node.LeftFirst; i < node.LeftFirst + node.TriangleCount; i++)
+		{
+			const BvhBounds& box = boxes[triangleIndices[i]];
+			bounds.Grow(BuildBounds{ XMLoadFloat3(&box.Min), XMLoadFloat3(&box.Max) });
+		}
+	}
+	else
+	{
+		for (uint32_t c = node.LeftFirst; c < node.LeftFirst + 2; c++)
+			bounds.Grow(BuildBounds{ XMLoadFloat3(&nodes[c].BoundsMin), XMLoadFloat3(&nodes[c].BoundsMax) });
+	}
+
+	XMFLOAT3 newMin, newMax;
+	XMStoreFloat3(&newMin, bounds.Min);
+	XMStoreFloat3(&newMax, bounds.Max);
+	if (newMin.x == node.BoundsMin.x && newMin.y == node.BoundsMin.y && newMin.z == node.BoundsMin.z &&
+		newMax.x == node.BoundsMax.x && newMax.y == node.BoundsMax.y && newMax.z == node.BoundsMax.z)
+		return false;
+
+	float oldArea = NodeArea(node);
+	node.BoundsMin = newMin;
+	node.BoundsMax = newMax;
+
+	float cost = node.IsLeaf() ? BVH_TRIANGLE_COST * node.TriangleCount : BVH_TRAVERSAL_COST;
+	refitAreaCost += (double)cost * (NodeArea(node) - oldArea);
+	return true;
+}
+
+// --------------------------------------------------------
+// Finds the closest triangle hit by the ray (within its
+// range), front or back facing.  Children are visited
+// nearest first, so far ones can often be skipped.
+// --------------------------------------------------------
+bool Bvh::Intersect(const BvhRay& ray, BvhHit& hit) const
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+	if (IsEmpty())
+		return false;
+
+	const BvhTriangle* treeTriangles = GetTriangles().data();
+	const uint32_t* treeIndices = GetTriangleIndices().data();
+	TraverseBvh(GetNodes().data(), ray, hit.T, [&](uint32_t first, uint32_t count)
+		{
+			IntersectBvhTriangles(treeTriangles, treeIndices, first, count, ray, hit);
+			return true;
+		});
+
+	return hit.TriangleIndex != BVH_NO_HIT;
+}
+
+
+// --------------------------------------------------------
+// Whether any triangle is hit within the ray's range.  The
+// walk takes leaves in whatever order it reaches them and
+// stops at the first hit, with no distances or barycentrics
+// worked out along the way.
+// --------------------------------------------------------
+bool Bvh::Occluded(const BvhRay& ray) const
+{
+	if (IsEmpty())
+		return false;
+
+	const BvhTriangle* treeTriangles = GetTriangles().data();
+	return TraverseBvhUnordered(GetNodes().data(), ray, [&](uint32_t first, uint32_t count)
+		{
+			return OccludeBvhTriangles(treeTriangles, first, count, ray);
+		});
+}
+
+
+// --------------------------------------------------------
+// The cost the SAH assigns to the whole tree: the expected
+// number of node visits and triangle tests (weighted by
+// their costs) for a random ray that hits the root, based
+// on each node's surface area relative to the root's
+// --------------------------------------------------------
+float Bvh::CalculateSahCost() const
+{
+	BvhArray<BvhNode> treeNodes = GetNodes();
+	if (treeNodes.empty())
+		return 0;
+
+	float rootArea = NodeArea(treeNodes[0]);
+	if (rootArea <= 0)
+		return BVH_TRIANGLE_COST * GetTriangleIndices().size();
+
+	double cost = 0;
+	for (const BvhNode& node : treeNodes)
+	{
+		float area = NodeArea(node);
+		if (node.IsLeaf())
+			cost += BVH_TRIANGLE_COST * node.TriangleCount * area;
+		else
+			cost += BVH_TRAVERSAL_COST * area;
+	}
+	return (float)(cost / rootArea);
+}
+
+
+// --------------------------------------------------------
+// Bytes used by the nodes and triangles (or boxes)
+// --------------------------------------------------------
+size_t Bvh::GetMemorySize() const
+{
+	return
+		GetNodes().size() * sizeof(BvhNode) +
+		GetTriangles().size() * sizeof(BvhTriangle) +
+		GetTriangleIndices().size() * sizeof(uint32_t) +
+		(nodeParents.size() + boxLeaves.size()) * sizeof(uint32_t);
+}
+
+
+// --------------------------------------------------------
+// The tree's arrays, wherever they live
+// --------------------------------------------------------
+BvhArray<BvhNode> Bvh::GetNodes() const
+{
+	if (cache)
+		return { cache->GetNodes(), cache->GetHeader()->NodeCount };
+	return { nodes.data(), nodes.size() };
+}
+
+BvhArray<BvhTriangle> Bvh::GetTriangles() const
+{
+	if (cache)
+		return { cache->GetTriangles(), cache->GetHeader()->ReferenceCount };
+	return { triangles.data(), triangles.size() };
+}
+
+BvhArray<uint32_t> Bvh::GetTriangleIndices() const
+{
+	if (cache)
+		return { cache->GetTriangleIndices(), cache->GetHeader()->ReferenceCount };
+	return { triangleIndices.data(), triangleIndices.size() };
+}
+
+
+// --------------------------------------------------------
+// Dot and cross products in plain floats, in a fixed order
+// (see IntersectTriangle)
+// --------------------------------------------------------
+static inline float Dot3(const float* a, const float* b)
+{
+	return (a[0] * b[0] + a[1] * b[1]) + a[2] * b[2];
+}
+
+static inline void Cross3(const float* a, const float* b, float* result)
+{
+	result[0] = a[1] * b[2] - a[2] * b[1];
+	result[1] = a[2] * b[0] - a[0] * b[2];
+	result[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+
+// --------------------------------------------------------
+// Moller-Trumbore for one triangle (front or back facing),
+// giving where along the ray it was hit, whatever the ray's
+// range.  Returns false on a miss.
+//
+// Triangles whose determinant could be all rounding (see
+// BVH_MIN_RELATIVE_DETERMINANT) are skipped: the edges of
+// a sliver nearly cancel, and what's left of the cross
+// product can put its hit far outside the triangle (and
+// its box, so whether a tree found it came down to which
+// other boxes happened to be nearby).
+//
+// The math is spelled out instead of using XMVector3Dot
+// and XMVector3Cross, whose rounding depends on what
+// DirectXMath was built for (SSE2 adds a dot product's x
+// and z first, SSE4 and FMA builds round differently
+// again).  The packet kernel (BvhPacket.cpp) does exactly
+// these operations in this order, so it gets bit for bit
+// the same hits.  Every test is written so that a NaN (from
+// a degenerate ray) fails it, like the packet's masks.
+//
+// minDet - BVH_MIN_RELATIVE_DETERMINANT times the length
+//   of the ray's direction
+// --------------------------------------------------------
+static inline bool IntersectTriangle(const BvhTriangle& triangle, const float* origin, const float* dir, float minDet, float& u, float& v, float& t)
+{
+	const float e1[3] = { triangle.V1.x - triangle.V0.x, triangle.V1.y - triangle.V0.y, triangle.V1.z - triangle.V0.z };
+	const float e2[3] = { triangle.V2.x - triangle.V0.x, triangle.V2.y - triangle.V0.y, triangle.V2.z - triangle.V0.z };
+
+	float p[3];
+	Cross3(dir, e2, p);
+	float det = Dot3(e1, p);
+	if (!(fabsf(det) > minDet * sqrtf(Dot3(e1, e1)) * sqrtf(Dot3(e2, e2))))
+		return false;
+
+	float invDet = 1.0f / det;
+	const float s[3] = { origin[0] - triangle.V0.x, origin[1] - triangle.V0.y, origin[2] - triangle.V0.z };
+	u = Dot3(s, p) * invDet;
+	if (!(u >= 0 && u <= 1))
+		return false;
+
+	float q[3];
+	Cross3(s, e1, q);
+	v = Dot3(dir, q) * invDet;
+	if (!(v >= 0 && u + v <= 1))
+		return false;
+
+	t = Dot3(e2, q) * invDet;
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Tests a run of leaf triangles against a ray (see
+// IntersectTriangle), updating the hit with any that are
+// closer.  Every BVH layout shares this, so they all agree
+// on exactly what counts as a hit.
+// --------------------------------------------------------
+void IntersectBvhTriangles(const BvhTriangle* triangles, const uint32_t* triangleIndices, uint32_t first, uint32_t count, const BvhRay& ray, BvhHit& hit)
+{
+	const float origin[3] = { ray.Origin.x, ray.Origin.y, ray.Origin.z };
+	const float dir[3] = { ray.Direction.x, ray.Direction.y, ray.Direction.z };
+	float minDet = BVH_MIN_RELATIVE_DETERMINANT * sqrtf(Dot3(dir, dir));
+
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		float u, v, t;
+		if (!IntersectTriangle(triangles[i], origin, dir, minDet, u, v, t) || !(t >= ray.TMin && t < hit.T))
+			continue;
+
+		hit.T = t;
+		hit.U = u;
+		hit.V = v;
+		hit.TriangleIndex = triangleIndices[i];
+	}
+}
+
+
+// --------------------------------------------------------
+// The same test as above, against the ray's whole range,
+// returning as soon as any triangle is hit, so a ray is
+// occluded exactly when Intersect() would have found a hit
+// --------------------------------------------------------
+bool OccludeBvhTriangles(const BvhTriangle* triangles, uint32_t first, uint32_t count, const BvhRay& ray)
+{
+	const float origin[3] = { ray.Origin.x, ray.Origin.y, ray.Origin.z };
+	const float dir[3] = { ray.Direction.x, ray.Direction.y, ray.Direction.z };
+	float minDet = BVH_MIN_RELATIVE_DETERMINANT * sqrtf(Dot3(dir, dir));
+
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		float u, v, t;
+		if (IntersectTriangle(triangles[i], origin, dir, minDet, u, v, t) && t >= ray.TMin && t < ray.TMax)
+			return true;
+	}
+	return false;
+}
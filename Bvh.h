@@ -0,0 +1,459 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Vertex.h"
+
+class BvhCache;
+
+// How many buckets the SAH tries along each axis
+#define BVH_SAH_BINS 16
+
+// Leaves never hold more triangles than this
+#define BVH_MAX_LEAF_TRIANGLES 8
+
+// Relative costs of visiting a node and testing a triangle,
+// which the SAH weighs against each other
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_TRIANGLE_COST 1.0f
+
+// Nodes with at least this many triangles build their two
+// children in parallel (and bin in parallel above 8x this).
+// Small enough that even a scene's top level tree spreads
+// out over every core.
+#define BVH_PARALLEL_THRESHOLD 1024
+
+// Deepest a tree can be traversed (builds never go deeper)
+#define BVH_MAX_DEPTH 64
+
+// Linear builds sort triangles by 30-bit Morton codes (10
+// bits per axis) up to this many triangles, and by 63-bit
+// ones (21 per axis) above it, where 1024 cells along each
+// axis start to lump too many triangles together (and the
+// sort takes twice as many passes)
+#define BVH_LINEAR_WIDE_CODE_TRIANGLES 262144
+
+// Treelet optimization reshapes groups of this many subtrees
+// at a time (the work grows as 3^n), but only over nodes with
+// at least this many triangles, i.e. the top of the tree
+#define BVH_TREELET_SIZE 7
+#define BVH_TREELET_MIN_TRIANGLES 256
+
+// BvhHit::TriangleIndex when nothing was hit
+#define BVH_NO_HIT 0xFFFFFFFF
+
+// Conservative walks stretch the far end of every box by this
+// much, covering the rounding in the slab test (1 + 2 gamma(3),
+// from Ize's "Robust BVH Ray Traversal"), so a triangle lying
+// right on a box's face can't be missed
+#define BVH_CONSERVATIVE_EXIT_SCALE (1.0f + 3 * FLT_EPSILON)
+
+// Moller-Trumbore determinants this small next to the edge
+// and direction lengths are nothing but rounding, which a
+// sliver (or a ray edge on to a triangle) can leave behind,
+// giving a "hit" that could be anywhere along the ray
+#define BVH_MIN_RELATIVE_DETERMINANT (16 * FLT_EPSILON)
+
+// --------------------------------------------------------
+// A node in a binary BVH, 32 bytes each.  Children always
+// come in pairs, so an interior node only needs the index
+// of the first.
+// --------------------------------------------------------
+struct BvhNode
+{
+	DirectX::XMFLOAT3 BoundsMin;
+	uint32_t LeftFirst;		// Left child (right is the next node), or first triangle for leaves
+	DirectX::XMFLOAT3 BoundsMax;
+	uint32_t TriangleCount;	// Zero for interior nodes
+
+	bool IsLeaf() const { return TriangleCount > 0; }
+};
+
+// An axis aligned box, for building trees over things other than triangles
+struct BvhBounds
+{
+	DirectX::XMFLOAT3 Min;
+	DirectX::XMFLOAT3 Max;
+};
+
+// A triangle's positions, copied out of the mesh in leaf order
+struct BvhTriangle
+{
+	DirectX::XMFLOAT3 V0;
+	DirectX::XMFLOAT3 V1;
+	DirectX::XMFLOAT3 V2;
+};
+
+// A ray (in the same space as the mesh), hitting things
+// between TMin and TMax along the direction
+struct BvhRay
+{
+	DirectX::XMFLOAT3 Origin;
+	float TMin;
+	DirectX::XMFLOAT3 Direction;
+	float TMax;
+};
+
+// --------------------------------------------------------
+// The closest hit along a ray.  U and V are barycentrics of
+// the hit, weighting the triangle's second and third
+// vertices, just like DXR's.
+// --------------------------------------------------------
+struct BvhHit
+{
+	float T;
+	float U;
+	float V;
+	uint32_t TriangleIndex;	// Triangle in the original index buffer, or BVH_NO_HIT
+};
+
+// --------------------------------------------------------
+// A read-only array that lives somewhere else: in a tree's
+// own vectors, or in the cache file it was loaded from.
+// Has just enough of a const std::vector's interface to
+// stand in for one.
+// --------------------------------------------------------
+template<typename T>
+struct BvhArray
+{
+	const T* Data;
+	size_t Count;
+
+	const T* data() const { return Data; }
+	size_t size() const { return Count; }
+	bool empty() const { return Count == 0; }
+	const T* begin() const { return Data; }
+	const T* end() const { return Data + Count; }
+	const T& operator[](size_t index) const { return Data[index]; }
+};
+
+// --------------------------------------------------------
+// Optional ways to build a tree over triangles
+//
+// Any new option also needs to go in BvhCache::HashOptions(),
+// which keeps meshes and caches built with different options
+// apart
+// --------------------------------------------------------
+struct BvhBuildOptions
+{
+	// Also consider spatial splits (an SBVH): splitting space,
+	// rather than the list of triangles, and putting triangles
+	// that straddle the split into both children (each clipped
+	// to its side).  Long, thin triangles, whose boxes overlap
+	// badly otherwise, get much tighter trees, at the cost of
+	// slower (single threaded) builds and some duplicates.
+	bool SpatialSplits = false;
+
+	// Most extra triangle references spatial splits can add,
+	// as a fraction of the triangle count
+	float MaxReferenceGrowth = 0.5f;
+
+	// Spatial splits are only tried where the best object
+	// split's children overlap by at least this much of the
+	// root's surface area (so most nodes skip the extra work)
+	float MinSpatialSplitOverlap = 1e-5f;
+
+	// Build a linear BVH (LBVH) instead: triangles are sorted
+	// along a Morton curve through their centroids, and the
+	// tree falls straight out of the sorted order.  Several
+	// times quicker than the SAH, for geometry that changes
+	// every frame, but usually slower to trace.  Ignores
+	// spatial splits.
+	bool Linear = false;
+
+	// For linear builds, how many times to go over the top of
+	// the tree reshaping small groups of nodes with the SAH
+	// (see BVH_TREELET_SIZE).  Each pass wins back some trace
+	// speed for a little more build time.
+	uint32_t TreeletPasses = 0;
+};
+
+// --------------------------------------------------------
+// How a build went
+// --------------------------------------------------------
+struct BvhBuildStats
+{
+	double BuildTimeMs;
+	float SahCost;			// Expected cost of a random ray (see CalculateSahCost)
+	uint32_t NodeCount;
+	uint32_t LeafCount;
+	uint32_t MaxDepth;
+	float AverageLeafTriangles;
+	uint32_t ReferenceCount;	// Triangles in leaves, counting spatial split duplicates
+	uint32_t SpatialSplits;		// Nodes split spatially rather than by object
+	size_t MemorySize;		// Bytes for nodes and triangles
+	bool FromCache;			// Loaded rather than built (BuildTimeMs is then the load)
+};
+
+// --------------------------------------------------------
+// A bounding volume hierarchy over a mesh's triangles, built
+// entirely on the CPU.  This is a software equivalent of a
+// DXR bottom level acceleration structure, so meshes can be
+// ray cast without a GPU.
+//
+// Builds are top down, using the surface area heuristic over
+// a fixed number of bins, and large subtrees are built in
+// parallel on the thread pool.  The result is the same no
+// matter how many threads there are.
+//
+// With spatial splits on (see BvhBuildOptions), a triangle
+// can end up in more than one leaf.  Linear builds skip the
+// SAH (mostly) for speed, sorting triangles by Morton code.
+//
+// Trees over triangles can also be saved to a .bvhbin (see
+// BvhCache) and loaded on later runs, in which case they
+// are used straight out of the mapped file.
+// --------------------------------------------------------
+class Bvh
+{
+public:
+	Bvh();
+
+	// Builds (or rebuilds) the tree over an indexed triangle list
+	void Build(const Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices, const BvhBuildOptions& options = BvhBuildOptions());
+
+	// Uses a tree saved with BvhCache::Write() instead of building one,
+	// as long as it was built from the same geometry (see
+	// BvhCache::HashGeometry) with the same options.  Returns false,
+	// leaving the tree empty, if the file is missing or stale.
+	bool Load(const std::wstring& cacheFile, uint64_t geometryHash, const BvhBuildOptions& options = BvhBuildOptions());
+
+	// Builds the tree over boxes instead, with no triangles at all
+	// (GetTriangleIndices() then gives the boxes in leaf order)
+	void Build(const BvhBounds* boxes, size_t count, uint32_t maxLeafSize);
+
+	// Moves some of a box tree's boxes without rebuilding: their leaves,
+	// and every node above them, are grown or shrunk to fit.  Returns
+	// the tree's SAH cost afterwards, which goes up as the tree (whose
+	// shape was picked for the old boxes) gets worse.
+	float Refit(const BvhBounds* boxes, const uint32_t* changedBoxes, size_t changedCount);
+
+	// Finds the closest hit along a ray, returning false on a miss
+	// (only for trees over triangles)
+	bool Intersect(const BvhRay& ray, BvhHit& hit) const;
+
+	// Whether anything at all blocks a ray, stopping at the first
+	// triangle found (for shadow and AO rays, which don't need the
+	// closest).  Only for trees over triangles.
+	bool Occluded(const BvhRay& ray) const;
+
+	// Expected cost of tracing a ray through the tree (lower is better)
+	float CalculateSahCost() const;
+
+	bool IsEmpty() const { return GetNodes().empty(); }
+	size_t GetMemorySize() const;
+	const BvhBuildStats& GetBuildStats() const { return buildStats; }
+
+	// Nodes (the root is first) and triangles in leaf order, with the
+	// original index buffer triangle for each
+	BvhArray<BvhNode> GetNodes() const;
+	BvhArray<BvhTriangle> GetTriangles() const;
+	BvhArray<uint32_t> GetTriangleIndices() const;
+
+private:
+	std::vector<BvhNode> nodes;
+	std::vector<BvhTriangle> triangles;
+	std::vector<uint32_t> triangleIndices;
+
+	// Only for loaded trees, which use the arrays in the file instead
+	// (shared, so copies of the tree can use the same mapping)
+	std::shared_ptr<const BvhCache> cache;
+
+	// Only for box trees, so they can be refit
+	std::vector<uint32_t> nodeParents;
+	std::vector<uint32_t> boxLeaves;
+	double refitAreaCost;	// SAH cost, before dividing by the root's area
+
+	BvhBuildStats buildStats;
+
+	bool RefitNode(const BvhBounds* boxes, uint32_t nodeIndex);
+};
+
+// Tests leaf triangles [first, first + count) against a ray, keeping
+// the closest hit (shared by every BVH layout)
+void IntersectBvhTriangles(const BvhTriangle* triangles, const uint32_t* triangleIndices, uint32_t first, uint32_t count, const BvhRay& ray, BvhHit& hit);
+
+// Whether any of leaf triangles [first, first + count) is hit within
+// [TMin, TMax), giving up at the first one (the same test as above)
+bool OccludeBvhTriangles(const BvhTriangle* triangles, uint32_t first, uint32_t count, const BvhRay& ray);
+
+// --------------------------------------------------------
+// Walks a binary tree along a ray, nearer children first,
+// calling leaf(first, count) for every leaf whose box the
+// ray reaches within [TMin, tMax].  The callback can shrink
+// tMax (when it finds a hit) to cull the rest of the walk,
+// and returns false to stop the walk right away.
+//
+// Which plane of each axis the ray enters through is known
+// up front, so a NaN (from a plane right on the origin of a
+// ray parallel to it) is just ignored by min/max, instead
+// of turning into a miss.
+//
+// visit(nodeIndex) is called for every node the walk steps
+// into (leaves included), for counting how much work a ray
+// took (see BvhStats.h).
+//
+// Conservative - Stretch each box a little for rounding (see
+//   BVH_CONSERVATIVE_EXIT_SCALE), for watertight triangle tests
+// nodes - The tree, with the root first (must not be empty)
+// --------------------------------------------------------
+template<bool Conservative = false, typename LeafFunction, typename VisitFunction>
+void TraverseBvh(const BvhNode* nodes, const BvhRay& ray, const float& tMax, LeafFunction leaf, VisitFunction visit)
+{
+	const float origin[3] = { ray.Origin.x, ray.Origin.y, ray.Origin.z };
+	const float invDir[3] = { 1.0f / ray.Direction.x, 1.0f / ray.Direction.y, 1.0f / ray.Direction.z };
+	const bool negative[3] = { invDir[0] < 0, invDir[1] < 0, invDir[2] < 0 };
+
+	// Distance to a node's box along the ray, or FLT_MAX for a miss
+	auto intersectBox = [&](const BvhNode& node)
+		{
+			const float* boxMin = &node.BoundsMin.x;
+			const float* boxMax = &node.BoundsMax.x;
+			float tNear = ray.TMin;
+			float tFar = tMax;
+			for (int a = 0; a < 3; a++)
+			{
+				float tEntry = ((negative[a] ? boxMax[a] : boxMin[a]) - origin[a]) * invDir[a];
+				float tExit = ((negative[a] ? boxMin[a] : boxMax[a]) - origin[a]) * invDir[a];
+				tNear = (std::max)(tNear, tEntry);
+				tFar = (std::min)(tFar, tExit);
+			}
+			if (Conservative)
+				tFar *= BVH_CONSERVATIVE_EXIT_SCALE;
+			return tNear <= tFar ? tNear : FLT_MAX;
+		};
+
+	uint32_t stack[BVH_MAX_DEPTH];
+	uint32_t stackSize = 0;
+	uint32_t nodeIndex = 0;
+	if (intersectBox(nodes[0]) == FLT_MAX)
+		return;
+
+	while (true)
+	{
+		visit(nodeIndex);
+		const BvhNode& node = nodes[nodeIndex];
+		if (node.IsLeaf())
+		{
+			if (!leaf(node.LeftFirst, node.TriangleCount))
+				return;
+		}
+		else
+		{
+			// Visit the nearer child next, and save the other for later
+			uint32_t nearChild = node.LeftFirst;
+			uint32_t farChild = node.LeftFirst + 1;
+			float nearT = intersectBox(nodes[nearChild]);
+			float farT = intersectBox(nodes[farChild]);
+			if (farT < nearT)
+			{
+				std::swap(nearChild, farChild);
+				std::swap(nearT, farT);
+			}
+
+			if (nearT != FLT_MAX)
+			{
+				if (farT != FLT_MAX)
+					stack[stackSize++] = farChild;
+				nodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		// Pop until there's a node that's still worth visiting
+		// (its box may be further than a hit found since)
+		bool found = false;
+		while (stackSize > 0 && !found)
+		{
+			nodeIndex = stack[--stackSize];
+			found = intersectBox(nodes[nodeIndex]) != FLT_MAX;
+		}
+		if (!found)
+			return;
+	}
+}
+
+// The same walk, without watching the nodes go by
+template<bool Conservative = false, typename LeafFunction>
+void TraverseBvh(const BvhNode* nodes, const BvhRay& ray, const float& tMax, LeafFunction leaf)
+{
+	TraverseBvh<Conservative>(nodes, ray, tMax, leaf, [](uint32_t) {});
+}
+
+
+// --------------------------------------------------------
+// Walks a binary tree along a ray in no particular order,
+// calling leaf(first, count) for every leaf whose box the
+// ray reaches within [TMin, TMax], until it returns true.
+// For any-hit queries, where the first hit ends the walk
+// and the closest one doesn't matter: children are never
+// sorted by distance, and the range never shrinks, so a
+// popped node never needs its box tested again.  Returns
+// whether the walk was stopped.
+//
+// nodes - The tree, with the root first (must not be empty)
+// --------------------------------------------------------
+template<typename LeafFunction>
+bool TraverseBvhUnordered(const BvhNode* nodes, const BvhRay& ray, LeafFunction leaf)
+{
+	const float origin[3] = { ray.Origin.x, ray.Origin.y, ray.Origin.z };
+	const float invDir[3] = { 1.0f / ray.Direction.x, 1.0f / ray.Direction.y, 1.0f / ray.Direction.z };
+	const bool negative[3] = { invDir[0] < 0, invDir[1] < 0, invDir[2] < 0 };
+
+	// Whether the ray reaches a node's box (see TraverseBvh)
+	auto hitsBox = [&](const BvhNode& node)
+		{
+			const float* boxMin = &node.BoundsMin.x;
+			const float* boxMax = &node.BoundsMax.x;
+			float tNear = ray.TMin;
+			float tFar = ray.TMax;
+			for (int a = 0; a < 3; a++)
+			{
+				float tEntry = ((negative[a] ? boxMax[a] : boxMin[a]) - origin[a]) * invDir[a];
+				float tExit = ((negative[a] ? boxMin[a] : boxMax[a]) - origin[a]) * invDir[a];
+				tNear = (std::max)(tNear, tEntry);
+				tFar = (std::min)(tFar, tExit);
+			}
+			return tNear <= tFar;
+		};
+
+	if (!hitsBox(nodes[0]))
+		return false;
+
+	uint32_t stack[BVH_MAX_DEPTH];
+	uint32_t stackSize = 0;
+	uint32_t nodeIndex = 0;
+	while (true)
+	{
+		const BvhNode& node = nodes[nodeIndex];
+		if (node.IsLeaf())
+		{
+			if (leaf(node.LeftFirst, node.TriangleCount))
+				return true;
+		}
+		else
+		{
+			// Go left if the ray reaches it, saving the right for later
+			bool hitLeft = hitsBox(nodes[node.LeftFirst]);
+			bool hitRight = hitsBox(nodes[node.LeftFirst + 1]);
+			if (hitLeft || hitRight)
+			{
+				if (hitLeft && hitRight)
+					stack[stackSize++] = node.LeftFirst + 1;
+				nodeIndex = hitLeft ? node.LeftFirst : node.LeftFirst + 1;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+			return false;
+		nodeIndex = stack[--stackSize];
+	}
+}
@@ -0,0 +1,343 @@
+#include "Bvh8.h"
+
+#include <algorithm>
+#include <cfloat>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static_assert(BVH_MAX_LEAF_TRIANGLES <= 8, "Leaf counts need to fit in three bits");
+static_assert(sizeof(Bvh8Node) == 224, "Bvh8Node should be tightly packed");
+
+// --------------------------------------------------------
+// Surface area of a binary node's box
+// --------------------------------------------------------
+static float NodeArea(const BvhNode& node)
+{
+	float x = node.BoundsMax.x - node.BoundsMin.x;
+	float y = node.BoundsMax.y - node.BoundsMin.y;
+	float z = node.BoundsMax.z - node.BoundsMin.z;
+	return 2.0f * (x * y + y * z + z * x);
+}
+
+// --------------------------------------------------------
+// Whether this CPU (and OS) can run the AVX2 kernel.  Checks
+// for AVX2 and FMA, and that the OS saves the upper halves
+// of the YMM registers on context switches.
+// --------------------------------------------------------
+static bool DetectAvx2()
+{
+	unsigned int info[4] = {};
+	auto cpuid = [&](unsigned int leaf)
+		{
+#if defined(_MSC_VER)
+			__cpuidex((int*)info, (int)leaf, 0);
+#else
+			__cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]);
+#endif
+		};
+
+	cpuid(0);
+	if (info[0] < 7)
+		return false;
+
+	// OSXSAVE, AVX and FMA
+	cpuid(1);
+	const unsigned int features = (1u << 27) | (1u << 28) | (1u << 12);
+	if ((info[2] & features) != features)
+		return false;
+
+	// XMM and YMM state both enabled by the OS
+#if defined(_MSC_VER)
+	unsigned long long xcr0 = _xgetbv(0);
+#else
+	unsigned int xcrLow, xcrHigh;
+	__asm__("xgetbv" : "=a"(xcrLow), "=d"(xcrHigh) : "c"(0));
+	unsigned long long xcr0 = ((unsigned long long)xcrHigh << 32) | xcrLow;
+#endif
+	if ((xcr0 & 6) != 6)
+		return false;
+
+	// AVX2
+	cpuid(7);
+	return (info[1] & (1u << 5)) != 0;
+}
+
+// --------------------------------------------------------
+// Picks the fastest kernel this CPU supports
+// --------------------------------------------------------
+Bvh8::Bvh8() :
+	kernel(IsAvx2Supported() ? Bvh8Kernel::Avx2 : Bvh8Kernel::Scalar)
+{
+}
+
+
+// --------------------------------------------------------
+// Whether the AVX2 kernel can run here (only checked once)
+// --------------------------------------------------------
+bool Bvh8::IsAvx2Supported()
+{
+	static const bool supported = DetectAvx2();
+	return supported;
+}
+
+
+// --------------------------------------------------------
+// Switches kernels, ignoring AVX2 if it isn't supported
+// --------------------------------------------------------
+void Bvh8::SetKernel(Bvh8Kernel newKernel)
+{
+	kernel = newKernel == Bvh8Kernel::Avx2 && !IsAvx2Supported() ? Bvh8Kernel::Scalar : newKernel;
+}
+
+
+// --------------------------------------------------------
+// Collapses a binary tree into this one.  Leaves (and the
+// triangles in them) are kept exactly as they are, while
+// each wide node pulls in up to eight of the binary tree's
+// nodes from the levels below it.
+// --------------------------------------------------------
+void Bvh8::Build(const Bvh& bvh)
+{
+	nodes.clear();
+	triangles.assign(bvh.GetTriangles().begin(), bvh.GetTriangles().end());
+	triangleIndices.assign(bvh.GetTriangleIndices().begin(), bvh.GetTriangleIndices().end());
+	if (bvh.IsEmpty())
+		return;
+
+	// Each wide node replaces at least one binary interior node
+	// (and usually closer to seven)
+	BvhArray<BvhNode> binaryNodes = bvh.GetNodes();
+	nodes.reserve(binaryNodes.size() / 8 + 1);
+	CollapseNode(binaryNodes.data(), 0);
+}
+
+
+// --------------------------------------------------------
+// Creates the wide node for a binary node, then recursively
+// does the same for its interior children, so nodes end up
+// in depth first order.
+//
+// Children are found by repeatedly opening up whichever
+// interior child has the largest surface area (the one a
+// random ray is most likely to hit) until there are eight.
+//
+// Returns the new node's index
+// --------------------------------------------------------
+uint32_t Bvh8::CollapseNode(const BvhNode* binaryNodes, uint32_t binaryIndex)
+{
+	uint32_t children[BVH8_WIDTH];
+	unsigned int childCount = 0;
+	const BvhNode& node = binaryNodes[binaryIndex];
+	if (node.IsLeaf())
+	{
+		// Only happens for a root that's also a leaf
+		children[childCount++] = binaryIndex;
+	}
+	else
+	{
+		children[childCount++] = node.LeftFirst;
+		children[childCount++] = node.LeftFirst + 1;
+	}
+
+	while (childCount < BVH8_WIDTH)
+	{
+		int largest = -1;
+		float largestArea = -1;
+		for (unsigned int i = 0; i < childCount; i++)
+		{
+			const BvhNode& child = binaryNodes[children[i]];
+			float area = NodeArea(child);
+			if (!child.IsLeaf() && area > largestArea)
+			{
+				largest = i;
+				largestArea = area;
+			}
+		}
+		if (largest < 0)
+			break;
+
+		uint32_t first = binaryNodes[children[largest]].LeftFirst;
+		children[largest] = first;
+		children[childCount++] = first + 1;
+	}
+
+	// Boxes go in now, and unused slots get inside out
+	// boxes that nothing can hit
+	uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	for (unsigned int i = 0; i < BVH8_WIDTH; i++)
+	{
+		Bvh8Node& wide = nodes[index];
+		if (i < childCount)
+		{
+			const BvhNode& child = binaryNodes[children[i]];
+			wide.MinX[i] = child.BoundsMin.x;
+			wide.MinY[i] = child.BoundsMin.y;
+			wide.MinZ[i] = child.BoundsMin.z;
+			wide.MaxX[i] = child.BoundsMax.x;
+			wide.MaxY[i] = child.BoundsMax.y;
+			wide.MaxZ[i] = child.BoundsMax.z;
+			wide.Children[i] = child.IsLeaf() ?
+				BVH8_LEAF_BIT | ((child.TriangleCount - 1) << BVH8_LEAF_COUNT_SHIFT) | child.LeftFirst :
+				0;
+		}
+		else
+		{
+			wide.MinX[i] = wide.MinY[i] = wide.MinZ[i] = FLT_MAX;
+			wide.MaxX[i] = wide.MaxY[i] = wide.MaxZ[i] = -FLT_MAX;
+			wide.Children[i] = BVH8_EMPTY;
+		}
+	}
+
+	// Interior children get their own nodes (which can move
+	// the vector, so no references across this)
+	for (unsigned int i = 0; i < childCount; i++)
+	{
+		if (!binaryNodes[children[i]].IsLeaf())
+		{
+			uint32_t childIndex = CollapseNode(binaryNodes, children[i]);
+			nodes[index].Children[i] = childIndex;
+		}
+	}
+
+	return index;
+}
+
+
+// --------------------------------------------------------
+// Finds the closest triangle hit by the ray (within its
+// range), front or back facing, using whichever kernel
+// was picked for this CPU
+// --------------------------------------------------------
+bool Bvh8::Intersect(const BvhRay& ray, BvhHit& hit) const
+{
+	if (nodes.empty())
+	{
+		hit.T = ray.TMax;
+		hit.U = 0;
+		hit.V = 0;
+		hit.TriangleIndex = BVH_NO_HIT;
+		return false;
+	}
+
+	if (kernel == Bvh8Kernel::Avx2)
+		return IntersectBvh8Avx2(nodes.data(), triangles.data(), triangleIndices.data(), ray, hit);
+	return IntersectBvh8Scalar(nodes.data(), triangles.data(), triangleIndices.data(), ray, hit);
+}
+
+
+// --------------------------------------------------------
+// Bytes used by the nodes and triangles
+// --------------------------------------------------------
+size_t Bvh8::GetMemorySize() const
+{
+	return
+		nodes.size() * sizeof(Bvh8Node) +
+		triangles.size() * sizeof(BvhTriangle) +
+		triangleIndices.size() * sizeof(uint32_t);
+}
+
+
+// --------------------------------------------------------
+// Traversal for CPUs without AVX2.  Same algorithm as the
+// AVX2 kernel, one child at a time: the children that are
+// hit get sorted nearest first, the nearest is visited next
+// and the rest are saved (with their distances) for later.
+//
+// nodes - The tree, with the root first (must not be empty)
+// --------------------------------------------------------
+bool IntersectBvh8Scalar(const Bvh8Node* nodes, const BvhTriangle* triangles, const uint32_t* triangleIndices, const BvhRay& ray, BvhHit& hit)
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+
+	const float origin[3] = { ray.Origin.x, ray.Origin.y, ray.Origin.z };
+	const float direction[3] = { ray.Direction.x, ray.Direction.y, ray.Direction.z };
+	float invDir[3];
+
+	// Where each axis' entry and exit planes are in a node (a
+	// node is just an array of floats, min planes first), which
+	// depends on which way the ray is going
+	unsigned int nearPlanes[3];
+	unsigned int farPlanes[3];
+	for (int a = 0; a < 3; a++)
+	{
+		invDir[a] = 1.0f / direction[a];
+		nearPlanes[a] = (invDir[a] >= 0 ? a : a + 3) * BVH8_WIDTH;
+		farPlanes[a] = (invDir[a] >= 0 ? a + 3 : a) * BVH8_WIDTH;
+	}
+
+	struct StackEntry
+	{
+		uint32_t Child;
+		float Distance;
+	};
+	StackEntry stack[BVH8_STACK_SIZE];
+	unsigned int stackSize = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		if (current & BVH8_LEAF_BIT)
+		{
+			IntersectBvhTriangles(triangles, triangleIndices,
+				current & BVH8_LEAF_FIRST_MASK,
+				((current >> BVH8_LEAF_COUNT_SHIFT) & 7) + 1,
+				ray, hit);
+		}
+		else
+		{
+			// Slab test each child, insertion sorting the hits
+			const Bvh8Node& node = nodes[current];
+			const float* planes = node.MinX;
+			StackEntry hits[BVH8_WIDTH];
+			unsigned int hitCount = 0;
+			for (unsigned int c = 0; c < BVH8_WIDTH; c++)
+			{
+				float tNear = ray.TMin;
+				float tFar = hit.T;
+				for (int a = 0; a < 3; a++)
+				{
+					tNear = (std::max)(tNear, (planes[nearPlanes[a] + c] - origin[a]) * invDir[a]);
+					tFar = (std::min)(tFar, (planes[farPlanes[a] + c] - origin[a]) * invDir[a]);
+				}
+				if (tNear > tFar)
+					continue;
+
+				unsigned int i = hitCount++;
+				for (; i > 0 && hits[i - 1].Distance > tNear; i--)
+					hits[i] = hits[i - 1];
+				hits[i].Child = node.Children[c];
+				hits[i].Distance = tNear;
+			}
+
+			if (hitCount > 0)
+			{
+				for (unsigned int i = hitCount - 1; i > 0; i--)
+					stack[stackSize++] = hits[i];
+				current = hits[0].Child;
+				continue;
+			}
+		}
+
+		// Pop until there's a child that's still worth visiting
+		// (its box may be further than a hit found since)
+		bool found = false;
+		while (stackSize > 0 && !found)
+		{
+			const StackEntry& entry = stack[--stackSize];
+			current = entry.Child;
+			found = entry.Distance <= hit.T;
+		}
+		if (!found)
+			break;
+	}
+
+	return hit.TriangleIndex != BVH_NO_HIT;
+}
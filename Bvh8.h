@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Bvh.h"
+
+// Children per node
+#define BVH8_WIDTH 8
+
+// A child slot with nothing in it (its box is inside out,
+// so rays never hit it)
+#define BVH8_EMPTY 0xFFFFFFFF
+
+// Leaf children have the top bit set, then their triangle
+// count (minus one) in the next three bits, and their first
+// triangle in the rest.  Anything else is a node index.
+#define BVH8_LEAF_BIT 0x80000000
+#define BVH8_LEAF_COUNT_SHIFT 28
+#define BVH8_LEAF_FIRST_MASK 0x0FFFFFFF
+
+// Each node pushes at most 7 children, at most once per level
+#define BVH8_STACK_SIZE (BVH_MAX_DEPTH * (BVH8_WIDTH - 1) + 1)
+
+// --------------------------------------------------------
+// A node in an 8-wide BVH, holding the boxes of all of its
+// children in SoA form, so that a single AVX2 slab test can
+// check a ray against all eight at once.  224 bytes each.
+// --------------------------------------------------------
+struct alignas(32) Bvh8Node
+{
+	float MinX[BVH8_WIDTH];
+	float MinY[BVH8_WIDTH];
+	float MinZ[BVH8_WIDTH];
+	float MaxX[BVH8_WIDTH];
+	float MaxY[BVH8_WIDTH];
+	float MaxZ[BVH8_WIDTH];
+	uint32_t Children[BVH8_WIDTH];	// Node index, leaf (see BVH8_LEAF_BIT) or BVH8_EMPTY
+};
+
+// Which code traverses the tree
+enum class Bvh8Kernel
+{
+	Scalar,
+	Avx2
+};
+
+// --------------------------------------------------------
+// An 8-wide BVH, collapsed from a binary one.  Wide nodes
+// mean far fewer node fetches per ray, and with AVX2 a whole
+// node's children are tested (and sorted by distance) with
+// a handful of instructions.
+//
+// The kernel is picked when the tree is created, based on
+// what the CPU supports, and machines without AVX2 (or FMA)
+// fall back to plain scalar code.  Both give exactly the
+// same hits as the binary tree it came from.
+// --------------------------------------------------------
+class Bvh8
+{
+public:
+	Bvh8();
+
+	// Collapses a binary tree (which can be thrown away afterwards)
+	void Build(const Bvh& bvh);
+
+	// Finds the closest hit along a ray, returning false on a miss
+	bool Intersect(const BvhRay& ray, BvhHit& hit) const;
+
+	bool IsEmpty() const { return nodes.empty(); }
+	size_t GetMemorySize() const;
+
+	// Can force the scalar kernel (AVX2 is only used if supported)
+	void SetKernel(Bvh8Kernel newKernel);
+	Bvh8Kernel GetKernel() const { return kernel; }
+	static bool IsAvx2Supported();
+
+	// Nodes (the root is first) and triangles in leaf order, with the
+	// original index buffer triangle for each
+	const std::vector<Bvh8Node>& GetNodes() const { return nodes; }
+	const std::vector<BvhTriangle>& GetTriangles() const { return triangles; }
+	const std::vector<uint32_t>& GetTriangleIndices() const { return triangleIndices; }
+
+private:
+	std::vector<Bvh8Node> nodes;
+	std::vector<BvhTriangle> triangles;
+	std::vector<uint32_t> triangleIndices;
+
+	Bvh8Kernel kernel;
+
+	uint32_t CollapseNode(const BvhNode* binaryNodes, uint32_t binaryIndex);
+};
+
+// Traversal kernels, which take the tree's arrays directly
+// (the AVX2 one lives in its own file, and must only be
+// called when Bvh8::IsAvx2Supported() says so)
+bool IntersectBvh8Scalar(const Bvh8Node* nodes, const BvhTriangle* triangles, const uint32_t* triangleIndices, const BvhRay& ray, BvhHit& hit);
+bool IntersectBvh8Avx2(const Bvh8Node* nodes, const BvhTriangle* triangles, const uint32_t* triangleIndices, const BvhRay& ray, BvhHit& hit);
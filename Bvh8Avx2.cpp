@@ -0,0 +1,337 @@
+#include "Bvh8.h"
+#include "Bvh8Compressed.h"
+
+#include <immintrin.h>
+
+// MSVC allows AVX2 intrinsics anywhere, while GCC and Clang
+// need each function using them marked (rather than building
+// the whole file for AVX2, which could let AVX2 code leak
+// into functions shared with the rest of the program)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BVH8_AVX2
+#else
+#define BVH8_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+// --------------------------------------------------------
+// Index of the lowest set bit (mask must not be zero)
+// --------------------------------------------------------
+static inline unsigned int LowestBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// --------------------------------------------------------
+// One step of a bitonic sorting network: every lane is
+// compared with the lane its index XOR'd with, and the lanes
+// set in the blend mask keep the larger of the two
+// --------------------------------------------------------
+#define BITONIC_STEP(keys, permutation, maxLanes) \
+	{ \
+		__m256i partner = _mm256_permutevar8x32_epi32(keys, permutation); \
+		keys = _mm256_blend_epi32(_mm256_min_epi32(keys, partner), _mm256_max_epi32(keys, partner), maxLanes); \
+	}
+
+// --------------------------------------------------------
+// Sorts eight (signed) integer keys, smallest first, with a
+// bitonic network - six steps of shuffles, min/max and
+// blends, and no branches at all
+// --------------------------------------------------------
+static BVH8_AVX2 inline __m256i SortKeys(__m256i keys)
+{
+	const __m256i swap1 = _mm256_setr_epi32(1, 0, 3, 2, 5, 4, 7, 6);
+	const __m256i swap2 = _mm256_setr_epi32(2, 3, 0, 1, 6, 7, 4, 5);
+	const __m256i swap4 = _mm256_setr_epi32(4, 5, 6, 7, 0, 1, 2, 3);
+
+	// Sorted pairs, alternating direction
+	BITONIC_STEP(keys, swap1, 0x66);
+
+	// Sorted fours, alternating direction
+	BITONIC_STEP(keys, swap2, 0x3C);
+	BITONIC_STEP(keys, swap1, 0x5A);
+
+	// All eight, ascending
+	BITONIC_STEP(keys, swap4, 0xF0);
+	BITONIC_STEP(keys, swap2, 0xCC);
+	BITONIC_STEP(keys, swap1, 0xAA);
+
+	return keys;
+}
+
+// --------------------------------------------------------
+// Traversal for CPUs with AVX2 and FMA.  Each node's eight
+// children are slab tested at once, then the ones that were
+// hit are sorted by distance with a sorting network: the
+// nearest is visited next and the rest are saved (with their
+// distances) for later.
+//
+// Sort keys are the entry distances' bits (which sort like
+// integers, as long as TMin isn't negative - otherwise the
+// order is just worse) with the low three bits swapped for
+// the child's slot, so the slots come out of the sort along
+// with the order.  Misses get the largest key possible and
+// end up last.
+//
+// nodes - The tree, with the root first (must not be empty)
+// --------------------------------------------------------
+BVH8_AVX2 bool IntersectBvh8Avx2(const Bvh8Node* nodes, const BvhTriangle* triangles, const uint32_t* triangleIndices, const BvhRay& ray, BvhHit& hit)
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+
+	const float origin[3] = { ray.Origin.x, ray.Origin.y, ray.Origin.z };
+	const float direction[3] = { ray.Direction.x, ray.Direction.y, ray.Direction.z };
+	__m256 invDir[3];
+	__m256 rayOrigin[3];
+
+	// Where each axis' entry and exit planes are in a node,
+	// which depends on which way the ray is going
+	unsigned int nearPlanes[3];
+	unsigned int farPlanes[3];
+	for (int a = 0; a < 3; a++)
+	{
+		float inv = 1.0f / direction[a];
+		invDir[a] = _mm256_set1_ps(inv);
+		rayOrigin[a] = _mm256_set1_ps(origin[a]);
+		nearPlanes[a] = (inv >= 0 ? a : a + 3) * BVH8_WIDTH;
+		farPlanes[a] = (inv >= 0 ? a + 3 : a) * BVH8_WIDTH;
+	}
+
+	const __m256 tMin = _mm256_set1_ps(ray.TMin);
+	const __m256i slots = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i distanceBits = _mm256_set1_epi32(~7);
+	const __m256i missKey = _mm256_set1_epi32(0x7FFFFFFF);
+
+	struct StackEntry
+	{
+		uint32_t Child;
+		float Distance;
+	};
+	StackEntry stack[BVH8_STACK_SIZE];
+	unsigned int stackSize = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		if (current & BVH8_LEAF_BIT)
+		{
+			IntersectBvhTriangles(triangles, triangleIndices,
+				current & BVH8_LEAF_FIRST_MASK,
+				((current >> BVH8_LEAF_COUNT_SHIFT) & 7) + 1,
+				ray, hit);
+		}
+		else
+		{
+			// t = (plane - o) * (1 / d), for every child at once.  This
+			// is a subtract and a multiply rather than one FMA, since
+			// o * (1 / d) is NaN when the ray is parallel to an axis
+			// through the origin, and then nothing would be culled on
+			// it.  The slab distances go first in min/max, so NaNs
+			// (from planes right on the origin of a ray parallel to
+			// them) are ignored rather than turning into misses.
+			const Bvh8Node& node = nodes[current];
+			const float* planes = node.MinX;
+			__m256 tNear = tMin;
+			__m256 tFar = _mm256_set1_ps(hit.T);
+			for (int a = 0; a < 3; a++)
+			{
+				__m256 entryT = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(planes + nearPlanes[a]), rayOrigin[a]), invDir[a]);
+				__m256 exitT = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(planes + farPlanes[a]), rayOrigin[a]), invDir[a]);
+				tNear = _mm256_max_ps(entryT, tNear);
+				tFar = _mm256_min_ps(exitT, tFar);
+			}
+
+			__m256 hitLanes = _mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ);
+			unsigned int hitMask = (unsigned int)_mm256_movemask_ps(hitLanes);
+			if (hitMask != 0)
+			{
+				// Only one child hit, so there's nothing to sort
+				if ((hitMask & (hitMask - 1)) == 0)
+				{
+					current = node.Children[LowestBit(hitMask)];
+					continue;
+				}
+
+				__m256i keys = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(tNear), distanceBits), slots);
+				keys = _mm256_blendv_epi8(missKey, keys, _mm256_castps_si256(hitLanes));
+				keys = SortKeys(keys);
+
+				alignas(32) uint32_t sorted[BVH8_WIDTH];
+				alignas(32) float distances[BVH8_WIDTH];
+				_mm256_store_si256((__m256i*)sorted, keys);
+				_mm256_store_ps(distances, tNear);
+
+				// Push far to near, so the nearest pops first
+				unsigned int hitCount = 0;
+				for (unsigned int bits = hitMask; bits != 0; bits &= bits - 1)
+					hitCount++;
+				for (unsigned int i = hitCount - 1; i > 0; i--)
+				{
+					unsigned int slot = sorted[i] & 7;
+					stack[stackSize].Child = node.Children[slot];
+					stack[stackSize].Distance = distances[slot];
+					stackSize++;
+				}
+				current = node.Children[sorted[0] & 7];
+				continue;
+			}
+		}
+
+		// Pop until there's a child that's still worth visiting
+		// (its box may be further than a hit found since)
+		bool found = false;
+		while (stackSize > 0 && !found)
+		{
+			const StackEntry& entry = stack[--stackSize];
+			current = entry.Child;
+			found = entry.Distance <= hit.T;
+		}
+		if (!found)
+			break;
+	}
+
+	return hit.TriangleIndex != BVH_NO_HIT;
+}
+
+
+// --------------------------------------------------------
+// The AVX2 kernel for compressed trees.  The only change
+// from the one above is that each node's planes are decoded
+// first: eight bytes are widened to floats, then scaled and
+// offset onto the node's grid with one FMA.  The step is a
+// power of two, so the multiply is exact and the planes
+// round just like they did when they were checked in
+// Bvh8Compressed::Build(), and the slab math after that
+// matches the scalar kernel's exactly.
+//
+// nodes - The tree, with the root first (must not be empty)
+// --------------------------------------------------------
+BVH8_AVX2 bool IntersectBvh8CompressedAvx2(const Bvh8CompressedNode* nodes, const BvhTriangle* triangles, const uint32_t* triangleIndices, const BvhRay& ray, BvhHit& hit)
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+
+	const float origin[3] = { ray.Origin.x, ray.Origin.y, ray.Origin.z };
+	const float direction[3] = { ray.Direction.x, ray.Direction.y, ray.Direction.z };
+	__m256 invDir[3];
+	__m256 rayOrigin[3];
+
+	// Where each axis' entry and exit planes are in a node
+	// (as bytes past the first quantized plane)
+	unsigned int nearPlanes[3];
+	unsigned int farPlanes[3];
+	for (int a = 0; a < 3; a++)
+	{
+		float inv = 1.0f / direction[a];
+		invDir[a] = _mm256_set1_ps(inv);
+		rayOrigin[a] = _mm256_set1_ps(origin[a]);
+		nearPlanes[a] = (inv >= 0 ? a : a + 3) * BVH8_WIDTH;
+		farPlanes[a] = (inv >= 0 ? a + 3 : a) * BVH8_WIDTH;
+	}
+
+	const __m256 tMin = _mm256_set1_ps(ray.TMin);
+	const __m256i slots = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i distanceBits = _mm256_set1_epi32(~7);
+	const __m256i missKey = _mm256_set1_epi32(0x7FFFFFFF);
+
+	struct StackEntry
+	{
+		uint32_t Child;
+		float Distance;
+	};
+	StackEntry stack[BVH8_STACK_SIZE];
+	unsigned int stackSize = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		if (current & BVH8_LEAF_BIT)
+		{
+			IntersectBvhTriangles(triangles, triangleIndices,
+				current & BVH8_LEAF_FIRST_MASK,
+				((current >> BVH8_LEAF_COUNT_SHIFT) & 7) + 1,
+				ray, hit);
+		}
+		else
+		{
+			const Bvh8CompressedNode& node = nodes[current];
+			const uint8_t* planes = node.QuantizedMinX;
+			const float* gridOrigin = &node.Origin.x;
+
+			__m256 tNear = tMin;
+			__m256 tFar = _mm256_set1_ps(hit.T);
+			for (int a = 0; a < 3; a++)
+			{
+				// Grid steps are built straight from the exponents' bits
+				__m256 step = _mm256_castsi256_ps(_mm256_set1_epi32((node.Exponents[a] + 127) << 23));
+				__m256 offset = _mm256_set1_ps(gridOrigin[a]);
+				__m256 nearQ = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(planes + nearPlanes[a]))));
+				__m256 farQ = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(planes + farPlanes[a]))));
+				__m256 entryT = _mm256_mul_ps(_mm256_sub_ps(_mm256_fmadd_ps(nearQ, step, offset), rayOrigin[a]), invDir[a]);
+				__m256 exitT = _mm256_mul_ps(_mm256_sub_ps(_mm256_fmadd_ps(farQ, step, offset), rayOrigin[a]), invDir[a]);
+				tNear = _mm256_max_ps(entryT, tNear);
+				tFar = _mm256_min_ps(exitT, tFar);
+			}
+
+			__m256 hitLanes = _mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ);
+			unsigned int hitMask = (unsigned int)_mm256_movemask_ps(hitLanes);
+			if (hitMask != 0)
+			{
+				// Only one child hit, so there's nothing to sort
+				if ((hitMask & (hitMask - 1)) == 0)
+				{
+					current = GetBvh8CompressedChild(node, LowestBit(hitMask));
+					continue;
+				}
+
+				__m256i keys = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(tNear), distanceBits), slots);
+				keys = _mm256_blendv_epi8(missKey, keys, _mm256_castps_si256(hitLanes));
+				keys = SortKeys(keys);
+
+				alignas(32) uint32_t sorted[BVH8_WIDTH];
+				alignas(32) float distances[BVH8_WIDTH];
+				_mm256_store_si256((__m256i*)sorted, keys);
+				_mm256_store_ps(distances, tNear);
+
+				// Push far to near, so the nearest pops first
+				unsigned int hitCount = 0;
+				for (unsigned int bits = hitMask; bits != 0; bits &= bits - 1)
+					hitCount++;
+				for (unsigned int i = hitCount - 1; i > 0; i--)
+				{
+					unsigned int slot = sorted[i] & 7;
+					stack[stackSize].Child = GetBvh8CompressedChild(node, slot);
+					stack[stackSize].Distance = distances[slot];
+					stackSize++;
+				}
+				current = GetBvh8CompressedChild(node, sorted[0] & 7);
+				continue;
+			}
+		}
+
+		// Pop until there's a child that's still worth visiting
+		// (its box may be further than a hit found since)
+		bool found = false;
+		while (stackSize > 0 && !found)
+		{
+			const StackEntry& entry = stack[--stackSize];
+			current = entry.Child;
+			found = entry.Distance <= hit.T;
+		}
+		if (!found)
+			break;
+	}
+
+	return hit.TriangleIndex != BVH_NO_HIT;
+}
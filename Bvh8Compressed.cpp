@@ -0,0 +1,326 @@
+#include "Bvh8Compressed.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace DirectX;
+
+static_assert(sizeof(Bvh8CompressedNode) == 80, "Bvh8CompressedNode should be tightly packed");
+static_assert(BVH_MAX_LEAF_TRIANGLES * (BVH8_WIDTH - 1) <= 255, "Leaf triangle offsets need to fit in a byte");
+
+// --------------------------------------------------------
+// A grid step (2^exponent) built straight from its bits, so
+// the kernels can do the same without any math
+// --------------------------------------------------------
+static float GridStep(int exponent)
+{
+	uint32_t bits = (uint32_t)(exponent + 127) << 23;
+	float step;
+	memcpy(&step, &bits, sizeof(step));
+	return step;
+}
+
+// --------------------------------------------------------
+// Finds the smallest grid (along one axis) that fits every
+// child's range, and where each range starts and ends on it.
+// Starts are rounded down and ends up, checking against the
+// exact float math the kernels decode with, so a decoded
+// range is never smaller than the real one.
+//
+// Returns the grid's exponent
+// --------------------------------------------------------
+static int8_t QuantizeAxis(float origin, const float* mins, const float* maxs, unsigned int childCount, uint8_t* quantizedMins, uint8_t* quantizedMaxs)
+{
+	float extent = 0;
+	for (unsigned int i = 0; i < childCount; i++)
+		extent = (std::max)(extent, maxs[i] - origin);
+
+	// Smallest power of two that spans the extent in 255 steps
+	int exponent = -126;
+	if (extent > 0)
+	{
+		int power;
+		float mantissa = frexpf(extent / BVH8_QUANTIZED_MAX, &power);
+		exponent = (std::max)(mantissa == 0.5f ? power - 1 : power, -126);
+	}
+
+	while (true)
+	{
+		float step = GridStep(exponent);
+		bool fits = true;
+		for (unsigned int i = 0; i < childCount && fits; i++)
+		{
+			float low = floorf((mins[i] - origin) / step);
+			float high = ceilf((maxs[i] - origin) / step);
+			while (low > 0 && origin + low * step > mins[i])
+				low--;
+			while (high <= BVH8_QUANTIZED_MAX && origin + high * step < maxs[i])
+				high++;
+
+			// Rounding pushed it off the end of the grid, so the
+			// next grid up (twice as coarse) has to be used
+			fits = high <= BVH8_QUANTIZED_MAX || exponent >= 127;
+			quantizedMins[i] = (uint8_t)(std::min)(low, (float)BVH8_QUANTIZED_MAX);
+			quantizedMaxs[i] = (uint8_t)(std::min)(high, (float)BVH8_QUANTIZED_MAX);
+		}
+		if (fits)
+			return (int8_t)exponent;
+		exponent++;
+	}
+}
+
+// --------------------------------------------------------
+// Picks the fastest kernel this CPU supports
+// --------------------------------------------------------
+Bvh8Compressed::Bvh8Compressed() :
+	kernel(Bvh8::IsAvx2Supported() ? Bvh8Kernel::Avx2 : Bvh8Kernel::Scalar)
+{
+}
+
+
+// --------------------------------------------------------
+// Switches kernels, ignoring AVX2 if it isn't supported
+// --------------------------------------------------------
+void Bvh8Compressed::SetKernel(Bvh8Kernel newKernel)
+{
+	kernel = newKernel == Bvh8Kernel::Avx2 && !Bvh8::IsAvx2Supported() ? Bvh8Kernel::Scalar : newKernel;
+}
+
+
+// --------------------------------------------------------
+// Collapses a binary tree into a regular 8-wide one, then
+// compresses each of its nodes.  Nodes and triangles both
+// get laid out again, since each node's interior children
+// (and the triangles of its leaves) need to be together.
+// --------------------------------------------------------
+void Bvh8Compressed::Build(const Bvh& bvh)
+{
+	nodes.clear();
+	triangles.clear();
+	triangleIndices.clear();
+	if (bvh.IsEmpty())
+		return;
+
+	Bvh8 wide;
+	wide.Build(bvh);
+
+	nodes.reserve(wide.GetNodes().size());
+	triangles.reserve(wide.GetTriangles().size());
+	triangleIndices.reserve(wide.GetTriangleIndices().size());
+	nodes.emplace_back();
+	CompressNode(wide, 0, 0);
+}
+
+
+// --------------------------------------------------------
+// Fills in an (already added) node from a wide one, then
+// adds its interior children all together at the end and
+// recursively does the same for them
+// --------------------------------------------------------
+void Bvh8Compressed::CompressNode(const Bvh8& wide, uint32_t wideIndex, uint32_t index)
+{
+	const Bvh8Node& source = wide.GetNodes()[wideIndex];
+	const std::vector<BvhTriangle>& sourceTriangles = wide.GetTriangles();
+	const std::vector<uint32_t>& sourceIndices = wide.GetTriangleIndices();
+
+	// Children are packed into the first slots, so
+	// the first empty one is the end of them
+	unsigned int childCount = 0;
+	while (childCount < BVH8_WIDTH && source.Children[childCount] != BVH8_EMPTY)
+		childCount++;
+
+	// The grid starts at the corner of the box around all of the children
+	Bvh8CompressedNode node = {};
+	node.Origin = XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX);
+	for (unsigned int i = 0; i < childCount; i++)
+	{
+		node.Origin.x = (std::min)(node.Origin.x, source.MinX[i]);
+		node.Origin.y = (std::min)(node.Origin.y, source.MinY[i]);
+		node.Origin.z = (std::min)(node.Origin.z, source.MinZ[i]);
+	}
+
+	node.Exponents[0] = QuantizeAxis(node.Origin.x, source.MinX, source.MaxX, childCount, node.QuantizedMinX, node.QuantizedMaxX);
+	node.Exponents[1] = QuantizeAxis(node.Origin.y, source.MinY, source.MaxY, childCount, node.QuantizedMinY, node.QuantizedMaxY);
+	node.Exponents[2] = QuantizeAxis(node.Origin.z, source.MinZ, source.MaxZ, childCount, node.QuantizedMinZ, node.QuantizedMaxZ);
+
+	// Empty slots are inside out, so nothing hits them
+	for (unsigned int i = childCount; i < BVH8_WIDTH; i++)
+	{
+		node.QuantizedMinX[i] = node.QuantizedMinY[i] = node.QuantizedMinZ[i] = BVH8_QUANTIZED_MAX;
+		node.QuantizedMaxX[i] = node.QuantizedMaxY[i] = node.QuantizedMaxZ[i] = 0;
+	}
+
+	// Leaves' triangles are copied over in slot order
+	node.ChildBase = (uint32_t)nodes.size();
+	node.TriangleBase = (uint32_t)triangles.size();
+	unsigned int internalCount = 0;
+	for (unsigned int i = 0; i < childCount; i++)
+	{
+		uint32_t child = source.Children[i];
+		if (child & BVH8_LEAF_BIT)
+		{
+			uint32_t first = child & BVH8_LEAF_FIRST_MASK;
+			uint32_t count = ((child >> BVH8_LEAF_COUNT_SHIFT) & 7) + 1;
+			triangles.insert(triangles.end(), sourceTriangles.begin() + first, sourceTriangles.begin() + first + count);
+			triangleIndices.insert(triangleIndices.end(), sourceIndices.begin() + first, sourceIndices.begin() + first + count);
+			node.LeafCounts[i] = (uint8_t)count;
+		}
+		else
+		{
+			node.InternalMask |= 1 << i;
+			internalCount++;
+		}
+	}
+
+	// Interior children all go in before any of them are filled
+	// in, which can move the vector (so no references across this)
+	nodes[index] = node;
+	nodes.resize(nodes.size() + internalCount);
+	uint32_t childIndex = node.ChildBase;
+	for (unsigned int i = 0; i < childCount; i++)
+	{
+		if (!(source.Children[i] & BVH8_LEAF_BIT))
+			CompressNode(wide, source.Children[i], childIndex++);
+	}
+}
+
+
+// --------------------------------------------------------
+// Finds the closest triangle hit by the ray (within its
+// range), front or back facing, using whichever kernel
+// was picked for this CPU
+// --------------------------------------------------------
+bool Bvh8Compressed::Intersect(const BvhRay& ray, BvhHit& hit) const
+{
+	if (nodes.empty())
+	{
+		hit.T = ray.TMax;
+		hit.U = 0;
+		hit.V = 0;
+		hit.TriangleIndex = BVH_NO_HIT;
+		return false;
+	}
+
+	if (kernel == Bvh8Kernel::Avx2)
+		return IntersectBvh8CompressedAvx2(nodes.data(), triangles.data(), triangleIndices.data(), ray, hit);
+	return IntersectBvh8CompressedScalar(nodes.data(), triangles.data(), triangleIndices.data(), ray, hit);
+}
+
+
+// --------------------------------------------------------
+// Bytes used by the nodes and triangles
+// --------------------------------------------------------
+size_t Bvh8Compressed::GetMemorySize() const
+{
+	return
+		nodes.size() * sizeof(Bvh8CompressedNode) +
+		triangles.size() * sizeof(BvhTriangle) +
+		triangleIndices.size() * sizeof(uint32_t);
+}
+
+
+// --------------------------------------------------------
+// Traversal for CPUs without AVX2: the same as Bvh8's
+// scalar kernel, except each child's box is decoded first.
+// Planes are decoded as origin + q * step, exactly the way
+// they were checked when they were built, so the boxes are
+// never smaller than the ones in the uncompressed tree.
+//
+// nodes - The tree, with the root first (must not be empty)
+// --------------------------------------------------------
+bool IntersectBvh8CompressedScalar(const Bvh8CompressedNode* nodes, const BvhTriangle* triangles, const uint32_t* triangleIndices, const BvhRay& ray, BvhHit& hit)
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+
+	const float origin[3] = { ray.Origin.x, ray.Origin.y, ray.Origin.z };
+	const float direction[3] = { ray.Direction.x, ray.Direction.y, ray.Direction.z };
+	float invDir[3];
+
+	// Where each axis' entry and exit planes are in a node
+	// (as bytes past the first quantized plane)
+	unsigned int nearPlanes[3];
+	unsigned int farPlanes[3];
+	for (int a = 0; a < 3; a++)
+	{
+		invDir[a] = 1.0f / direction[a];
+		nearPlanes[a] = (invDir[a] >= 0 ? a : a + 3) * BVH8_WIDTH;
+		farPlanes[a] = (invDir[a] >= 0 ? a + 3 : a) * BVH8_WIDTH;
+	}
+
+	struct StackEntry
+	{
+		uint32_t Child;
+		float Distance;
+	};
+	StackEntry stack[BVH8_STACK_SIZE];
+	unsigned int stackSize = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		if (current & BVH8_LEAF_BIT)
+		{
+			IntersectBvhTriangles(triangles, triangleIndices,
+				current & BVH8_LEAF_FIRST_MASK,
+				((current >> BVH8_LEAF_COUNT_SHIFT) & 7) + 1,
+				ray, hit);
+		}
+		else
+		{
+			const Bvh8CompressedNode& node = nodes[current];
+			const uint8_t* planes = node.QuantizedMinX;
+			const float gridOrigin[3] = { node.Origin.x, node.Origin.y, node.Origin.z };
+			const float step[3] = { GridStep(node.Exponents[0]), GridStep(node.Exponents[1]), GridStep(node.Exponents[2]) };
+
+			// Slab test each child, insertion sorting the hits
+			StackEntry hits[BVH8_WIDTH];
+			unsigned int hitCount = 0;
+			for (unsigned int c = 0; c < BVH8_WIDTH; c++)
+			{
+				float tNear = ray.TMin;
+				float tFar = hit.T;
+				for (int a = 0; a < 3; a++)
+				{
+					float nearPlane = gridOrigin[a] + planes[nearPlanes[a] + c] * step[a];
+					float farPlane = gridOrigin[a] + planes[farPlanes[a] + c] * step[a];
+					tNear = (std::max)(tNear, (nearPlane - origin[a]) * invDir[a]);
+					tFar = (std::min)(tFar, (farPlane - origin[a]) * invDir[a]);
+				}
+				if (tNear > tFar)
+					continue;
+
+				unsigned int i = hitCount++;
+				for (; i > 0 && hits[i - 1].Distance > tNear; i--)
+					hits[i] = hits[i - 1];
+				hits[i].Child = GetBvh8CompressedChild(node, c);
+				hits[i].Distance = tNear;
+			}
+
+			if (hitCount > 0)
+			{
+				for (unsigned int i = hitCount - 1; i > 0; i--)
+					stack[stackSize++] = hits[i];
+				current = hits[0].Child;
+				continue;
+			}
+		}
+
+		// Pop until there's a child that's still worth visiting
+		// (its box may be further than a hit found since)
+		bool found = false;
+		while (stackSize > 0 && !found)
+		{
+			const StackEntry& entry = stack[--stackSize];
+			current = entry.Child;
+			found = entry.Distance <= hit.T;
+		}
+		if (!found)
+			break;
+	}
+
+	return hit.TriangleIndex != BVH_NO_HIT;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "Bvh.h"
+#include "Bvh8.h"
+
+// Quantized child bounds go from 0 to this, along each axis
+#define BVH8_QUANTIZED_MAX 255
+
+// --------------------------------------------------------
+// A node in a compressed 8-wide BVH, 80 bytes each (versus
+// 224 for a Bvh8Node).  Child boxes are stored as 8-bit
+// coordinates on a grid over the node's own box: the grid
+// starts at Origin, and each step along an axis is a power
+// of two.  Decoded boxes are always rounded outwards, so
+// they can only ever be bigger than the real ones.
+//
+// Instead of an index per child, interior children are
+// stored next to each other starting at ChildBase, and leaf
+// children's triangles are stored next to each other
+// starting at TriangleBase, both in slot order.
+// --------------------------------------------------------
+struct alignas(16) Bvh8CompressedNode
+{
+	DirectX::XMFLOAT3 Origin;
+	int8_t Exponents[3];		// Grid step on each axis is 2^Exponent
+	uint8_t InternalMask;		// Slots holding interior children
+	uint32_t ChildBase;
+	uint32_t TriangleBase;
+	uint8_t LeafCounts[BVH8_WIDTH];	// Triangles in each leaf child (zero otherwise)
+	uint8_t QuantizedMinX[BVH8_WIDTH];
+	uint8_t QuantizedMinY[BVH8_WIDTH];
+	uint8_t QuantizedMinZ[BVH8_WIDTH];
+	uint8_t QuantizedMaxX[BVH8_WIDTH];
+	uint8_t QuantizedMaxY[BVH8_WIDTH];
+	uint8_t QuantizedMaxZ[BVH8_WIDTH];
+};
+
+// --------------------------------------------------------
+// An 8-wide BVH with compressed nodes, for when memory
+// bandwidth (rather than math) limits how fast rays go:
+// many meshes at once, or big ones, whose nodes don't fit
+// in cache.  Each node costs a little more to decode, but
+// takes well under half the memory of a Bvh8Node.
+//
+// Hits are exactly the same as the binary tree it came from.
+// --------------------------------------------------------
+class Bvh8Compressed
+{
+public:
+	Bvh8Compressed();
+
+	// Collapses and compresses a binary tree (which can be thrown away afterwards)
+	void Build(const Bvh& bvh);
+
+	// Finds the closest hit along a ray, returning false on a miss
+	bool Intersect(const BvhRay& ray, BvhHit& hit) const;
+
+	bool IsEmpty() const { return nodes.empty(); }
+	size_t GetMemorySize() const;
+
+	// Can force the scalar kernel (AVX2 is only used if supported)
+	void SetKernel(Bvh8Kernel newKernel);
+	Bvh8Kernel GetKernel() const { return kernel; }
+
+	// Nodes (the root is first) and triangles in leaf order, with the
+	// original index buffer triangle for each
+	const std::vector<Bvh8CompressedNode>& GetNodes() const { return nodes; }
+	const std::vector<BvhTriangle>& GetTriangles() const { return triangles; }
+	const std::vector<uint32_t>& GetTriangleIndices() const { return triangleIndices; }
+
+private:
+	std::vector<Bvh8CompressedNode> nodes;
+	std::vector<BvhTriangle> triangles;
+	std::vector<uint32_t> triangleIndices;
+
+	Bvh8Kernel kernel;
+
+	void CompressNode(const Bvh8& wide, uint32_t wideIndex, uint32_t index);
+};
+
+// --------------------------------------------------------
+// What's in one of a compressed node's slots, in the same
+// form as Bvh8Node::Children (a node index, or a leaf with
+// its first triangle and count), so both kinds of tree can
+// share the same traversal loop.  The slot must not be empty.
+// --------------------------------------------------------
+inline uint32_t GetBvh8CompressedChild(const Bvh8CompressedNode& node, unsigned int slot)
+{
+	unsigned int below = (1u << slot) - 1;
+	if (node.InternalMask & (1u << slot))
+	{
+		// Interior children before this one
+		unsigned int bits = node.InternalMask & below;
+		bits = bits - ((bits >> 1) & 0x55);
+		bits = (bits & 0x33) + ((bits >> 2) & 0x33);
+		bits = (bits + (bits >> 4)) & 0x0F;
+		return node.ChildBase + bits;
+	}
+
+	// Triangles in the leaves before this one: multiplying
+	// sums every byte into all of the bytes above it
+	uint64_t counts;
+	memcpy(&counts, node.LeafCounts, sizeof(counts));
+	uint32_t offset = (uint32_t)((((counts << 8) * 0x0101010101010101ull) >> (slot * 8)) & 0xFF);
+	return BVH8_LEAF_BIT | ((node.LeafCounts[slot] - 1u) << BVH8_LEAF_COUNT_SHIFT) | (node.TriangleBase + offset);
+}
+
+// Traversal kernels, which take the tree's arrays directly
+// (the AVX2 one lives with Bvh8's, and must only be called
+// when Bvh8::IsAvx2Supported() says so)
+bool IntersectBvh8CompressedScalar(const Bvh8CompressedNode* nodes, const BvhTriangle* triangles, const uint32_t* triangleIndices, const BvhRay& ray, BvhHit& hit);
+bool IntersectBvh8CompressedAvx2(const Bvh8CompressedNode* nodes, const BvhTriangle* triangles, const uint32_t* triangleIndices, const BvhRay& ray, BvhHit& hit);
@@ -0,0 +1,1076 @@
+#include "BvhBenchmark.h"
+#include "AssetLoader.h"
+#include "Bvh.h"
+#include "Bvh8.h"
+#include "Bvh8Compressed.h"
+#include "BvhPacket.h"
+#include "BvhStats.h"
+#include "BvhStream.h"
+#include "BvhWatertight.h"
+#include "SceneBvh.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace DirectX;
+
+// How many times each tree is built (the fastest build counts)
+#define BVH_BENCHMARK_BUILDS 5
+
+// Rays are cast from this many views, at this resolution each,
+// and every tree traces them this many times (the fastest counts)
+#define BVH_BENCHMARK_VIEWS 4
+#define BVH_BENCHMARK_RESOLUTION 256
+#define BVH_BENCHMARK_TRACES 3
+
+// Treelet passes for the second linear build of each mesh
+#define BVH_BENCHMARK_TREELET_PASSES 2
+
+// Instances (of all of the meshes) in the scene benchmark
+#define BVH_BENCHMARK_INSTANCES 10000
+
+// Diffuse bounces traced as ray streams after the scene's
+// primary rays
+#define BVH_BENCHMARK_BOUNCES 3
+
+// Every this many instances in the scene are masked as glass,
+// which the occlusion benchmark's masked rays go straight
+// through
+#define BVH_BENCHMARK_GLASS_EVERY 4
+
+// Occlusion rays are traced in batches of this many per job
+#define BVH_BENCHMARK_OCCLUSION_BATCH 4096
+
+// --------------------------------------------------------
+// Primary rays for a square image of a mesh, from a camera
+// circling its bounding sphere
+//
+// view - Which of the BVH_BENCHMARK_VIEWS this is
+// --------------------------------------------------------
+static void MakeBenchmarkRays(const BvhNode& root, int view, std::vector<BvhRay>& rays)
+{
+	XMVECTOR boundsMin = XMLoadFloat3(&root.BoundsMin);
+	XMVECTOR boundsMax = XMLoadFloat3(&root.BoundsMax);
+	XMVECTOR center = XMVectorScale(XMVectorAdd(boundsMin, boundsMax), 0.5f);
+	float radius = XMVectorGetX(XMVector3Length(XMVectorSubtract(boundsMax, center)));
+	if (radius <= 0)
+		radius = 1;
+
+	// Around the sphere, and a bit above it
+	float angle = XM_2PI * view / BVH_BENCHMARK_VIEWS;
+	XMVECTOR forward = XMVector3Normalize(XMVectorSet(-cosf(angle), -0.4f, -sinf(angle), 0));
+	XMVECTOR right = XMVector3Normalize(XMVector3Cross(XMVectorSet(0, 1, 0, 0), forward));
+	XMVECTOR up = XMVector3Cross(forward, right);
+	XMVECTOR origin = XMVectorSubtract(center, XMVectorScale(forward, radius * 2.5f));
+
+	// Roughly a 45 degree field of view, which fits the sphere
+	float halfSize = tanf(XM_PIDIV4 * 0.5f);
+	rays.resize(BVH_BENCHMARK_RESOLUTION * BVH_BENCHMARK_RESOLUTION);
+	for (int y = 0; y < BVH_BENCHMARK_RESOLUTION; y++)
+	{
+		for (int x = 0; x < BVH_BENCHMARK_RESOLUTION; x++)
+		{
+			float u = ((x + 0.5f) / BVH_BENCHMARK_RESOLUTION * 2 - 1) * halfSize;
+			float v = (1 - (y + 0.5f) / BVH_BENCHMARK_RESOLUTION * 2) * halfSize;
+			XMVECTOR dir = XMVector3Normalize(XMVectorAdd(forward,
+				XMVectorAdd(XMVectorScale(right, u), XMVectorScale(up, v))));
+
+			BvhRay& ray = rays[y * BVH_BENCHMARK_RESOLUTION + x];
+			XMStoreFloat3(&ray.Origin, origin);
+			XMStoreFloat3(&ray.Direction, dir);
+			ray.TMin = 0;
+			ray.TMax = FLT_MAX;
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Casts every view's rays through a tree, on one thread
+// (so the number is per core), a few times over
+//
+// Returns how long the fastest pass took in milliseconds
+// --------------------------------------------------------
+template<typename Hit, typename Tree>
+static double TraceBenchmarkRays(const Tree& tree, const std::vector<std::vector<BvhRay>>& views, size_t& hits)
+{
+	double bestMs = 0;
+	for (int pass = 0; pass < BVH_BENCHMARK_TRACES; pass++)
+	{
+		hits = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Hit hit;
+		for (const std::vector<BvhRay>& rays : views)
+		{
+			for (const BvhRay& ray : rays)
+				hits += tree.Intersect(ray, hit) ? 1 : 0;
+		}
+
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		bestMs = pass == 0 ? ms : (std::min)(bestMs, ms);
+	}
+	return bestMs;
+}
+
+// --------------------------------------------------------
+// Casts every view's rays through a tree a tile at a time,
+// as packets, the same way as TraceBenchmarkRays
+//
+// mismatches - Rays whose hit doesn't agree with casting
+//   them one at a time (beyond rounding, since packets test
+//   triangles with their own SIMD code)
+//
+// Returns how long the fastest pass took in milliseconds
+// --------------------------------------------------------
+template<typename Hit, typename Tree>
+static double TraceBenchmarkPackets(const Tree& tree, const std::vector<std::vector<BvhRay>>& views, size_t& hits, size_t& mismatches)
+{
+	std::vector<Hit> packetHits(BVH_BENCHMARK_RESOLUTION * BVH_BENCHMARK_RESOLUTION);
+	double bestMs = 0;
+	mismatches = 0;
+	for (int pass = 0; pass < BVH_BENCHMARK_TRACES; pass++)
+	{
+		hits = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (const std::vector<BvhRay>& rays : views)
+			hits += IntersectBvhImage(tree, rays.data(), BVH_BENCHMARK_RESOLUTION, BVH_BENCHMARK_RESOLUTION, packetHits.data());
+
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		bestMs = pass == 0 ? ms : (std::min)(bestMs, ms);
+	}
+
+	// Only the last view's hits are still around to check
+	const std::vector<BvhRay>& rays = views.back();
+	for (size_t i = 0; i < rays.size(); i++)
+	{
+		Hit hit;
+		bool rayHit = tree.Intersect(rays[i], hit);
+		bool packetHit = packetHits[i].TriangleIndex != BVH_NO_HIT;
+		if (rayHit != packetHit || (rayHit && fabsf(hit.T - packetHits[i].T) > 1e-4f * (std::max)(1.0f, hit.T)))
+			mismatches++;
+	}
+	return bestMs;
+}
+
+
+// --------------------------------------------------------
+// Scatters instances of every mesh's tree over a grid, with
+// random rotations and scales (the same layout every time)
+//
+// Returns how many meshes ended up in the scene (0 if none)
+// --------------------------------------------------------
+static size_t MakeBenchmarkScene(const std::vector<std::unique_ptr<Bvh>>& trees, std::vector<SceneBvhInstanceDesc>& descs)
+{
+	std::vector<const Bvh*> blases;
+	float spacing = 0;
+	for (const std::unique_ptr<Bvh>& tree : trees)
+	{
+		if (tree->IsEmpty())
+			continue;
+
+		const BvhNode& root = tree->GetNodes()[0];
+		XMVECTOR size = XMVectorSubtract(XMLoadFloat3(&root.BoundsMax), XMLoadFloat3(&root.BoundsMin));
+		spacing = (std::max)(spacing, XMVectorGetX(XMVector3Length(size)));
+		blases.push_back(tree.get());
+	}
+	descs.clear();
+	if (blases.empty())
+		return 0;
+
+	std::mt19937 random(1);
+	std::uniform_real_distribution<float> angle(0, XM_2PI);
+	std::uniform_real_distribution<float> scale(0.5f, 1.0f);
+	int side = (int)ceilf(sqrtf((float)BVH_BENCHMARK_INSTANCES));
+	descs.resize(BVH_BENCHMARK_INSTANCES);
+	for (int i = 0; i < BVH_BENCHMARK_INSTANCES; i++)
+	{
+		float s = scale(random);
+		XMMATRIX world =
+			XMMatrixScaling(s, s, s) *
+			XMMatrixRotationRollPitchYaw(angle(random), angle(random), angle(random)) *
+			XMMatrixTranslation((i % side - side / 2) * spacing, 0, (i / side - side / 2) * spacing);
+		XMStoreFloat4x4(&descs[i].World, world);
+		descs[i].Blas = blases[i % blases.size()];
+		descs[i].InstanceMask = i % BVH_BENCHMARK_GLASS_EVERY == 0 ? MATERIAL_MASK_REFRACTIVE : MATERIAL_MASK_OPAQUE;
+	}
+	return blases.size();
+}
+
+
+// --------------------------------------------------------
+// Traces one view of the scene as a ray stream, bouncing
+// every hit off in a random direction a few times, and
+// times each round against the same rays traced one at a
+// time in the order they were made (across the same
+// threads, in the same size batches)
+// --------------------------------------------------------
+static void RunBounceBenchmark(const SceneBvh& scene, const std::vector<BvhRay>& primaryRays)
+{
+	BvhRayStream stream(primaryRays.size());
+	for (size_t i = 0; i < primaryRays.size(); i++)
+		stream.Push(primaryRays[i], (uint32_t)i);
+
+	printf("\nRay streams (sorted by octant and origin, Mrays/s on %u threads, vs unsorted one at a time):\n",
+		ThreadPool::GetInstance().GetThreadCount());
+	printf("  %-8s %8s %10s %10s %8s %9s %8s %10s\n", "bounce", "rays", "stream", "unsorted", "speedup", "sort ms", "packets", "mismatch");
+
+	std::mt19937 random(2);
+	std::uniform_real_distribution<float> offset(-1, 1);
+	std::vector<BvhRay> rays;
+	std::vector<uint32_t> ids;
+	std::vector<SceneBvhHit> rayHits;
+	for (int bounce = 0; bounce <= BVH_BENCHMARK_BOUNCES && stream.GetCount() > 0; bounce++)
+	{
+		rays = stream.GetRays();
+		ids = stream.GetIds();
+		rayHits.resize(rays.size());
+
+		double streamMs = 0;
+		double sortMs = 0;
+		double rayMs = 0;
+		size_t batchCount = (rays.size() + BVH_STREAM_BATCH_SIZE - 1) / BVH_STREAM_BATCH_SIZE;
+		for (int pass = 0; pass < BVH_BENCHMARK_TRACES; pass++)
+		{
+			stream.Trace(scene);
+			const BvhStreamStats& stats = stream.GetStats();
+			double ms = stats.SortTimeMs + stats.TraceTimeMs;
+			if (pass == 0 || ms < streamMs)
+			{
+				streamMs = ms;
+				sortMs = stats.SortTimeMs;
+			}
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			ThreadPool::GetInstance().ParallelFor(batchCount, [&](size_t batch)
+				{
+					size_t end = (std::min)(rays.size(), (batch + 1) * BVH_STREAM_BATCH_SIZE);
+					for (size_t i = batch * BVH_STREAM_BATCH_SIZE; i < end; i++)
+						scene.Intersect(rays[i], rayHits[i]);
+				});
+			ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			rayMs = pass == 0 ? ms : (std::min)(rayMs, ms);
+		}
+
+		const std::vector<SceneBvhHit>& streamHits = stream.GetHits();
+		size_t mismatches = 0;
+		for (size_t i = 0; i < rays.size(); i++)
+		{
+			bool rayHit = rayHits[i].InstanceIndex != BVH_NO_HIT;
+			bool streamHit = streamHits[i].InstanceIndex != BVH_NO_HIT;
+			if (rayHit != streamHit || (rayHit && fabsf(rayHits[i].T - streamHits[i].T) > 1e-4f * (std::max)(1.0f, rayHits[i].T)))
+				mismatches++;
+		}
+
+		printf("  %-8d %8zu %10.2f %10.2f %7.2fx %9.2f %7.0f%% %10zu\n",
+			bounce,
+			rays.size(),
+			streamMs > 0 ? rays.size() / streamMs / 1000.0 : 0.0,
+			rayMs > 0 ? rays.size() / rayMs / 1000.0 : 0.0,
+			streamMs > 0 ? rayMs / streamMs : 0.0,
+			sortMs,
+			100.0 * stream.GetStats().PacketRays / rays.size(),
+			mismatches);
+
+		// Every hit bounces back the way its ray came from, in a
+		// random direction (there are no normals here, so this
+		// stands in for the hemisphere above the surface), from
+		// just in front of the hit so it can't hit itself again
+		stream.Clear();
+		for (size_t i = 0; i < rays.size(); i++)
+		{
+			if (rayHits[i].InstanceIndex == BVH_NO_HIT)
+				continue;
+
+			XMVECTOR incoming = XMLoadFloat3(&rays[i].Direction);
+			XMVECTOR point = XMVectorAdd(XMLoadFloat3(&rays[i].Origin), XMVectorScale(incoming, rayHits[i].T));
+			XMVECTOR back = XMVectorScale(XMVector3Normalize(incoming), -1.0f);
+			float distance = rayHits[i].T * XMVectorGetX(XMVector3Length(incoming));
+
+			XMVECTOR direction;
+			do
+			{
+				direction = XMVectorSet(offset(random), offset(random), offset(random), 0);
+			} while (XMVectorGetX(XMVector3LengthSq(direction)) > 1 || XMVectorGetX(XMVector3LengthSq(direction)) < 1e-6f);
+			if (XMVectorGetX(XMVector3Dot(direction, back)) < 0)
+				direction = XMVectorScale(direction, -1.0f);
+
+			BvhRay ray;
+			XMStoreFloat3(&ray.Origin, XMVectorAdd(point, XMVectorScale(back, 1e-4f * (std::max)(1.0f, distance))));
+			XMStoreFloat3(&ray.Direction, XMVector3Normalize(direction));
+			ray.TMin = 0;
+			ray.TMax = FLT_MAX;
+			stream.Push(ray, ids[i]);
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Times shadow rays (toward a far away light) and short AO
+// rays (in random directions) from every primary hit, as
+// occlusion queries against the same rays traced for their
+// closest hits, with and without glass masked out.  Every
+// ray has to agree on whether it's blocked.
+// --------------------------------------------------------
+static void RunOcclusionBenchmark(const SceneBvh& scene, const std::vector<BvhRay>& primaryRays)
+{
+	std::vector<SceneBvhHit> primaryHits(primaryRays.size());
+	for (size_t i = 0; i < primaryRays.size(); i++)
+		scene.Intersect(primaryRays[i], primaryHits[i]);
+
+	// AO rays reach about half an instance's spacing
+	const BvhNode& root = scene.GetTopLevel().GetNodes()[0];
+	XMVECTOR sceneSize = XMVectorSubtract(XMLoadFloat3(&root.BoundsMax), XMLoadFloat3(&root.BoundsMin));
+	float aoDistance = 0.5f * XMVectorGetX(XMVector3Length(sceneSize)) / sqrtf((float)BVH_BENCHMARK_INSTANCES);
+	XMVECTOR toLight = XMVector3Normalize(XMVectorSet(0.3f, 1.0f, 0.2f, 0));
+
+	std::mt19937 random(3);
+	std::uniform_real_distribution<float> offset(-1, 1);
+	std::vector<BvhRay> shadowRays;
+	std::vector<BvhRay> aoRays;
+	for (size_t i = 0; i < primaryRays.size(); i++)
+	{
+		if (primaryHits[i].InstanceIndex == BVH_NO_HIT)
+			continue;
+
+		// Start just in front of the hit, like the bounce benchmark
+		XMVECTOR incoming = XMLoadFloat3(&primaryRays[i].Direction);
+		XMVECTOR back = XMVectorScale(XMVector3Normalize(incoming), -1.0f);
+		float distance = primaryHits[i].T * XMVectorGetX(XMVector3Length(incoming));
+		XMVECTOR point = XMVectorAdd(
+			XMVectorAdd(XMLoadFloat3(&primaryRays[i].Origin), XMVectorScale(incoming, primaryHits[i].T)),
+			XMVectorScale(back, 1e-4f * (std::max)(1.0f, distance)));
+
+		BvhRay ray;
+		XMStoreFloat3(&ray.Origin, point);
+		XMStoreFloat3(&ray.Direction, toLight);
+		ray.TMin = 0;
+		ray.TMax = FLT_MAX;
+		shadowRays.push_back(ray);
+
+		XMVECTOR direction;
+		do
+		{
+			direction = XMVectorSet(offset(random), offset(random), offset(random), 0);
+		} while (XMVectorGetX(XMVector3LengthSq(direction)) > 1 || XMVectorGetX(XMVector3LengthSq(direction)) < 1e-6f);
+		if (XMVectorGetX(XMVector3Dot(direction, back)) < 0)
+			direction = XMVectorScale(direction, -1.0f);
+		XMStoreFloat3(&ray.Direction, XMVector3Normalize(direction));
+		ray.TMax = aoDistance;
+		aoRays.push_back(ray);
+	}
+
+	printf("\nOcclusion rays (from the first view's hits, Mrays/s on %u threads, vs closest hit):\n",
+		ThreadPool::GetInstance().GetThreadCount());
+	printf("  %-14s %8s %10s %10s %8s %9s %10s\n", "rays", "count", "occluded", "closest", "speedup", "blocked", "mismatch");
+
+	struct OcclusionRun
+	{
+		const char* Name;
+		const std::vector<BvhRay>* Rays;
+		uint8_t Mask;
+	};
+	const OcclusionRun runs[] =
+	{
+		{ "shadow", &shadowRays, MATERIAL_MASK_ALL },
+		{ "shadow, glass", &shadowRays, MATERIAL_MASK_OPAQUE },
+		{ "AO", &aoRays, MATERIAL_MASK_ALL },
+		{ "AO, glass", &aoRays, MATERIAL_MASK_OPAQUE },
+	};
+	std::vector<uint8_t> occluded;
+	std::vector<uint8_t> closest;
+	for (const OcclusionRun& run : runs)
+	{
+		const std::vector<BvhRay>& rays = *run.Rays;
+		occluded.assign(rays.size(), 0);
+		closest.assign(rays.size(), 0);
+		size_t batchCount = (rays.size() + BVH_BENCHMARK_OCCLUSION_BATCH - 1) / BVH_BENCHMARK_OCCLUSION_BATCH;
+
+		double occludedMs = 0;
+		double closestMs = 0;
+		for (int pass = 0; pass < BVH_BENCHMARK_TRACES; pass++)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			ThreadPool::GetInstance().ParallelFor(batchCount, [&](size_t batch)
+				{
+					size_t end = (std::min)(rays.size(), (batch + 1) * BVH_BENCHMARK_OCCLUSION_BATCH);
+					for (size_t i = batch * BVH_BENCHMARK_OCCLUSION_BATCH; i < end; i++)
+						occluded[i] = scene.Occluded(rays[i], run.Mask);
+				});
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			occludedMs = pass == 0 ? ms : (std::min)(occludedMs, ms);
+
+			start = std::chrono::steady_clock::now();
+			ThreadPool::GetInstance().ParallelFor(batchCount, [&](size_t batch)
+				{
+					size_t end = (std::min)(rays.size(), (batch + 1) * BVH_BENCHMARK_OCCLUSION_BATCH);
+					for (size_t i = batch * BVH_BENCHMARK_OCCLUSION_BATCH; i < end; i++)
+					{
+						SceneBvhHit hit;
+						closest[i] = scene.Intersect(rays[i], hit, run.Mask);
+					}
+				});
+			ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			closestMs = pass == 0 ? ms : (std::min)(closestMs, ms);
+		}
+
+		size_t blocked = 0;
+		size_t mismatches = 0;
+		for (size_t i = 0; i < rays.size(); i++)
+		{
+			blocked += occluded[i];
+			mismatches += occluded[i] != closest[i];
+		}
+
+		printf("  %-14s %8zu %10.2f %10.2f %7.2fx %8.1f%% %10zu\n",
+			run.Name,
+			rays.size(),
+			occludedMs > 0 ? rays.size() / occludedMs / 1000.0 : 0.0,
+			closestMs > 0 ? rays.size() / closestMs / 1000.0 : 0.0,
+			occludedMs > 0 ? closestMs / occludedMs : 0.0,
+			rays.empty() ? 0.0 : 100.0 * blocked / rays.size(),
+			mismatches);
+	}
+}
+
+
+// --------------------------------------------------------
+// Times rebuilding the benchmark scene's top level and
+// casting rays through the whole thing
+// --------------------------------------------------------
+static void RunSceneBenchmark(const std::vector<std::unique_ptr<Bvh>>& trees)
+{
+	std::vector<SceneBvhInstanceDesc> descs;
+	size_t meshCount = MakeBenchmarkScene(trees, descs);
+	if (meshCount == 0)
+		return;
+
+	SceneBvh scene;
+	double buildMs = 0;
+	double topLevelMs = 0;
+	for (int i = 0; i < BVH_BENCHMARK_BUILDS; i++)
+	{
+		scene.Build(descs.data(), descs.size());
+		const SceneBvhBuildStats& stats = scene.GetBuildStats();
+		if (i == 0 || stats.BuildTimeMs < buildMs)
+		{
+			buildMs = stats.BuildTimeMs;
+			topLevelMs = stats.TopLevelTimeMs;
+		}
+	}
+
+	std::vector<std::vector<BvhRay>> views(BVH_BENCHMARK_VIEWS);
+	for (int view = 0; view < BVH_BENCHMARK_VIEWS; view++)
+		MakeBenchmarkRays(scene.GetTopLevel().GetNodes()[0], view, views[view]);
+
+	size_t hits = 0;
+	double rayMs = TraceBenchmarkRays<SceneBvhHit>(scene, views, hits);
+	size_t rayCount = BVH_BENCHMARK_VIEWS * views[0].size();
+
+	size_t packetHits = 0;
+	size_t mismatches = 0;
+	double packetMs = TraceBenchmarkPackets<SceneBvhHit>(scene, views, packetHits, mismatches);
+
+	const SceneBvhBuildStats& stats = scene.GetBuildStats();
+	printf("\nScene (%u instances of %zu meshes, best of %d builds on %u threads):\n",
+		stats.InstanceCount, meshCount, BVH_BENCHMARK_BUILDS, ThreadPool::GetInstance().GetThreadCount());
+	printf("  build %.3f ms (top level %.3f ms), %u nodes, depth %u, %.2f Mrays/s, %.1f%% hits\n",
+		buildMs,
+		topLevelMs,
+		stats.NodeCount,
+		stats.MaxDepth,
+		rayMs > 0 ? rayCount / rayMs / 1000.0 : 0.0,
+		100.0 * hits / rayCount);
+	printf("  %dx%d packets %.2f Mrays/s (%.2fx), %zu of the last view's rays hit differently\n",
+		BVH_PACKET_TILE,
+		BVH_PACKET_TILE,
+		packetMs > 0 ? rayCount / packetMs / 1000.0 : 0.0,
+		packetMs > 0 ? rayMs / packetMs : 0.0,
+		mismatches);
+
+	RunBounceBenchmark(scene, views[0]);
+	RunOcclusionBenchmark(scene, views[0]);
+}
+
+
+// --------------------------------------------------------
+// Loads every .obj in a folder (in parallel), sorted by name
+// --------------------------------------------------------
+static void LoadBenchmarkMeshes(const std::wstring& modelFolder, std::vector<std::filesystem::path>& files, std::vector<MeshLoadHandle>& meshes)
+{
+	std::error_code error;
+	for (std::filesystem::directory_iterator it(modelFolder, error), end; !error && it != end; it.increment(error))
+	{
+		if (it->is_regular_file() && it->path().extension() == ".obj")
+			files.push_back(it->path());
+	}
+	std::sort(files.begin(), files.end());
+
+	AssetLoader assetLoader;
+	for (const std::filesystem::path& file : files)
+		meshes.push_back(assetLoader.LoadMeshAsync(file.wstring()));
+	assetLoader.WaitForAll();
+}
+
+
+// --------------------------------------------------------
+// Loads every .obj in the folder (in parallel), then, one
+// mesh at a time, builds its BVH several times and casts
+// a few views' worth of primary rays through it, both as
+// a binary tree and collapsed to an 8-wide one, and again
+// built with spatial splits.  Finally, all of the meshes are
+// instanced into one big scene.
+//
+// modelFolder - Folder holding the .obj files
+// --------------------------------------------------------
+void RunBvhBenchmark(const std::wstring& modelFolder)
+{
+	std::vector<std::filesystem::path> files;
+	std::vector<MeshLoadHandle> meshes;
+	LoadBenchmarkMeshes(modelFolder, files, meshes);
+
+	// Traversal numbers are printed after all of the builds
+	struct TraversalRow
+	{
+		std::string Name;
+		uint32_t BinaryNodes;
+		uint32_t WideNodes;
+		size_t WideMemory;
+		size_t RayCount;
+		size_t Hits;
+		double BinaryMs;
+		double ScalarMs;
+		double Avx2Ms;
+		bool Mismatch;
+
+		// The same mesh built with spatial splits
+		double SpatialBuildMs;
+		float BinarySah;
+		float SpatialSah;
+		uint32_t Triangles;
+		uint32_t SpatialReferences;
+		double SpatialMs;
+		double SpatialAvx2Ms;
+
+		// The wide tree with compressed nodes
+		size_t CompressedMemory;
+		double CompressedScalarMs;
+		double CompressedAvx2Ms;
+
+		// Linear builds, without and with treelet passes
+		double BinaryBuildMs;
+		double LinearBuildMs[2];
+		float LinearSah[2];
+		double LinearMs[2];
+
+		// Coherent packets through the binary tree
+		double PacketMs;
+		size_t PacketMismatches;
+
+		// Watertight tests on SoA leaves (scalar, SSE, AVX2)
+		size_t BinaryMemory;
+		size_t WatertightMemory;
+		double WatertightMs[3];
+		size_t WatertightMismatches;
+	};
+	std::vector<TraversalRow> traversal;
+	std::vector<std::unique_ptr<Bvh>> trees;
+
+	printf("BVH benchmark (%d SAH bins, up to %d triangles per leaf, best of %d builds):\n",
+		BVH_SAH_BINS, BVH_MAX_LEAF_TRIANGLES, BVH_BENCHMARK_BUILDS);
+	printf("  %-24s %9s %10s %9s %8s %7s %6s %9s\n",
+		"mesh", "tris", "build ms", "Mtris/s", "SAH", "nodes", "depth", "memory KB");
+
+	double totalBuildMs = 0;
+	size_t totalTriangles = 0;
+	size_t totalMemory = 0;
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		const MeshLoadResult& mesh = *meshes[m].get();
+		std::string name = files[m].filename().string();
+		if (!mesh.Success)
+		{
+			printf("  %-24s FAILED TO LOAD\n", name.c_str());
+			continue;
+		}
+
+		// Kept around for the scene afterwards
+		trees.push_back(std::make_unique<Bvh>());
+		Bvh& bvh = *trees.back();
+		double buildMs = 0;
+		for (int i = 0; i < BVH_BENCHMARK_BUILDS; i++)
+		{
+			bvh.Build(mesh.Vertices, mesh.VertexCount, mesh.Indices, mesh.IndexCount);
+			double ms = bvh.GetBuildStats().BuildTimeMs;
+			buildMs = i == 0 ? ms : (std::min)(buildMs, ms);
+		}
+		if (bvh.IsEmpty())
+			continue;
+
+		const BvhBuildStats& stats = bvh.GetBuildStats();
+		size_t triangles = mesh.IndexCount / 3;
+		printf("  %-24s %9zu %10.3f %9.2f %8.2f %7u %6u %9.1f\n",
+			name.c_str(),
+			triangles,
+			buildMs,
+			buildMs > 0 ? triangles / buildMs / 1000.0 : 0.0,
+			stats.SahCost,
+			stats.NodeCount,
+			stats.MaxDepth,
+			stats.MemorySize / 1024.0);
+
+		totalBuildMs += buildMs;
+		totalTriangles += triangles;
+		totalMemory += stats.MemorySize;
+
+		// Same rays through every kind of tree
+		std::vector<std::vector<BvhRay>> views(BVH_BENCHMARK_VIEWS);
+		for (int view = 0; view < BVH_BENCHMARK_VIEWS; view++)
+			MakeBenchmarkRays(bvh.GetNodes()[0], view, views[view]);
+
+		Bvh8 bvh8;
+		bvh8.Build(bvh);
+
+		TraversalRow row = {};
+		row.Name = name;
+		row.BinaryNodes = stats.NodeCount;
+		row.WideNodes = (uint32_t)bvh8.GetNodes().size();
+		row.WideMemory = bvh8.GetMemorySize();
+		row.RayCount = BVH_BENCHMARK_VIEWS * views[0].size();
+
+		size_t scalarHits = 0;
+		size_t avx2Hits = 0;
+		row.BinaryMs = TraceBenchmarkRays<BvhHit>(bvh, views, row.Hits);
+		bvh8.SetKernel(Bvh8Kernel::Scalar);
+		row.ScalarMs = TraceBenchmarkRays<BvhHit>(bvh8, views, scalarHits);
+		if (Bvh8::IsAvx2Supported())
+		{
+			bvh8.SetKernel(Bvh8Kernel::Avx2);
+			row.Avx2Ms = TraceBenchmarkRays<BvhHit>(bvh8, views, avx2Hits);
+		}
+		row.Mismatch = scalarHits != row.Hits || (Bvh8::IsAvx2Supported() && avx2Hits != row.Hits);
+
+		// Compressed boxes are only ever bigger, so the hits can't change
+		Bvh8Compressed compressed;
+		compressed.Build(bvh);
+		row.CompressedMemory = compressed.GetMemorySize();
+		compressed.SetKernel(Bvh8Kernel::Scalar);
+		row.CompressedScalarMs = TraceBenchmarkRays<BvhHit>(compressed, views, scalarHits);
+		row.Mismatch |= scalarHits != row.Hits;
+		if (Bvh8::IsAvx2Supported())
+		{
+			compressed.SetKernel(Bvh8Kernel::Avx2);
+			row.CompressedAvx2Ms = TraceBenchmarkRays<BvhHit>(compressed, views, avx2Hits);
+			row.Mismatch |= avx2Hits != row.Hits;
+		}
+
+		// Spatial splits only change the tree, so the hits should too
+		BvhBuildOptions spatialOptions;
+		spatialOptions.SpatialSplits = true;
+		Bvh spatialBvh;
+		spatialBvh.Build(mesh.Vertices, mesh.VertexCount, mesh.Indices, mesh.IndexCount, spatialOptions);
+		row.SpatialBuildMs = spatialBvh.GetBuildStats().BuildTimeMs;
+		row.BinarySah = stats.SahCost;
+		row.SpatialSah = spatialBvh.GetBuildStats().SahCost;
+		row.Triangles = (uint32_t)triangles;
+		row.SpatialReferences = spatialBvh.GetBuildStats().ReferenceCount;
+
+		size_t spatialHits = 0;
+		row.SpatialMs = TraceBenchmarkRays<BvhHit>(spatialBvh, views, spatialHits);
+		row.Mismatch |= spatialHits != row.Hits;
+		if (Bvh8::IsAvx2Supported())
+		{
+			Bvh8 spatialBvh8;
+			spatialBvh8.Build(spatialBvh);
+			row.SpatialAvx2Ms = TraceBenchmarkRays<BvhHit>(spatialBvh8, views, spatialHits);
+			row.Mismatch |= spatialHits != row.Hits;
+		}
+
+		// Linear builds trade trace speed for build speed
+		row.BinaryBuildMs = buildMs;
+		for (int treelets = 0; treelets < 2; treelets++)
+		{
+			BvhBuildOptions linearOptions;
+			linearOptions.Linear = true;
+			linearOptions.TreeletPasses = treelets ? BVH_BENCHMARK_TREELET_PASSES : 0;
+			Bvh linearBvh;
+			for (int i = 0; i < BVH_BENCHMARK_BUILDS; i++)
+			{
+				linearBvh.Build(mesh.Vertices, mesh.VertexCount, mesh.Indices, mesh.IndexCount, linearOptions);
+				double ms = linearBvh.GetBuildStats().BuildTimeMs;
+				row.LinearBuildMs[treelets] = i == 0 ? ms : (std::min)(row.LinearBuildMs[treelets], ms);
+			}
+			row.LinearSah[treelets] = linearBvh.GetBuildStats().SahCost;
+
+			size_t linearHits = 0;
+			row.LinearMs[treelets] = TraceBenchmarkRays<BvhHit>(linearBvh, views, linearHits);
+			row.Mismatch |= linearHits != row.Hits;
+		}
+
+		size_t packetHits = 0;
+		row.PacketMs = TraceBenchmarkPackets<BvhHit>(bvh, views, packetHits, row.PacketMismatches);
+
+		// Watertight hits only differ from the binary tree's along edges
+		BvhWatertight watertight;
+		watertight.Build(bvh);
+		row.BinaryMemory = stats.MemorySize;
+		row.WatertightMemory = watertight.GetMemorySize();
+		const BvhWatertightKernel kernels[3] = { BvhWatertightKernel::Scalar, BvhWatertightKernel::Sse, BvhWatertightKernel::Avx2 };
+		for (int k = 0; k < 3; k++)
+		{
+			if (kernels[k] == BvhWatertightKernel::Avx2 && !Bvh8::IsAvx2Supported())
+				continue;
+
+			size_t watertightHits = 0;
+			watertight.SetKernel(kernels[k]);
+			row.WatertightMs[k] = TraceBenchmarkRays<BvhHit>(watertight, views, watertightHits);
+		}
+		for (const BvhRay& ray : views.back())
+		{
+			BvhHit hit;
+			BvhHit watertightHit;
+			bool rayHit = bvh.Intersect(ray, hit);
+			bool watertightRayHit = watertight.Intersect(ray, watertightHit);
+			if (rayHit != watertightRayHit || (rayHit && fabsf(hit.T - watertightHit.T) > 1e-4f * (std::max)(1.0f, hit.T)))
+				row.WatertightMismatches++;
+		}
+		traversal.push_back(row);
+	}
+
+	printf("  %-24s %9zu %10.3f %9.2f %8s %7s %6s %9.1f\n",
+		"total",
+		totalTriangles,
+		totalBuildMs,
+		totalBuildMs > 0 ? totalTriangles / totalBuildMs / 1000.0 : 0.0,
+		"", "", "",
+		totalMemory / 1024.0);
+
+	// Rays per second on a single thread
+	auto raysPerSecond = [](size_t rays, double ms) { return ms > 0 ? rays / ms / 1000.0 : 0.0; };
+	printf("\nTraversal (%d views at %dx%d, best of %d, Mrays/s on a single thread):\n",
+		BVH_BENCHMARK_VIEWS, BVH_BENCHMARK_RESOLUTION, BVH_BENCHMARK_RESOLUTION, BVH_BENCHMARK_TRACES);
+	printf("  %-24s %7s %7s %10s %9s %9s %9s %6s\n",
+		"mesh", "nodes", "nodes8", "memory8 KB", "BVH2", "BVH8", "BVH8 AVX2", "hits");
+	for (const TraversalRow& row : traversal)
+	{
+		char avx2[16] = "-";
+		if (Bvh8::IsAvx2Supported())
+			snprintf(avx2, sizeof(avx2), "%.2f", raysPerSecond(row.RayCount, row.Avx2Ms));
+
+		printf("  %-24s %7u %7u %10.1f %9.2f %9.2f %9s %5.1f%%%s\n",
+			row.Name.c_str(),
+			row.BinaryNodes,
+			row.WideNodes,
+			row.WideMemory / 1024.0,
+			raysPerSecond(row.RayCount, row.BinaryMs),
+			raysPerSecond(row.RayCount, row.ScalarMs),
+			avx2,
+			100.0 * row.Hits / row.RayCount,
+			row.Mismatch ? "  HITS DIFFER" : "");
+	}
+
+	// Spatial splits against the plain SAH build, on the same rays
+	printf("\nSpatial splits (SBVH, up to %.0f%% more references, vs plain SAH):\n",
+		BvhBuildOptions().MaxReferenceGrowth * 100);
+	printf("  %-24s %10s %8s %8s %8s %9s %9s %8s %9s %9s\n",
+		"mesh", "build ms", "refs", "SAH", "SBVH SAH", "BVH2", "SBVH2", "speedup", "BVH8 AVX2", "SBVH8 AVX2");
+	for (const TraversalRow& row : traversal)
+	{
+		double binary = raysPerSecond(row.RayCount, row.BinaryMs);
+		double spatial = raysPerSecond(row.RayCount, row.SpatialMs);
+		char avx2[16] = "-";
+		char spatialAvx2[16] = "-";
+		if (Bvh8::IsAvx2Supported())
+		{
+			snprintf(avx2, sizeof(avx2), "%.2f", raysPerSecond(row.RayCount, row.Avx2Ms));
+			snprintf(spatialAvx2, sizeof(spatialAvx2), "%.2f", raysPerSecond(row.RayCount, row.SpatialAvx2Ms));
+		}
+
+		printf("  %-24s %10.3f %+7.1f%% %8.2f %8.2f %9.2f %9.2f %7.2fx %9s %9s\n",
+			row.Name.c_str(),
+			row.SpatialBuildMs,
+			100.0 * ((double)row.SpatialReferences - row.Triangles) / row.Triangles,
+			row.BinarySah,
+			row.SpatialSah,
+			binary,
+			spatial,
+			binary > 0 ? spatial / binary : 0.0,
+			avx2,
+			spatialAvx2);
+	}
+
+	// Compressed wide nodes against regular ones, on the same rays
+	printf("\nCompressed nodes (%zu bytes per node vs %zu, Mrays/s):\n",
+		sizeof(Bvh8CompressedNode), sizeof(Bvh8Node));
+	printf("  %-24s %10s %10s %10s %9s %9s %9s %9s\n",
+		"mesh", "nodes8 KB", "nodesC KB", "memoryC KB", "BVH8", "CBVH8", "BVH8 AVX2", "CBVH8 AVX2");
+	for (const TraversalRow& row : traversal)
+	{
+		char avx2[16] = "-";
+		char compressedAvx2[16] = "-";
+		if (Bvh8::IsAvx2Supported())
+		{
+			snprintf(avx2, sizeof(avx2), "%.2f", raysPerSecond(row.RayCount, row.Avx2Ms));
+			snprintf(compressedAvx2, sizeof(compressedAvx2), "%.2f", raysPerSecond(row.RayCount, row.CompressedAvx2Ms));
+		}
+
+		printf("  %-24s %10.1f %10.1f %10.1f %9.2f %9.2f %9s %9s\n",
+			row.Name.c_str(),
+			row.WideNodes * sizeof(Bvh8Node) / 1024.0,
+			row.WideNodes * sizeof(Bvh8CompressedNode) / 1024.0,
+			row.CompressedMemory / 1024.0,
+			raysPerSecond(row.RayCount, row.ScalarMs),
+			raysPerSecond(row.RayCount, row.CompressedScalarMs),
+			avx2,
+			compressedAvx2);
+	}
+
+	// Linear builds against the SAH build, on the same rays
+	printf("\nLinear builds (LBVH, then with %d treelet passes, vs binned SAH):\n", BVH_BENCHMARK_TREELET_PASSES);
+	printf("  %-24s %9s %9s %8s %9s %8s %8s %8s %8s %9s %9s %9s\n",
+		"mesh", "SAH ms", "LBVH ms", "speedup", "LBVH+T ms", "speedup", "SAH", "LBVH SAH", "+T SAH", "BVH2", "LBVH2", "LBVH2+T");
+	for (const TraversalRow& row : traversal)
+	{
+		printf("  %-24s %9.3f %9.3f %7.2fx %9.3f %7.2fx %8.2f %8.2f %8.2f %9.2f %9.2f %9.2f\n",
+			row.Name.c_str(),
+			row.BinaryBuildMs,
+			row.LinearBuildMs[0],
+			row.LinearBuildMs[0] > 0 ? row.BinaryBuildMs / row.LinearBuildMs[0] : 0.0,
+			row.LinearBuildMs[1],
+			row.LinearBuildMs[1] > 0 ? row.BinaryBuildMs / row.LinearBuildMs[1] : 0.0,
+			row.BinarySah,
+			row.LinearSah[0],
+			row.LinearSah[1],
+			raysPerSecond(row.RayCount, row.BinaryMs),
+			raysPerSecond(row.RayCount, row.LinearMs[0]),
+			raysPerSecond(row.RayCount, row.LinearMs[1]));
+	}
+
+	// Packets against single rays, through the same binary tree
+	printf("\nPackets (%dx%d tiles, SSE, Mrays/s on a single thread, vs one ray at a time):\n", BVH_PACKET_TILE, BVH_PACKET_TILE);
+	printf("  %-24s %9s %9s %8s %8s\n", "mesh", "BVH2", "packets", "speedup", "differ");
+	for (const TraversalRow& row : traversal)
+	{
+		double single = raysPerSecond(row.RayCount, row.BinaryMs);
+		double packets = raysPerSecond(row.RayCount, row.PacketMs);
+		printf("  %-24s %9.2f %9.2f %7.2fx %8zu\n",
+			row.Name.c_str(),
+			single,
+			packets,
+			single > 0 ? packets / single : 0.0,
+			row.PacketMismatches);
+	}
+
+	// Watertight SoA leaves against the binary tree's own triangles
+	printf("\nWatertight leaves (groups of %d triangles, %zu bytes each, Mrays/s, vs Moller-Trumbore):\n",
+		BVH_TRIANGLE4_WIDTH, sizeof(BvhTriangle4));
+	printf("  %-24s %9s %10s %9s %9s %9s %9s %8s %8s\n",
+		"mesh", "memory KB", "memoryW KB", "BVH2", "scalar", "SSE", "AVX2", "speedup", "differ");
+	for (const TraversalRow& row : traversal)
+	{
+		double binary = raysPerSecond(row.RayCount, row.BinaryMs);
+		double fastest = raysPerSecond(row.RayCount, row.WatertightMs[Bvh8::IsAvx2Supported() ? 2 : 1]);
+		char avx2[16] = "-";
+		if (Bvh8::IsAvx2Supported())
+			snprintf(avx2, sizeof(avx2), "%.2f", raysPerSecond(row.RayCount, row.WatertightMs[2]));
+
+		printf("  %-24s %9.1f %10.1f %9.2f %9.2f %9.2f %9s %7.2fx %8zu\n",
+			row.Name.c_str(),
+			row.BinaryMemory / 1024.0,
+			row.WatertightMemory / 1024.0,
+			binary,
+			raysPerSecond(row.RayCount, row.WatertightMs[0]),
+			raysPerSecond(row.RayCount, row.WatertightMs[1]),
+			avx2,
+			binary > 0 ? fastest / binary : 0.0,
+			row.WatertightMismatches);
+	}
+
+	RunSceneBenchmark(trees);
+}
+
+
+// --------------------------------------------------------
+// Prints one row of the quality table, for a tree and the
+// work it took to trace a view's rays through it
+// --------------------------------------------------------
+static void PrintStatsRow(const std::string& name, const char* builder, const BvhQualityStats& quality, const BvhTraversalStats& traversal)
+{
+	double rays = traversal.RayCount > 0 ? (double)traversal.RayCount : 1.0;
+	double nodes = traversal.NodesVisited / rays;
+	double triangles = traversal.TrianglesTested / rays;
+	printf("  %-24s %-7s %8.2f %8u %5u %7.2f %6.2f %7.3f %7.2f %8.2f %8.2f %8.2f %6u %5.1f%%\n",
+		name.c_str(),
+		builder,
+		quality.SahCost,
+		quality.NodeCount,
+		quality.MaxDepth,
+		quality.AverageLeafDepth,
+		quality.AverageLeafSize,
+		quality.AverageOverlap,
+		quality.OverlapCost,
+		nodes,
+		triangles,
+		nodes * BVH_TRAVERSAL_COST + triangles * BVH_TRIANGLE_COST,
+		traversal.MaxNodesVisited,
+		100.0 * traversal.HitCount / rays);
+}
+
+
+// --------------------------------------------------------
+// Builds every model's tree with each builder, measures the
+// trees' shapes, and traces one benchmark view through each
+// while counting the work per ray.  Every tree also gets a
+// heatmap of that work (with the same scale for all of a
+// mesh's builders, so they can be compared side by side),
+// and finally the whole benchmark scene gets the same, once
+// per builder.
+//
+// modelFolder - Folder holding the .obj files
+// outputFolder - Where the .ppm heatmaps go (created if needed)
+// --------------------------------------------------------
+void RunBvhStatsReport(const std::wstring& modelFolder, const std::wstring& outputFolder)
+{
+	std::vector<std::filesystem::path> files;
+	std::vector<MeshLoadHandle> meshes;
+	LoadBenchmarkMeshes(modelFolder, files, meshes);
+
+	std::error_code error;
+	std::filesystem::create_directories(outputFolder, error);
+	std::filesystem::path output(outputFolder);
+
+	struct StatsBuilder
+	{
+		const char* Name;
+		BvhBuildOptions Options;
+		std::vector<std::unique_ptr<Bvh>> Trees;
+	};
+	StatsBuilder builders[4];
+	builders[0].Name = "sah";
+	builders[1].Name = "sbvh";
+	builders[1].Options.SpatialSplits = true;
+	builders[2].Name = "lbvh";
+	builders[2].Options.Linear = true;
+	builders[3].Name = "treelet";
+	builders[3].Options.Linear = true;
+	builders[3].Options.TreeletPasses = BVH_BENCHMARK_TREELET_PASSES;
+
+	// Leaf sizes are printed after the main table
+	struct LeafRow
+	{
+		std::string Name;
+		const char* Builder;
+		BvhQualityStats Quality;
+	};
+	std::vector<LeafRow> leafRows;
+
+	printf("BVH statistics (one %dx%d view each, cost = nodes x %.1f + triangles x %.1f):\n",
+		BVH_BENCHMARK_RESOLUTION, BVH_BENCHMARK_RESOLUTION, BVH_TRAVERSAL_COST, BVH_TRIANGLE_COST);
+	printf("  %-24s %-7s %8s %8s %5s %7s %6s %7s %7s %8s %8s %8s %6s %6s\n",
+		"mesh", "builder", "SAH", "nodes", "depth", "avg dep", "leaf", "overlap", "ovl SAH",
+		"nodes/ray", "tris/ray", "cost/ray", "worst", "hits");
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		const MeshLoadResult& mesh = *meshes[m].get();
+		std::string name = files[m].filename().string();
+		if (!mesh.Success)
+		{
+			printf("  %-24s FAILED TO LOAD\n", name.c_str());
+			continue;
+		}
+
+		std::vector<BvhRay> rays;
+		std::vector<float> costs[4];
+		for (int b = 0; b < 4; b++)
+		{
+			builders[b].Trees.push_back(std::make_unique<Bvh>());
+			Bvh& bvh = *builders[b].Trees.back();
+			bvh.Build(mesh.Vertices, mesh.VertexCount, mesh.Indices, mesh.IndexCount, builders[b].Options);
+			if (bvh.IsEmpty())
+				break;
+
+			// Every builder's tree has the same bounds, so the same rays
+			if (rays.empty())
+				MakeBenchmarkRays(bvh.GetNodes()[0], 0, rays);
+
+			BvhQualityStats quality = AnalyzeBvh(bvh);
+			BvhTraversalStats traversal = TraceBvhStats(bvh, rays, &costs[b]);
+			PrintStatsRow(name, builders[b].Name, quality, traversal);
+			leafRows.push_back({ name, builders[b].Name, quality });
+		}
+		if (rays.empty())
+			continue;
+
+		float maxCost = 0;
+		for (int b = 0; b < 4; b++)
+		{
+			for (float cost : costs[b])
+				maxCost = (std::max)(maxCost, cost);
+		}
+		for (int b = 0; b < 4; b++)
+		{
+			std::string file = files[m].stem().string() + "_" + builders[b].Name + ".ppm";
+			WriteBvhHeatmap((output / file).wstring(), costs[b], BVH_BENCHMARK_RESOLUTION, BVH_BENCHMARK_RESOLUTION, maxCost);
+		}
+	}
+
+	// The same scene, over each builder's trees
+	std::vector<float> sceneCosts[4];
+	float sceneMaxCost = 0;
+	for (int b = 0; b < 4; b++)
+	{
+		std::vector<SceneBvhInstanceDesc> descs;
+		if (MakeBenchmarkScene(builders[b].Trees, descs) == 0)
+			break;
+
+		SceneBvh scene;
+		scene.Build(descs.data(), descs.size());
+
+		std::vector<BvhRay> rays;
+		MakeBenchmarkRays(scene.GetTopLevel().GetNodes()[0], 0, rays);
+		BvhQualityStats quality = AnalyzeBvh(scene.GetTopLevel());
+		BvhTraversalStats traversal = TraceBvhStats(scene, rays, &sceneCosts[b]);
+		PrintStatsRow("scene", builders[b].Name, quality, traversal);
+		if (b == 3)
+		{
+			printf("  %-24s (shape of the top level over %u instances, %.2f instances entered per ray)\n",
+				"", scene.GetBuildStats().InstanceCount, (double)traversal.InstancesTested / traversal.RayCount);
+		}
+
+		for (float cost : sceneCosts[b])
+			sceneMaxCost = (std::max)(sceneMaxCost, cost);
+	}
+	for (int b = 0; b < 4; b++)
+	{
+		if (!sceneCosts[b].empty())
+		{
+			std::string file = std::string("scene_") + builders[b].Name + ".ppm";
+			WriteBvhHeatmap((output / file).wstring(), sceneCosts[b], BVH_BENCHMARK_RESOLUTION, BVH_BENCHMARK_RESOLUTION, sceneMaxCost);
+		}
+	}
+
+	// How full the leaves are, as a share of each tree's leaves
+	printf("\nLeaf sizes (%% of leaves with each triangle count):\n");
+	printf("  %-24s %-7s %7s", "mesh", "builder", "leaves");
+	for (int i = 1; i < BVH_STATS_LEAF_BUCKETS; i++)
+		printf(i < BVH_STATS_LEAF_BUCKETS - 1 ? " %5d" : " %4d+", i);
+	printf("\n");
+	for (const LeafRow& row : leafRows)
+	{
+		printf("  %-24s %-7s %7u", row.Name.c_str(), row.Builder, row.Quality.LeafCount);
+		for (int i = 1; i < BVH_STATS_LEAF_BUCKETS; i++)
+			printf(" %5.1f", 100.0 * row.Quality.LeafSizes[i] / row.Quality.LeafCount);
+		printf("\n");
+	}
+
+	printf("\nHeatmaps written to %s\n", output.string().c_str());
+}
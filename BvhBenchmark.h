@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+// Builds a BVH over every .obj model in a folder and casts
+// rays through each, printing build times, SAH costs, memory
+// use and ray throughput (no GPU needed)
+void RunBvhBenchmark(const std::wstring& modelFolder);
+
+// Builds every .obj model's BVH with each builder and prints
+// the trees' shapes (SAH cost, leaf sizes, overlap) and the
+// work per ray through one view, writing a .ppm heatmap of
+// that work for each (and for a scene of all of them)
+void RunBvhStatsReport(const std::wstring& modelFolder, const std::wstring& outputFolder);
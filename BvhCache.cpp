@@ -0,0 +1,308 @@
+#include "BvhCache.h"
+
+#include <cstring>
+#include <cwchar>
+#include <filesystem>
+#include <fstream>
+
+// Keeps the arrays nicely aligned within the file
+#define BVH_CACHE_ALIGNMENT 32
+#define ALIGN(value, alignment) (((value + alignment - 1) / alignment) * alignment)
+
+// --------------------------------------------------------
+// Maps the given cache file and checks that it was built
+// from the same geometry, with the same options, by this
+// version of the builder.  If anything is off (missing,
+// stale, truncated) IsValid() returns false and the caller
+// should build the tree again.
+// --------------------------------------------------------
+BvhCache::BvhCache(const std::wstring& cacheFile, uint64_t geometryHash, const BvhBuildOptions& options) :
+	file(std::make_unique<MappedFile>(cacheFile)),
+	data(0),
+	header(0)
+{
+	if (!file->IsOpen())
+		return;
+
+	header = Validate(file->GetData(), file->GetSize(), geometryHash, options);
+	if (header)
+		data = file->GetData();
+}
+
+
+// --------------------------------------------------------
+// Returns the header if the data is a complete .bvhbin for
+// the given geometry and options, whose nodes form a single
+// tree that traversal can walk safely (see ValidateNodes)
+// --------------------------------------------------------
+const BvhCacheHeader* BvhCache::Validate(const char* data, size_t size, uint64_t geometryHash, const BvhBuildOptions& options)
+{
+	if (!data || size < sizeof(BvhCacheHeader))
+		return 0;
+
+	const BvhCacheHeader* h = (const BvhCacheHeader*)data;
+	if (memcmp(h->Magic, "BVHC", 4) != 0 ||
+		h->Version != BVH_CACHE_VERSION ||
+		h->NodeStride != sizeof(BvhNode) ||
+		h->TriangleStride != sizeof(BvhTriangle) ||
+		h->SahBins != BVH_SAH_BINS ||
+		h->MaxLeafTriangles != BVH_MAX_LEAF_TRIANGLES ||
+		h->GeometryHash != geometryHash)
+		return 0;
+
+	if (h->SpatialSplits != (options.SpatialSplits ? 1u : 0u) ||
+		h->MaxReferenceGrowth != options.MaxReferenceGrowth ||
+		h->MinSpatialSplitOverlap != options.MinSpatialSplitOverlap ||
+		h->Linear != (options.Linear ? 1u : 0u) ||
+		h->TreeletPasses != options.TreeletPasses)
+		return 0;
+
+	// Traversal stacks are sized for the deepest tree a build can make
+	if (h->NodeCount == 0 || h->MaxDepth > BVH_MAX_DEPTH)
+		return 0;
+
+	// Make sure the arrays actually fit in the file
+	uint64_t nodeEnd = (uint64_t)h->NodeOffset + (uint64_t)h->NodeCount * sizeof(BvhNode);
+	uint64_t triangleEnd = (uint64_t)h->TriangleOffset + (uint64_t)h->ReferenceCount * sizeof(BvhTriangle);
+	uint64_t indexEnd = (uint64_t)h->TriangleIndexOffset + (uint64_t)h->ReferenceCount * sizeof(uint32_t);
+	if (h->NodeOffset < sizeof(BvhCacheHeader) ||
+		h->TriangleOffset < nodeEnd ||
+		h->TriangleIndexOffset < triangleEnd ||
+		indexEnd > size)
+		return 0;
+
+	if (!ValidateNodes((const BvhNode*)(data + h->NodeOffset), h->NodeCount, h->ReferenceCount))
+		return 0;
+
+	return h;
+}
+
+
+// --------------------------------------------------------
+// Walks the whole tree, since traversal trusts the nodes
+// completely: every child pair has to be inside the array
+// and reached only once (no cycles or shared subtrees),
+// every leaf's triangles inside the triangle arrays, every
+// node part of the tree, and the tree no deeper than the
+// traversal stacks (BVH_MAX_DEPTH).  The header's MaxDepth
+// is only a stat, so the real depth is measured here.
+// --------------------------------------------------------
+bool BvhCache::ValidateNodes(const BvhNode* nodes, uint32_t nodeCount, uint32_t referenceCount)
+{
+	struct WalkEntry { uint32_t Node; uint32_t Depth; };
+	std::vector<WalkEntry> stack;
+	std::vector<bool> reached(nodeCount, false);
+	uint32_t reachedCount = 1;
+	reached[0] = true;
+	stack.push_back({ 0, 1 });
+
+	while (!stack.empty())
+	{
+		WalkEntry entry = stack.back();
+		stack.pop_back();
+		if (entry.Depth > BVH_MAX_DEPTH)
+			return false;
+
+		const BvhNode& node = nodes[entry.Node];
+		if (node.IsLeaf())
+		{
+			if ((uint64_t)node.LeftFirst + node.TriangleCount > referenceCount)
+				return false;
+			continue;
+		}
+
+		uint32_t left = node.LeftFirst;
+		if ((uint64_t)left + 1 >= nodeCount || reached[left] || reached[left + 1])
+			return false;
+
+		reached[left] = true;
+		reached[left + 1] = true;
+		reachedCount += 2;
+		stack.push_back({ left, entry.Depth + 1 });
+		stack.push_back({ left + 1, entry.Depth + 1 });
+	}
+
+	return reachedCount == nodeCount;
+}
+
+
+// --------------------------------------------------------
+// Pointers into the cached data (null if not valid)
+// --------------------------------------------------------
+const BvhNode* BvhCache::GetNodes() const
+{
+	return header ? (const BvhNode*)(data + header->NodeOffset) : 0;
+}
+
+const BvhTriangle* BvhCache::GetTriangles() const
+{
+	return header ? (const BvhTriangle*)(data + header->TriangleOffset) : 0;
+}
+
+const uint32_t* BvhCache::GetTriangleIndices() const
+{
+	return header ? (const uint32_t*)(data + header->TriangleIndexOffset) : 0;
+}
+
+
+// --------------------------------------------------------
+// Lays out a tree exactly as a cache file would hold it
+// (header, nodes, triangles, then triangle indices)
+// --------------------------------------------------------
+std::vector<char> BvhCache::Serialize(const Bvh& bvh, uint64_t geometryHash, const BvhBuildOptions& options)
+{
+	BvhArray<BvhNode> nodes = bvh.GetNodes();
+	BvhArray<BvhTriangle> triangles = bvh.GetTriangles();
+	BvhArray<uint32_t> triangleIndices = bvh.GetTriangleIndices();
+	const BvhBuildStats& stats = bvh.GetBuildStats();
+
+	size_t nodeBytes = nodes.size() * sizeof(BvhNode);
+	size_t triangleBytes = triangles.size() * sizeof(BvhTriangle);
+	size_t indexBytes = triangleIndices.size() * sizeof(uint32_t);
+
+	BvhCacheHeader header = {};
+	memcpy(header.Magic, "BVHC", 4);
+	header.Version = BVH_CACHE_VERSION;
+	header.NodeStride = sizeof(BvhNode);
+	header.TriangleStride = sizeof(BvhTriangle);
+	header.SahBins = BVH_SAH_BINS;
+	header.MaxLeafTriangles = BVH_MAX_LEAF_TRIANGLES;
+	header.SpatialSplits = options.SpatialSplits ? 1 : 0;
+	header.MaxReferenceGrowth = options.MaxReferenceGrowth;
+	header.MinSpatialSplitOverlap = options.MinSpatialSplitOverlap;
+	header.Linear = options.Linear ? 1 : 0;
+	header.TreeletPasses = options.TreeletPasses;
+	header.NodeCount = (uint32_t)nodes.size();
+	header.ReferenceCount = (uint32_t)triangles.size();
+	header.NodeOffset = (uint32_t)ALIGN(sizeof(BvhCacheHeader), BVH_CACHE_ALIGNMENT);
+	header.TriangleOffset = (uint32_t)ALIGN(header.NodeOffset + nodeBytes, BVH_CACHE_ALIGNMENT);
+	header.TriangleIndexOffset = (uint32_t)ALIGN(header.TriangleOffset + triangleBytes, BVH_CACHE_ALIGNMENT);
+	header.GeometryHash = geometryHash;
+	header.SahCost = stats.SahCost;
+	header.LeafCount = stats.LeafCount;
+	header.MaxDepth = stats.MaxDepth;
+	header.SpatialSplitCount = stats.SpatialSplits;
+
+	// Padding between arrays stays zeroed
+	std::vector<char> bytes(header.TriangleIndexOffset + indexBytes, 0);
+	memcpy(bytes.data(), &header, sizeof(BvhCacheHeader));
+	memcpy(bytes.data() + header.NodeOffset, nodes.data(), nodeBytes);
+	memcpy(bytes.data() + header.TriangleOffset, triangles.data(), triangleBytes);
+	memcpy(bytes.data() + header.TriangleIndexOffset, triangleIndices.data(), indexBytes);
+	return bytes;
+}
+
+
+// --------------------------------------------------------
+// Writes a tree to a cache file
+//
+// - Only trees over triangles can be cached (box trees
+//    are cheap to build, and get refit every frame anyway)
+// - Writes to a temporary file first and then swaps it in,
+//    so a crash mid-write never leaves a half-written cache
+//
+// Returns false if the tree is empty or the file couldn't be written
+// --------------------------------------------------------
+bool BvhCache::Write(const std::wstring& cacheFile, const Bvh& bvh, uint64_t geometryHash, const BvhBuildOptions& options)
+{
+	if (bvh.IsEmpty() || bvh.GetTriangles().size() != bvh.GetTriangleIndices().size())
+		return false;
+
+	std::vector<char> bytes = Serialize(bvh, geometryHash, options);
+
+	std::filesystem::path finalPath(cacheFile);
+	std::filesystem::path tempPath(cacheFile + L".tmp");
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if (!out.is_open())
+			return false;
+
+		out.write(bytes.data(), bytes.size());
+		if (!out.good())
+			return false;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempPath, finalPath, error);
+	if (error)
+	{
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
+
+	return true;
+}
+
+
+// --------------------------------------------------------
+// The cache sits next to its source file, so with the
+// default options "Models/cube.obj" is cached as
+// "Models/cube.bvhbin".  Any other options add their hash,
+// like "Models/cube.1f2e3d4c.bvhbin".
+// --------------------------------------------------------
+std::wstring BvhCache::GetCachePath(const std::wstring& sourceFile, const BvhBuildOptions& options)
+{
+	uint64_t hash = HashOptions(options);
+	if (hash == HashOptions(BvhBuildOptions()))
+		return std::filesystem::path(sourceFile).replace_extension(L".bvhbin").wstring();
+
+	wchar_t suffix[32];
+	swprintf(suffix, 32, L".%08x.bvhbin", (uint32_t)(hash ^ (hash >> 32)));
+	return std::filesystem::path(sourceFile).replace_extension(suffix).wstring();
+}
+
+
+// --------------------------------------------------------
+// Mixes in every field of the options (floats by their bits)
+// --------------------------------------------------------
+uint64_t BvhCache::HashOptions(const BvhBuildOptions& options)
+{
+	const uint64_t prime = 0x100000001B3ull;
+	uint64_t hash = 0xCBF29CE484222325ull;
+	auto mix = [&](uint32_t word)
+		{
+			hash = (hash ^ word) * prime;
+			hash ^= hash >> 29;
+		};
+
+	uint32_t growth;
+	uint32_t overlap;
+	memcpy(&growth, &options.MaxReferenceGrowth, sizeof(growth));
+	memcpy(&overlap, &options.MinSpatialSplitOverlap, sizeof(overlap));
+
+	mix(options.SpatialSplits ? 1 : 0);
+	mix(growth);
+	mix(overlap);
+	mix(options.Linear ? 1 : 0);
+	mix(options.TreeletPasses);
+	return hash ^ (hash >> 32);
+}
+
+
+// --------------------------------------------------------
+// A quick 64-bit hash of every position and index, a word at
+// a time (the same mixing as MeshCache::HashData).  Normals,
+// UVs and so on are skipped, since the tree doesn't use them.
+// --------------------------------------------------------
+uint64_t BvhCache::HashGeometry(const Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices)
+{
+	const uint64_t prime = 0x100000001B3ull;
+	uint64_t hash = 0xCBF29CE484222325ull ^ numVerts ^ ((uint64_t)numIndices << 32);
+	auto mix = [&](uint64_t word)
+		{
+			hash = (hash ^ word) * prime;
+			hash ^= hash >> 29;
+		};
+
+	for (size_t i = 0; i < numVerts; i++)
+	{
+		uint32_t position[3];
+		memcpy(position, &verts[i].Position, sizeof(position));
+		mix(((uint64_t)position[1] << 32) | position[0]);
+		mix(position[2]);
+	}
+	for (size_t i = 0; i < numIndices; i++)
+		mix(indices[i]);
+
+	return hash ^ (hash >> 32);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Bvh.h"
+#include "MappedFile.h"
+
+// Bump this whenever the layout of a .bvhbin file (or the
+// way trees are built) changes
+#define BVH_CACHE_VERSION 2
+
+// --------------------------------------------------------
+// Header at the start of every .bvhbin file, followed by
+// the node array, the triangles in leaf order, and then the
+// original index buffer triangle for each of those.  Nodes
+// only refer to each other (and to triangles) by index, so
+// the whole file can be used right where it's mapped.
+// --------------------------------------------------------
+struct BvhCacheHeader
+{
+	char Magic[4];				// Always "BVHC"
+	uint32_t Version;			// BVH_CACHE_VERSION when written
+	uint32_t NodeStride;		// sizeof(BvhNode) when written
+	uint32_t TriangleStride;	// sizeof(BvhTriangle) when written
+	uint32_t SahBins;			// BVH_SAH_BINS when written
+	uint32_t MaxLeafTriangles;	// BVH_MAX_LEAF_TRIANGLES when written
+	uint32_t SpatialSplits;		// The BvhBuildOptions it was built with
+	float MaxReferenceGrowth;
+	float MinSpatialSplitOverlap;
+	uint32_t Linear;
+	uint32_t TreeletPasses;
+	uint32_t NodeCount;
+	uint32_t ReferenceCount;	// Triangles in leaves (see BvhBuildStats)
+	uint32_t NodeOffset;		// Byte offsets from start of file
+	uint32_t TriangleOffset;
+	uint32_t TriangleIndexOffset;
+	uint64_t GeometryHash;		// Hash of the positions and indices it was built over
+
+	// The rest of the build's stats, so loading doesn't need to work them out
+	float SahCost;
+	uint32_t LeafCount;
+	uint32_t MaxDepth;
+	uint32_t SpatialSplitCount;
+};
+
+// --------------------------------------------------------
+// A validated, memory-mapped .bvhbin file, holding a mesh's
+// BVH so later runs don't need to build it again.  The array
+// pointers point straight into the mapping, so they are only
+// valid while this object is alive (Bvh::Load holds onto it).
+// --------------------------------------------------------
+class BvhCache
+{
+public:
+	BvhCache(const std::wstring& cacheFile, uint64_t geometryHash, const BvhBuildOptions& options);
+
+	bool IsValid() const { return header != 0; }
+	const BvhCacheHeader* GetHeader() const { return header; }
+	const BvhNode* GetNodes() const;
+	const BvhTriangle* GetTriangles() const;
+	const uint32_t* GetTriangleIndices() const;
+
+	// Writes a cache file for a tree built over triangles
+	static bool Write(const std::wstring& cacheFile, const Bvh& bvh, uint64_t geometryHash, const BvhBuildOptions& options);
+
+	// The exact bytes Write() puts in a cache file
+	static std::vector<char> Serialize(const Bvh& bvh, uint64_t geometryHash, const BvhBuildOptions& options);
+
+	// Path of the cache file that sits next to a source file (each
+	// set of options gets its own, so they don't replace each other)
+	static std::wstring GetCachePath(const std::wstring& sourceFile, const BvhBuildOptions& options);
+
+	// Hash of every build option, which differs for any two sets
+	// of options that could build different trees
+	static uint64_t HashOptions(const BvhBuildOptions& options);
+
+	// Hash of just the geometry a tree depends on (positions and indices)
+	static uint64_t HashGeometry(const Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices);
+
+private:
+	std::unique_ptr<MappedFile> file;
+	const char* data;
+	const BvhCacheHeader* header;
+
+	// Checks the header, build settings and layout
+	const BvhCacheHeader* Validate(const char* data, size_t size, uint64_t geometryHash, const BvhBuildOptions& options);
+	static bool ValidateNodes(const BvhNode* nodes, uint32_t nodeCount, uint32_t referenceCount);
+};
@@ -0,0 +1,718 @@
+#include "BvhPacket.h"
+
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace DirectX;
+
+// Four rays per SSE register
+#define BVH_PACKET_GROUPS (BVH_PACKET_SIZE / 4)
+
+static_assert(BVH_PACKET_SIZE % 4 == 0 && BVH_PACKET_SIZE <= 32, "Packets are traced four rays at a time, with a bit per ray");
+
+// Every lane of a full packet
+#define ALL_LANES ((uint32_t)((1ull << BVH_PACKET_SIZE) - 1))
+
+// --------------------------------------------------------
+// Index of the lowest set bit (mask must not be zero)
+// --------------------------------------------------------
+static inline unsigned int LowestBit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// --------------------------------------------------------
+// How many bits are set
+// --------------------------------------------------------
+static inline unsigned int CountBits(uint32_t mask)
+{
+	unsigned int count = 0;
+	for (; mask; mask &= mask - 1)
+		count++;
+	return count;
+}
+
+// --------------------------------------------------------
+// A packet as it's traced: the rays (in whichever space the
+// current tree is in) with their reciprocal directions, and
+// bounds on all of the rays together for culling whole
+// nodes at once.  Lanes that aren't traced get an empty
+// range, so no box or triangle test ever passes for them.
+// --------------------------------------------------------
+struct PacketRays
+{
+	alignas(16) float Origin[3][BVH_PACKET_SIZE];
+	alignas(16) float Direction[3][BVH_PACKET_SIZE];
+	alignas(16) float InvDirection[3][BVH_PACKET_SIZE];
+	alignas(16) float TMin[BVH_PACKET_SIZE];
+
+	// Which way every ray goes along each axis
+	bool Negative[3];
+
+	// Interval bounds over every traced ray, unless some ray
+	// is parallel to an axis (where they'd turn into NaNs),
+	// or is a NaN itself
+	bool HasInterval;
+	float OriginMin[3];
+	float OriginMax[3];
+	float InvDirectionMin[3];
+	float InvDirectionMax[3];
+};
+
+// --------------------------------------------------------
+// Fills in reciprocals and bounds once the origins,
+// directions and TMin of the traced lanes are set
+//
+// Returns false if the rays don't all head the same way
+// along every axis, in which case they need to be traced
+// one at a time
+// --------------------------------------------------------
+static bool PreparePacket(PacketRays& rays, uint32_t lanes)
+{
+	// Copies of a traced ray keep the math clean (and don't
+	// change any bounds), and an empty range keeps them from
+	// hitting anything
+	unsigned int firstLane = LowestBit(lanes);
+	for (uint32_t unused = ~lanes & ALL_LANES; unused; unused &= unused - 1)
+	{
+		unsigned int i = LowestBit(unused);
+		for (int a = 0; a < 3; a++)
+		{
+			rays.Origin[a][i] = rays.Origin[a][firstLane];
+			rays.Direction[a][i] = rays.Direction[a][firstLane];
+		}
+		rays.TMin[i] = FLT_MAX;
+	}
+
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 infinity = _mm_set1_ps(INFINITY);
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	__m128 unbounded = _mm_setzero_ps();
+	for (int a = 0; a < 3; a++)
+	{
+		__m128 originMin = _mm_load_ps(rays.Origin[a]);
+		__m128 originMax = originMin;
+		__m128 invMin = _mm_set1_ps(FLT_MAX);
+		__m128 invMax = _mm_set1_ps(-FLT_MAX);
+		uint32_t negative = 0;
+		for (unsigned int group = 0; group < BVH_PACKET_GROUPS; group++)
+		{
+			unsigned int offset = group * 4;
+			__m128 origin = _mm_load_ps(rays.Origin[a] + offset);
+			__m128 invDir = _mm_div_ps(one, _mm_load_ps(rays.Direction[a] + offset));
+			_mm_store_ps(rays.InvDirection[a] + offset, invDir);
+
+			negative |= (uint32_t)_mm_movemask_ps(_mm_cmplt_ps(invDir, _mm_setzero_ps())) << offset;
+			unbounded = _mm_or_ps(unbounded, _mm_cmpnlt_ps(_mm_andnot_ps(signBit, invDir), infinity));
+			originMin = _mm_min_ps(originMin, origin);
+			originMax = _mm_max_ps(originMax, origin);
+			invMin = _mm_min_ps(invMin, invDir);
+			invMax = _mm_max_ps(invMax, invDir);
+		}
+		if (negative != 0 && negative != ALL_LANES)
+			return false;
+
+		alignas(16) float bounds[4][4];
+		_mm_store_ps(bounds[0], originMin);
+		_mm_store_ps(bounds[1], originMax);
+		_mm_store_ps(bounds[2], invMin);
+		_mm_store_ps(bounds[3], invMax);
+		rays.Negative[a] = negative != 0;
+		rays.OriginMin[a] = (std::min)((std::min)(bounds[0][0], bounds[0][1]), (std::min)(bounds[0][2], bounds[0][3]));
+		rays.OriginMax[a] = (std::max)((std::max)(bounds[1][0], bounds[1][1]), (std::max)(bounds[1][2], bounds[1][3]));
+		rays.InvDirectionMin[a] = (std::min)((std::min)(bounds[2][0], bounds[2][1]), (std::min)(bounds[2][2], bounds[2][3]));
+		rays.InvDirectionMax[a] = (std::max)((std::max)(bounds[3][0], bounds[3][1]), (std::max)(bounds[3][2], bounds[3][3]));
+	}
+
+	// Rays parallel to an axis would give NaN bounds, and a
+	// NaN reciprocal would be quietly dropped by min and max
+	// (both are caught by not being less than infinity)
+	rays.HasInterval = _mm_movemask_ps(unbounded) == 0;
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Slab tests four of the packet's rays against a box, the
+// same way TraverseBvh does (so a NaN from a plane right on
+// an origin is ignored the same way, too)
+//
+// Returns a bit for each of the four that hit it
+// --------------------------------------------------------
+static inline uint32_t IntersectBoxGroup(const BvhNode& node, const PacketRays& rays, const float* hitT, unsigned int group)
+{
+	const float* boxMin = &node.BoundsMin.x;
+	const float* boxMax = &node.BoundsMax.x;
+	unsigned int offset = group * 4;
+
+	__m128 tNear = _mm_load_ps(rays.TMin + offset);
+	__m128 tFar = _mm_load_ps(hitT + offset);
+	for (int a = 0; a < 3; a++)
+	{
+		__m128 nearPlane = _mm_set1_ps(rays.Negative[a] ? boxMax[a] : boxMin[a]);
+		__m128 farPlane = _mm_set1_ps(rays.Negative[a] ? boxMin[a] : boxMax[a]);
+		__m128 origin = _mm_load_ps(rays.Origin[a] + offset);
+		__m128 invDir = _mm_load_ps(rays.InvDirection[a] + offset);
+
+		// The accumulated value goes second, since that's the
+		// one SSE keeps when the other is NaN
+		tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, origin), invDir), tNear);
+		tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, origin), invDir), tFar);
+	}
+	return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+}
+
+
+// --------------------------------------------------------
+// Interval arithmetic over the whole packet: the earliest
+// any ray could enter the box, and the latest any could
+// leave it.  If even those don't overlap, no ray hits it.
+//
+// maxT - The furthest any traced ray can still go
+// --------------------------------------------------------
+static inline bool PacketMissesBox(const BvhNode& node, const PacketRays& rays, float minT, float maxT)
+{
+	const float* boxMin = &node.BoundsMin.x;
+	const float* boxMax = &node.BoundsMax.x;
+	float entry = minT;
+	float exit = maxT;
+	for (int a = 0; a < 3; a++)
+	{
+		// Signs are shared, so the products' extremes only
+		// depend on which side of the planes the origins are
+		float nearDistance, farDistance;
+		if (!rays.Negative[a])
+		{
+			nearDistance = boxMin[a] - rays.OriginMax[a];
+			farDistance = boxMax[a] - rays.OriginMin[a];
+			entry = (std::max)(entry, nearDistance * (nearDistance >= 0 ? rays.InvDirectionMin[a] : rays.InvDirectionMax[a]));
+			exit = (std::min)(exit, farDistance * (farDistance >= 0 ? rays.InvDirectionMax[a] : rays.InvDirectionMin[a]));
+		}
+		else
+		{
+			nearDistance = boxMax[a] - rays.OriginMin[a];
+			farDistance = boxMin[a] - rays.OriginMax[a];
+			entry = (std::max)(entry, nearDistance * (nearDistance >= 0 ? rays.InvDirectionMin[a] : rays.InvDirectionMax[a]));
+			exit = (std::min)(exit, farDistance * (farDistance < 0 ? rays.InvDirectionMin[a] : rays.InvDirectionMax[a]));
+		}
+	}
+	return entry > exit;
+}
+
+
+// --------------------------------------------------------
+// Moller-Trumbore for one triangle against four rays,
+// keeping any hits closer than what each ray already has.
+// Every operation is the same, in the same order, as
+// IntersectBvhTriangles' (which spells its math out for
+// this), so each ray gets bit for bit the same hit as it
+// would on its own, even right on a shared edge.
+// --------------------------------------------------------
+static inline void IntersectTriangleGroup(const BvhTriangle& triangle, uint32_t triangleIndex, const PacketRays& rays, BvhPacketHit& hit, unsigned int group)
+{
+	unsigned int offset = group * 4;
+	__m128 v0[3] = { _mm_set1_ps(triangle.V0.x), _mm_set1_ps(triangle.V0.y), _mm_set1_ps(triangle.V0.z) };
+	__m128 e1[3] =
+	{
+		_mm_set1_ps(triangle.V1.x - triangle.V0.x),
+		_mm_set1_ps(triangle.V1.y - triangle.V0.y),
+		_mm_set1_ps(triangle.V1.z - triangle.V0.z)
+	};
+	__m128 e2[3] =
+	{
+		_mm_set1_ps(triangle.V2.x - triangle.V0.x),
+		_mm_set1_ps(triangle.V2.y - triangle.V0.y),
+		_mm_set1_ps(triangle.V2.z - triangle.V0.z)
+	};
+	__m128 dir[3] =
+	{
+		_mm_load_ps(rays.Direction[0] + offset),
+		_mm_load_ps(rays.Direction[1] + offset),
+		_mm_load_ps(rays.Direction[2] + offset)
+	};
+
+	auto cross = [](const __m128* a, const __m128* b, __m128* result)
+		{
+			result[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+			result[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+			result[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+		};
+	auto dot = [](const __m128* a, const __m128* b)
+		{
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+		};
+
+	__m128 p[3];
+	cross(dir, e2, p);
+	__m128 det = dot(e1, p);
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	__m128 s[3] =
+	{
+		_mm_sub_ps(_mm_load_ps(rays.Origin[0] + offset), v0[0]),
+		_mm_sub_ps(_mm_load_ps(rays.Origin[1] + offset), v0[1]),
+		_mm_sub_ps(_mm_load_ps(rays.Origin[2] + offset), v0[2])
+	};
+	__m128 u = _mm_mul_ps(dot(s, p), invDet);
+
+	__m128 q[3];
+	cross(s, e1, q);
+	__m128 v = _mm_mul_ps(dot(dir, q), invDet);
+	__m128 t = _mm_mul_ps(dot(e2, q), invDet);
+
+	// Determinants that could be all rounding are misses (see
+	// BVH_MIN_RELATIVE_DETERMINANT)
+	__m128 minDet = _mm_mul_ps(_mm_set1_ps(BVH_MIN_RELATIVE_DETERMINANT), _mm_sqrt_ps(dot(dir, dir)));
+	minDet = _mm_mul_ps(_mm_mul_ps(minDet, _mm_sqrt_ps(dot(e1, e1))), _mm_sqrt_ps(dot(e2, e2)));
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	__m128 hitT = _mm_load_ps(hit.T + offset);
+	__m128 mask = _mm_cmpgt_ps(_mm_andnot_ps(signBit, det), minDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(u, one));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(t, _mm_load_ps(rays.TMin + offset)));
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(t, hitT));
+	if (_mm_movemask_ps(mask) == 0)
+		return;
+
+	auto blend = [&](float* values, __m128 newValues)
+		{
+			__m128 old = _mm_load_ps(values + offset);
+			_mm_store_ps(values + offset, _mm_or_ps(_mm_and_ps(mask, newValues), _mm_andnot_ps(mask, old)));
+		};
+	blend(hit.T, t);
+	blend(hit.U, u);
+	blend(hit.V, v);
+	blend((float*)hit.TriangleIndex, _mm_castsi128_ps(_mm_set1_epi32((int)triangleIndex)));
+}
+
+
+// --------------------------------------------------------
+// Walks a binary tree with a whole packet (Wald et al.'s
+// "first active ray" traversal).  Each node is entered with
+// the first ray that might still hit it: that ray's group is
+// tested first, since with coherent rays it usually hits,
+// then the packet's interval bounds, which cull most nodes
+// that none of the rays hit, and only then the rest of the
+// rays.  Rays before the first active one have already
+// missed an ancestor, so they're skipped below it.
+//
+// Children are visited in the order the packet is heading
+// along the axis that separates their centers the most.
+//
+// leaf(first, count, hitLanes) is called for every leaf at
+// least one ray hits, with a mask of the rays that hit it.
+// --------------------------------------------------------
+template<typename LeafFunction>
+static void TraversePacket(const BvhNode* nodes, const PacketRays& rays, uint32_t lanes, const float* hitT, LeafFunction leaf)
+{
+	float minT = FLT_MAX;
+	for (unsigned int i = 0; i < BVH_PACKET_SIZE; i++)
+		minT = (std::min)(minT, rays.TMin[i]);
+
+	// The furthest any ray can still go, which only changes after leaves
+	auto getMaxT = [&]()
+		{
+			float maxT = -FLT_MAX;
+			for (unsigned int i = 0; i < BVH_PACKET_SIZE; i++)
+			{
+				if (lanes & (1u << i))
+					maxT = (std::max)(maxT, hitT[i]);
+			}
+			return maxT;
+		};
+	float maxT = getMaxT();
+
+	// First lane at or after firstLane that hits the node, or
+	// BVH_PACKET_SIZE if none do
+	auto findFirstHit = [&](const BvhNode& node, unsigned int firstLane)
+		{
+			unsigned int group = firstLane / 4;
+			uint32_t hits = IntersectBoxGroup(node, rays, hitT, group) & (0xFu << (firstLane % 4)) & 0xF;
+			if (hits)
+				return group * 4 + LowestBit(hits);
+
+			if (rays.HasInterval && PacketMissesBox(node, rays, minT, maxT))
+				return (unsigned int)BVH_PACKET_SIZE;
+
+			for (group++; group < BVH_PACKET_GROUPS; group++)
+			{
+				hits = IntersectBoxGroup(node, rays, hitT, group);
+				if (hits)
+					return group * 4 + LowestBit(hits);
+			}
+			return (unsigned int)BVH_PACKET_SIZE;
+		};
+
+	struct StackEntry
+	{
+		uint32_t Node;
+		uint32_t FirstLane;
+	};
+	StackEntry stack[BVH_PACKET_STACK_SIZE];
+	unsigned int stackSize = 0;
+	stack[stackSize++] = { 0, LowestBit(lanes) };
+
+	while (stackSize > 0)
+	{
+		StackEntry entry = stack[--stackSize];
+		const BvhNode& node = nodes[entry.Node];
+		unsigned int firstLane = findFirstHit(node, entry.FirstLane);
+		if (firstLane == BVH_PACKET_SIZE)
+			continue;
+
+		if (node.IsLeaf())
+		{
+			// Only the rays that actually reach the leaf test what's in it
+			uint32_t hitLanes = 0;
+			for (unsigned int group = firstLane / 4; group < BVH_PACKET_GROUPS; group++)
+				hitLanes |= IntersectBoxGroup(node, rays, hitT, group) << (group * 4);
+
+			leaf(node.LeftFirst, node.TriangleCount, hitLanes & lanes);
+			maxT = getMaxT();
+			continue;
+		}
+
+		// Whichever child is further along the packet's way goes on the stack first
+		const BvhNode& left = nodes[node.LeftFirst];
+		const BvhNode& right = nodes[node.LeftFirst + 1];
+		int axis = 0;
+		float largest = -1;
+		float separation[3];
+		for (int a = 0; a < 3; a++)
+		{
+			separation[a] =
+				((&right.BoundsMin.x)[a] + (&right.BoundsMax.x)[a]) -
+				((&left.BoundsMin.x)[a] + (&left.BoundsMax.x)[a]);
+			if (fabsf(separation[a]) > largest)
+			{
+				largest = fabsf(separation[a]);
+				axis = a;
+			}
+		}
+		bool leftFirst = (separation[axis] >= 0) != rays.Negative[axis];
+		uint32_t nearChild = leftFirst ? node.LeftFirst : node.LeftFirst + 1;
+		uint32_t farChild = leftFirst ? node.LeftFirst + 1 : node.LeftFirst;
+		stack[stackSize++] = { farChild, firstLane };
+		stack[stackSize++] = { nearChild, firstLane };
+	}
+}
+
+
+// --------------------------------------------------------
+// Traces a prepared packet through a mesh's tree.  The hit
+// has to start out with each ray's TMax (and no triangle).
+// --------------------------------------------------------
+static void IntersectPacketRays(const Bvh& bvh, const PacketRays& rays, uint32_t lanes, BvhPacketHit& hit)
+{
+	const BvhTriangle* triangles = bvh.GetTriangles().data();
+	const uint32_t* triangleIndices = bvh.GetTriangleIndices().data();
+	TraversePacket(bvh.GetNodes().data(), rays, lanes, hit.T, [&](uint32_t first, uint32_t count, uint32_t hitLanes)
+		{
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				for (unsigned int group = LowestBit(hitLanes) / 4; group < BVH_PACKET_GROUPS; group++)
+				{
+					if ((hitLanes >> (group * 4)) & 0xF)
+						IntersectTriangleGroup(triangles[i], triangleIndices[i], rays, hit, group);
+				}
+			}
+		});
+}
+
+
+// --------------------------------------------------------
+// Mask of a packet's first Count lanes
+// --------------------------------------------------------
+static uint32_t GetPacketLanes(const BvhRayPacket& packet)
+{
+	unsigned int count = (std::min)(packet.Count, (unsigned int)BVH_PACKET_SIZE);
+	return count == BVH_PACKET_SIZE ? ALL_LANES : (1u << count) - 1;
+}
+
+
+// --------------------------------------------------------
+// Clears the hit for every lane, to each ray's TMax
+// --------------------------------------------------------
+static void ResetPacketHit(const BvhRayPacket& packet, BvhPacketHit& hit)
+{
+	for (unsigned int i = 0; i < BVH_PACKET_SIZE; i++)
+	{
+		hit.T[i] = i < packet.Count ? packet.TMax[i] : -FLT_MAX;
+		hit.U[i] = 0;
+		hit.V[i] = 0;
+		hit.TriangleIndex[i] = BVH_NO_HIT;
+		hit.InstanceIndex[i] = BVH_NO_HIT;
+	}
+}
+
+
+// --------------------------------------------------------
+// Finds the closest triangle hit by each ray in the packet
+// (within its range), front or back facing
+// --------------------------------------------------------
+uint32_t IntersectBvhPacket(const Bvh& bvh, const BvhRayPacket& packet, BvhPacketHit& hit)
+{
+	ResetPacketHit(packet, hit);
+	uint32_t lanes = GetPacketLanes(packet);
+	if (bvh.IsEmpty() || lanes == 0)
+		return 0;
+
+	PacketRays rays;
+	memcpy(rays.Origin[0], packet.OriginX, sizeof(rays.Origin[0]));
+	memcpy(rays.Origin[1], packet.OriginY, sizeof(rays.Origin[1]));
+	memcpy(rays.Origin[2], packet.OriginZ, sizeof(rays.Origin[2]));
+	memcpy(rays.Direction[0], packet.DirectionX, sizeof(rays.Direction[0]));
+	memcpy(rays.Direction[1], packet.DirectionY, sizeof(rays.Direction[1]));
+	memcpy(rays.Direction[2], packet.DirectionZ, sizeof(rays.Direction[2]));
+	memcpy(rays.TMin, packet.TMin, sizeof(rays.TMin));
+
+	uint32_t hitLanes = 0;
+	if (PreparePacket(rays, lanes))
+	{
+		IntersectPacketRays(bvh, rays, lanes, hit);
+		for (unsigned int i = 0; i < BVH_PACKET_SIZE; i++)
+			hitLanes |= (lanes & (1u << i)) && hit.TriangleIndex[i] != BVH_NO_HIT ? 1u << i : 0;
+		return hitLanes;
+	}
+
+	// Too divergent to share a walk
+	for (unsigned int i = 0; i < packet.Count; i++)
+	{
+		BvhHit rayHit;
+		if (bvh.Intersect(packet.GetRay(i), rayHit))
+			hitLanes |= 1u << i;
+		hit.T[i] = rayHit.T;
+		hit.U[i] = rayHit.U;
+		hit.V[i] = rayHit.V;
+		hit.TriangleIndex[i] = rayHit.TriangleIndex;
+	}
+	return hitLanes;
+}
+
+
+// --------------------------------------------------------
+// Moves the groups of rays with any of the given lanes into
+// an instance's object space, four at a time, in the same
+// order of operations as XMVector3TransformCoord and
+// XMVector3TransformNormal (which SceneBvh::Intersect uses)
+// --------------------------------------------------------
+static void TransformPacket(const PacketRays& rays, const XMFLOAT4X4& matrix, uint32_t lanes, PacketRays& objectRays)
+{
+	for (unsigned int group = 0; group < BVH_PACKET_GROUPS; group++)
+	{
+		if (!((lanes >> (group * 4)) & 0xF))
+			continue;
+
+		unsigned int offset = group * 4;
+		__m128 origin[3];
+		__m128 direction[3];
+		for (int a = 0; a < 3; a++)
+		{
+			origin[a] = _mm_load_ps(rays.Origin[a] + offset);
+			direction[a] = _mm_load_ps(rays.Direction[a] + offset);
+		}
+
+		__m128 transformed[4];
+		for (int c = 0; c < 4; c++)
+		{
+			__m128 value = _mm_add_ps(_mm_mul_ps(origin[2], _mm_set1_ps(matrix.m[2][c])), _mm_set1_ps(matrix.m[3][c]));
+			value = _mm_add_ps(_mm_mul_ps(origin[1], _mm_set1_ps(matrix.m[1][c])), value);
+			transformed[c] = _mm_add_ps(_mm_mul_ps(origin[0], _mm_set1_ps(matrix.m[0][c])), value);
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			_mm_store_ps(objectRays.Origin[c] + offset, _mm_div_ps(transformed[c], transformed[3]));
+
+			__m128 value = _mm_mul_ps(direction[2], _mm_set1_ps(matrix.m[2][c]));
+			value = _mm_add_ps(_mm_mul_ps(direction[1], _mm_set1_ps(matrix.m[1][c])), value);
+			value = _mm_add_ps(_mm_mul_ps(direction[0], _mm_set1_ps(matrix.m[0][c])), value);
+			_mm_store_ps(objectRays.Direction[c] + offset, value);
+		}
+		_mm_store_ps(objectRays.TMin + offset, _mm_load_ps(rays.TMin + offset));
+	}
+}
+
+
+// --------------------------------------------------------
+// Walks the scene's top level with the whole packet, and
+// at each instance moves the rays that reach it into its
+// object space (the same transforms SceneBvh::Intersect
+// uses) and carries on through the mesh's tree as a packet.
+// Instances that rotate the rays apart, or that only a few
+// of the rays reach, are traced one ray at a time.
+// --------------------------------------------------------
+uint32_t IntersectBvhPacket(const SceneBvh& scene, const BvhRayPacket& packet, BvhPacketHit& hit)
+{
+	ResetPacketHit(packet, hit);
+	uint32_t lanes = GetPacketLanes(packet);
+	if (scene.IsEmpty() || lanes == 0)
+		return 0;
+
+	PacketRays rays;
+	memcpy(rays.Origin[0], packet.OriginX, sizeof(rays.Origin[0]));
+	memcpy(rays.Origin[1], packet.OriginY, sizeof(rays.Origin[1]));
+	memcpy(rays.Origin[2], packet.OriginZ, sizeof(rays.Origin[2]));
+	memcpy(rays.Direction[0], packet.DirectionX, sizeof(rays.Direction[0]));
+	memcpy(rays.Direction[1], packet.DirectionY, sizeof(rays.Direction[1]));
+	memcpy(rays.Direction[2], packet.DirectionZ, sizeof(rays.Direction[2]));
+	memcpy(rays.TMin, packet.TMin, sizeof(rays.TMin));
+
+	uint32_t hitLanes = 0;
+	if (!PreparePacket(rays, lanes))
+	{
+		for (unsigned int i = 0; i < packet.Count; i++)
+		{
+			SceneBvhHit rayHit;
+			if (scene.Intersect(packet.GetRay(i), rayHit))
+				hitLanes |= 1u << i;
+			hit.T[i] = rayHit.T;
+			hit.U[i] = rayHit.U;
+			hit.V[i] = rayHit.V;
+			hit.TriangleIndex[i] = rayHit.TriangleIndex;
+			hit.InstanceIndex[i] = rayHit.InstanceIndex;
+		}
+		return hitLanes;
+	}
+
+	const std::vector<SceneBvhInstance>& instances = scene.GetInstances();
+	PacketRays objectRays;
+	BvhPacketHit objectHit;
+	TraversePacket(scene.GetTopLevel().GetNodes().data(), rays, lanes, hit.T, [&](uint32_t first, uint32_t count, uint32_t instanceLanes)
+		{
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				const SceneBvhInstance& instance = instances[i];
+				TransformPacket(rays, instance.WorldToObject, instanceLanes, objectRays);
+
+				// Object space T is the same as world space T (the
+				// directions aren't renormalized), so the hits so far
+				// still bound the rays
+				for (unsigned int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+				{
+					objectHit.T[lane] = instanceLanes & (1u << lane) ? hit.T[lane] : -FLT_MAX;
+					objectHit.TriangleIndex[lane] = BVH_NO_HIT;
+				}
+
+				if (CountBits(instanceLanes) >= BVH_PACKET_MIN_RAYS && PreparePacket(objectRays, instanceLanes))
+				{
+					IntersectPacketRays(*instance.Blas, objectRays, instanceLanes, objectHit);
+				}
+				else
+				{
+					for (unsigned int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+					{
+						if (!(instanceLanes & (1u << lane)))
+							continue;
+
+						BvhRay objectRay;
+						objectRay.Origin = XMFLOAT3(objectRays.Origin[0][lane], objectRays.Origin[1][lane], objectRays.Origin[2][lane]);
+						objectRay.Direction = XMFLOAT3(objectRays.Direction[0][lane], objectRays.Direction[1][lane], objectRays.Direction[2][lane]);
+						objectRay.TMin = objectRays.TMin[lane];
+						objectRay.TMax = hit.T[lane];
+
+						BvhHit rayHit;
+						if (instance.Blas->Intersect(objectRay, rayHit))
+						{
+							objectHit.T[lane] = rayHit.T;
+							objectHit.U[lane] = rayHit.U;
+							objectHit.V[lane] = rayHit.V;
+							objectHit.TriangleIndex[lane] = rayHit.TriangleIndex;
+						}
+					}
+				}
+
+				for (unsigned int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+				{
+					if ((instanceLanes & (1u << lane)) && objectHit.TriangleIndex[lane] != BVH_NO_HIT)
+					{
+						hit.T[lane] = objectHit.T[lane];
+						hit.U[lane] = objectHit.U[lane];
+						hit.V[lane] = objectHit.V[lane];
+						hit.TriangleIndex[lane] = objectHit.TriangleIndex[lane];
+						hit.InstanceIndex[lane] = instance.InstanceIndex;
+					}
+				}
+			}
+		});
+
+	for (unsigned int i = 0; i < BVH_PACKET_SIZE; i++)
+		hitLanes |= (lanes & (1u << i)) && hit.InstanceIndex[i] != BVH_NO_HIT ? 1u << i : 0;
+	return hitLanes;
+}
+
+
+// --------------------------------------------------------
+// Cuts an image into tiles, and traces each tile's rays as
+// a packet (partial tiles along the edges just leave some
+// lanes unused)
+// --------------------------------------------------------
+template<typename Tree, typename Hit>
+static size_t IntersectImage(const Tree& tree, const BvhRay* rays, unsigned int width, unsigned int height, Hit* hits, void(*storeHit)(const BvhPacketHit&, unsigned int, Hit&))
+{
+	size_t hitCount = 0;
+	BvhRayPacket packet;
+	BvhPacketHit packetHit;
+	unsigned int pixels[BVH_PACKET_SIZE];
+	for (unsigned int tileY = 0; tileY < height; tileY += BVH_PACKET_TILE)
+	{
+		for (unsigned int tileX = 0; tileX < width; tileX += BVH_PACKET_TILE)
+		{
+			packet.Count = 0;
+			for (unsigned int y = tileY; y < (std::min)(tileY + BVH_PACKET_TILE, height); y++)
+			{
+				for (unsigned int x = tileX; x < (std::min)(tileX + BVH_PACKET_TILE, width); x++)
+				{
+					pixels[packet.Count] = y * width + x;
+					packet.SetRay(packet.Count++, rays[y * width + x]);
+				}
+			}
+
+			uint32_t hitLanes = IntersectBvhPacket(tree, packet, packetHit);
+			for (unsigned int i = 0; i < packet.Count; i++)
+			{
+				storeHit(packetHit, i, hits[pixels[i]]);
+				hitCount += (hitLanes >> i) & 1;
+			}
+		}
+	}
+	return hitCount;
+}
+
+size_t IntersectBvhImage(const Bvh& bvh, const BvhRay* rays, unsigned int width, unsigned int height, BvhHit* hits)
+{
+	return IntersectImage<Bvh, BvhHit>(bvh, rays, width, height, hits, [](const BvhPacketHit& packetHit, unsigned int lane, BvhHit& hit)
+		{
+			hit.T = packetHit.T[lane];
+			hit.U = packetHit.U[lane];
+			hit.V = packetHit.V[lane];
+			hit.TriangleIndex = packetHit.TriangleIndex[lane];
+		});
+}
+
+size_t IntersectBvhImage(const SceneBvh& scene, const BvhRay* rays, unsigned int width, unsigned int height, SceneBvhHit* hits)
+{
+	return IntersectImage<SceneBvh, SceneBvhHit>(scene, rays, width, height, hits, [](const BvhPacketHit& packetHit, unsigned int lane, SceneBvhHit& hit)
+		{
+			hit.T = packetHit.T[lane];
+			hit.U = packetHit.U[lane];
+			hit.V = packetHit.V[lane];
+			hit.TriangleIndex = packetHit.TriangleIndex[lane];
+			hit.InstanceIndex = packetHit.InstanceIndex[lane];
+		});
+}
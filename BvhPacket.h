@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Bvh.h"
+#include "SceneBvh.h"
+
+// Rays per packet, a square tile of pixels (traced four at
+// a time with SSE, so the size is a multiple of four)
+#define BVH_PACKET_TILE 4
+#define BVH_PACKET_SIZE (BVH_PACKET_TILE * BVH_PACKET_TILE)
+
+// When fewer rays than this reach an instance, they go
+// through its tree one at a time (a mostly empty packet
+// costs more than it saves)
+#define BVH_PACKET_MIN_RAYS 3
+
+// Deepest a packet walk can go: each interior node pushes both
+// children, and one of them comes right back off
+#define BVH_PACKET_STACK_SIZE (BVH_MAX_DEPTH + 1)
+
+// --------------------------------------------------------
+// Up to BVH_PACKET_SIZE rays in SoA form, one array per
+// component, so each SSE register holds four rays.  Only
+// the first Count rays are traced.
+// --------------------------------------------------------
+struct alignas(16) BvhRayPacket
+{
+	float OriginX[BVH_PACKET_SIZE];
+	float OriginY[BVH_PACKET_SIZE];
+	float OriginZ[BVH_PACKET_SIZE];
+	float DirectionX[BVH_PACKET_SIZE];
+	float DirectionY[BVH_PACKET_SIZE];
+	float DirectionZ[BVH_PACKET_SIZE];
+	float TMin[BVH_PACKET_SIZE];
+	float TMax[BVH_PACKET_SIZE];
+	unsigned int Count;
+
+	void SetRay(unsigned int lane, const BvhRay& ray)
+	{
+		OriginX[lane] = ray.Origin.x;
+		OriginY[lane] = ray.Origin.y;
+		OriginZ[lane] = ray.Origin.z;
+		DirectionX[lane] = ray.Direction.x;
+		DirectionY[lane] = ray.Direction.y;
+		DirectionZ[lane] = ray.Direction.z;
+		TMin[lane] = ray.TMin;
+		TMax[lane] = ray.TMax;
+	}
+
+	BvhRay GetRay(unsigned int lane) const
+	{
+		BvhRay ray;
+		ray.Origin = DirectX::XMFLOAT3(OriginX[lane], OriginY[lane], OriginZ[lane]);
+		ray.Direction = DirectX::XMFLOAT3(DirectionX[lane], DirectionY[lane], DirectionZ[lane]);
+		ray.TMin = TMin[lane];
+		ray.TMax = TMax[lane];
+		return ray;
+	}
+};
+
+// --------------------------------------------------------
+// The closest hit for each ray in a packet (see BvhHit and
+// SceneBvhHit).  InstanceIndex is only set for scenes.
+// --------------------------------------------------------
+struct alignas(16) BvhPacketHit
+{
+	float T[BVH_PACKET_SIZE];
+	float U[BVH_PACKET_SIZE];
+	float V[BVH_PACKET_SIZE];
+	uint32_t TriangleIndex[BVH_PACKET_SIZE];
+	uint32_t InstanceIndex[BVH_PACKET_SIZE];
+};
+
+// Finds the closest hit for every ray in a packet, returning
+// a mask of the lanes that hit something.  Packets whose rays
+// don't all head the same way (per axis) are traced one ray
+// at a time instead, as are instances that turn them apart
+// (or that only a few of them reach).
+uint32_t IntersectBvhPacket(const Bvh& bvh, const BvhRayPacket& packet, BvhPacketHit& hit);
+uint32_t IntersectBvhPacket(const SceneBvh& scene, const BvhRayPacket& packet, BvhPacketHit& hit);
+
+// Traces an image's rays (row major, like MakeBvhCameraRays gives)
+// a tile at a time, returning how many hit something
+size_t IntersectBvhImage(const Bvh& bvh, const BvhRay* rays, unsigned int width, unsigned int height, BvhHit* hits);
+size_t IntersectBvhImage(const SceneBvh& scene, const BvhRay* rays, unsigned int width, unsigned int height, SceneBvhHit* hits);
@@ -0,0 +1,335 @@
+#include "BvhStats.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+using namespace DirectX;
+
+// --------------------------------------------------------
+// Surface area of a box (zero if it's inside out)
+// --------------------------------------------------------
+static float BoxArea(const XMFLOAT3& boxMin, const XMFLOAT3& boxMax)
+{
+	float x = boxMax.x - boxMin.x;
+	float y = boxMax.y - boxMin.y;
+	float z = boxMax.z - boxMin.z;
+	if (x < 0 || y < 0 || z < 0)
+		return 0;
+	return 2.0f * (x * y + y * z + z * x);
+}
+
+
+// --------------------------------------------------------
+// Walks the whole tree once, gathering its depth, leaf sizes
+// and how much each node's children overlap
+// --------------------------------------------------------
+BvhQualityStats AnalyzeBvh(const Bvh& bvh)
+{
+	BvhQualityStats stats = {};
+	if (bvh.IsEmpty())
+		return stats;
+
+	BvhArray<BvhNode> nodes = bvh.GetNodes();
+	stats.SahCost = bvh.CalculateSahCost();
+	stats.NodeCount = (uint32_t)nodes.size();
+
+	struct StackEntry
+	{
+		uint32_t Node;
+		uint32_t Depth;
+	};
+
+	// Depths count levels, like BvhBuildStats (the root is 1)
+	std::vector<StackEntry> stack;
+	stack.push_back({ 0, 1 });
+
+	float rootArea = BoxArea(nodes[0].BoundsMin, nodes[0].BoundsMax);
+	uint64_t leafDepths = 0;
+	uint64_t leafTriangles = 0;
+	uint32_t interiorCount = 0;
+	double overlapRatios = 0;
+	double overlapAreas = 0;
+	while (!stack.empty())
+	{
+		StackEntry entry = stack.back();
+		stack.pop_back();
+
+		const BvhNode& node = nodes[entry.Node];
+		stats.MaxDepth = (std::max)(stats.MaxDepth, entry.Depth);
+		if (node.IsLeaf())
+		{
+			stats.LeafCount++;
+			leafDepths += entry.Depth;
+			leafTriangles += node.TriangleCount;
+			stats.LeafSizes[(std::min)(node.TriangleCount, (uint32_t)BVH_STATS_LEAF_BUCKETS - 1)]++;
+			continue;
+		}
+
+		// The box the two children share
+		const BvhNode& left = nodes[node.LeftFirst];
+		const BvhNode& right = nodes[node.LeftFirst + 1];
+		XMFLOAT3 overlapMin(
+			(std::max)(left.BoundsMin.x, right.BoundsMin.x),
+			(std::max)(left.BoundsMin.y, right.BoundsMin.y),
+			(std::max)(left.BoundsMin.z, right.BoundsMin.z));
+		XMFLOAT3 overlapMax(
+			(std::min)(left.BoundsMax.x, right.BoundsMax.x),
+			(std::min)(left.BoundsMax.y, right.BoundsMax.y),
+			(std::min)(left.BoundsMax.z, right.BoundsMax.z));
+		float overlap = BoxArea(overlapMin, overlapMax);
+		float area = BoxArea(node.BoundsMin, node.BoundsMax);
+
+		interiorCount++;
+		overlapRatios += area > 0 ? overlap / area : 0;
+		overlapAreas += overlap;
+
+		stack.push_back({ node.LeftFirst + 1, entry.Depth + 1 });
+		stack.push_back({ node.LeftFirst, entry.Depth + 1 });
+	}
+
+	stats.AverageLeafDepth = (float)((double)leafDepths / stats.LeafCount);
+	stats.AverageLeafSize = (float)((double)leafTriangles / stats.LeafCount);
+	stats.AverageOverlap = interiorCount > 0 ? (float)(overlapRatios / interiorCount) : 0;
+	stats.OverlapCost = rootArea > 0 ? (float)(overlapAreas / rootArea) : 0;
+	return stats;
+}
+
+
+// --------------------------------------------------------
+// Bvh::Intersect, counting every node the walk steps into
+// and every triangle in the leaves it reaches
+// --------------------------------------------------------
+bool IntersectBvhCounted(const Bvh& bvh, const BvhRay& ray, BvhHit& hit, BvhRayCost& cost)
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+	if (bvh.IsEmpty())
+		return false;
+
+	const BvhTriangle* treeTriangles = bvh.GetTriangles().data();
+	const uint32_t* treeIndices = bvh.GetTriangleIndices().data();
+	TraverseBvh(bvh.GetNodes().data(), ray, hit.T,
+		[&](uint32_t first, uint32_t count)
+		{
+			cost.TrianglesTested += count;
+			IntersectBvhTriangles(treeTriangles, treeIndices, first, count, ray, hit);
+			return true;
+		},
+		[&](uint32_t) { cost.NodesVisited++; });
+
+	return hit.TriangleIndex != BVH_NO_HIT;
+}
+
+
+// --------------------------------------------------------
+// SceneBvh::Intersect, counting the top level's nodes as
+// well as everything done inside each instance's tree
+// --------------------------------------------------------
+bool IntersectBvhCounted(const SceneBvh& scene, const BvhRay& ray, SceneBvhHit& hit, BvhRayCost& cost)
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+	hit.InstanceIndex = BVH_NO_HIT;
+	if (scene.IsEmpty())
+		return false;
+
+	const std::vector<SceneBvhInstance>& instances = scene.GetInstances();
+	XMVECTOR origin = XMLoadFloat3(&ray.Origin);
+	XMVECTOR direction = XMLoadFloat3(&ray.Direction);
+
+	TraverseBvh(scene.GetTopLevel().GetNodes().data(), ray, hit.T,
+		[&](uint32_t first, uint32_t count)
+		{
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				const SceneBvhInstance& instance = instances[i];
+				XMMATRIX worldToObject = XMLoadFloat4x4(&instance.WorldToObject);
+
+				BvhRay objectRay;
+				XMStoreFloat3(&objectRay.Origin, XMVector3TransformCoord(origin, worldToObject));
+				XMStoreFloat3(&objectRay.Direction, XMVector3TransformNormal(direction, worldToObject));
+				objectRay.TMin = ray.TMin;
+				objectRay.TMax = hit.T;
+
+				cost.InstancesTested++;
+				BvhHit objectHit;
+				if (IntersectBvhCounted(*instance.Blas, objectRay, objectHit, cost))
+				{
+					hit.T = objectHit.T;
+					hit.U = objectHit.U;
+					hit.V = objectHit.V;
+					hit.TriangleIndex = objectHit.TriangleIndex;
+					hit.InstanceIndex = instance.InstanceIndex;
+				}
+			}
+			return true;
+		},
+		[&](uint32_t) { cost.NodesVisited++; });
+
+	return hit.InstanceIndex != BVH_NO_HIT;
+}
+
+
+// --------------------------------------------------------
+// Weighs a ray's work the way the SAH does, so the average
+// over many rays is comparable to a tree's SAH cost
+// --------------------------------------------------------
+float GetBvhRayCost(const BvhRayCost& cost)
+{
+	return cost.NodesVisited * BVH_TRAVERSAL_COST + cost.TrianglesTested * BVH_TRIANGLE_COST;
+}
+
+
+// --------------------------------------------------------
+// Unprojects each pixel's center at the near and far planes
+// (so this works for orthographic cameras too), and casts
+// from the near plane toward the far one
+// --------------------------------------------------------
+void MakeBvhCameraRays(const XMFLOAT4X4& view, const XMFLOAT4X4& projection, unsigned int width, unsigned int height, std::vector<BvhRay>& rays)
+{
+	XMMATRIX viewProjection = XMMatrixMultiply(XMLoadFloat4x4(&view), XMLoadFloat4x4(&projection));
+	XMMATRIX inverse = XMMatrixInverse(0, viewProjection);
+
+	rays.resize((size_t)width * height);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			float ndcX = (x + 0.5f) / width * 2 - 1;
+			float ndcY = 1 - (y + 0.5f) / height * 2;
+			XMVECTOR nearPoint = XMVector3TransformCoord(XMVectorSet(ndcX, ndcY, 0, 1), inverse);
+			XMVECTOR farPoint = XMVector3TransformCoord(XMVectorSet(ndcX, ndcY, 1, 1), inverse);
+			XMVECTOR toFar = XMVectorSubtract(farPoint, nearPoint);
+
+			BvhRay& ray = rays[(size_t)y * width + x];
+			XMStoreFloat3(&ray.Origin, nearPoint);
+			XMStoreFloat3(&ray.Direction, XMVector3Normalize(toFar));
+			ray.TMin = 0;
+			ray.TMax = XMVectorGetX(XMVector3Length(toFar));
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Traces batches of rays across the thread pool, each job
+// adding up its own totals (merged at the end, so results
+// don't depend on how jobs were scheduled)
+// --------------------------------------------------------
+template<typename Hit, typename Tree>
+static BvhTraversalStats TraceRays(const Tree& tree, const std::vector<BvhRay>& rays, std::vector<float>* rayCosts)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (rayCosts)
+		rayCosts->resize(rays.size());
+
+	size_t jobCount = (rays.size() + BVH_STATS_RAY_JOB_SIZE - 1) / BVH_STATS_RAY_JOB_SIZE;
+	std::vector<BvhTraversalStats> jobStats(jobCount, BvhTraversalStats{});
+	ThreadPool::GetInstance().ParallelFor(jobCount, [&](size_t job)
+		{
+			BvhTraversalStats& stats = jobStats[job];
+			size_t end = (std::min)(rays.size(), (job + 1) * BVH_STATS_RAY_JOB_SIZE);
+			for (size_t i = job * BVH_STATS_RAY_JOB_SIZE; i < end; i++)
+			{
+				BvhRayCost cost = {};
+				Hit hit;
+				stats.RayCount++;
+				stats.HitCount += IntersectBvhCounted(tree, rays[i], hit, cost) ? 1 : 0;
+				stats.NodesVisited += cost.NodesVisited;
+				stats.TrianglesTested += cost.TrianglesTested;
+				stats.InstancesTested += cost.InstancesTested;
+				stats.MaxNodesVisited = (std::max)(stats.MaxNodesVisited, cost.NodesVisited);
+				stats.MaxTrianglesTested = (std::max)(stats.MaxTrianglesTested, cost.TrianglesTested);
+				if (rayCosts)
+					(*rayCosts)[i] = GetBvhRayCost(cost);
+			}
+		});
+
+	BvhTraversalStats total = {};
+	for (const BvhTraversalStats& stats : jobStats)
+	{
+		total.RayCount += stats.RayCount;
+		total.HitCount += stats.HitCount;
+		total.NodesVisited += stats.NodesVisited;
+		total.TrianglesTested += stats.TrianglesTested;
+		total.InstancesTested += stats.InstancesTested;
+		total.MaxNodesVisited = (std::max)(total.MaxNodesVisited, stats.MaxNodesVisited);
+		total.MaxTrianglesTested = (std::max)(total.MaxTrianglesTested, stats.MaxTrianglesTested);
+	}
+	total.TraceTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return total;
+}
+
+BvhTraversalStats TraceBvhStats(const Bvh& bvh, const std::vector<BvhRay>& rays, std::vector<float>* rayCosts)
+{
+	return TraceRays<BvhHit>(bvh, rays, rayCosts);
+}
+
+BvhTraversalStats TraceBvhStats(const SceneBvh& scene, const std::vector<BvhRay>& rays, std::vector<float>* rayCosts)
+{
+	return TraceRays<SceneBvhHit>(scene, rays, rayCosts);
+}
+
+
+// --------------------------------------------------------
+// Writes costs as a binary .ppm (which nearly every image
+// viewer opens), blending from blue through cyan, green and
+// yellow to red.  Pixels that cost nothing (rays that missed
+// the whole tree) are left black.
+//
+// Returns false if the sizes don't match or the file couldn't be written
+// --------------------------------------------------------
+bool WriteBvhHeatmap(const std::wstring& file, const std::vector<float>& costs, unsigned int width, unsigned int height, float maxCost)
+{
+	if (width == 0 || height == 0 || costs.size() != (size_t)width * height)
+		return false;
+
+	if (maxCost <= 0)
+		maxCost = (std::max)(1.0f, *std::max_element(costs.begin(), costs.end()));
+
+	static const float ramp[][3] =
+	{
+		{ 0, 0, 1 },
+		{ 0, 1, 1 },
+		{ 0, 1, 0 },
+		{ 1, 1, 0 },
+		{ 1, 0, 0 },
+	};
+	const int rampSteps = sizeof(ramp) / sizeof(ramp[0]) - 1;
+
+	std::vector<unsigned char> pixels(costs.size() * 3, 0);
+	for (size_t i = 0; i < costs.size(); i++)
+	{
+		if (costs[i] <= 0)
+			continue;
+
+		float t = (std::min)(costs[i] / maxCost, 1.0f) * rampSteps;
+		int step = (std::min)((int)t, rampSteps - 1);
+		float blend = t - step;
+		for (int c = 0; c < 3; c++)
+		{
+			float value = ramp[step][c] + (ramp[step + 1][c] - ramp[step][c]) * blend;
+			pixels[i * 3 + c] = (unsigned char)(value * 255 + 0.5f);
+		}
+	}
+
+	std::ofstream out(std::filesystem::path(file), std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		return false;
+
+	char header[64];
+	int headerSize = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+	out.write(header, headerSize);
+	out.write((const char*)pixels.data(), pixels.size());
+	return out.good();
+}
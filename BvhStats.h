@@ -0,0 +1,89 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Bvh.h"
+#include "SceneBvh.h"
+
+// Leaves are counted by size, with anything past the usual
+// limit (only box trees go over it) in the last bucket
+#define BVH_STATS_LEAF_BUCKETS (BVH_MAX_LEAF_TRIANGLES + 2)
+
+// Rays are traced in batches of this many per job
+#define BVH_STATS_RAY_JOB_SIZE 1024
+
+// --------------------------------------------------------
+// The shape of a finished tree, independent of any rays.
+// Overlap is between the boxes of each node's two children:
+// wherever they overlap, a ray has to visit both.
+// --------------------------------------------------------
+struct BvhQualityStats
+{
+	float SahCost;				// Expected cost of a random ray (see Bvh::CalculateSahCost)
+	uint32_t NodeCount;
+	uint32_t LeafCount;
+	uint32_t MaxDepth;
+	float AverageLeafDepth;
+	float AverageLeafSize;		// Triangles (or boxes) per leaf
+	uint32_t LeafSizes[BVH_STATS_LEAF_BUCKETS];	// Leaves with each count, see above
+
+	// Surface area of the children's overlap relative to the parent,
+	// averaged over every interior node, and the sum of all overlap
+	// areas relative to the root (the expected number of nodes where
+	// a random ray has to enter both children)
+	float AverageOverlap;
+	float OverlapCost;
+};
+
+// --------------------------------------------------------
+// The work done for a single ray
+// --------------------------------------------------------
+struct BvhRayCost
+{
+	uint32_t NodesVisited;		// Every level of the scene's trees counts
+	uint32_t TrianglesTested;
+	uint32_t InstancesTested;	// Only for scenes: times a ray entered a mesh's tree
+};
+
+// --------------------------------------------------------
+// Totals for a whole set of rays (divide by RayCount for
+// per-ray averages)
+// --------------------------------------------------------
+struct BvhTraversalStats
+{
+	uint64_t RayCount;
+	uint64_t HitCount;
+	uint64_t NodesVisited;
+	uint64_t TrianglesTested;
+	uint64_t InstancesTested;
+	uint32_t MaxNodesVisited;	// The single worst ray
+	uint32_t MaxTrianglesTested;
+	double TraceTimeMs;			// Wall time, counting slows it down a little
+};
+
+// Measures the shape of a tree (mesh or scene top level)
+BvhQualityStats AnalyzeBvh(const Bvh& bvh);
+
+// Same hits as Bvh::Intersect and SceneBvh::Intersect, while adding
+// up how much work each ray took (cost is added to, not reset)
+bool IntersectBvhCounted(const Bvh& bvh, const BvhRay& ray, BvhHit& hit, BvhRayCost& cost);
+bool IntersectBvhCounted(const SceneBvh& scene, const BvhRay& ray, SceneBvhHit& hit, BvhRayCost& cost);
+
+// The cost of a ray in the same units as the SAH
+float GetBvhRayCost(const BvhRayCost& cost);
+
+// One ray through the center of each pixel, top row first, from a
+// camera's (row major) view and projection matrices
+void MakeBvhCameraRays(const DirectX::XMFLOAT4X4& view, const DirectX::XMFLOAT4X4& projection, unsigned int width, unsigned int height, std::vector<BvhRay>& rays);
+
+// Traces every ray (across the thread pool), optionally keeping
+// each ray's cost (see GetBvhRayCost) for a heatmap
+BvhTraversalStats TraceBvhStats(const Bvh& bvh, const std::vector<BvhRay>& rays, std::vector<float>* rayCosts = 0);
+BvhTraversalStats TraceBvhStats(const SceneBvh& scene, const std::vector<BvhRay>& rays, std::vector<float>* rayCosts = 0);
+
+// Writes per-pixel costs as a false color binary .ppm, from blue
+// (cheap) to red (maxCost and up, or the most expensive pixel if 0)
+bool WriteBvhHeatmap(const std::wstring& file, const std::vector<float>& costs, unsigned int width, unsigned int height, float maxCost = 0);
@@ -0,0 +1,230 @@
+#include "BvhStream.h"
+#include "ThreadPool.h"
+
+#include <chrono>
+#include <cmath>
+
+using namespace DirectX;
+
+// Bits per radix sort pass (three passes cover a 30-bit key)
+#define BVH_STREAM_SORT_BITS 10
+
+static_assert(BVH_STREAM_GRID_BITS * 3 + 3 <= BVH_STREAM_SORT_BITS * 3, "Stream keys need to fit in three sort passes");
+
+// --------------------------------------------------------
+// Spreads the low 10 bits of a value out to every third bit
+// --------------------------------------------------------
+static inline uint32_t SpreadBits(uint32_t value)
+{
+	value &= 0x3FF;
+	value = (value | (value << 16)) & 0x030000FF;
+	value = (value | (value << 8)) & 0x0300F00F;
+	value = (value | (value << 4)) & 0x030C30C3;
+	value = (value | (value << 2)) & 0x09249249;
+	return value;
+}
+
+// --------------------------------------------------------
+// Which of the eight octants a direction points into (a bit
+// per negative axis, counting -0 as negative, the same way
+// traversal picks each axis' near plane)
+// --------------------------------------------------------
+static inline uint32_t GetOctant(const XMFLOAT3& direction)
+{
+	return
+		(std::signbit(direction.x) ? 4 : 0) |
+		(std::signbit(direction.y) ? 2 : 0) |
+		(std::signbit(direction.z) ? 1 : 0);
+}
+
+
+// --------------------------------------------------------
+// Reserves everything up front, so pushing never allocates
+// --------------------------------------------------------
+BvhRayStream::BvhRayStream(size_t capacity) :
+	capacity(capacity),
+	stats{}
+{
+	rays.reserve(capacity);
+	ids.reserve(capacity);
+	hits.reserve(capacity);
+	order.reserve(capacity);
+	sortScratch.reserve(capacity);
+}
+
+
+// --------------------------------------------------------
+// Adds a ray to the queue, if there's room
+// --------------------------------------------------------
+bool BvhRayStream::Push(const BvhRay& ray, uint32_t id)
+{
+	if (rays.size() >= capacity)
+		return false;
+
+	rays.push_back(ray);
+	ids.push_back(id);
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Empties the queue (vectors keep their capacity)
+// --------------------------------------------------------
+void BvhRayStream::Clear()
+{
+	rays.clear();
+	ids.clear();
+	hits.clear();
+	order.clear();
+}
+
+
+// --------------------------------------------------------
+// Traces every queued ray through a scene or a single mesh
+// --------------------------------------------------------
+void BvhRayStream::Trace(const SceneBvh& scene)
+{
+	TraceSorted(scene);
+}
+
+void BvhRayStream::Trace(const Bvh& bvh)
+{
+	TraceSorted(bvh);
+}
+
+
+// --------------------------------------------------------
+// Orders the rays by octant, then by origin along a Morton
+// curve through a grid over all of the origins.  Keys go in
+// the top half of each entry and ray indices in the bottom,
+// so one LSD radix sort over the keys' digits carries the
+// indices along with them.
+// --------------------------------------------------------
+void BvhRayStream::Sort()
+{
+	const size_t count = rays.size();
+	XMVECTOR originMin = XMVectorReplicate(FLT_MAX);
+	XMVECTOR originMax = XMVectorReplicate(-FLT_MAX);
+	for (const BvhRay& ray : rays)
+	{
+		XMVECTOR origin = XMLoadFloat3(&ray.Origin);
+		originMin = XMVectorMin(originMin, origin);
+		originMax = XMVectorMax(originMax, origin);
+	}
+
+	// Cells per unit along each axis (flat axes all land in cell 0)
+	const float cells = (float)(1 << BVH_STREAM_GRID_BITS);
+	XMVECTOR extent = XMVectorSubtract(originMax, originMin);
+	XMVECTOR scale = XMVectorSelect(
+		XMVectorDivide(XMVectorReplicate(cells - 1), extent),
+		XMVectorZero(),
+		XMVectorLessOrEqual(extent, XMVectorZero()));
+
+	order.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		XMFLOAT3 cell;
+		XMStoreFloat3(&cell, XMVectorMultiply(XMVectorSubtract(XMLoadFloat3(&rays[i].Origin), originMin), scale));
+		uint32_t key =
+			(GetOctant(rays[i].Direction) << (BVH_STREAM_GRID_BITS * 3)) |
+			(SpreadBits((uint32_t)cell.x) << 2) |
+			(SpreadBits((uint32_t)cell.y) << 1) |
+			SpreadBits((uint32_t)cell.z);
+		order[i] = ((uint64_t)key << 32) | i;
+	}
+
+	// All three digits are counted in one pass
+	const uint32_t digits = 1u << BVH_STREAM_SORT_BITS;
+	uint32_t offsets[3][1u << BVH_STREAM_SORT_BITS] = {};
+	for (uint64_t entry : order)
+	{
+		for (int pass = 0; pass < 3; pass++)
+			offsets[pass][(entry >> (32 + pass * BVH_STREAM_SORT_BITS)) & (digits - 1)]++;
+	}
+
+	sortScratch.resize(count);
+	for (int pass = 0; pass < 3; pass++)
+	{
+		// Passes where every key has the same digit change nothing
+		uint32_t total = 0;
+		bool sameForAll = false;
+		for (uint32_t digit = 0; digit < digits; digit++)
+		{
+			uint32_t digitCount = offsets[pass][digit];
+			sameForAll |= digitCount == count;
+			offsets[pass][digit] = total;
+			total += digitCount;
+		}
+		if (sameForAll)
+			continue;
+
+		unsigned int shift = 32 + pass * BVH_STREAM_SORT_BITS;
+		for (uint64_t entry : order)
+			sortScratch[offsets[pass][(entry >> shift) & (digits - 1)]++] = entry;
+		order.swap(sortScratch);
+	}
+}
+
+
+// --------------------------------------------------------
+// Sorts the rays, then traces them in batches across the
+// thread pool.  Within a batch, runs of up to a packet's
+// worth of rays in the same octant go through as a packet.
+// --------------------------------------------------------
+template<typename Tree>
+void BvhRayStream::TraceSorted(const Tree& tree)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const size_t count = rays.size();
+	stats = {};
+	stats.RayCount = (uint32_t)count;
+	hits.resize(count);
+
+	Sort();
+	std::chrono::steady_clock::time_point sorted = std::chrono::steady_clock::now();
+
+	const uint32_t octantShift = 32 + BVH_STREAM_GRID_BITS * 3;
+	size_t batchCount = (count + BVH_STREAM_BATCH_SIZE - 1) / BVH_STREAM_BATCH_SIZE;
+	std::vector<BvhStreamStats> batchStats(batchCount, BvhStreamStats{});
+	ThreadPool::GetInstance().ParallelFor(batchCount, [&](size_t batch)
+		{
+			BvhRayPacket packet;
+			BvhPacketHit packetHit;
+			size_t end = (std::min)(count, (batch + 1) * BVH_STREAM_BATCH_SIZE);
+			size_t i = batch * BVH_STREAM_BATCH_SIZE;
+			while (i < end)
+			{
+				// Gather a run of rays heading into the same octant
+				uint64_t octant = order[i] >> octantShift;
+				packet.Count = 0;
+				for (; i < end && packet.Count < BVH_PACKET_SIZE && (order[i] >> octantShift) == octant; i++)
+					packet.SetRay(packet.Count++, rays[(uint32_t)order[i]]);
+
+				uint32_t hitLanes = IntersectBvhPacket(tree, packet, packetHit);
+				for (unsigned int lane = 0; lane < packet.Count; lane++)
+				{
+					SceneBvhHit& hit = hits[(uint32_t)order[i - packet.Count + lane]];
+					hit.T = packetHit.T[lane];
+					hit.U = packetHit.U[lane];
+					hit.V = packetHit.V[lane];
+					hit.TriangleIndex = packetHit.TriangleIndex[lane];
+					hit.InstanceIndex = packetHit.InstanceIndex[lane];
+				}
+
+				BvhStreamStats& counts = batchStats[batch];
+				for (uint32_t lanes = hitLanes; lanes; lanes &= lanes - 1)
+					counts.HitCount++;
+				counts.PacketRays += packet.Count >= BVH_PACKET_MIN_RAYS ? packet.Count : 0;
+			}
+		});
+
+	for (const BvhStreamStats& counts : batchStats)
+	{
+		stats.HitCount += counts.HitCount;
+		stats.PacketRays += counts.PacketRays;
+	}
+
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	stats.SortTimeMs = std::chrono::duration<double, std::milli>(sorted - start).count();
+	stats.TraceTimeMs = std::chrono::duration<double, std::milli>(end - sorted).count();
+}
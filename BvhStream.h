@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Bvh.h"
+#include "BvhPacket.h"
+#include "SceneBvh.h"
+
+// Rays a stream holds unless told otherwise (72 bytes each,
+// counting hits and sorting space, so 18 MB)
+#define BVH_STREAM_DEFAULT_CAPACITY (1 << 18)
+
+// Ray origins are binned into a grid with 2^this many cells
+// along each axis (so the cell's Morton code, plus three bits
+// for the direction's octant, fits in 30 bits)
+#define BVH_STREAM_GRID_BITS 9
+
+// Sorted rays are traced in batches of this many per job
+#define BVH_STREAM_BATCH_SIZE 4096
+
+// --------------------------------------------------------
+// How tracing a stream's rays went
+// --------------------------------------------------------
+struct BvhStreamStats
+{
+	uint32_t RayCount;
+	uint32_t HitCount;
+	uint32_t PacketRays;	// Rays that went through as part of a packet
+	double SortTimeMs;
+	double TraceTimeMs;		// Just tracing, after sorting
+};
+
+// --------------------------------------------------------
+// A queue of incoherent rays (bounces, shadows, and so on)
+// traced all at once, wavefront style, instead of one at a
+// time as they're made.  Before tracing, rays are sorted by
+// the octant their direction points into, then by where
+// their origins are (along a Morton curve through a grid
+// over every origin), so that rays next to each other in
+// the queue start close together, head the same general way,
+// and mostly visit the same nodes.  Sorted runs of rays are
+// then traced as packets, which never split apart for
+// pointing different ways, and batches of runs are spread
+// across the thread pool.
+//
+// The queue never grows past its capacity (Push says when
+// it's full, so the caller can trace what's there and carry
+// on), and its memory is kept across Clear() calls, so a
+// stream can be reused every bounce of every frame without
+// allocating.
+// --------------------------------------------------------
+class BvhRayStream
+{
+public:
+	BvhRayStream(size_t capacity = BVH_STREAM_DEFAULT_CAPACITY);
+
+	// Queues a ray with an id of the caller's choosing (a pixel or
+	// path index, say), returning false (and dropping it) if full
+	bool Push(const BvhRay& ray, uint32_t id);
+
+	// Sorts and traces every queued ray.  Hits stay in the order
+	// the rays were pushed.
+	void Trace(const SceneBvh& scene);
+	void Trace(const Bvh& bvh);
+
+	// Empties the queue, keeping its memory
+	void Clear();
+
+	size_t GetCount() const { return rays.size(); }
+	size_t GetCapacity() const { return capacity; }
+	bool IsFull() const { return rays.size() >= capacity; }
+
+	// The queued rays and their ids, and after tracing, their hits
+	// (the scene's, or for a single mesh InstanceIndex is BVH_NO_HIT)
+	const std::vector<BvhRay>& GetRays() const { return rays; }
+	const std::vector<uint32_t>& GetIds() const { return ids; }
+	const std::vector<SceneBvhHit>& GetHits() const { return hits; }
+	const BvhStreamStats& GetStats() const { return stats; }
+
+private:
+	size_t capacity;
+
+	std::vector<BvhRay> rays;
+	std::vector<uint32_t> ids;
+	std::vector<SceneBvhHit> hits;
+
+	// Sorting space: each ray's key (in the top half) and index,
+	// which end up in the order the rays get traced in
+	std::vector<uint64_t> order;
+	std::vector<uint64_t> sortScratch;
+
+	BvhStreamStats stats;
+
+	void Sort();
+
+	template<typename Tree>
+	void TraceSorted(const Tree& tree);
+};
@@ -0,0 +1,399 @@
+#include "BvhWatertight.h"
+#include "Bvh8.h"
+
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include <emmintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace DirectX;
+
+static_assert(sizeof(BvhTriangle4) == 160, "BvhTriangle4 should be tightly packed");
+
+// --------------------------------------------------------
+// Index of the lowest set bit (mask must not be zero)
+// --------------------------------------------------------
+static inline unsigned int LowestBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// --------------------------------------------------------
+// Picks the fastest kernel this CPU supports
+// --------------------------------------------------------
+BvhWatertight::BvhWatertight() :
+	kernel(Bvh8::IsAvx2Supported() ? BvhWatertightKernel::Avx2 : BvhWatertightKernel::Sse)
+{
+}
+
+
+// --------------------------------------------------------
+// Switches kernels, ignoring AVX2 if it isn't supported
+// --------------------------------------------------------
+void BvhWatertight::SetKernel(BvhWatertightKernel newKernel)
+{
+	kernel = newKernel == BvhWatertightKernel::Avx2 && !Bvh8::IsAvx2Supported() ? BvhWatertightKernel::Sse : newKernel;
+}
+
+
+// --------------------------------------------------------
+// Copies a binary tree's nodes, and packs each leaf's
+// triangles (already in leaf order) into groups of four,
+// pointing the leaf at its first group instead
+// --------------------------------------------------------
+void BvhWatertight::Build(const Bvh& bvh)
+{
+	BvhArray<BvhNode> binaryNodes = bvh.GetNodes();
+	BvhArray<BvhTriangle> binaryTriangles = bvh.GetTriangles();
+	BvhArray<uint32_t> binaryIndices = bvh.GetTriangleIndices();
+	nodes.clear();
+	triangles.clear();
+
+	// Box trees have nothing to test
+	if (binaryNodes.empty() || binaryTriangles.empty())
+		return;
+
+	nodes.assign(binaryNodes.begin(), binaryNodes.end());
+	size_t groupCount = 0;
+	for (const BvhNode& node : nodes)
+	{
+		if (node.IsLeaf())
+			groupCount += (node.TriangleCount + BVH_TRIANGLE4_WIDTH - 1) / BVH_TRIANGLE4_WIDTH;
+	}
+	triangles.reserve(groupCount);
+
+	const float empty = std::numeric_limits<float>::quiet_NaN();
+	for (BvhNode& node : nodes)
+	{
+		if (!node.IsLeaf())
+			continue;
+
+		uint32_t binaryFirst = node.LeftFirst;
+		node.LeftFirst = (uint32_t)triangles.size();
+		for (uint32_t i = 0; i < node.TriangleCount; i += BVH_TRIANGLE4_WIDTH)
+		{
+			BvhTriangle4 group;
+			for (uint32_t lane = 0; lane < BVH_TRIANGLE4_WIDTH; lane++)
+			{
+				bool used = i + lane < node.TriangleCount;
+				const BvhTriangle& triangle = binaryTriangles[used ? binaryFirst + i + lane : binaryFirst];
+				const XMFLOAT3* vertices[3] = { &triangle.V0, &triangle.V1, &triangle.V2 };
+				float(*groupVertices[3])[BVH_TRIANGLE4_WIDTH] = { group.V0, group.V1, group.V2 };
+				for (int v = 0; v < 3; v++)
+				{
+					groupVertices[v][0][lane] = used ? vertices[v]->x : empty;
+					groupVertices[v][1][lane] = used ? vertices[v]->y : empty;
+					groupVertices[v][2][lane] = used ? vertices[v]->z : empty;
+				}
+				group.TriangleIndex[lane] = used ? binaryIndices[binaryFirst + i + lane] : BVH_NO_HIT;
+			}
+			triangles.push_back(group);
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Finds the closest hit along a ray with the current kernel
+// --------------------------------------------------------
+bool BvhWatertight::Intersect(const BvhRay& ray, BvhHit& hit) const
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+	if (nodes.empty())
+		return false;
+
+	BvhWatertightRay prepared;
+	PrepareBvhWatertightRay(ray, prepared);
+
+	void (*leafKernel)(const BvhTriangle4*, uint32_t, uint32_t, const BvhWatertightRay&, BvhHit&) =
+		kernel == BvhWatertightKernel::Avx2 ? IntersectBvhTriangle4Avx2 :
+		kernel == BvhWatertightKernel::Sse ? IntersectBvhTriangle4Sse :
+		IntersectBvhTriangle4Scalar;
+
+	// Boxes need to be just as careful as the triangles, or a ray
+	// down a shared edge could still slip between two leaves
+	const BvhTriangle4* groups = triangles.data();
+	TraverseBvh<true>(nodes.data(), ray, hit.T, [&](uint32_t first, uint32_t count)
+		{
+			leafKernel(groups, first, count, prepared, hit);
+			return true;
+		});
+
+	return hit.TriangleIndex != BVH_NO_HIT;
+}
+
+
+// --------------------------------------------------------
+// Bytes used by the nodes and triangles
+// --------------------------------------------------------
+size_t BvhWatertight::GetMemorySize() const
+{
+	return nodes.size() * sizeof(BvhNode) + triangles.size() * sizeof(BvhTriangle4);
+}
+
+
+// --------------------------------------------------------
+// Picks the axis the ray mostly points along as z (so the
+// shear never divides by something tiny), and the other two
+// as x and y, swapped for rays pointing down -z so triangles
+// keep their winding
+// --------------------------------------------------------
+void PrepareBvhWatertightRay(const BvhRay& ray, BvhWatertightRay& prepared)
+{
+	const float* origin = &ray.Origin.x;
+	const float* dir = &ray.Direction.x;
+	float absX = fabsf(dir[0]);
+	float absY = fabsf(dir[1]);
+	float absZ = fabsf(dir[2]);
+
+	uint32_t kz = absX >= absY ? (absX >= absZ ? 0 : 2) : (absY >= absZ ? 1 : 2);
+	uint32_t kx = (kz + 1) % 3;
+	uint32_t ky = (kx + 1) % 3;
+	if (dir[kz] < 0)
+		std::swap(kx, ky);
+
+	prepared.Axis[0] = kx;
+	prepared.Axis[1] = ky;
+	prepared.Axis[2] = kz;
+	prepared.Origin[0] = origin[kx];
+	prepared.Origin[1] = origin[ky];
+	prepared.Origin[2] = origin[kz];
+	prepared.ShearX = dir[kx] / dir[kz];
+	prepared.ShearY = dir[ky] / dir[kz];
+	prepared.ShearZ = 1.0f / dir[kz];
+	prepared.TMin = ray.TMin;
+}
+
+
+// --------------------------------------------------------
+// The watertight test, one triangle at a time.  Vertices
+// are moved so the ray starts at the origin and sheared so
+// it runs down +z, and then the ray is inside the triangle
+// if the three edge functions (twice the signed areas of
+// the 2D triangles it makes with each edge) agree in sign.
+// Distance is only divided out once the hit is known to be
+// in range.
+//
+// The SIMD kernels do exactly the same math in exactly the
+// same order.
+// --------------------------------------------------------
+bool IntersectTriangleWatertight(
+	const BvhWatertightRay& ray,
+	const XMFLOAT3& v0,
+	const XMFLOAT3& v1,
+	const XMFLOAT3& v2,
+	float tMax,
+	float& t,
+	float& u,
+	float& v)
+{
+	const float* p0 = &v0.x;
+	const float* p1 = &v1.x;
+	const float* p2 = &v2.x;
+	const uint32_t kx = ray.Axis[0];
+	const uint32_t ky = ray.Axis[1];
+	const uint32_t kz = ray.Axis[2];
+
+	float az = p0[kz] - ray.Origin[2];
+	float bz = p1[kz] - ray.Origin[2];
+	float cz = p2[kz] - ray.Origin[2];
+	float ax = (p0[kx] - ray.Origin[0]) - ray.ShearX * az;
+	float ay = (p0[ky] - ray.Origin[1]) - ray.ShearY * az;
+	float bx = (p1[kx] - ray.Origin[0]) - ray.ShearX * bz;
+	float by = (p1[ky] - ray.Origin[1]) - ray.ShearY * bz;
+	float cx = (p2[kx] - ray.Origin[0]) - ray.ShearX * cz;
+	float cy = (p2[ky] - ray.Origin[1]) - ray.ShearY * cz;
+
+	float edgeU = cx * by - cy * bx;
+	float edgeV = ax * cy - ay * cx;
+	float edgeW = bx * ay - by * ax;
+	if (edgeU == 0 || edgeV == 0 || edgeW == 0)
+		RefineBvhWatertightEdges(ax, ay, bx, by, cx, cy, edgeU, edgeV, edgeW);
+
+	// Front or back facing, but not straddling an edge (NaNs fail both)
+	bool inside =
+		(edgeU >= 0 && edgeV >= 0 && edgeW >= 0) ||
+		(edgeU <= 0 && edgeV <= 0 && edgeW <= 0);
+	float det = edgeU + edgeV + edgeW;
+	if (!inside || det == 0)
+		return false;
+
+	float scaledT =
+		edgeU * (ray.ShearZ * az) +
+		edgeV * (ray.ShearZ * bz) +
+		edgeW * (ray.ShearZ * cz);
+
+	// Flip everything to a positive determinant
+	if (det < 0)
+	{
+		det = -det;
+		scaledT = -scaledT;
+		edgeV = -edgeV;
+		edgeW = -edgeW;
+	}
+	if (!(scaledT >= ray.TMin * det && scaledT < tMax * det))
+		return false;
+
+	float invDet = 1.0f / det;
+	t = scaledT * invDet;
+	u = edgeV * invDet;
+	v = edgeW * invDet;
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Reference kernel: the leaf's triangles one at a time
+// --------------------------------------------------------
+void IntersectBvhTriangle4Scalar(const BvhTriangle4* triangles, uint32_t first, uint32_t count, const BvhWatertightRay& ray, BvhHit& hit)
+{
+	const float tMax = hit.T;
+	bool found = false;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const BvhTriangle4& group = triangles[first + i / BVH_TRIANGLE4_WIDTH];
+		uint32_t lane = i % BVH_TRIANGLE4_WIDTH;
+		XMFLOAT3 v0(group.V0[0][lane], group.V0[1][lane], group.V0[2][lane]);
+		XMFLOAT3 v1(group.V1[0][lane], group.V1[1][lane], group.V1[2][lane]);
+		XMFLOAT3 v2(group.V2[0][lane], group.V2[1][lane], group.V2[2][lane]);
+
+		float t, u, v;
+		if (!IntersectTriangleWatertight(ray, v0, v1, v2, tMax, t, u, v))
+			continue;
+		if (found && !(t < hit.T))
+			continue;
+
+		found = true;
+		hit.T = t;
+		hit.U = u;
+		hit.V = v;
+		hit.TriangleIndex = group.TriangleIndex[lane];
+	}
+}
+
+
+// --------------------------------------------------------
+// SSE kernel: a group of four triangles at a time.  Lanes
+// where an edge function comes out zero are redone in
+// double precision, a lane at a time (this is rare).
+// --------------------------------------------------------
+void IntersectBvhTriangle4Sse(const BvhTriangle4* triangles, uint32_t first, uint32_t count, const BvhWatertightRay& ray, BvhHit& hit)
+{
+	const uint32_t kx = ray.Axis[0];
+	const uint32_t ky = ray.Axis[1];
+	const uint32_t kz = ray.Axis[2];
+	const __m128 originX = _mm_set1_ps(ray.Origin[0]);
+	const __m128 originY = _mm_set1_ps(ray.Origin[1]);
+	const __m128 originZ = _mm_set1_ps(ray.Origin[2]);
+	const __m128 shearX = _mm_set1_ps(ray.ShearX);
+	const __m128 shearY = _mm_set1_ps(ray.ShearY);
+	const __m128 shearZ = _mm_set1_ps(ray.ShearZ);
+	const __m128 tMin = _mm_set1_ps(ray.TMin);
+	const __m128 tMax = _mm_set1_ps(hit.T);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	const __m128 infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+	bool found = false;
+	uint32_t groupCount = (count + BVH_TRIANGLE4_WIDTH - 1) / BVH_TRIANGLE4_WIDTH;
+	for (uint32_t g = first; g < first + groupCount; g++)
+	{
+		const BvhTriangle4& group = triangles[g];
+		__m128 az = _mm_sub_ps(_mm_load_ps(group.V0[kz]), originZ);
+		__m128 bz = _mm_sub_ps(_mm_load_ps(group.V1[kz]), originZ);
+		__m128 cz = _mm_sub_ps(_mm_load_ps(group.V2[kz]), originZ);
+		__m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.V0[kx]), originX), _mm_mul_ps(shearX, az));
+		__m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.V0[ky]), originY), _mm_mul_ps(shearY, az));
+		__m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.V1[kx]), originX), _mm_mul_ps(shearX, bz));
+		__m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.V1[ky]), originY), _mm_mul_ps(shearY, bz));
+		__m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.V2[kx]), originX), _mm_mul_ps(shearX, cz));
+		__m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.V2[ky]), originY), _mm_mul_ps(shearY, cz));
+
+		__m128 edgeU = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+		__m128 edgeV = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+		__m128 edgeW = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+		__m128 onEdge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(edgeU, zero), _mm_cmpeq_ps(edgeV, zero)), _mm_cmpeq_ps(edgeW, zero));
+		unsigned int refine = (unsigned int)_mm_movemask_ps(onEdge);
+		if (refine)
+		{
+			alignas(16) float lanes[9][BVH_TRIANGLE4_WIDTH];
+			_mm_store_ps(lanes[0], ax);
+			_mm_store_ps(lanes[1], ay);
+			_mm_store_ps(lanes[2], bx);
+			_mm_store_ps(lanes[3], by);
+			_mm_store_ps(lanes[4], cx);
+			_mm_store_ps(lanes[5], cy);
+			_mm_store_ps(lanes[6], edgeU);
+			_mm_store_ps(lanes[7], edgeV);
+			_mm_store_ps(lanes[8], edgeW);
+			for (; refine; refine &= refine - 1)
+			{
+				unsigned int lane = LowestBit(refine);
+				RefineBvhWatertightEdges(
+					lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane], lanes[4][lane], lanes[5][lane],
+					lanes[6][lane], lanes[7][lane], lanes[8][lane]);
+			}
+			edgeU = _mm_load_ps(lanes[6]);
+			edgeV = _mm_load_ps(lanes[7]);
+			edgeW = _mm_load_ps(lanes[8]);
+		}
+
+		__m128 inside = _mm_or_ps(
+			_mm_and_ps(_mm_and_ps(_mm_cmpge_ps(edgeU, zero), _mm_cmpge_ps(edgeV, zero)), _mm_cmpge_ps(edgeW, zero)),
+			_mm_and_ps(_mm_and_ps(_mm_cmple_ps(edgeU, zero), _mm_cmple_ps(edgeV, zero)), _mm_cmple_ps(edgeW, zero)));
+		__m128 det = _mm_add_ps(_mm_add_ps(edgeU, edgeV), edgeW);
+		__m128 valid = _mm_and_ps(inside, _mm_cmpneq_ps(det, zero));
+		if (!_mm_movemask_ps(valid))
+			continue;
+
+		__m128 scaledT = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(edgeU, _mm_mul_ps(shearZ, az)),
+			_mm_mul_ps(edgeV, _mm_mul_ps(shearZ, bz))),
+			_mm_mul_ps(edgeW, _mm_mul_ps(shearZ, cz)));
+
+		__m128 sign = _mm_and_ps(det, signBit);
+		det = _mm_xor_ps(det, sign);
+		scaledT = _mm_xor_ps(scaledT, sign);
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(scaledT, _mm_mul_ps(tMin, det)));
+		valid = _mm_and_ps(valid, _mm_cmplt_ps(scaledT, _mm_mul_ps(tMax, det)));
+		if (!_mm_movemask_ps(valid))
+			continue;
+
+		// The nearest lane, the lowest one on ties
+		__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+		__m128 t = _mm_mul_ps(scaledT, invDet);
+		__m128 nearest = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, infinity));
+		nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+		unsigned int lane = LowestBit((unsigned int)_mm_movemask_ps(_mm_and_ps(valid, _mm_cmpeq_ps(t, nearest))));
+
+		alignas(16) float lanes[3][BVH_TRIANGLE4_WIDTH];
+		_mm_store_ps(lanes[0], t);
+		if (found && !(lanes[0][lane] < hit.T))
+			continue;
+
+		_mm_store_ps(lanes[1], _mm_mul_ps(_mm_xor_ps(edgeV, sign), invDet));
+		_mm_store_ps(lanes[2], _mm_mul_ps(_mm_xor_ps(edgeW, sign), invDet));
+		found = true;
+		hit.T = lanes[0][lane];
+		hit.U = lanes[1][lane];
+		hit.V = lanes[2][lane];
+		hit.TriangleIndex = group.TriangleIndex[lane];
+	}
+}
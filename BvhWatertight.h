@@ -0,0 +1,141 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstdint>
+#include <vector>
+
+#include "Bvh.h"
+
+// Triangles per group, one SSE register's worth (AVX2 tests
+// two groups at once)
+#define BVH_TRIANGLE4_WIDTH 4
+
+// --------------------------------------------------------
+// Four of a leaf's triangles in SoA form, one array per
+// vertex component, so a single SSE instruction works on
+// the same component of all four.  Each triangle carries
+// its own original index, so hits need nothing else.
+// Empty lanes (in a leaf's last group) have NaN vertices,
+// which never hit anything.  160 bytes each.
+// --------------------------------------------------------
+struct alignas(16) BvhTriangle4
+{
+	float V0[3][BVH_TRIANGLE4_WIDTH];	// x, y and z of each triangle's first vertex
+	float V1[3][BVH_TRIANGLE4_WIDTH];
+	float V2[3][BVH_TRIANGLE4_WIDTH];
+	uint32_t TriangleIndex[BVH_TRIANGLE4_WIDTH];	// Triangle in the original index buffer, or BVH_NO_HIT
+};
+
+// --------------------------------------------------------
+// A ray set up for watertight triangle tests, once per ray:
+// the axis it mostly points along becomes z, and the shear
+// that turns it into the +z axis (see PrepareBvhWatertightRay)
+// --------------------------------------------------------
+struct BvhWatertightRay
+{
+	uint32_t Axis[3];	// Which of the ray's axes become x, y and z
+	float Origin[3];	// The origin, in that order
+	float ShearX;
+	float ShearY;
+	float ShearZ;
+	float TMin;
+};
+
+// Which code tests the triangles
+enum class BvhWatertightKernel
+{
+	Scalar,
+	Sse,
+	Avx2
+};
+
+// --------------------------------------------------------
+// A binary tree (the same nodes as the Bvh it came from)
+// whose leaves' triangles are repacked into BvhTriangle4
+// groups, and tested with the watertight algorithm from
+// Woop, Benthin and Wald's "Watertight Ray/Triangle
+// Intersection": each ray is sheared and scaled so it runs
+// straight down +z from the origin, which turns the triangle
+// test into 2D edge functions.  A ray that hits an edge or
+// vertex shared by two triangles always hits at least one of
+// them (which Moller-Trumbore, with its separately rounded
+// barycentrics, can't promise), so closed meshes never leak.
+//
+// The SIMD kernels test four (SSE) or eight (AVX2) triangles
+// at once and give exactly the same hits as the scalar one,
+// which stays around as the reference.  Hits agree with the
+// binary tree's (Moller-Trumbore) ones to within rounding,
+// apart from rays that graze an edge.
+//
+// Leaves are padded out to whole groups, so the triangles
+// take more memory than the binary tree's (more so with
+// small leaves).
+// --------------------------------------------------------
+class BvhWatertight
+{
+public:
+	BvhWatertight();
+
+	// Repacks a binary tree over triangles (which can be thrown
+	// away afterwards)
+	void Build(const Bvh& bvh);
+
+	// Finds the closest hit along a ray, returning false on a miss
+	bool Intersect(const BvhRay& ray, BvhHit& hit) const;
+
+	bool IsEmpty() const { return nodes.empty(); }
+	size_t GetMemorySize() const;
+
+	// Can force a slower kernel (AVX2 is only used if supported)
+	void SetKernel(BvhWatertightKernel newKernel);
+	BvhWatertightKernel GetKernel() const { return kernel; }
+
+	// Nodes (the root is first), where each leaf's LeftFirst is its
+	// first group of triangles, and the groups in leaf order
+	const std::vector<BvhNode>& GetNodes() const { return nodes; }
+	const std::vector<BvhTriangle4>& GetTriangles() const { return triangles; }
+
+private:
+	std::vector<BvhNode> nodes;
+	std::vector<BvhTriangle4> triangles;
+
+	BvhWatertightKernel kernel;
+};
+
+// Sets up a ray for the watertight tests
+void PrepareBvhWatertightRay(const BvhRay& ray, BvhWatertightRay& prepared);
+
+// The reference test for a single triangle: whether the ray hits it
+// at T in [TMin, tMax), with barycentrics of the second and third
+// vertices (like BvhHit)
+bool IntersectTriangleWatertight(
+	const BvhWatertightRay& ray,
+	const DirectX::XMFLOAT3& v0,
+	const DirectX::XMFLOAT3& v1,
+	const DirectX::XMFLOAT3& v2,
+	float tMax,
+	float& t,
+	float& u,
+	float& v);
+
+// --------------------------------------------------------
+// Redoes a triangle's edge functions in double precision,
+// for when any of them comes out exactly zero in float (so
+// whether the ray is on an edge, or just beside it, is
+// decided exactly).  Shared by every kernel.
+// --------------------------------------------------------
+inline void RefineBvhWatertightEdges(float ax, float ay, float bx, float by, float cx, float cy, float& edgeU, float& edgeV, float& edgeW)
+{
+	edgeU = (float)((double)cx * by - (double)cy * bx);
+	edgeV = (float)((double)ax * cy - (double)ay * cx);
+	edgeW = (float)((double)bx * ay - (double)by * ax);
+}
+
+// Tests a leaf's count triangles, in the groups starting at first,
+// against a ray, keeping the closest hit.  Every triangle is checked
+// against the hit from before the leaf, and the closest of them wins
+// (the earliest on ties), so all three kernels agree exactly.  The
+// AVX2 one must only be called when Bvh8::IsAvx2Supported() says so.
+void IntersectBvhTriangle4Scalar(const BvhTriangle4* triangles, uint32_t first, uint32_t count, const BvhWatertightRay& ray, BvhHit& hit);
+void IntersectBvhTriangle4Sse(const BvhTriangle4* triangles, uint32_t first, uint32_t count, const BvhWatertightRay& ray, BvhHit& hit);
+void IntersectBvhTriangle4Avx2(const BvhTriangle4* triangles, uint32_t first, uint32_t count, const BvhWatertightRay& ray, BvhHit& hit);
@@ -0,0 +1,169 @@
+#include "BvhWatertight.h"
+
+#include <limits>
+
+#include <immintrin.h>
+
+// MSVC allows AVX2 intrinsics anywhere, while GCC and Clang
+// need each function using them marked.  Unlike the BVH8
+// kernels, this leaves FMA out on purpose: GCC and Clang
+// would otherwise fuse the edge functions' multiplies and
+// subtracts, and the two triangles on either side of an edge
+// would no longer get exactly opposite edge functions (or
+// the same hits as the scalar kernel).
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BVH_WATERTIGHT_AVX2
+#else
+#define BVH_WATERTIGHT_AVX2 __attribute__((target("avx2")))
+#endif
+
+// --------------------------------------------------------
+// Index of the lowest set bit (mask must not be zero)
+// --------------------------------------------------------
+static inline unsigned int LowestBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// --------------------------------------------------------
+// Two groups' worth of one vertex component in one register
+// --------------------------------------------------------
+static BVH_WATERTIGHT_AVX2 inline __m256 LoadPair(const float* low, const float* high)
+{
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(low)), _mm_load_ps(high), 1);
+}
+
+// --------------------------------------------------------
+// AVX2 kernel: the same math as the SSE one, over two groups
+// (eight triangles) at a time.  A leaf with an odd number of
+// groups tests its last one alone, with the upper half of
+// every register masked off.
+// --------------------------------------------------------
+BVH_WATERTIGHT_AVX2 void IntersectBvhTriangle4Avx2(const BvhTriangle4* triangles, uint32_t first, uint32_t count, const BvhWatertightRay& ray, BvhHit& hit)
+{
+	const uint32_t kx = ray.Axis[0];
+	const uint32_t ky = ray.Axis[1];
+	const uint32_t kz = ray.Axis[2];
+	const __m256 originX = _mm256_set1_ps(ray.Origin[0]);
+	const __m256 originY = _mm256_set1_ps(ray.Origin[1]);
+	const __m256 originZ = _mm256_set1_ps(ray.Origin[2]);
+	const __m256 shearX = _mm256_set1_ps(ray.ShearX);
+	const __m256 shearY = _mm256_set1_ps(ray.ShearY);
+	const __m256 shearZ = _mm256_set1_ps(ray.ShearZ);
+	const __m256 tMin = _mm256_set1_ps(ray.TMin);
+	const __m256 tMax = _mm256_set1_ps(hit.T);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 signBit = _mm256_set1_ps(-0.0f);
+	const __m256 infinity = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+	const __m256 lowHalf = _mm256_castsi256_ps(_mm256_setr_epi32(-1, -1, -1, -1, 0, 0, 0, 0));
+
+	bool found = false;
+	uint32_t groupCount = (count + BVH_TRIANGLE4_WIDTH - 1) / BVH_TRIANGLE4_WIDTH;
+	for (uint32_t g = first; g < first + groupCount; g += 2)
+	{
+		const BvhTriangle4& low = triangles[g];
+		bool pair = g + 1 < first + groupCount;
+		const BvhTriangle4& high = pair ? triangles[g + 1] : low;
+
+		__m256 az = _mm256_sub_ps(LoadPair(low.V0[kz], high.V0[kz]), originZ);
+		__m256 bz = _mm256_sub_ps(LoadPair(low.V1[kz], high.V1[kz]), originZ);
+		__m256 cz = _mm256_sub_ps(LoadPair(low.V2[kz], high.V2[kz]), originZ);
+		__m256 ax = _mm256_sub_ps(_mm256_sub_ps(LoadPair(low.V0[kx], high.V0[kx]), originX), _mm256_mul_ps(shearX, az));
+		__m256 ay = _mm256_sub_ps(_mm256_sub_ps(LoadPair(low.V0[ky], high.V0[ky]), originY), _mm256_mul_ps(shearY, az));
+		__m256 bx = _mm256_sub_ps(_mm256_sub_ps(LoadPair(low.V1[kx], high.V1[kx]), originX), _mm256_mul_ps(shearX, bz));
+		__m256 by = _mm256_sub_ps(_mm256_sub_ps(LoadPair(low.V1[ky], high.V1[ky]), originY), _mm256_mul_ps(shearY, bz));
+		__m256 cx = _mm256_sub_ps(_mm256_sub_ps(LoadPair(low.V2[kx], high.V2[kx]), originX), _mm256_mul_ps(shearX, cz));
+		__m256 cy = _mm256_sub_ps(_mm256_sub_ps(LoadPair(low.V2[ky], high.V2[ky]), originY), _mm256_mul_ps(shearY, cz));
+
+		__m256 edgeU = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+		__m256 edgeV = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+		__m256 edgeW = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+		__m256 onEdge = _mm256_or_ps(_mm256_or_ps(
+			_mm256_cmp_ps(edgeU, zero, _CMP_EQ_OQ),
+			_mm256_cmp_ps(edgeV, zero, _CMP_EQ_OQ)),
+			_mm256_cmp_ps(edgeW, zero, _CMP_EQ_OQ));
+		unsigned int refine = (unsigned int)_mm256_movemask_ps(onEdge) & (pair ? 0xFF : 0x0F);
+		if (refine)
+		{
+			alignas(32) float lanes[9][2 * BVH_TRIANGLE4_WIDTH];
+			_mm256_store_ps(lanes[0], ax);
+			_mm256_store_ps(lanes[1], ay);
+			_mm256_store_ps(lanes[2], bx);
+			_mm256_store_ps(lanes[3], by);
+			_mm256_store_ps(lanes[4], cx);
+			_mm256_store_ps(lanes[5], cy);
+			_mm256_store_ps(lanes[6], edgeU);
+			_mm256_store_ps(lanes[7], edgeV);
+			_mm256_store_ps(lanes[8], edgeW);
+			for (; refine; refine &= refine - 1)
+			{
+				unsigned int lane = LowestBit(refine);
+				RefineBvhWatertightEdges(
+					lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane], lanes[4][lane], lanes[5][lane],
+					lanes[6][lane], lanes[7][lane], lanes[8][lane]);
+			}
+			edgeU = _mm256_load_ps(lanes[6]);
+			edgeV = _mm256_load_ps(lanes[7]);
+			edgeW = _mm256_load_ps(lanes[8]);
+		}
+
+		__m256 inside = _mm256_or_ps(
+			_mm256_and_ps(_mm256_and_ps(
+				_mm256_cmp_ps(edgeU, zero, _CMP_GE_OQ),
+				_mm256_cmp_ps(edgeV, zero, _CMP_GE_OQ)),
+				_mm256_cmp_ps(edgeW, zero, _CMP_GE_OQ)),
+			_mm256_and_ps(_mm256_and_ps(
+				_mm256_cmp_ps(edgeU, zero, _CMP_LE_OQ),
+				_mm256_cmp_ps(edgeV, zero, _CMP_LE_OQ)),
+				_mm256_cmp_ps(edgeW, zero, _CMP_LE_OQ)));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(edgeU, edgeV), edgeW);
+		__m256 valid = _mm256_and_ps(inside, _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+		if (!pair)
+			valid = _mm256_and_ps(valid, lowHalf);
+		if (!_mm256_movemask_ps(valid))
+			continue;
+
+		__m256 scaledT = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(edgeU, _mm256_mul_ps(shearZ, az)),
+			_mm256_mul_ps(edgeV, _mm256_mul_ps(shearZ, bz))),
+			_mm256_mul_ps(edgeW, _mm256_mul_ps(shearZ, cz)));
+
+		__m256 sign = _mm256_and_ps(det, signBit);
+		det = _mm256_xor_ps(det, sign);
+		scaledT = _mm256_xor_ps(scaledT, sign);
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(scaledT, _mm256_mul_ps(tMin, det), _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(scaledT, _mm256_mul_ps(tMax, det), _CMP_LT_OQ));
+		if (!_mm256_movemask_ps(valid))
+			continue;
+
+		// The nearest lane, the lowest one on ties (so the first group wins)
+		__m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+		__m256 t = _mm256_mul_ps(scaledT, invDet);
+		__m256 nearest = _mm256_blendv_ps(infinity, t, valid);
+		nearest = _mm256_min_ps(nearest, _mm256_permute_ps(nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		nearest = _mm256_min_ps(nearest, _mm256_permute_ps(nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+		nearest = _mm256_min_ps(nearest, _mm256_permute2f128_ps(nearest, nearest, 0x01));
+		unsigned int lane = LowestBit((unsigned int)_mm256_movemask_ps(_mm256_and_ps(valid, _mm256_cmp_ps(t, nearest, _CMP_EQ_OQ))));
+
+		alignas(32) float lanes[3][2 * BVH_TRIANGLE4_WIDTH];
+		_mm256_store_ps(lanes[0], t);
+		if (found && !(lanes[0][lane] < hit.T))
+			continue;
+
+		_mm256_store_ps(lanes[1], _mm256_mul_ps(_mm256_xor_ps(edgeV, sign), invDet));
+		_mm256_store_ps(lanes[2], _mm256_mul_ps(_mm256_xor_ps(edgeW, sign), invDet));
+		found = true;
+		hit.T = lanes[0][lane];
+		hit.U = lanes[1][lane];
+		hit.V = lanes[2][lane];
+		hit.TriangleIndex = (lane < BVH_TRIANGLE4_WIDTH ? low : high).TriangleIndex[lane % BVH_TRIANGLE4_WIDTH];
+	}
+}
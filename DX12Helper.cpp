@@ -78,6 +78,40 @@ void DX12Helper::WaitForGPU()
     }
 }
 
+// --------------------------------------------------------------
+// Starts batching setup work.  Until EndBatch() is called, helpers
+// that would normally execute the command list and wait (like
+// CreateStaticBuffer()) just record their commands instead, so
+// many uploads and BLAS builds cost a single GPU round trip.
+// --------------------------------------------------------------
+void DX12Helper::BeginBatch()
+{
+    batching = true;
+}
+
+// --------------------------------------------------------------
+// Executes everything recorded since BeginBatch(), waits for it
+// to finish and releases any temporary resources it needed
+// --------------------------------------------------------------
+void DX12Helper::EndBatch()
+{
+    if (!batching)
+        return;
+
+    batching = false;
+    CloseExecuteAndResetCommandList();
+    batchResources.clear();
+}
+
+// --------------------------------------------------------------
+// Holds a reference to a resource that recorded (but not yet
+// executed) commands rely on, until the batch ends
+// --------------------------------------------------------------
+void DX12Helper::KeepAliveUntilBatchEnds(Microsoft::WRL::ComPtr<ID3D12Resource> resource)
+{
+    batchResources.push_back(resource);
+}
+
 Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> DX12Helper::GetCBVSRVDescriptorHeap() { return cbvSrvDescriptorHeap; }
 
 // --------------------------------------------------------------
@@ -165,6 +199,27 @@ D3D12_CPU_DESCRIPTOR_HANDLE DX12Helper::LoadTexture(const wchar_t* file, bool ge
     auto finish = upload.End(commandQueue.Get());
     finish.wait();
 
+    return CreateTextureSRV(texture);
+}
+
+// Same as above, but for an image file that's already in memory
+// (like one from an asset pack), so there's no file access at all
+D3D12_CPU_DESCRIPTOR_HANDLE DX12Helper::LoadTexture(const void* data, size_t dataSize, bool generateMips)
+{
+    ResourceUploadBatch upload(device.Get());
+    upload.Begin();
+
+    Microsoft::WRL::ComPtr<ID3D12Resource> texture;
+    CreateWICTextureFromMemory(device.Get(), upload, (const uint8_t*)data, dataSize, texture.GetAddressOf(), generateMips);
+
+    auto finish = upload.End(commandQueue.Get());
+    finish.wait();
+
+    return CreateTextureSRV(texture);
+}
+
+D3D12_CPU_DESCRIPTOR_HANDLE DX12Helper::CreateTextureSRV(Microsoft::WRL::ComPtr<ID3D12Resource> texture)
+{
     // Now that we have the texture, add to our list and make a CPU-side descriptor heap
     // just for this texture's SRV. Note that it would probably be better to put all
     // texture SRVs into the same descriptor heap, bu we don't know how many we'll need
@@ -271,19 +326,80 @@ Microsoft::WRL::ComPtr<ID3D12Resource> DX12Helper::CreateBuffer(
 // --------------------------------------------------------
 void DX12Helper::ReserveSrvUavDescriptorHeapSlot(D3D12_CPU_DESCRIPTOR_HANDLE* reservedCPUHandle, D3D12_GPU_DESCRIPTOR_HANDLE* reservedGPUHandle)
 {
-    // Grab the actual heap start on both sides and offset to the next open SRV/UAV portion
+    ReserveSrvUavDescriptorHeapSlots(1, reservedCPUHandle, reservedGPUHandle);
+}
+
+// --------------------------------------------------------
+// Reserves several consecutive SRV/UAV slots, reusing freed
+// ones when a large enough range is available. Handles are
+// for the first slot in the range.
+// --------------------------------------------------------
+void DX12Helper::ReserveSrvUavDescriptorHeapSlots(unsigned int count, D3D12_CPU_DESCRIPTOR_HANDLE* reservedCPUHandle, D3D12_GPU_DESCRIPTOR_HANDLE* reservedGPUHandle)
+{
+    // Look for a freed range first, and fall back to the next open slots
+    unsigned int slot = srvDescriptorOffset;
+    bool reused = false;
+    for (size_t i = 0; i < freeSrvUavSlots.size(); i++)
+    {
+        if (freeSrvUavSlots[i].second < count)
+            continue;
+
+        slot = freeSrvUavSlots[i].first;
+        freeSrvUavSlots[i].first += count;
+        freeSrvUavSlots[i].second -= count;
+        if (freeSrvUavSlots[i].second == 0)
+            freeSrvUavSlots.erase(freeSrvUavSlots.begin() + i);
+        reused = true;
+        break;
+    }
+
+    // Grab the actual heap start on both sides and offset to the slot
     D3D12_CPU_DESCRIPTOR_HANDLE cpuHandle = cbvSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart();
     D3D12_GPU_DESCRIPTOR_HANDLE gpuHandle = cbvSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart();
 
-    cpuHandle.ptr += (SIZE_T)srvDescriptorOffset * cbvSrvDescriptorHeapIncrementSize;
-    gpuHandle.ptr += (SIZE_T)srvDescriptorOffset * cbvSrvDescriptorHeapIncrementSize;
+    cpuHandle.ptr += (SIZE_T)slot * cbvSrvDescriptorHeapIncrementSize;
+    gpuHandle.ptr += (SIZE_T)slot * cbvSrvDescriptorHeapIncrementSize;
 
     // Set the requested handle(s)
     if (reservedCPUHandle) { *reservedCPUHandle = cpuHandle; }
     if (reservedGPUHandle) { *reservedGPUHandle = gpuHandle; }
 
     // Update the overall offset
-    srvDescriptorOffset++;
+    if (!reused)
+        srvDescriptorOffset += count;
+}
+
+// --------------------------------------------------------
+// Gives back slots from ReserveSrvUavDescriptorHeapSlot(s)
+// so they can be reused. The GPU must be done with them.
+// --------------------------------------------------------
+void DX12Helper::FreeSrvUavDescriptorHeapSlots(D3D12_GPU_DESCRIPTOR_HANDLE firstGPUHandle, unsigned int count)
+{
+    if (count == 0 || firstGPUHandle.ptr == 0)
+        return;
+
+    unsigned int slot = (unsigned int)((firstGPUHandle.ptr -
+        cbvSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart().ptr) / cbvSrvDescriptorHeapIncrementSize);
+
+    // Keep the ranges sorted and merge neighbors, so frees
+    // of small ranges can eventually satisfy larger requests
+    size_t i = 0;
+    while (i < freeSrvUavSlots.size() && freeSrvUavSlots[i].first < slot)
+        i++;
+    freeSrvUavSlots.insert(freeSrvUavSlots.begin() + i, std::make_pair(slot, count));
+
+    if (i + 1 < freeSrvUavSlots.size() &&
+        freeSrvUavSlots[i].first + freeSrvUavSlots[i].second == freeSrvUavSlots[i + 1].first)
+    {
+        freeSrvUavSlots[i].second += freeSrvUavSlots[i + 1].second;
+        freeSrvUavSlots.erase(freeSrvUavSlots.begin() + i + 1);
+    }
+    if (i > 0 &&
+        freeSrvUavSlots[i - 1].first + freeSrvUavSlots[i - 1].second == freeSrvUavSlots[i].first)
+    {
+        freeSrvUavSlots[i - 1].second += freeSrvUavSlots[i].second;
+        freeSrvUavSlots.erase(freeSrvUavSlots.begin() + i);
+    }
 }
 
 // --------------------------------------------------------
@@ -386,7 +502,7 @@ void DX12Helper::CreateCBVSRVDescriptorHeap()
 // data - Pointer to the data itself
 // --------------------------------------------------------------
 Microsoft::WRL::ComPtr<ID3D12Resource> DX12Helper::CreateStaticBuffer(
-    unsigned int dataStride, unsigned int dataCount, void* data)
+    unsigned int dataStride, unsigned int dataCount, const void* data)
 {
     // The overall buffer we'll be creating
     Microsoft::WRL::ComPtr<ID3D12Resource> buffer;
@@ -456,7 +572,13 @@ Microsoft::WRL::ComPtr<ID3D12Resource> DX12Helper::CreateStaticBuffer(
     rb.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
     commandList->ResourceBarrier(1, &rb);
 
-    // Execute the command list and return the finished buffer
-    CloseExecuteAndResetCommandList();
+    // If we're batching, the upload heap needs to stick around
+    // until the batch executes.  Otherwise, execute right away.
+    if (batching)
+        KeepAliveUntilBatchEnds(uploadHeap);
+    else
+        CloseExecuteAndResetCommandList();
+
+    // Return the finished buffer
     return buffer;
 }
\ No newline at end of file
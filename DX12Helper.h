@@ -1,5 +1,6 @@
 #include <d3d12.h>
 #include <wrl/client.h>
+#include <utility>
 #include <vector>
 
 #pragma once
@@ -27,7 +28,8 @@ private:
 	DX12Helper() : 
 		waitFenceCounter(0),
 		waitFenceEvent(0),
-		waitFence(0)
+		waitFence(0),
+		batching(false)
 	{};
 #pragma endregion
 public:
@@ -44,12 +46,18 @@ public:
 	Microsoft::WRL::ComPtr<ID3D12Resource> CreateStaticBuffer(
 		unsigned int dataStride,
 		unsigned int dataCount,
-		void* data);
+		const void* data);
 
 	// Command list & xynchronization
 	void CloseExecuteAndResetCommandList();
 	void WaitForGPU();
 
+	// Batching of one-time setup work (buffer uploads, BLAS builds)
+	void BeginBatch();
+	void EndBatch();
+	bool IsBatching() { return batching; }
+	void KeepAliveUntilBatchEnds(Microsoft::WRL::ComPtr<ID3D12Resource> resource);
+
 	Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> GetCBVSRVDescriptorHeap();
 
 	D3D12_GPU_DESCRIPTOR_HANDLE FillNextConstantBufferAndGetGPUDescriptorHandle(
@@ -57,6 +65,7 @@ public:
 		unsigned int dataSizeInBytes);
 
 	D3D12_CPU_DESCRIPTOR_HANDLE LoadTexture(const wchar_t* file, bool generateMips = true);
+	D3D12_CPU_DESCRIPTOR_HANDLE LoadTexture(const void* data, size_t dataSize, bool generateMips = true);
 	D3D12_GPU_DESCRIPTOR_HANDLE CopySRVsToDescriptorHeapAndGetGPUDescriptorHandle(
 		D3D12_CPU_DESCRIPTOR_HANDLE firstDescriptorToCopy,
 		unsigned int numDescriptorsToCopy);
@@ -71,6 +80,13 @@ public:
 	void ReserveSrvUavDescriptorHeapSlot(
 		D3D12_CPU_DESCRIPTOR_HANDLE* reservedCPUHandle,
 		D3D12_GPU_DESCRIPTOR_HANDLE* reservedGPUHandle);
+	void ReserveSrvUavDescriptorHeapSlots(
+		unsigned int count,
+		D3D12_CPU_DESCRIPTOR_HANDLE* reservedCPUHandle,
+		D3D12_GPU_DESCRIPTOR_HANDLE* reservedGPUHandle);
+	void FreeSrvUavDescriptorHeapSlots(
+		D3D12_GPU_DESCRIPTOR_HANDLE firstGPUHandle,
+		unsigned int count);
 
 	Microsoft::WRL::ComPtr<ID3D12CommandAllocator> GetDefaultAllocator();
 
@@ -91,6 +107,12 @@ private:
 	HANDLE								waitFenceEvent;
 	unsigned long						waitFenceCounter;
 
+	// Are we recording a batch of setup work?  If so, these are
+	// temporary resources (upload heaps, scratch buffers) that
+	// the GPU needs until the batch actually executes
+	bool batching;
+	std::vector<Microsoft::WRL::ComPtr<ID3D12Resource>> batchResources;
+
 	// Maximum number of constant buffers, assuming each buffer
 	// is 256 bytes or less. Larger buffers are fine, but will 
 	// result in fewer buffers in use at any time
@@ -120,7 +142,13 @@ private:
 
 	unsigned int srvDescriptorOffset;
 
+	// Ranges of SRV/UAV slots (first slot, count) that have
+	// been freed and can be handed out again
+	std::vector<std::pair<unsigned int, unsigned int>> freeSrvUavSlots;
+
 	// Texture resources we need to keep alive
 	std::vector<Microsoft::WRL::ComPtr<ID3D12Resource>> textures;
 	std::vector<Microsoft::WRL::ComPtr<ID3D12DescriptorHeap>> cpuSideTextureDescriptorHeaps;
+
+	D3D12_CPU_DESCRIPTOR_HANDLE CreateTextureSRV(Microsoft::WRL::ComPtr<ID3D12Resource> texture);
 };
@@ -1,5 +1,6 @@
 #include "Game.h"
 #include "Vertex.h"
+#include "VertexPacking.h"
 #include "Input.h"
 #include "PathHelpers.h"
 
@@ -13,6 +14,12 @@
 #include "Material.h"
 
 #include "RaytracingHelper.h"
+#include "AssetLoader.h"
+#include "AssetPack.h"
+#include "MeshRegistry.h"
+#include "BvhStats.h"
+
+#include <chrono>
 
 // For the DirectX Math library
 using namespace DirectX;
@@ -56,6 +63,7 @@ Game::~Game()
 	// is actually done with its work
 	DX12Helper::GetInstance().WaitForGPU();
 
+	delete& MeshRegistry::GetInstance();
 	delete& RaytracingHelper::GetInstance();
 }
 
@@ -174,14 +182,51 @@ void Game::Init()
 // --------------------------------------------------------
 void Game::CreateBasicGeometry()
 {
-	// Loads in all the mesh files and creates entities with each, adding it to the entity list
-	std::shared_ptr<Mesh> cubeMesh = std::make_shared<Mesh>(FixPath(L"../../Assets/Models/cube.obj").c_str());
-	std::shared_ptr<Mesh> cylinderMesh = std::make_shared<Mesh>(FixPath(L"../../Assets/Models/cylinder.obj").c_str());
-	std::shared_ptr<Mesh> helixMesh = std::make_shared<Mesh>(FixPath(L"../../Assets/Models/helix.obj").c_str());
-	std::shared_ptr<Mesh> quadMesh = std::make_shared<Mesh>(FixPath(L"../../Assets/Models/quad.obj").c_str());
-	std::shared_ptr<Mesh> quadDSMesh = std::make_shared<Mesh>(FixPath(L"../../Assets/Models/quad_double_sided.obj").c_str());
-	std::shared_ptr<Mesh> sphereMesh = std::make_shared<Mesh>(FixPath(L"../../Assets/Models/sphere.obj").c_str());
-	std::shared_ptr<Mesh> torusMesh = std::make_shared<Mesh>(FixPath(L"../../Assets/Models/torus.obj").c_str());
+	// Loads in all the mesh files in parallel (CPU work only),
+	// straight out of the asset pack if one has been built...
+	AssetPack pack(FixPath(L"../../Assets/assets.pak"));
+	AssetLoader assetLoader;
+	auto loadMesh = [&](const std::string& name)
+		{
+			return pack.IsOpen() ?
+				assetLoader.LoadMeshAsync(pack, name) :
+				assetLoader.LoadMeshAsync(FixPath(L"../../Assets/" + NarrowToWide(name)));
+		};
+	MeshLoadHandle cubeData = loadMesh("Models/cube.obj");
+	MeshLoadHandle cylinderData = loadMesh("Models/cylinder.obj");
+	MeshLoadHandle helixData = loadMesh("Models/helix.obj");
+	MeshLoadHandle quadData = loadMesh("Models/quad.obj");
+	MeshLoadHandle quadDSData = loadMesh("Models/quad_double_sided.obj");
+	MeshLoadHandle sphereData = loadMesh("Models/sphere.obj");
+	MeshLoadHandle torusData = loadMesh("Models/torus.obj");
+	assetLoader.WaitForAll();
+
+	// ...then creates all of their buffers and BLAS's in a single GPU batch
+	// (through the registry, so anything loaded again later is shared)
+	std::chrono::steady_clock::time_point gpuStart = std::chrono::steady_clock::now();
+	MeshRegistry& meshRegistry = MeshRegistry::GetInstance();
+	DX12Helper::GetInstance().BeginBatch();
+
+	// The cylinder's long, thin sides get a tighter CPU BVH with
+	// spatial splits (the other meshes' triangles are too evenly
+	// shaped to be worth the slower build)
+	BvhBuildOptions thinTriangleBvh;
+	thinTriangleBvh.SpatialSplits = true;
+
+	std::shared_ptr<Mesh> cubeMesh = meshRegistry.GetMesh(*cubeData.get());
+	std::shared_ptr<Mesh> cylinderMesh = meshRegistry.GetMesh(*cylinderData.get(), thinTriangleBvh);
+	std::shared_ptr<Mesh> helixMesh = meshRegistry.GetMesh(*helixData.get());
+	std::shared_ptr<Mesh> quadMesh = meshRegistry.GetMesh(*quadData.get());
+	std::shared_ptr<Mesh> quadDSMesh = meshRegistry.GetMesh(*quadDSData.get());
+	std::shared_ptr<Mesh> sphereMesh = meshRegistry.GetMesh(*sphereData.get());
+	std::shared_ptr<Mesh> torusMesh = meshRegistry.GetMesh(*torusData.get());
+	DX12Helper::GetInstance().EndBatch();
+	double gpuTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - gpuStart).count();
+
+#if defined(DEBUG) || defined(_DEBUG)
+	assetLoader.PrintReport();
+	printf("GPU buffers and BLAS's created in %.2f ms\n", gpuTimeMs);
+#endif
 
 	//-- Load Textures --
 
@@ -362,6 +407,7 @@ void Game::CreateBasicGeometry()
 	}
 
 	RaytracingHelper::GetInstance().CreateTopLevelAccelerationStructureForScene(entityList);
+	sceneBvh.Build(entityList);
 }
 
 // --------------------------------------------------------
@@ -390,7 +436,9 @@ void Game::CreateRootSigAndPipelineState()
 		// used by the vertex shader we're using
 		// - This is used by the pipeline to know how to interpret the raw data
 		//    sitting inside a vertex buffer
+		// - This must match GPUVertex (see VertexLayout.h & VertexPacking.h)
 
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
 		inputElements[0].AlignedByteOffset = D3D12_APPEND_ALIGNED_ELEMENT;
 		inputElements[0].Format = DXGI_FORMAT_R32G32B32_FLOAT; // R32 G32 B32 = float3
 		inputElements[0].SemanticName = "POSITION";			   // Name must match semantic in shader
@@ -410,6 +458,33 @@ void Game::CreateRootSigAndPipelineState()
 		inputElements[3].Format = DXGI_FORMAT_R32G32B32_FLOAT; // R32 G32 B32 = float3
 		inputElements[3].SemanticName = "TANGENT";
 		inputElements[3].SemanticIndex = 0;					   // This is the first TANGENT semantic
+#else
+		// Packed layouts: position (4 x 16 bits, w unused), then the
+		// octahedral normal & tangent, then the fp16 UV
+		inputElements[0].AlignedByteOffset = D3D12_APPEND_ALIGNED_ELEMENT;
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_HALF
+		inputElements[0].Format = DXGI_FORMAT_R16G16B16A16_FLOAT;	// Absolute fp16 position
+#else
+		inputElements[0].Format = DXGI_FORMAT_R16G16B16A16_SNORM;	// Relative to the mesh's bounds
+#endif
+		inputElements[0].SemanticName = "POSITION";
+		inputElements[0].SemanticIndex = 0;
+
+		inputElements[1].AlignedByteOffset = D3D12_APPEND_ALIGNED_ELEMENT;
+		inputElements[1].Format = DXGI_FORMAT_R16G16_SNORM;		// Octahedral
+		inputElements[1].SemanticName = "NORMAL";
+		inputElements[1].SemanticIndex = 0;
+
+		inputElements[2].AlignedByteOffset = D3D12_APPEND_ALIGNED_ELEMENT;
+		inputElements[2].Format = DXGI_FORMAT_R16G16_SNORM;		// Octahedral
+		inputElements[2].SemanticName = "TANGENT";
+		inputElements[2].SemanticIndex = 0;
+
+		inputElements[3].AlignedByteOffset = D3D12_APPEND_ALIGNED_ELEMENT;
+		inputElements[3].Format = DXGI_FORMAT_R16G16_FLOAT;
+		inputElements[3].SemanticName = "TEXCOORD";
+		inputElements[3].SemanticIndex = 0;
+#endif
 	}
 
 	// Root Signature
@@ -593,6 +668,33 @@ void Game::Update(float deltaTime, float totalTime)
 	//}
 
 	camera->Update(deltaTime);
+
+	// Only the entities that moved this frame get refit
+	sceneBvh.Update(entityList);
+
+	// H traces the CPU scene BVH from the camera, printing the work
+	// per ray and saving a heatmap of it next to the executable
+	if (Input::GetInstance().KeyPress('H'))
+	{
+		std::vector<BvhRay> rays;
+		std::vector<float> costs;
+		MakeBvhCameraRays(camera->GetView(), camera->GetProjection(), windowWidth, windowHeight, rays);
+		BvhTraversalStats stats = TraceBvhStats(sceneBvh, rays, &costs);
+		WriteBvhHeatmap(FixPath(L"bvh_heatmap.ppm"), costs, windowWidth, windowHeight);
+
+		double rayCount = stats.RayCount > 0 ? (double)stats.RayCount : 1.0;
+		printf("Scene BVH view: %.2f nodes, %.2f triangles, %.2f instances per ray (worst %u nodes), %.1f%% hits, %.2f ms\n",
+			stats.NodesVisited / rayCount,
+			stats.TrianglesTested / rayCount,
+			stats.InstancesTested / rayCount,
+			stats.MaxNodesVisited,
+			100.0 * stats.HitCount / rayCount,
+			stats.TraceTimeMs);
+	}
+
+	// The last frame has finished on the GPU, so meshes nothing
+	// uses anymore can safely be evicted
+	MeshRegistry::GetInstance().Trim();
 }
 
 // --------------------------------------------------------
@@ -666,6 +768,10 @@ void Game::Draw(float deltaTime, float totalTime)
 	//		vsData.projection = camera->GetProjection();
 	//		vsData.view = camera->GetView();
 
+	//		VertexQuantization q = entityList[i]->GetMesh()->GetVertexQuantization();
+	//		vsData.positionCenter = XMFLOAT4(q.Center.x, q.Center.y, q.Center.z, 0);
+	//		vsData.positionHalfExtent = XMFLOAT4(q.HalfExtent.x, q.HalfExtent.y, q.HalfExtent.z, 0);
+
 	//		D3D12_GPU_DESCRIPTOR_HANDLE cbHandleVS =
 	//			dx12Helper.FillNextConstantBufferAndGetGPUDescriptorHandle(
 	//				(void*)(&vsData), sizeof(VertexShaderExternalData));
@@ -740,9 +846,10 @@ void Game::Draw(float deltaTime, float totalTime)
 
 	// Raytracing
 	{
-		// Update the raytracing accel structure
+		// Update the raytracing accel structure, picking each
+		// entity's level of detail based on the camera
 		RaytracingHelper::GetInstance().
-			CreateTopLevelAccelerationStructureForScene(entityList);
+			CreateTopLevelAccelerationStructureForScene(entityList, camera);
 
 		// Perform raytrace, including execution of command list
 		RaytracingHelper::GetInstance().Raytrace(
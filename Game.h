@@ -9,6 +9,7 @@
 #include "Camera.h"
 #include "GameEntity.h"
 #include "Lights.h"
+#include "SceneBvh.h"
 
 class Game 
 	: public DXCore
@@ -48,6 +49,10 @@ private:
 	std::shared_ptr<Camera> camera;
 	std::vector<std::shared_ptr<GameEntity>> entityList;
 
+	// CPU copy of the scene's acceleration structure, for ray
+	// queries that don't go through the GPU
+	SceneBvh sceneBvh;
+
 	int lightCount;
 	std::vector<Light> lights;
 };
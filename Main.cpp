@@ -1,6 +1,13 @@
 
 #include <Windows.h>
 #include "Game.h"
+#include "AssetPack.h"
+#include "BvhBenchmark.h"
+#include "MeshBenchmark.h"
+#include "PathHelpers.h"
+#include "SelfTest.h"
+
+#include <cstring>
 
 // --------------------------------------------------------
 // Entry point for a graphical (non-console) Windows application
@@ -18,6 +25,63 @@ int WINAPI WinMain(
 	_CrtSetDbgFlag( _CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF );
 #endif
 
+	// "-pack" bundles everything in the Assets folder into a
+	// single file (which the game then loads from) and exits
+	if (strstr(lpCmdLine, "-pack"))
+		return AssetPack::Build(FixPath(L"../../Assets/"), FixPath(L"../../Assets/assets.pak")) ? 0 : 1;
+
+	// "-bvhbench" prints CPU BVH build and ray cast numbers for
+	// every model (to the console it was launched from) and exits
+	if (strstr(lpCmdLine, "-bvhbench"))
+	{
+		if (!AttachConsole(ATTACH_PARENT_PROCESS))
+			AllocConsole();
+
+		FILE* stream;
+		freopen_s(&stream, "CONOUT$", "w", stdout);
+		RunBvhBenchmark(FixPath(L"../../Assets/Models/"));
+		return 0;
+	}
+
+	// "-meshbench" prints CPU mesh loading and processing numbers
+	// (to the console it was launched from) and exits
+	if (strstr(lpCmdLine, "-meshbench"))
+	{
+		if (!AttachConsole(ATTACH_PARENT_PROCESS))
+			AllocConsole();
+
+		FILE* stream;
+		freopen_s(&stream, "CONOUT$", "w", stdout);
+		RunMeshBenchmark(FixPath(L"../../Assets/Models/"));
+		return 0;
+	}
+
+	// "-selftest" runs the CPU-side correctness checks (printing
+	// to the console it was launched from) and exits, returning
+	// non-zero if anything failed
+	if (strstr(lpCmdLine, "-selftest"))
+	{
+		if (!AttachConsole(ATTACH_PARENT_PROCESS))
+			AllocConsole();
+
+		FILE* stream;
+		freopen_s(&stream, "CONOUT$", "w", stdout);
+		return RunSelfTests() ? 0 : 1;
+	}
+
+	// "-bvhstats" prints every model's BVH quality and per-ray
+	// traversal work for each builder, and writes heatmaps of it
+	if (strstr(lpCmdLine, "-bvhstats"))
+	{
+		if (!AttachConsole(ATTACH_PARENT_PROCESS))
+			AllocConsole();
+
+		FILE* stream;
+		freopen_s(&stream, "CONOUT$", "w", stdout);
+		RunBvhStatsReport(FixPath(L"../../Assets/Models/"), FixPath(L"BvhStats/"));
+		return 0;
+	}
+
 	// Create the Game object using
 	// the app handle we got from WinMain
 	Game dxGame(hInstance);
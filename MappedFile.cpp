@@ -0,0 +1,84 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// --------------------------------------------------------
+// Opens and maps the given file for reading.  On failure
+// (missing file, empty file, etc.) IsOpen() returns false.
+// --------------------------------------------------------
+MappedFile::MappedFile(const std::wstring& path) :
+	data(0),
+	size(0),
+	fileHandle(0),
+	mappingHandle(0)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileW(
+		path.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		0,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+		0);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	fileHandle = file;
+
+	// Mapping a zero-length file is an error, so bail early
+	LARGE_INTEGER fileSize = {};
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+		return;
+
+	HANDLE mapping = CreateFileMappingW(file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mapping)
+		return;
+	mappingHandle = mapping;
+
+	data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data)
+		size = (size_t)fileSize.QuadPart;
+#else
+	int fd = open(std::filesystem::path(path).c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat info = {};
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+	{
+		void* view = mmap(0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (view != MAP_FAILED)
+		{
+			madvise(view, (size_t)info.st_size, MADV_SEQUENTIAL);
+			data = (const char*)view;
+			size = (size_t)info.st_size;
+		}
+	}
+
+	// The mapping keeps its own reference to the file
+	close(fd);
+#endif
+}
+
+
+// --------------------------------------------------------
+// Unmaps the view and releases any OS handles
+// --------------------------------------------------------
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mappingHandle) CloseHandle((HANDLE)mappingHandle);
+	if (fileHandle) CloseHandle((HANDLE)fileHandle);
+#else
+	if (data) munmap((void*)data, size);
+#endif
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+
+// --------------------------------------------------------
+// A read-only, memory-mapped view of an entire file
+//
+// The mapping lives as long as this object does, so any
+// pointers handed out by GetData() must not outlive it.
+// --------------------------------------------------------
+class MappedFile
+{
+public:
+	MappedFile(const std::wstring& path);
+	~MappedFile();
+
+	// Mappings own OS handles, so no copying
+	MappedFile(MappedFile const&) = delete;
+	void operator=(MappedFile const&) = delete;
+
+	bool IsOpen() { return data != 0; }
+	const char* GetData() { return data; }
+	size_t GetSize() { return size; }
+
+private:
+	const char* data;
+	size_t size;
+
+	// Platform handles (file and mapping object on Windows)
+	void* fileHandle;
+	void* mappingHandle;
+};
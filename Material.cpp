@@ -42,6 +42,7 @@ Microsoft::WRL::ComPtr<ID3D12PipelineState> Material::GetPipelineState() { retur
 D3D12_GPU_DESCRIPTOR_HANDLE Material::GetFinalGPUHandleForSRVs() { return finalGPUHandleForSRVs; }
 MaterialType Material::GetType() { return type; }
 float Material::GetRoughness() { return roughness; }
+unsigned int Material::GetInstanceMask() { return type == MaterialType::Refractive ? MATERIAL_MASK_REFRACTIVE : MATERIAL_MASK_OPAQUE; }
 
 // Setters
 void Material::SetColorTint(DirectX::XMFLOAT3 colorTint) { this->colorTint = colorTint; }
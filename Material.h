@@ -2,6 +2,8 @@
 #include <wrl/client.h>
 #include <DirectXMath.h>
 
+#include "MaterialMask.h"
+
 enum MaterialType {
 	Normal,
 	Refractive
@@ -31,6 +33,7 @@ public:
 	D3D12_GPU_DESCRIPTOR_HANDLE GetFinalGPUHandleForSRVs();
 	MaterialType GetType();
 	float GetRoughness();
+	unsigned int GetInstanceMask();
 
 	// Setters
 	void SetColorTint(DirectX::XMFLOAT3 colorTint);
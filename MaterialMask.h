@@ -0,0 +1,8 @@
+#pragma once
+
+// Instance mask bits for each type of material (see
+// Material::GetInstanceMask), so ray queries can skip them.
+// Kept on their own so the CPU ray queries don't need D3D.
+#define MATERIAL_MASK_OPAQUE 0x01
+#define MATERIAL_MASK_REFRACTIVE 0x02
+#define MATERIAL_MASK_ALL 0xFF
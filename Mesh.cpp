@@ -1,9 +1,11 @@
 #include "Mesh.h"
 #include <DirectXMath.h>
 #include <vector>
-#include <fstream>
+#include <cstdio>
 
+#include "BvhCache.h"
 #include "DX12Helper.h"
+#include "MeshLoader.h"
 
 #include "RaytracingHelper.h"
 
@@ -16,185 +18,56 @@ using namespace DirectX;
 // numVerts   - The number of verts in the array
 // indexArray - An array of indices into the vertex array
 // numIndices - The number of indices in the index array
+// bvhOptions - How to build the CPU BVH
 // device     - The D3D device to use for buffer creation
 // --------------------------------------------------------
-Mesh::Mesh(Vertex* vertArray, size_t numVerts, unsigned int* indexArray, size_t numIndices) :
-	numIndices(0)
+Mesh::Mesh(Vertex* vertArray, size_t numVerts, unsigned int* indexArray, size_t numIndices, const BvhBuildOptions& bvhOptions) :
+	numVertices(0),
+	boundsMin(0, 0, 0),
+	boundsMax(0, 0, 0)
 {
-	CreateBuffers(vertArray, numVerts, indexArray, numIndices);
+	CalculateTangents(vertArray, numVerts, indexArray, numIndices);
+	CalculateBounds(vertArray, numVerts, boundsMin, boundsMax);
+	CreateBuffers(vertArray, numVerts, indexArray, numIndices, bvhOptions, std::wstring());
 }
 
 
 // --------------------------------------------------------
 // Creates a new mesh by loading vertices from the given .obj file
+//
+// - All of the CPU work happens in LoadMesh(), which also
+//    handles the .meshbin cache next to the .obj
+// - To load several meshes in parallel, use an AssetLoader
+//    and the MeshLoadResult constructor instead
 // 
-// objFile  - Path to the .obj 3D model file to load
-// device   - The D3D device to use for buffer creation
+// objFile    - Path to the .obj 3D model file to load
+// bvhOptions - How to build the CPU BVH
+// device     - The D3D device to use for buffer creation
 // --------------------------------------------------------
-Mesh::Mesh(const std::wstring& objFile) :
-	numIndices(0),
-	numVertices(0)
+Mesh::Mesh(const std::wstring& objFile, const BvhBuildOptions& bvhOptions) :
+	numVertices(0),
+	boundsMin(0, 0, 0),
+	boundsMax(0, 0, 0)
 {
-	// File input object
-	std::ifstream obj(objFile);
-
-	// Check for successful open
-	if (!obj.is_open())
-		return;
+	MeshLoadResult loadResult;
+	LoadMesh(objFile, loadResult);
+	CreateFromLoadResult(loadResult, bvhOptions);
+}
 
-	// Variables used while reading the file
-	std::vector<XMFLOAT3> positions;     // Positions from the file
-	std::vector<XMFLOAT3> normals;       // Normals from the file
-	std::vector<XMFLOAT2> uvs;           // UVs from the file
-	std::vector<Vertex> verts;           // Verts we're assembling
-	std::vector<UINT> indices;           // Indices of these verts
-	unsigned int vertCounter = 0;        // Count of vertices/indices
-	char chars[100];                     // String for line reading
-
-	// Still have data left?
-	while (obj.good())
-	{
-		// Get the line (100 characters should be more than enough)
-		obj.getline(chars, 100);
-
-		// Check the type of line
-		if (chars[0] == 'v' && chars[1] == 'n')
-		{
-			// Read the 3 numbers directly into an XMFLOAT3
-			XMFLOAT3 norm = { 0, 0, 0 };
-			sscanf_s(
-				chars,
-				"vn %f %f %f",
-				&norm.x, &norm.y, &norm.z);
-
-			// Add to the list of normals
-			normals.push_back(norm);
-		}
-		else if (chars[0] == 'v' && chars[1] == 't')
-		{
-			// Read the 2 numbers directly into an XMFLOAT2
-			XMFLOAT2 uv = { 0, 0 };
-			sscanf_s(
-				chars,
-				"vt %f %f",
-				&uv.x, &uv.y);
-
-			// Add to the list of uv's
-			uvs.push_back(uv);
-		}
-		else if (chars[0] == 'v')
-		{
-			// Read the 3 numbers directly into an XMFLOAT3
-			XMFLOAT3 pos = { 0, 0, 0 };
-			sscanf_s(
-				chars,
-				"v %f %f %f",
-				&pos.x, &pos.y, &pos.z);
-
-			// Add to the positions
-			positions.push_back(pos);
-		}
-		else if (chars[0] == 'f')
-		{
-			// Read the face indices into an array
-			// NOTE: This assumes the given obj file contains
-			//  vertex positions, uv coordinates AND normals.
-			//  If the model is missing any of these, this 
-			//  code will not handle the file correctly!
-			unsigned int i[12] = {};
-			int facesRead = sscanf_s(
-				chars,
-				"f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d",
-				&i[0], &i[1], &i[2],
-				&i[3], &i[4], &i[5],
-				&i[6], &i[7], &i[8],
-				&i[9], &i[10], &i[11]);
-
-			// - Create the verts by looking up
-			//    corresponding data from vectors
-			// - OBJ File indices are 1-based, so
-			//    they need to be adusted
-			Vertex v1 = {};
-			v1.Position = positions[max(i[0] - 1, 0)];
-			v1.UV = uvs[max(i[1] - 1, 0)];
-			v1.Normal = normals[max(i[2] - 1, 0)];
-
-			Vertex v2 = {};
-			v2.Position = positions[max(i[3] - 1, 0)];
-			v2.UV = uvs[max(i[4] - 1, 0)];
-			v2.Normal = normals[max(i[5] - 1, 0)];
-
-			Vertex v3 = {};
-			v3.Position = positions[max(i[6] - 1, 0)];
-			v3.UV = uvs[max(i[7] - 1, 0)];
-			v3.Normal = normals[max(i[8] - 1, 0)];
-
-			// The model is most likely in a right-handed space,
-			// especially if it came from Maya.  We want to convert
-			// to a left-handed space for DirectX.  This means we 
-			// need to:
-			//  - Invert the Z position
-			//  - Invert the normal's Z
-			//  - Flip the winding order
-			// We also need to flip the UV coordinate since DirectX
-			// defines (0,0) as the top left of the texture, and many
-			// 3D modeling packages use the bottom left as (0,0)
-
-			// Flip the UV's since they're probably "upside down"
-			v1.UV.y = 1.0f - v1.UV.y;
-			v2.UV.y = 1.0f - v2.UV.y;
-			v3.UV.y = 1.0f - v3.UV.y;
-
-			// Flip Z (LH vs. RH)
-			v1.Position.z *= -1.0f;
-			v2.Position.z *= -1.0f;
-			v3.Position.z *= -1.0f;
-
-			// Flip normal Z
-			v1.Normal.z *= -1.0f;
-			v2.Normal.z *= -1.0f;
-			v3.Normal.z *= -1.0f;
-
-			// Add the verts to the vector (flipping the winding order)
-			verts.push_back(v1);
-			verts.push_back(v3);
-			verts.push_back(v2);
-
-			// Add three more indices
-			indices.push_back(vertCounter); vertCounter += 1;
-			indices.push_back(vertCounter); vertCounter += 1;
-			indices.push_back(vertCounter); vertCounter += 1;
-
-			// Was there a 4th face?
-			if (facesRead == 12)
-			{
-				// Make the last vertex
-				Vertex v4 = {};
-				v4.Position = positions[max(i[9] - 1, 0)];
-				v4.UV = uvs[max(i[10] - 1, 0)];
-				v4.Normal = normals[max(i[11] - 1, 0)];
-
-				// Flip the UV, Z pos and normal
-				v4.UV.y = 1.0f - v4.UV.y;
-				v4.Position.z *= -1.0f;
-				v4.Normal.z *= -1.0f;
-
-				// Add a whole triangle (flipping the winding order)
-				verts.push_back(v1);
-				verts.push_back(v4);
-				verts.push_back(v3);
-
-				// Add three more indices
-				indices.push_back(vertCounter); vertCounter += 1;
-				indices.push_back(vertCounter); vertCounter += 1;
-				indices.push_back(vertCounter); vertCounter += 1;
-			}
-		}
-	}
 
-	// Close the file and create the actual buffers
-	obj.close();
-	CreateBuffers(&verts[0], vertCounter, &indices[0], vertCounter);
+// --------------------------------------------------------
+// Creates a new mesh from geometry that was already loaded
+// and processed on the CPU (possibly on another thread)
+//
+// loadResult - Final geometry from LoadMesh()
+// bvhOptions - How to build the CPU BVH
+// --------------------------------------------------------
+Mesh::Mesh(const MeshLoadResult& loadResult, const BvhBuildOptions& bvhOptions) :
+	numVertices(0),
+	boundsMin(0, 0, 0),
+	boundsMax(0, 0, 0)
+{
+	CreateFromLoadResult(loadResult, bvhOptions);
 }
 
 
@@ -210,126 +83,141 @@ Mesh::~Mesh() { }
 // Getters for private variables
 // --------------------------------------------------------
 D3D12_VERTEX_BUFFER_VIEW Mesh::GetVBView() { return vbView; }
-D3D12_INDEX_BUFFER_VIEW Mesh::GetIBView() { return ibView; }
-unsigned int Mesh::GetIndexCount() { return numIndices; }
+D3D12_INDEX_BUFFER_VIEW Mesh::GetIBView(unsigned int lod) { return levels[lod].IBView; }
+unsigned int Mesh::GetIndexCount(unsigned int lod) { return levels[lod].IndexCount; }
+DirectX::XMFLOAT3 Mesh::GetBoundsMin() { return boundsMin; }
+DirectX::XMFLOAT3 Mesh::GetBoundsMax() { return boundsMax; }
 
 
 // --------------------------------------------------------
-// Helper for creating the actual D3D buffers.
-// Also calculates tangents for each vertex before creating buffers.
-// 
-// vertArray  - An array of vertices
-// numVerts   - The number of verts in the array
-// indexArray - An array of indices into the vertex array
-// numIndices - The number of indices in the index array
-// device     - The D3D device to use for buffer creation
+// Adds up the size of the vertex buffer and, for each level,
+// the index buffer and BLAS
 // --------------------------------------------------------
-void Mesh::CreateBuffers(Vertex* vertArray, size_t numVerts, unsigned int* indexArray, size_t numIndices)
+UINT64 Mesh::GetMemorySize()
 {
-	// Save the indices
-	this->numIndices = (unsigned int)numIndices;
-	this->numVertices = (unsigned int)numVerts;
+	UINT64 size = vb ? vb->GetDesc().Width : 0;
+	for (MeshLevel& level : levels)
+	{
+		size += level.IB->GetDesc().Width;
+		if (level.RaytracingData.BLAS)
+			size += level.RaytracingData.BLAS->GetDesc().Width;
+	}
+	return size;
+}
 
-	// Calculate the tangents of each vertex first
-	CalculateTangents(vertArray, numVerts, indexArray, numIndices);
 
-	//Create the two buffers
-	DX12Helper& dx12Helper = DX12Helper::GetInstance();
-	vb = dx12Helper.CreateStaticBuffer(sizeof(Vertex), (unsigned int)numVerts, vertArray);
-	ib = dx12Helper.CreateStaticBuffer(sizeof(unsigned int), (unsigned int)numIndices, indexArray);
+// --------------------------------------------------------
+// Releases the raytracing slots used by every level
+// --------------------------------------------------------
+void Mesh::ReleaseRaytracingData()
+{
+	for (MeshLevel& level : levels)
+		RaytracingHelper::GetInstance().ReleaseBottomLevelAccelerationStructure(level.RaytracingData);
+}
 
-	// Set up the views
-	vbView.StrideInBytes = sizeof(Vertex);
-	vbView.SizeInBytes = (UINT)(sizeof(Vertex) * numVerts);
-	vbView.BufferLocation = vb->GetGPUVirtualAddress();
 
-	ibView.Format = DXGI_FORMAT_R32_UINT;
-	ibView.SizeInBytes = (UINT)(sizeof(unsigned int) * numIndices);
-	ibView.BufferLocation = ib->GetGPUVirtualAddress();
+// --------------------------------------------------------
+// Helper for creating buffers from processed geometry, which
+// is ready to go as-is (tangents and bounds included)
+// --------------------------------------------------------
+void Mesh::CreateFromLoadResult(const MeshLoadResult& loadResult, const BvhBuildOptions& bvhOptions)
+{
+	if (!loadResult.Success || loadResult.IndexCount == 0)
+		return;
+
+	boundsMin = loadResult.BoundsMin;
+	boundsMax = loadResult.BoundsMax;
+
+	// Packs are read-only, so only meshes from files cache their BVHs
+	CreateBuffers(
+		loadResult.Vertices, loadResult.VertexCount,
+		loadResult.Indices, loadResult.IndexCount,
+		bvhOptions,
+		loadResult.FromPack ? std::wstring() : BvhCache::GetCachePath(loadResult.SourceFile, bvhOptions));
 
-	raytracingData = RaytracingHelper::GetInstance().CreateBottomLevelAccelerationStructureForMesh(this);
+	// Lower detail levels just need their own indices
+	for (unsigned int i = 0; i < loadResult.LodCount; i++)
+		CreateLevel(loadResult.LodIndices[i], loadResult.LodIndexCounts[i], loadResult.LodErrors[i]);
 }
 
+
 // --------------------------------------------------------
-// Calculates the tangents of the vertices in a mesh
-// - Code originally adapted from: http://www.terathon.com/code/tangent.html
-//   - Updated version now found here: http://foundationsofgameenginedev.com/FGED2-sample.pdf
-//   - See listing 7.4 in section 7.5 (page 9 of the PDF)
-//
-// - Note: For this code to work, your Vertex format must
-//         contain an XMFLOAT3 called Tangent
+// Helper for creating the actual D3D buffers.
+// Vertices should already have their tangents calculated,
+// and the bounds should already be set.
 //
-// - Be sure to call this BEFORE creating your D3D vertex/index buffers
+// The vertex buffer holds GPUVertex, so vertices are packed
+// into that layout first, unless it's the full Vertex.
+// 
+// vertArray    - An array of vertices
+// numVerts     - The number of verts in the array
+// indexArray   - An array of indices into the vertex array
+// numIndices   - The number of indices in the index array
+// bvhOptions   - How to build the CPU BVH
+// bvhCacheFile - Where the BVH is cached (empty to always build it)
+// device       - The D3D device to use for buffer creation
 // --------------------------------------------------------
-void Mesh::CalculateTangents(Vertex* verts, size_t numVerts, unsigned int* indices, size_t numIndices)
+void Mesh::CreateBuffers(const Vertex* vertArray, size_t numVerts, const unsigned int* indexArray, size_t numIndices, const BvhBuildOptions& bvhOptions, const std::wstring& bvhCacheFile)
 {
-	// Reset tangents
-	for (int i = 0; i < numVerts; i++)
-	{
-		verts[i].Tangent = XMFLOAT3(0, 0, 0);
-	}
+	this->numVertices = (unsigned int)numVerts;
 
-	// Calculate tangents one whole triangle at a time
-	for (int i = 0; i < numIndices;)
+	//Create the vertex buffer
+	DX12Helper& dx12Helper = DX12Helper::GetInstance();
+	quantization = CalculateQuantization(boundsMin, boundsMax);
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
+	vb = dx12Helper.CreateStaticBuffer(sizeof(GPUVertex), (unsigned int)numVerts, vertArray);
+#else
+	std::vector<GPUVertex> packedVerts(numVerts);
+	EncodeVertices(vertArray, numVerts, quantization, packedVerts.data());
+	vb = dx12Helper.CreateStaticBuffer(sizeof(GPUVertex), (unsigned int)numVerts, packedVerts.data());
+#endif
+
+	// Set up the view
+	vbView.StrideInBytes = sizeof(GPUVertex);
+	vbView.SizeInBytes = (UINT)(sizeof(GPUVertex) * numVerts);
+	vbView.BufferLocation = vb->GetGPUVirtualAddress();
+
+	// The original indices are level 0
+	levels.clear();
+	CreateLevel(indexArray, numIndices, 0.0f);
+
+	// Along with a BVH, so the mesh can be ray cast on the CPU too.
+	// Building one can take a while for big meshes, so they're
+	// saved and then mapped straight back in on later runs, as
+	// long as the geometry hasn't changed.
+	bool cached = !bvhCacheFile.empty();
+	uint64_t geometryHash = cached ? BvhCache::HashGeometry(vertArray, numVerts, indexArray, numIndices) : 0;
+	if (!cached || !bvh.Load(bvhCacheFile, geometryHash, bvhOptions))
 	{
-		// Grab indices and vertices of first triangle
-		unsigned int i1 = indices[i++];
-		unsigned int i2 = indices[i++];
-		unsigned int i3 = indices[i++];
-		Vertex* v1 = &verts[i1];
-		Vertex* v2 = &verts[i2];
-		Vertex* v3 = &verts[i3];
-
-		// Calculate vectors relative to triangle positions
-		float x1 = v2->Position.x - v1->Position.x;
-		float y1 = v2->Position.y - v1->Position.y;
-		float z1 = v2->Position.z - v1->Position.z;
-
-		float x2 = v3->Position.x - v1->Position.x;
-		float y2 = v3->Position.y - v1->Position.y;
-		float z2 = v3->Position.z - v1->Position.z;
-
-		// Do the same for vectors relative to triangle uv's
-		float s1 = v2->UV.x - v1->UV.x;
-		float t1 = v2->UV.y - v1->UV.y;
-
-		float s2 = v3->UV.x - v1->UV.x;
-		float t2 = v3->UV.y - v1->UV.y;
-
-		// Create vectors for tangent calculation
-		float r = 1.0f / (s1 * t2 - s2 * t1);
-
-		float tx = (t2 * x1 - t1 * x2) * r;
-		float ty = (t2 * y1 - t1 * y2) * r;
-		float tz = (t2 * z1 - t1 * z2) * r;
-
-		// Adjust tangents of each vert of the triangle
-		v1->Tangent.x += tx;
-		v1->Tangent.y += ty;
-		v1->Tangent.z += tz;
-
-		v2->Tangent.x += tx;
-		v2->Tangent.y += ty;
-		v2->Tangent.z += tz;
-
-		v3->Tangent.x += tx;
-		v3->Tangent.y += ty;
-		v3->Tangent.z += tz;
+		bvh.Build(vertArray, numVerts, indexArray, numIndices, bvhOptions);
+		if (cached)
+			BvhCache::Write(bvhCacheFile, bvh, geometryHash, bvhOptions);
 	}
+}
 
-	// Ensure all of the tangents are orthogonal to the normals
-	for (int i = 0; i < numVerts; i++)
-	{
-		// Grab the two vectors
-		XMVECTOR normal = XMLoadFloat3(&verts[i].Normal);
-		XMVECTOR tangent = XMLoadFloat3(&verts[i].Tangent);
 
-		// Use Gram-Schmidt orthonormalize to ensure
-		// the normal and tangent are exactly 90 degrees apart
-		tangent = XMVector3Normalize(
-			tangent - normal * XMVector3Dot(normal, tangent));
+// --------------------------------------------------------
+// Helper for adding a level of detail, which is an index
+// buffer (and BLAS) over the existing vertex buffer.  Levels
+// must be added from most to least detailed.
+//
+// indexArray - Indices into the mesh's vertices
+// numIndices - The number of indices in the index array
+// error      - How far this level strays from level 0
+// --------------------------------------------------------
+void Mesh::CreateLevel(const unsigned int* indexArray, size_t numIndices, float error)
+{
+	MeshLevel level;
+	level.IB = DX12Helper::GetInstance().CreateStaticBuffer(sizeof(unsigned int), (unsigned int)numIndices, indexArray);
+	level.IndexCount = (unsigned int)numIndices;
+	level.Error = error;
+
+	level.IBView.Format = DXGI_FORMAT_R32_UINT;
+	level.IBView.SizeInBytes = (UINT)(sizeof(unsigned int) * numIndices);
+	level.IBView.BufferLocation = level.IB->GetGPUVirtualAddress();
 
-		// Store the tangent
-		XMStoreFloat3(&verts[i].Tangent, tangent);
-	}
-}
\ No newline at end of file
+	levels.push_back(level);
+
+	unsigned int lod = (unsigned int)levels.size() - 1;
+	levels[lod].RaytracingData = RaytracingHelper::GetInstance().CreateBottomLevelAccelerationStructureForMesh(this, lod);
+}
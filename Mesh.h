@@ -3,51 +3,96 @@
 #include <d3d12.h>
 #include <wrl/client.h>
 #include <string>
+#include <vector>
 
+#include "Bvh.h"
 #include "Vertex.h"
+#include "VertexPacking.h"
+
+struct MeshLoadResult;
 
 struct MeshRaytracingData
 {
 	D3D12_GPU_DESCRIPTOR_HANDLE IndexbufferSRV { };
 	D3D12_GPU_DESCRIPTOR_HANDLE VertexBufferSRV { };
 	Microsoft::WRL::ComPtr<ID3D12Resource> BLAS;
+	Microsoft::WRL::ComPtr<ID3D12Resource> BLASTransform; // Only for bounds-relative vertex layouts
 	unsigned int HitGroupIndex = 0;
 };
 
+// --------------------------------------------------------
+// GPU resources for one level of detail.  Every level has
+// its own index buffer and BLAS over the mesh's shared
+// vertex buffer.
+// --------------------------------------------------------
+struct MeshLevel
+{
+	Microsoft::WRL::ComPtr<ID3D12Resource> IB;
+	D3D12_INDEX_BUFFER_VIEW IBView = {};
+	unsigned int IndexCount = 0;
+	float Error = 0.0f; // Largest deviation from level 0, in local space units
+	MeshRaytracingData RaytracingData;
+};
+
 class Mesh
 {
 public:
-	Mesh(Vertex* vertArray, size_t numVerts, unsigned int* indexArray, size_t numIndices);
-	Mesh(const std::wstring& objFile);
+	// Each mesh can pick how its CPU BVH is built (see GetBvh)
+	Mesh(Vertex* vertArray, size_t numVerts, unsigned int* indexArray, size_t numIndices, const BvhBuildOptions& bvhOptions = BvhBuildOptions());
+	Mesh(const std::wstring& objFile, const BvhBuildOptions& bvhOptions = BvhBuildOptions());
+	Mesh(const MeshLoadResult& loadResult, const BvhBuildOptions& bvhOptions = BvhBuildOptions());
 	~Mesh();
 
-	// Getters for mesh data
+	// Getters for mesh data - levels of detail go from 0 (the
+	// original mesh) to GetLodCount() - 1 (the least detailed)
 	D3D12_VERTEX_BUFFER_VIEW GetVBView();
-	D3D12_INDEX_BUFFER_VIEW GetIBView();
-	unsigned int GetIndexCount();
+	D3D12_INDEX_BUFFER_VIEW GetIBView(unsigned int lod = 0);
+	unsigned int GetIndexCount(unsigned int lod = 0);
 	unsigned int GetVertexCount() { return numVertices; }
+	unsigned int GetLodCount() { return (unsigned int)levels.size(); }
+	float GetLodError(unsigned int lod) { return levels[lod].Error; }
+	DirectX::XMFLOAT3 GetBoundsMin();
+	DirectX::XMFLOAT3 GetBoundsMax();
+	VertexQuantization GetVertexQuantization() { return quantization; }
 
 	Microsoft::WRL::ComPtr<ID3D12Resource> GetVBResource() { return vb; }
-	Microsoft::WRL::ComPtr<ID3D12Resource> GetIBResource() { return ib; }
+	Microsoft::WRL::ComPtr<ID3D12Resource> GetIBResource(unsigned int lod = 0) { return levels[lod].IB; }
+
+	MeshRaytracingData GetRaytracingData(unsigned int lod = 0) { return levels[lod].RaytracingData; }
+
+	// CPU side equivalent of level 0's BLAS, for ray queries without the GPU.
+	// Meshes from files cache theirs next to the file (see BvhCache).
+	const Bvh& GetBvh() { return bvh; }
+
+	// Total size of every GPU buffer (and BLAS) this mesh owns
+	UINT64 GetMemorySize();
 
-	MeshRaytracingData GetRaytracingData() { return raytracingData; }
+	// Gives back every level's hit group and descriptors (see
+	// RaytracingHelper), after which the mesh can't be raytraced
+	void ReleaseRaytracingData();
 
 private:
 	// D3D buffers
 	Microsoft::WRL::ComPtr<ID3D12Resource> vb;
-	Microsoft::WRL::ComPtr<ID3D12Resource> ib;
-
 	D3D12_VERTEX_BUFFER_VIEW vbView = {};
-	D3D12_INDEX_BUFFER_VIEW ibView = {};
-
-	// Total indices in this mesh
-	unsigned int numIndices;
 	unsigned int numVertices;
 
-	// Helper for creating buffers (in the event we add more constructor overloads)
-	void CreateBuffers(Vertex* vertArray, size_t numVerts, unsigned int* indexArray, size_t numIndices);
-	void CalculateTangents(Vertex* verts, size_t numVerts, unsigned int* indices, size_t numIndices);
+	// Index buffers (and BLAS's) for each level of detail
+	std::vector<MeshLevel> levels;
+
+	// CPU copy of level 0's geometry, for ray queries
+	Bvh bvh;
 
-	MeshRaytracingData raytracingData;
+	// Local space bounding box
+	DirectX::XMFLOAT3 boundsMin;
+	DirectX::XMFLOAT3 boundsMax;
+
+	// How positions in the vertex buffer map back to local space
+	VertexQuantization quantization;
+
+	// Helper for creating buffers (in the event we add more constructor overloads)
+	void CreateBuffers(const Vertex* vertArray, size_t numVerts, const unsigned int* indexArray, size_t numIndices, const BvhBuildOptions& bvhOptions, const std::wstring& bvhCacheFile);
+	void CreateLevel(const unsigned int* indexArray, size_t numIndices, float error);
+	void CreateFromLoadResult(const MeshLoadResult& loadResult, const BvhBuildOptions& bvhOptions);
 };
 
@@ -0,0 +1,427 @@
+#include "MeshBenchmark.h"
+#include "MappedFile.h"
+#include "MeshData.h"
+#include "MeshOptimizer.h"
+#include "ObjLoader.h"
+#include "ThreadPool.h"
+#include "VertexWelder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace DirectX;
+
+// How many times each parse runs (the fastest counts)
+#define MESH_BENCHMARK_PARSES 3
+
+// How many copies of helix.obj the parsing benchmark strings
+// together for each of its file sizes
+static const int objScales[] = { 1, 10, 100 };
+
+// Same for the tangents benchmark, which is quick enough to
+// go bigger
+static const int tangentScales[] = { 1, 4, 16, 64, 256 };
+
+// FIFO post-transform cache sizes the vertex cache benchmark
+// simulates (the optimizer always targets VERTEX_CACHE_SIZE)
+static const unsigned int vertexCacheSizes[] = { 8, 16, 32, 64 };
+
+// The old parser's sscanf_s isn't standard
+#if defined(_MSC_VER)
+#define BENCHMARK_SSCANF sscanf_s
+#else
+#define BENCHMARK_SSCANF sscanf
+#endif
+
+// --------------------------------------------------------
+// Strings together copies of an .obj file's text, each one
+// with its faces' (absolute) indices shifted past all of the
+// copies before it, so every copy is its own set of triangles
+// --------------------------------------------------------
+static void ScaleObjText(const char* text, size_t length, int copies, std::string& scaled)
+{
+	// How many of each kind of line one copy has
+	size_t counts[3] = {};
+	std::istringstream counter(std::string(text, length));
+	std::string line;
+	while (std::getline(counter, line))
+	{
+		if (line.compare(0, 3, "vt ") == 0) counts[1]++;
+		else if (line.compare(0, 3, "vn ") == 0) counts[2]++;
+		else if (line.compare(0, 2, "v ") == 0) counts[0]++;
+	}
+
+	scaled.clear();
+	scaled.reserve(length * copies + length / 4 * copies / 10);
+	for (int c = 0; c < copies; c++)
+	{
+		const char* p = text;
+		const char* end = text + length;
+		while (p < end)
+		{
+			const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+			lineEnd = lineEnd ? lineEnd + 1 : end;
+			if (c == 0 || p[0] != 'f' || lineEnd - p < 2 || p[1] != ' ')
+			{
+				scaled.append(p, lineEnd);
+				p = lineEnd;
+				continue;
+			}
+
+			// Rewrite each positive index in "f a/b/c ..." (which of the
+			// three it is comes from how many slashes came before it)
+			int component = 0;
+			while (p < lineEnd)
+			{
+				if (*p >= '0' && *p <= '9' && (p[-1] == ' ' || p[-1] == '/'))
+				{
+					char* digitsEnd;
+					size_t index = strtoul(p, &digitsEnd, 10);
+					scaled += std::to_string(index + counts[component] * c);
+					p = digitsEnd;
+					continue;
+				}
+
+				if (*p == '/') component++;
+				else if (*p == ' ') component = 0;
+				scaled += *p++;
+			}
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// The getline/sscanf_s loop Mesh used to parse .obj files
+// with, for comparison: 100 character lines, and every face
+// a triangle or quad with a position, UV and normal
+// --------------------------------------------------------
+static void ParseObjLegacy(const std::string& text, MeshData& meshData)
+{
+	std::istringstream obj(text);
+	std::vector<XMFLOAT3> positions;
+	std::vector<XMFLOAT3> normals;
+	std::vector<XMFLOAT2> uvs;
+	std::vector<Vertex>& verts = meshData.Vertices;
+	std::vector<unsigned int>& indices = meshData.Indices;
+	verts.clear();
+	indices.clear();
+	char chars[100];
+
+	// Looks up one face corner, flipped into a left handed space
+	auto corner = [&](const int* i)
+		{
+			Vertex v = {};
+			v.Position = positions[(std::max)(i[0] - 1, 0)];
+			v.UV = uvs[(std::max)(i[1] - 1, 0)];
+			v.Normal = normals[(std::max)(i[2] - 1, 0)];
+			v.UV.y = 1.0f - v.UV.y;
+			v.Position.z *= -1.0f;
+			v.Normal.z *= -1.0f;
+			return v;
+		};
+	auto triangle = [&](const Vertex& a, const Vertex& b, const Vertex& c)
+		{
+			verts.push_back(a);
+			verts.push_back(b);
+			verts.push_back(c);
+			for (int k = 0; k < 3; k++)
+				indices.push_back((unsigned int)indices.size());
+		};
+
+	while (obj.good())
+	{
+		obj.getline(chars, 100);
+		if (chars[0] == 'v' && chars[1] == 'n')
+		{
+			XMFLOAT3 norm = { 0, 0, 0 };
+			BENCHMARK_SSCANF(chars, "vn %f %f %f", &norm.x, &norm.y, &norm.z);
+			normals.push_back(norm);
+		}
+		else if (chars[0] == 'v' && chars[1] == 't')
+		{
+			XMFLOAT2 uv = { 0, 0 };
+			BENCHMARK_SSCANF(chars, "vt %f %f", &uv.x, &uv.y);
+			uvs.push_back(uv);
+		}
+		else if (chars[0] == 'v')
+		{
+			XMFLOAT3 pos = { 0, 0, 0 };
+			BENCHMARK_SSCANF(chars, "v %f %f %f", &pos.x, &pos.y, &pos.z);
+			positions.push_back(pos);
+		}
+		else if (chars[0] == 'f')
+		{
+			int i[12] = {};
+			int facesRead = BENCHMARK_SSCANF(chars, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d",
+				&i[0], &i[1], &i[2], &i[3], &i[4], &i[5], &i[6], &i[7], &i[8], &i[9], &i[10], &i[11]);
+
+			Vertex v1 = corner(&i[0]);
+			Vertex v2 = corner(&i[3]);
+			Vertex v3 = corner(&i[6]);
+			triangle(v1, v3, v2);
+			if (facesRead == 12)
+				triangle(v1, corner(&i[9]), v3);
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Parses helix.obj, strung together into bigger and bigger
+// files, with the old single threaded parser and then with
+// ParseOBJ on 1, 2, 4... threads (up to every core).  Also
+// checks that both parsers made the same vertices.
+// --------------------------------------------------------
+static void RunObjParseBenchmark(const std::wstring& objFile)
+{
+	MappedFile file(objFile);
+	if (!file.IsOpen())
+	{
+		printf("OBJ parsing: couldn't open helix.obj\n");
+		return;
+	}
+
+	ThreadPool& threadPool = ThreadPool::GetInstance();
+	unsigned int maxThreads = threadPool.GetThreadCount();
+	printf("OBJ parsing (helix.obj strung together, best of %d parses, vs the old getline/sscanf parser):\n", MESH_BENCHMARK_PARSES);
+	printf("  %-6s %8s %9s %8s %10s %9s %8s %8s %9s\n",
+		"copies", "MB", "tris", "threads", "ms", "MB/s", "vs 1", "vs old", "mismatch");
+
+	std::string text;
+	MeshData legacy;
+	MeshData parsed;
+	for (int copies : objScales)
+	{
+		ScaleObjText(file.GetData(), file.GetSize(), copies, text);
+		double megabytes = text.size() / (1024.0 * 1024.0);
+
+		double legacyMs = 0;
+		for (int pass = 0; pass < MESH_BENCHMARK_PARSES; pass++)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			ParseObjLegacy(text, legacy);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			legacyMs = pass == 0 ? ms : (std::min)(legacyMs, ms);
+		}
+		printf("  %-6d %8.1f %9zu %8s %10.2f %9.1f\n",
+			copies, megabytes, legacy.Indices.size() / 3, "old", legacyMs, megabytes / legacyMs * 1000.0);
+
+		double oneThreadMs = 0;
+		for (unsigned int threads = 1; ; threads = (std::min)(threads * 2, maxThreads))
+		{
+			threadPool.SetThreadLimit(threads);
+			double parseMs = 0;
+			for (int pass = 0; pass < MESH_BENCHMARK_PARSES; pass++)
+			{
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				ParseOBJ(text.data(), text.size(), parsed);
+				double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				parseMs = pass == 0 ? ms : (std::min)(parseMs, ms);
+			}
+			if (threads == 1)
+				oneThreadMs = parseMs;
+
+			// Every vertex should match the old parser's exactly
+			size_t mismatches = 0;
+			if (parsed.Vertices.size() != legacy.Vertices.size())
+				mismatches = (std::max)(parsed.Vertices.size(), legacy.Vertices.size());
+			else
+			{
+				for (size_t i = 0; i < parsed.Vertices.size(); i++)
+				{
+					const Vertex& a = parsed.Vertices[i];
+					const Vertex& b = legacy.Vertices[i];
+					if (a.Position.x != b.Position.x || a.Position.y != b.Position.y || a.Position.z != b.Position.z ||
+						a.Normal.x != b.Normal.x || a.Normal.y != b.Normal.y || a.Normal.z != b.Normal.z ||
+						a.UV.x != b.UV.x || a.UV.y != b.UV.y)
+						mismatches++;
+				}
+			}
+
+			printf("  %-6d %8.1f %9zu %8u %10.2f %9.1f %7.2fx %7.2fx %9zu\n",
+				copies, megabytes, parsed.Indices.size() / 3, threads, parseMs, megabytes / parseMs * 1000.0,
+				oneThreadMs / parseMs, legacyMs / parseMs, mismatches);
+
+			if (threads == maxThreads)
+				break;
+		}
+	}
+	threadPool.SetThreadLimit(0);
+}
+
+
+// --------------------------------------------------------
+// Every .obj in a folder, sorted by name
+// --------------------------------------------------------
+static std::vector<std::filesystem::path> FindObjFiles(const std::wstring& modelFolder)
+{
+	std::vector<std::filesystem::path> files;
+	std::error_code error;
+	for (std::filesystem::directory_iterator it(modelFolder, error), end; !error && it != end; it.increment(error))
+	{
+		if (it->is_regular_file() && it->path().extension() == ".obj")
+			files.push_back(it->path());
+	}
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+
+// --------------------------------------------------------
+// Parses and welds each model (in its file's order, with
+// no optimization), then reorders it with OptimizeMesh and
+// compares the two orders: the post-transform cache's ACMR
+// and ATVR over a range of (FIFO) cache sizes, and how many
+// bytes of vertex data a small memory cache pulls in
+// --------------------------------------------------------
+static void RunVertexCacheBenchmark(const std::vector<std::filesystem::path>& files)
+{
+	printf("\nVertex cache (simulated FIFO caches, the file's order vs Tipsify tuned for %d entries):\n", VERTEX_CACHE_SIZE);
+	printf("  %-24s %8s %6s %8s %8s %8s %8s %8s\n",
+		"mesh", "tris", "cache", "ACMR", "->", "ATVR", "->", "saved");
+
+	std::vector<MeshData> optimized(files.size());
+	std::vector<MeshData> original(files.size());
+	std::vector<double> optimizeMs(files.size());
+	for (size_t f = 0; f < files.size(); f++)
+	{
+		MappedFile file(files[f].wstring());
+		if (!file.IsOpen() || !ParseOBJ(file.GetData(), file.GetSize(), original[f]) || original[f].Indices.empty())
+			continue;
+		WeldVertices(original[f]);
+
+		optimized[f] = original[f];
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		OptimizeMesh(optimized[f]);
+		optimizeMs[f] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		const MeshData& before = original[f];
+		const MeshData& after = optimized[f];
+		std::string name = files[f].filename().string();
+		for (unsigned int cacheSize : vertexCacheSizes)
+		{
+			VertexCacheStats a = AnalyzeVertexCache(before.Indices.data(), before.Indices.size(), before.Vertices.size(), cacheSize);
+			VertexCacheStats b = AnalyzeVertexCache(after.Indices.data(), after.Indices.size(), after.Vertices.size(), cacheSize);
+			printf("  %-24s %8zu %6u %8.3f %8.3f %8.3f %8.3f %7.1f%%\n",
+				name.c_str(), before.Indices.size() / 3, cacheSize, a.ACMR, b.ACMR, a.ATVR, b.ATVR,
+				a.ACMR > 0 ? 100.0 * (1.0 - b.ACMR / a.ACMR) : 0.0);
+		}
+	}
+
+	printf("\n  %-24s %10s %10s %12s\n", "mesh", "overfetch", "->", "optimize ms");
+	for (size_t f = 0; f < files.size(); f++)
+	{
+		const MeshData& before = original[f];
+		const MeshData& after = optimized[f];
+		if (before.Indices.empty())
+			continue;
+
+		printf("  %-24s %10.3f %10.3f %12.3f\n",
+			files[f].filename().string().c_str(),
+			AnalyzeVertexFetch(before.Indices.data(), before.Indices.size(), before.Vertices.size(), sizeof(Vertex)),
+			AnalyzeVertexFetch(after.Indices.data(), after.Indices.size(), after.Vertices.size(), sizeof(Vertex)),
+			optimizeMs[f]);
+	}
+}
+
+
+// --------------------------------------------------------
+// Times both tangent paths on helix.obj strung together
+// into bigger and bigger meshes: the serial loop, then the
+// parallel one on 1, 2, 4... threads (up to every core).
+// Where the parallel one starts winning is what sets
+// CalculateTangents' thresholds (see MeshData.cpp).  Also
+// shows how far apart their tangents ever get.
+// --------------------------------------------------------
+static void RunTangentBenchmark(const std::wstring& objFile)
+{
+	MappedFile file(objFile);
+	if (!file.IsOpen())
+	{
+		printf("\nTangents: couldn't open helix.obj\n");
+		return;
+	}
+
+	ThreadPool& threadPool = ThreadPool::GetInstance();
+	unsigned int maxThreads = threadPool.GetThreadCount();
+	printf("\nTangents (helix.obj strung together, best of %d runs, parallel vs the serial loop):\n", MESH_BENCHMARK_PARSES);
+	printf("  %-6s %9s %8s %10s %9s %8s %10s\n", "copies", "tris", "threads", "ms", "Mtri/s", "vs loop", "max error");
+
+	std::string text;
+	MeshData mesh;
+	std::vector<Vertex> serial;
+	std::vector<Vertex> parallel;
+	for (int copies : tangentScales)
+	{
+		ScaleObjText(file.GetData(), file.GetSize(), copies, text);
+		if (!ParseOBJ(text.data(), text.size(), mesh) || mesh.Indices.empty())
+			continue;
+		WeldVertices(mesh);
+		size_t triangles = mesh.Indices.size() / 3;
+
+		double serialMs = 0;
+		for (int pass = 0; pass < MESH_BENCHMARK_PARSES; pass++)
+		{
+			serial = mesh.Vertices;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			CalculateTangentsSerial(serial.data(), serial.size(), mesh.Indices.data(), mesh.Indices.size());
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			serialMs = pass == 0 ? ms : (std::min)(serialMs, ms);
+		}
+		printf("  %-6d %9zu %8s %10.3f %9.1f\n", copies, triangles, "loop", serialMs, triangles / serialMs / 1000.0);
+
+		for (unsigned int threads = 1; ; threads = (std::min)(threads * 2, maxThreads))
+		{
+			threadPool.SetThreadLimit(threads);
+			double parallelMs = 0;
+			for (int pass = 0; pass < MESH_BENCHMARK_PARSES; pass++)
+			{
+				parallel = mesh.Vertices;
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				CalculateTangentsParallel(parallel.data(), parallel.size(), mesh.Indices.data(), mesh.Indices.size());
+				double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				parallelMs = pass == 0 ? ms : (std::min)(parallelMs, ms);
+			}
+
+			// Largest difference in any tangent component
+			float maxError = 0.0f;
+			for (size_t i = 0; i < serial.size(); i++)
+			{
+				const XMFLOAT3& a = serial[i].Tangent;
+				const XMFLOAT3& b = parallel[i].Tangent;
+				maxError = (std::max)(maxError, (std::max)(fabsf(a.x - b.x), (std::max)(fabsf(a.y - b.y), fabsf(a.z - b.z))));
+			}
+
+			printf("  %-6d %9zu %8u %10.3f %9.1f %7.2fx %10.2g\n",
+				copies, triangles, threads, parallelMs, triangles / parallelMs / 1000.0, serialMs / parallelMs, maxError);
+
+			if (threads == maxThreads)
+				break;
+		}
+	}
+	threadPool.SetThreadLimit(0);
+}
+
+
+// --------------------------------------------------------
+// Runs each of the mesh pipeline benchmarks in turn
+//
+// modelFolder - Folder holding the .obj files
+// --------------------------------------------------------
+void RunMeshBenchmark(const std::wstring& modelFolder)
+{
+	std::vector<std::filesystem::path> files = FindObjFiles(modelFolder);
+
+	RunObjParseBenchmark((std::filesystem::path(modelFolder) / L"helix.obj").wstring());
+	RunVertexCacheBenchmark(files);
+	RunTangentBenchmark((std::filesystem::path(modelFolder) / L"helix.obj").wstring());
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+
+// Times the CPU side of the mesh pipeline on the .obj models
+// in a folder, printing the numbers (no GPU needed)
+void RunMeshBenchmark(const std::wstring& modelFolder);
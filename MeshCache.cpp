@@ -0,0 +1,386 @@
+#include "MeshCache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+// Keeps the vertex data nicely aligned within the file
+#define MESH_CACHE_ALIGNMENT 16
+#define ALIGN(value, alignment) (((value + alignment - 1) / alignment) * alignment)
+
+// --------------------------------------------------------
+// Maps the given cache file and checks that it matches the
+// current source file, vertex layout and processing flags.
+// If anything is off (missing, stale, truncated) IsValid()
+// returns false and the caller should rebuild from the
+// source.
+// --------------------------------------------------------
+MeshCache::MeshCache(const std::wstring& cacheFile, uint64_t sourceHash, uint64_t sourceSize, uint32_t flags) :
+	file(std::make_unique<MappedFile>(cacheFile)),
+	data(0),
+	header(0)
+{
+	if (!file->IsOpen())
+		return;
+
+	const MeshCacheHeader* h = Validate(file->GetData(), file->GetSize(), flags);
+	if (!h ||
+		h->SourceHash != sourceHash ||
+		h->SourceSize != sourceSize)
+		return;
+
+	data = file->GetData();
+	header = h;
+}
+
+
+// --------------------------------------------------------
+// Wraps .meshbin data that's already in memory.  There's no
+// source file to compare against, so only the layout and
+// processing flags are checked.
+// --------------------------------------------------------
+MeshCache::MeshCache(const char* data, size_t size, uint32_t flags) :
+	data(0),
+	header(0)
+{
+	header = Validate(data, size, flags);
+	if (header)
+		this->data = data;
+}
+
+
+// --------------------------------------------------------
+// Returns the header if the data is a complete .meshbin
+// with the current vertex layout and the given flags, its
+// arrays are aligned (they're read in place), and every
+// index (of every LOD, and of every meshlet) is in range
+// --------------------------------------------------------
+const MeshCacheHeader* MeshCache::Validate(const char* data, size_t size, uint32_t flags)
+{
+	if (!data || size < sizeof(MeshCacheHeader))
+		return 0;
+
+	const MeshCacheHeader* h = (const MeshCacheHeader*)data;
+	if (memcmp(h->Magic, "MBIN", 4) != 0 ||
+		h->Version != MESH_CACHE_VERSION ||
+		h->VertexStride != sizeof(Vertex) ||
+		h->Flags != flags)
+		return 0;
+
+	// Make sure the arrays actually fit in the file
+	if (h->LodCount > MESH_MAX_LODS - 1)
+		return 0;
+
+	uint64_t totalIndices = h->IndexCount;
+	for (uint32_t i = 0; i < h->LodCount; i++)
+		totalIndices += h->LodIndexCounts[i];
+
+	uint64_t vertexEnd = (uint64_t)h->VertexOffset + (uint64_t)h->VertexCount * sizeof(Vertex);
+	uint64_t indexEnd = (uint64_t)h->IndexOffset + totalIndices * sizeof(unsigned int);
+	if (h->VertexOffset < sizeof(MeshCacheHeader) ||
+		h->IndexOffset < vertexEnd ||
+		indexEnd > size)
+		return 0;
+	if (h->VertexOffset % MESH_CACHE_ALIGNMENT != 0 ||
+		h->IndexOffset % MESH_CACHE_ALIGNMENT != 0)
+		return 0;
+
+	// Every level has to be whole triangles, and every index (which
+	// goes straight to the BVH builder and the GPU) has to point at a
+	// vertex, so a corrupted file is rebuilt instead of read past
+	if (h->IndexCount % 3 != 0)
+		return 0;
+	for (uint32_t i = 0; i < h->LodCount; i++)
+	{
+		if (h->LodIndexCounts[i] % 3 != 0)
+			return 0;
+	}
+
+	const unsigned int* indices = (const unsigned int*)(data + h->IndexOffset);
+	unsigned int maxIndex = 0;
+	for (uint64_t i = 0; i < totalIndices; i++)
+		maxIndex = (std::max)(maxIndex, indices[i]);
+	if (totalIndices > 0 && maxIndex >= h->VertexCount)
+		return 0;
+
+	if (h->MeshletCount > 0 && !ValidateMeshlets(data, size, h, indexEnd))
+		return 0;
+
+	return h;
+}
+
+
+// --------------------------------------------------------
+// Checks that the meshlet arrays fit after the indices, and
+// that every meshlet stays within its limits and arrays
+// --------------------------------------------------------
+bool MeshCache::ValidateMeshlets(const char* data, size_t size, const MeshCacheHeader* h, uint64_t indexEnd)
+{
+	uint64_t boundsOffset = (uint64_t)h->MeshletOffset + (uint64_t)h->MeshletCount * sizeof(Meshlet);
+	uint64_t vertexOffset = boundsOffset + (uint64_t)h->MeshletCount * sizeof(MeshletBounds);
+	uint64_t triangleOffset = vertexOffset + (uint64_t)h->MeshletVertexCount * sizeof(unsigned int);
+	uint64_t end = triangleOffset + (uint64_t)h->MeshletTriangleCount * 3;
+	if (h->MeshletOffset < indexEnd || h->MeshletOffset % MESH_CACHE_ALIGNMENT != 0 || end > size)
+		return false;
+
+	const Meshlet* meshlets = (const Meshlet*)(data + h->MeshletOffset);
+	const unsigned int* vertices = (const unsigned int*)(data + vertexOffset);
+	const uint8_t* triangles = (const uint8_t*)(data + triangleOffset);
+	for (uint32_t m = 0; m < h->MeshletCount; m++)
+	{
+		const Meshlet& meshlet = meshlets[m];
+		if (meshlet.VertexCount > MESHLET_MAX_VERTICES ||
+			meshlet.TriangleCount > MESHLET_MAX_TRIANGLES ||
+			(uint64_t)meshlet.VertexOffset + meshlet.VertexCount > h->MeshletVertexCount ||
+			(uint64_t)meshlet.TriangleOffset + meshlet.TriangleCount > h->MeshletTriangleCount)
+			return false;
+
+		for (uint32_t v = 0; v < meshlet.VertexCount; v++)
+		{
+			if (vertices[meshlet.VertexOffset + v] >= h->VertexCount)
+				return false;
+		}
+
+		const uint8_t* local = &triangles[(size_t)meshlet.TriangleOffset * 3];
+		for (uint32_t i = 0; i < meshlet.TriangleCount * 3; i++)
+		{
+			if (local[i] >= meshlet.VertexCount)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Pointers into the cached data (null if not valid)
+// --------------------------------------------------------
+const Vertex* MeshCache::GetVertices()
+{
+	return header ? (const Vertex*)(data + header->VertexOffset) : 0;
+}
+
+const unsigned int* MeshCache::GetIndices()
+{
+	return header ? (const unsigned int*)(data + header->IndexOffset) : 0;
+}
+
+const unsigned int* MeshCache::GetLodIndices(unsigned int lod)
+{
+	if (!header || lod >= header->LodCount)
+		return 0;
+
+	const unsigned int* indices = GetIndices() + header->IndexCount;
+	for (unsigned int i = 0; i < lod; i++)
+		indices += header->LodIndexCounts[i];
+	return indices;
+}
+
+const Meshlet* MeshCache::GetMeshlets()
+{
+	return header && header->MeshletCount > 0 ? (const Meshlet*)(data + header->MeshletOffset) : 0;
+}
+
+const MeshletBounds* MeshCache::GetMeshletBounds()
+{
+	const Meshlet* meshlets = GetMeshlets();
+	return meshlets ? (const MeshletBounds*)(meshlets + header->MeshletCount) : 0;
+}
+
+const unsigned int* MeshCache::GetMeshletVertices()
+{
+	const MeshletBounds* bounds = GetMeshletBounds();
+	return bounds ? (const unsigned int*)(bounds + header->MeshletCount) : 0;
+}
+
+const uint8_t* MeshCache::GetMeshletTriangles()
+{
+	const unsigned int* vertices = GetMeshletVertices();
+	return vertices ? (const uint8_t*)(vertices + header->MeshletVertexCount) : 0;
+}
+
+
+// --------------------------------------------------------
+// Lays out the given geometry exactly as a cache file
+// would hold it (header, vertices, all indices, then the
+// meshlet arrays)
+// --------------------------------------------------------
+std::vector<char> MeshCache::Serialize(
+	const MeshData& meshData,
+	uint64_t sourceHash,
+	uint64_t sourceSize,
+	uint32_t flags,
+	DirectX::XMFLOAT3 boundsMin,
+	DirectX::XMFLOAT3 boundsMax)
+{
+	size_t vertexBytes = meshData.Vertices.size() * sizeof(Vertex);
+	size_t indexBytes = meshData.Indices.size() * sizeof(unsigned int);
+
+	MeshCacheHeader header = {};
+	memcpy(header.Magic, "MBIN", 4);
+	header.Version = MESH_CACHE_VERSION;
+	header.VertexStride = sizeof(Vertex);
+	header.VertexCount = (uint32_t)meshData.Vertices.size();
+	header.IndexCount = (uint32_t)meshData.Indices.size();
+	header.VertexOffset = (uint32_t)ALIGN(sizeof(MeshCacheHeader), MESH_CACHE_ALIGNMENT);
+	header.IndexOffset = (uint32_t)ALIGN(header.VertexOffset + vertexBytes, MESH_CACHE_ALIGNMENT);
+	header.Flags = flags;
+	header.SourceHash = sourceHash;
+	header.SourceSize = sourceSize;
+	header.BoundsMin = boundsMin;
+	header.BoundsMax = boundsMax;
+	header.LodCount = (uint32_t)(std::min)(meshData.Lods.size(), (size_t)MESH_MAX_LODS - 1);
+
+	size_t totalBytes = header.IndexOffset + indexBytes;
+	for (uint32_t i = 0; i < header.LodCount; i++)
+	{
+		header.LodIndexCounts[i] = (uint32_t)meshData.Lods[i].Indices.size();
+		header.LodErrors[i] = meshData.Lods[i].Error;
+		totalBytes += meshData.Lods[i].Indices.size() * sizeof(unsigned int);
+	}
+
+	const MeshletData& meshlets = meshData.Meshlets;
+	size_t meshletBytes[4] =
+	{
+		meshlets.Meshlets.size() * sizeof(Meshlet),
+		meshlets.Bounds.size() * sizeof(MeshletBounds),
+		meshlets.Vertices.size() * sizeof(unsigned int),
+		meshlets.Triangles.size(),
+	};
+	if (!meshlets.Meshlets.empty())
+	{
+		header.MeshletCount = (uint32_t)meshlets.Meshlets.size();
+		header.MeshletVertexCount = (uint32_t)meshlets.Vertices.size();
+		header.MeshletTriangleCount = (uint32_t)(meshlets.Triangles.size() / 3);
+		header.MeshletOffset = (uint32_t)ALIGN(totalBytes, MESH_CACHE_ALIGNMENT);
+		totalBytes = header.MeshletOffset + meshletBytes[0] + meshletBytes[1] + meshletBytes[2] + meshletBytes[3];
+	}
+
+	// Padding between arrays stays zeroed
+	std::vector<char> bytes(totalBytes, 0);
+	memcpy(bytes.data(), &header, sizeof(MeshCacheHeader));
+	memcpy(bytes.data() + header.VertexOffset, meshData.Vertices.data(), vertexBytes);
+	memcpy(bytes.data() + header.IndexOffset, meshData.Indices.data(), indexBytes);
+
+	size_t offset = header.IndexOffset + indexBytes;
+	for (uint32_t i = 0; i < header.LodCount; i++)
+	{
+		size_t lodBytes = meshData.Lods[i].Indices.size() * sizeof(unsigned int);
+		memcpy(bytes.data() + offset, meshData.Lods[i].Indices.data(), lodBytes);
+		offset += lodBytes;
+	}
+
+	if (header.MeshletCount > 0)
+	{
+		const void* arrays[4] = { meshlets.Meshlets.data(), meshlets.Bounds.data(), meshlets.Vertices.data(), meshlets.Triangles.data() };
+		offset = header.MeshletOffset;
+		for (int i = 0; i < 4; i++)
+		{
+			memcpy(bytes.data() + offset, arrays[i], meshletBytes[i]);
+			offset += meshletBytes[i];
+		}
+	}
+
+	return bytes;
+}
+
+
+// --------------------------------------------------------
+// Writes the given geometry to a cache file
+//
+// - The geometry should be final (welded, tangents calculated)
+//    since it is handed straight to the GPU on load
+// - Writes to a temporary file first and then swaps it in,
+//    so a crash mid-write never leaves a half-written cache.
+//    Each write gets its own temporary file, so loads of the
+//    same mesh racing each other never write into one file.
+//
+// Returns false if the file couldn't be written
+// --------------------------------------------------------
+bool MeshCache::Write(
+	const std::wstring& cacheFile,
+	const MeshData& meshData,
+	uint64_t sourceHash,
+	uint64_t sourceSize,
+	uint32_t flags,
+	DirectX::XMFLOAT3 boundsMin,
+	DirectX::XMFLOAT3 boundsMax)
+{
+	std::vector<char> bytes = Serialize(meshData, sourceHash, sourceSize, flags, boundsMin, boundsMax);
+
+	std::filesystem::path finalPath(cacheFile);
+	std::filesystem::path tempPath(GetTempPath(cacheFile));
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if (!out.is_open())
+			return false;
+
+		out.write(bytes.data(), bytes.size());
+		if (!out.good())
+			return false;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempPath, finalPath, error);
+	if (error)
+	{
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
+
+	return true;
+}
+
+
+// --------------------------------------------------------
+// A temporary file name next to the cache that no other
+// write (from this thread or any other) is using, like
+// "cube.meshbin.81235.7.tmp"
+// --------------------------------------------------------
+std::wstring MeshCache::GetTempPath(const std::wstring& cacheFile)
+{
+	static std::atomic<uint32_t> writeCount(0);
+	size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+	return cacheFile + L"." + std::to_wstring(thread) + L"." + std::to_wstring(writeCount++) + L".tmp";
+}
+
+
+// --------------------------------------------------------
+// The cache sits next to its source file, so
+// "Models/cube.obj" is cached as "Models/cube.meshbin"
+// --------------------------------------------------------
+std::wstring MeshCache::GetCachePath(const std::wstring& sourceFile)
+{
+	return std::filesystem::path(sourceFile).replace_extension(L".meshbin").wstring();
+}
+
+
+// --------------------------------------------------------
+// A quick 64-bit hash (FNV-1a style, but a word at a time)
+// - Not cryptographic, just good at noticing edits
+// --------------------------------------------------------
+uint64_t MeshCache::HashData(const char* data, size_t size)
+{
+	const uint64_t prime = 0x100000001B3ull;
+	uint64_t hash = 0xCBF29CE484222325ull ^ size;
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * prime;
+		hash ^= hash >> 29;
+	}
+	for (; i < size; i++)
+	{
+		hash = (hash ^ (unsigned char)data[i]) * prime;
+	}
+
+	return hash ^ (hash >> 32);
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MeshData.h"
+#include "MappedFile.h"
+
+// Bump this whenever the layout of a .meshbin file (or of the
+// data we store in it, like tangents) changes
+#define MESH_CACHE_VERSION 4
+
+// Processing that was applied to the cached geometry
+#define MESH_CACHE_FLAG_OPTIMIZED 0x1
+#define MESH_CACHE_FLAG_LODS 0x2
+#define MESH_CACHE_FLAG_MESHLETS 0x4
+
+// --------------------------------------------------------
+// Header at the start of every .meshbin file, followed by
+// the final vertex array and then the index array, which
+// holds the base mesh's indices and then each LOD's in order.
+// Meshlets (if any) come last: the meshlets, their bounds,
+// their vertices and then their triangles.
+// --------------------------------------------------------
+struct MeshCacheHeader
+{
+	char Magic[4];				// Always "MBIN"
+	uint32_t Version;			// MESH_CACHE_VERSION when written
+	uint32_t VertexStride;		// sizeof(Vertex) when written
+	uint32_t VertexCount;
+	uint32_t IndexCount;
+	uint32_t VertexOffset;		// Byte offsets from start of file
+	uint32_t IndexOffset;
+	uint32_t Flags;				// MESH_CACHE_FLAG_ values
+	uint64_t SourceHash;		// Hash of the file this was built from
+	uint64_t SourceSize;
+	DirectX::XMFLOAT3 BoundsMin;
+	DirectX::XMFLOAT3 BoundsMax;
+	uint32_t LodCount;			// Not including the base mesh
+	uint32_t LodIndexCounts[MESH_MAX_LODS - 1];
+	float LodErrors[MESH_MAX_LODS - 1];
+	uint32_t MeshletCount;
+	uint32_t MeshletVertexCount;	// Entries in the meshlet vertex array
+	uint32_t MeshletTriangleCount;	// Triangles (3 bytes each) in the meshlet triangle array
+	uint32_t MeshletOffset;			// Byte offset of the meshlets (and the arrays after them)
+};
+
+// --------------------------------------------------------
+// A validated, memory-mapped .meshbin file.  The vertex and
+// index pointers point straight into the mapping, so they
+// are only valid while this object is alive.
+//
+// Can also wrap .meshbin data that is already in memory
+// (like a mesh inside an AssetPack), in which case that
+// memory must outlive this object too.
+// --------------------------------------------------------
+class MeshCache
+{
+public:
+	MeshCache(const std::wstring& cacheFile, uint64_t sourceHash, uint64_t sourceSize, uint32_t flags);
+	MeshCache(const char* data, size_t size, uint32_t flags);
+
+	bool IsValid() { return header != 0; }
+	const MeshCacheHeader* GetHeader() { return header; }
+	const Vertex* GetVertices();
+	const unsigned int* GetIndices();
+	const unsigned int* GetLodIndices(unsigned int lod);
+	const Meshlet* GetMeshlets();
+	const MeshletBounds* GetMeshletBounds();
+	const unsigned int* GetMeshletVertices();
+	const uint8_t* GetMeshletTriangles();
+
+	// Writes a new cache file for already processed geometry
+	static bool Write(
+		const std::wstring& cacheFile,
+		const MeshData& meshData,
+		uint64_t sourceHash,
+		uint64_t sourceSize,
+		uint32_t flags,
+		DirectX::XMFLOAT3 boundsMin,
+		DirectX::XMFLOAT3 boundsMax);
+
+	// The exact bytes Write() puts in a cache file
+	static std::vector<char> Serialize(
+		const MeshData& meshData,
+		uint64_t sourceHash,
+		uint64_t sourceSize,
+		uint32_t flags,
+		DirectX::XMFLOAT3 boundsMin,
+		DirectX::XMFLOAT3 boundsMax);
+
+	// Path of the cache file that sits next to a source file
+	static std::wstring GetCachePath(const std::wstring& sourceFile);
+
+	// Hash used to detect changes to the source file
+	static uint64_t HashData(const char* data, size_t size);
+
+private:
+	std::unique_ptr<MappedFile> file; // Only when we mapped it ourselves
+	const char* data;
+	const MeshCacheHeader* header;
+
+	// Checks the header and layout (but not the source)
+	const MeshCacheHeader* Validate(const char* data, size_t size, uint32_t flags);
+	bool ValidateMeshlets(const char* data, size_t size, const MeshCacheHeader* h, uint64_t indexEnd);
+
+	// Where each Write() puts the file before renaming it
+	static std::wstring GetTempPath(const std::wstring& cacheFile);
+};
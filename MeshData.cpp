@@ -0,0 +1,387 @@
+#include "MeshData.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+// Triangles (or vertices) per parallel job in CalculateTangentsParallel,
+// which must be a multiple of 4 (the SIMD width)
+#define TANGENT_JOB_SIZE 16384
+
+// The parallel version does a few times the work of the serial
+// loop (see RunTangentBenchmark), so CalculateTangents only uses
+// it with at least this many threads to share the work...
+#define TANGENT_PARALLEL_MIN_THREADS 8
+
+// ...on meshes big enough to give each of them a few jobs
+#define TANGENT_PARALLEL_MIN_TRIANGLES (1 << 18)
+
+using namespace DirectX;
+
+// --------------------------------------------------------
+// Calculates the local space bounding box of the vertices
+// --------------------------------------------------------
+void CalculateBounds(const Vertex* verts, size_t numVerts, XMFLOAT3& boundsMin, XMFLOAT3& boundsMax)
+{
+	boundsMin = XMFLOAT3(0, 0, 0);
+	boundsMax = XMFLOAT3(0, 0, 0);
+	if (numVerts == 0)
+		return;
+
+	XMVECTOR minV = XMLoadFloat3(&verts[0].Position);
+	XMVECTOR maxV = minV;
+	for (size_t i = 1; i < numVerts; i++)
+	{
+		XMVECTOR pos = XMLoadFloat3(&verts[i].Position);
+		minV = XMVectorMin(minV, pos);
+		maxV = XMVectorMax(maxV, pos);
+	}
+
+	XMStoreFloat3(&boundsMin, minV);
+	XMStoreFloat3(&boundsMax, maxV);
+}
+
+// --------------------------------------------------------
+// Calculates the (unnormalized) tangent of each triangle in
+// [start, end), 4 triangles at a time.  Results are stored
+// as SoA, and the arrays must be padded to a multiple of 4.
+// --------------------------------------------------------
+static void CalculateTriangleTangents(
+	const Vertex* verts,
+	const unsigned int* indices,
+	size_t start,
+	size_t end,
+	float* tangentX,
+	float* tangentY,
+	float* tangentZ)
+{
+	for (size_t t = start; t < end; t += 4)
+	{
+		// Grab the vertices of each triangle (repeating the
+		// last one if we're short, which lands in the padding)
+		const Vertex* v1[4];
+		const Vertex* v2[4];
+		const Vertex* v3[4];
+		for (size_t lane = 0; lane < 4; lane++)
+		{
+			size_t triangle = (std::min)(t + lane, end - 1);
+			v1[lane] = &verts[indices[triangle * 3]];
+			v2[lane] = &verts[indices[triangle * 3 + 1]];
+			v3[lane] = &verts[indices[triangle * 3 + 2]];
+		}
+
+#define GATHER(v, member) XMVectorSet(v[0]->member, v[1]->member, v[2]->member, v[3]->member)
+		// Calculate vectors relative to triangle positions
+		XMVECTOR x1 = GATHER(v2, Position.x) - GATHER(v1, Position.x);
+		XMVECTOR y1 = GATHER(v2, Position.y) - GATHER(v1, Position.y);
+		XMVECTOR z1 = GATHER(v2, Position.z) - GATHER(v1, Position.z);
+
+		XMVECTOR x2 = GATHER(v3, Position.x) - GATHER(v1, Position.x);
+		XMVECTOR y2 = GATHER(v3, Position.y) - GATHER(v1, Position.y);
+		XMVECTOR z2 = GATHER(v3, Position.z) - GATHER(v1, Position.z);
+
+		// Do the same for vectors relative to triangle uv's
+		XMVECTOR s1 = GATHER(v2, UV.x) - GATHER(v1, UV.x);
+		XMVECTOR t1 = GATHER(v2, UV.y) - GATHER(v1, UV.y);
+
+		XMVECTOR s2 = GATHER(v3, UV.x) - GATHER(v1, UV.x);
+		XMVECTOR t2 = GATHER(v3, UV.y) - GATHER(v1, UV.y);
+#undef GATHER
+
+		// Create vectors for tangent calculation
+		XMVECTOR r = XMVectorSplatOne() / (s1 * t2 - s2 * t1);
+
+		XMStoreFloat4((XMFLOAT4*)&tangentX[t], (t2 * x1 - t1 * x2) * r);
+		XMStoreFloat4((XMFLOAT4*)&tangentY[t], (t2 * y1 - t1 * y2) * r);
+		XMStoreFloat4((XMFLOAT4*)&tangentZ[t], (t2 * z1 - t1 * z2) * r);
+	}
+}
+
+
+// --------------------------------------------------------
+// Builds a list of the triangles that use each vertex, in
+// triangle order (a parallel counting sort)
+//
+// - Each thread counts a slice of the index buffer, then
+//    every vertex works out where each slice's entries go,
+//    and finally each thread fills in its own slice
+// - Vertex v's triangles are adjacency[start[v]] up to
+//    adjacency[start[v + 1]]
+// --------------------------------------------------------
+static void BuildVertexAdjacency(
+	const unsigned int* indices,
+	size_t numIndices,
+	size_t numVerts,
+	std::vector<unsigned int>& adjacencyStart,
+	std::vector<unsigned int>& adjacency)
+{
+	ThreadPool& threadPool = ThreadPool::GetInstance();
+	size_t slices = threadPool.GetThreadCount();
+	size_t sliceSize = (numIndices / 3 + slices - 1) / slices * 3;
+	size_t vertexJobs = (numVerts + TANGENT_JOB_SIZE - 1) / TANGENT_JOB_SIZE;
+
+	// Per-slice counts, which become per-slice write positions
+	std::vector<std::vector<unsigned int>> sliceOffsets(slices);
+	threadPool.ParallelFor(slices, [&](size_t slice)
+		{
+			std::vector<unsigned int>& counts = sliceOffsets[slice];
+			counts.assign(numVerts, 0);
+
+			size_t end = (std::min)((slice + 1) * sliceSize, numIndices);
+			for (size_t i = slice * sliceSize; i < end; i++)
+				counts[indices[i]]++;
+		});
+
+	// Total uses of each vertex, then where each vertex starts
+	adjacencyStart.assign(numVerts + 1, 0);
+	threadPool.ParallelFor(vertexJobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * TANGENT_JOB_SIZE, numVerts);
+			for (size_t v = job * TANGENT_JOB_SIZE; v < end; v++)
+			{
+				unsigned int total = 0;
+				for (size_t slice = 0; slice < slices; slice++)
+					total += sliceOffsets[slice][v];
+				adjacencyStart[v + 1] = total;
+			}
+		});
+
+	for (size_t v = 0; v < numVerts; v++)
+		adjacencyStart[v + 1] += adjacencyStart[v];
+
+	// Each slice's entries for a vertex come after earlier slices'
+	threadPool.ParallelFor(vertexJobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * TANGENT_JOB_SIZE, numVerts);
+			for (size_t v = job * TANGENT_JOB_SIZE; v < end; v++)
+			{
+				unsigned int offset = adjacencyStart[v];
+				for (size_t slice = 0; slice < slices; slice++)
+				{
+					unsigned int count = sliceOffsets[slice][v];
+					sliceOffsets[slice][v] = offset;
+					offset += count;
+				}
+			}
+		});
+
+	// Fill in the triangle indices
+	adjacency.resize(numIndices);
+	threadPool.ParallelFor(slices, [&](size_t slice)
+		{
+			std::vector<unsigned int>& offsets = sliceOffsets[slice];
+			size_t end = (std::min)((slice + 1) * sliceSize, numIndices);
+			for (size_t i = slice * sliceSize; i < end; i++)
+				adjacency[offsets[indices[i]]++] = (unsigned int)(i / 3);
+		});
+}
+
+
+// --------------------------------------------------------
+// Calculates the tangents of the vertices in a mesh
+// - Code originally adapted from: http://www.terathon.com/code/tangent.html
+//   - Updated version now found here: http://foundationsofgameenginedev.com/FGED2-sample.pdf
+//   - See listing 7.4 in section 7.5 (page 9 of the PDF)
+//
+// - Note: For this code to work, your Vertex format must
+//         contain an XMFLOAT3 called Tangent
+//
+// - Be sure to call this BEFORE creating your D3D vertex/index buffers
+//
+// Large meshes are split across the thread pool when it has
+// enough threads to make up for the extra work, and the rest
+// go through the serial loop
+// --------------------------------------------------------
+void CalculateTangents(Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices)
+{
+	if (numIndices / 3 >= TANGENT_PARALLEL_MIN_TRIANGLES &&
+		ThreadPool::GetInstance().GetThreadCount() >= TANGENT_PARALLEL_MIN_THREADS)
+		CalculateTangentsParallel(verts, numVerts, indices, numIndices);
+	else
+		CalculateTangentsSerial(verts, numVerts, indices, numIndices);
+}
+
+
+// --------------------------------------------------------
+// The original loop, one triangle at a time
+// --------------------------------------------------------
+void CalculateTangentsSerial(Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices)
+{
+	// Reset tangents
+	for (size_t i = 0; i < numVerts; i++)
+	{
+		verts[i].Tangent = XMFLOAT3(0, 0, 0);
+	}
+
+	// Calculate tangents one whole triangle at a time
+	for (size_t i = 0; i < numIndices;)
+	{
+		// Grab indices and vertices of first triangle
+		unsigned int i1 = indices[i++];
+		unsigned int i2 = indices[i++];
+		unsigned int i3 = indices[i++];
+		Vertex* v1 = &verts[i1];
+		Vertex* v2 = &verts[i2];
+		Vertex* v3 = &verts[i3];
+
+		// Calculate vectors relative to triangle positions
+		float x1 = v2->Position.x - v1->Position.x;
+		float y1 = v2->Position.y - v1->Position.y;
+		float z1 = v2->Position.z - v1->Position.z;
+
+		float x2 = v3->Position.x - v1->Position.x;
+		float y2 = v3->Position.y - v1->Position.y;
+		float z2 = v3->Position.z - v1->Position.z;
+
+		// Do the same for vectors relative to triangle uv's
+		float s1 = v2->UV.x - v1->UV.x;
+		float t1 = v2->UV.y - v1->UV.y;
+
+		float s2 = v3->UV.x - v1->UV.x;
+		float t2 = v3->UV.y - v1->UV.y;
+
+		// Create vectors for tangent calculation
+		float r = 1.0f / (s1 * t2 - s2 * t1);
+
+		float tx = (t2 * x1 - t1 * x2) * r;
+		float ty = (t2 * y1 - t1 * y2) * r;
+		float tz = (t2 * z1 - t1 * z2) * r;
+
+		// Adjust tangents of each vert of the triangle
+		v1->Tangent.x += tx;
+		v1->Tangent.y += ty;
+		v1->Tangent.z += tz;
+
+		v2->Tangent.x += tx;
+		v2->Tangent.y += ty;
+		v2->Tangent.z += tz;
+
+		v3->Tangent.x += tx;
+		v3->Tangent.y += ty;
+		v3->Tangent.z += tz;
+	}
+
+	// Ensure all of the tangents are orthogonal to the normals
+	for (size_t i = 0; i < numVerts; i++)
+	{
+		// Grab the two vectors
+		XMVECTOR normal = XMLoadFloat3(&verts[i].Normal);
+		XMVECTOR tangent = XMLoadFloat3(&verts[i].Tangent);
+
+		// Use Gram-Schmidt orthonormalize to ensure
+		// the normal and tangent are exactly 90 degrees apart
+		tangent = XMVector3Normalize(
+			tangent - normal * XMVector3Dot(normal, tangent));
+
+		// Store the tangent
+		XMStoreFloat3(&verts[i].Tangent, tangent);
+	}
+}
+
+
+// --------------------------------------------------------
+// The same tangents, split across the thread pool.  Adding
+// each triangle's tangent into its three vertices can't be
+// split across threads without atomics, so this goes in
+// three passes:
+//
+//  1. Tangents for 4 triangles at a time, stored as SoA
+//  2. Each vertex sums up its own triangles' tangents, using
+//     a vertex -> triangle adjacency list
+//  3. Gram-Schmidt, 4 vertices at a time
+//
+// The sums happen in triangle order, like the serial loop's,
+// so results only differ by the SIMD math's rounding.
+// --------------------------------------------------------
+void CalculateTangentsParallel(Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices)
+{
+	ThreadPool& threadPool = ThreadPool::GetInstance();
+	size_t numTriangles = numIndices / 3;
+
+	// SoA tangents, padded out to a whole number of SIMD batches
+	size_t paddedTriangles = (numTriangles + 3) & ~(size_t)3;
+	size_t paddedVerts = (numVerts + 3) & ~(size_t)3;
+	std::vector<float> triangleTangents(paddedTriangles * 3);
+	std::vector<float> vertexTangents(paddedVerts * 3, 0.0f);
+	float* triangleX = triangleTangents.data();
+	float* triangleY = triangleX + paddedTriangles;
+	float* triangleZ = triangleY + paddedTriangles;
+	float* vertexX = vertexTangents.data();
+	float* vertexY = vertexX + paddedVerts;
+	float* vertexZ = vertexY + paddedVerts;
+
+	// Calculate tangents 4 whole triangles at a time
+	size_t triangleJobs = (numTriangles + TANGENT_JOB_SIZE - 1) / TANGENT_JOB_SIZE;
+	threadPool.ParallelFor(triangleJobs, [&](size_t job)
+		{
+			size_t start = job * TANGENT_JOB_SIZE;
+			size_t end = (std::min)(start + TANGENT_JOB_SIZE, numTriangles);
+			CalculateTriangleTangents(verts, indices, start, end, triangleX, triangleY, triangleZ);
+		});
+
+	// Adjust tangents of each vert of each triangle, each vertex
+	// gathering from its own triangles (so no two jobs share one)
+	std::vector<unsigned int> adjacencyStart;
+	std::vector<unsigned int> adjacency;
+	BuildVertexAdjacency(indices, numTriangles * 3, numVerts, adjacencyStart, adjacency);
+
+	size_t vertexJobs = (numVerts + TANGENT_JOB_SIZE - 1) / TANGENT_JOB_SIZE;
+	threadPool.ParallelFor(vertexJobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * TANGENT_JOB_SIZE, numVerts);
+			for (size_t v = job * TANGENT_JOB_SIZE; v < end; v++)
+			{
+				float x = 0, y = 0, z = 0;
+				for (unsigned int a = adjacencyStart[v]; a < adjacencyStart[v + 1]; a++)
+				{
+					unsigned int triangle = adjacency[a];
+					x += triangleX[triangle];
+					y += triangleY[triangle];
+					z += triangleZ[triangle];
+				}
+				vertexX[v] = x;
+				vertexY[v] = y;
+				vertexZ[v] = z;
+			}
+		});
+
+	// Ensure all of the tangents are orthogonal to the normals
+	threadPool.ParallelFor(vertexJobs, [&](size_t job)
+		{
+			size_t start = job * TANGENT_JOB_SIZE;
+			size_t end = (std::min)(start + TANGENT_JOB_SIZE, numVerts);
+			for (size_t v = start; v < end; v += 4)
+			{
+				// Grab the two vectors for 4 vertices (repeating
+				// the last one if we're short)
+				size_t lanes = (std::min)((size_t)4, end - v);
+				const Vertex* vert[4];
+				for (size_t lane = 0; lane < 4; lane++)
+					vert[lane] = &verts[v + (std::min)(lane, lanes - 1)];
+
+				XMVECTOR nx = XMVectorSet(vert[0]->Normal.x, vert[1]->Normal.x, vert[2]->Normal.x, vert[3]->Normal.x);
+				XMVECTOR ny = XMVectorSet(vert[0]->Normal.y, vert[1]->Normal.y, vert[2]->Normal.y, vert[3]->Normal.y);
+				XMVECTOR nz = XMVectorSet(vert[0]->Normal.z, vert[1]->Normal.z, vert[2]->Normal.z, vert[3]->Normal.z);
+				XMVECTOR tx = XMLoadFloat4((const XMFLOAT4*)&vertexX[v]);
+				XMVECTOR ty = XMLoadFloat4((const XMFLOAT4*)&vertexY[v]);
+				XMVECTOR tz = XMLoadFloat4((const XMFLOAT4*)&vertexZ[v]);
+
+				// Use Gram-Schmidt orthonormalize to ensure
+				// the normal and tangent are exactly 90 degrees apart
+				XMVECTOR dot = nx * tx + ny * ty + nz * tz;
+				tx -= nx * dot;
+				ty -= ny * dot;
+				tz -= nz * dot;
+
+				// Normalize, leaving zero length tangents at zero
+				XMVECTOR length = XMVectorSqrt(tx * tx + ty * ty + tz * tz);
+				XMVECTOR isZero = XMVectorEqual(length, XMVectorZero());
+				XMStoreFloat4((XMFLOAT4*)&vertexX[v], XMVectorSelect(tx / length, XMVectorZero(), isZero));
+				XMStoreFloat4((XMFLOAT4*)&vertexY[v], XMVectorSelect(ty / length, XMVectorZero(), isZero));
+				XMStoreFloat4((XMFLOAT4*)&vertexZ[v], XMVectorSelect(tz / length, XMVectorZero(), isZero));
+
+				// Store the tangents
+				for (size_t lane = 0; lane < lanes; lane++)
+					verts[v + lane].Tangent = XMFLOAT3(vertexX[v + lane], vertexY[v + lane], vertexZ[v + lane]);
+			}
+		});
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "MeshletBuilder.h"
+#include "Vertex.h"
+
+// Most detail levels a mesh can have, including the original
+#define MESH_MAX_LODS 5
+
+// --------------------------------------------------------
+// A lower detail version of a mesh, which indexes into the
+// same vertices as the original
+// --------------------------------------------------------
+struct MeshLod
+{
+	std::vector<unsigned int> Indices;
+	float Error;	// Largest deviation from the original, in local space units
+};
+
+// --------------------------------------------------------
+// CPU-side geometry for a single mesh, ready to be handed
+// off to Mesh for buffer creation.  Has no D3D dependencies
+// so it can be produced (and inspected) without a device.
+// --------------------------------------------------------
+struct MeshData
+{
+	std::vector<Vertex> Vertices;
+	std::vector<unsigned int> Indices;
+
+	// Lower detail levels, from most to least detailed (may be empty)
+	std::vector<MeshLod> Lods;
+
+	// The base mesh split into meshlets (may be empty)
+	MeshletData Meshlets;
+};
+
+// CPU-side processing helpers for raw vertex/index arrays
+void CalculateBounds(const Vertex* verts, size_t numVerts, DirectX::XMFLOAT3& boundsMin, DirectX::XMFLOAT3& boundsMax);
+void CalculateTangents(Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices); // Uses the ThreadPool on large meshes
+
+// The two ways CalculateTangents can go, for tests and benchmarks
+void CalculateTangentsSerial(Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices);
+void CalculateTangentsParallel(Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices);
@@ -0,0 +1,271 @@
+#include "MeshLoader.h"
+#include "AssetPack.h"
+#include "MappedFile.h"
+#include "ObjLoader.h"
+
+#include <chrono>
+
+// Milliseconds between two points in time
+static double ElapsedMs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Clears out everything from a previous load
+static void ResetResult(const std::wstring& sourceFile, MeshLoadResult& result)
+{
+	result.Success = false;
+	result.FromCache = false;
+	result.FromPack = false;
+	result.SourceFile = sourceFile;
+	result.SourceHash = 0;
+	result.SourceSize = 0;
+	result.Flags = 0;
+	result.Vertices = 0;
+	result.VertexCount = 0;
+	result.Indices = 0;
+	result.IndexCount = 0;
+	result.BoundsMin = DirectX::XMFLOAT3(0, 0, 0);
+	result.BoundsMax = DirectX::XMFLOAT3(0, 0, 0);
+	result.LodCount = 0;
+	for (unsigned int i = 0; i < MESH_MAX_LODS - 1; i++)
+	{
+		result.LodIndices[i] = 0;
+		result.LodIndexCounts[i] = 0;
+		result.LodErrors[i] = 0;
+	}
+	result.MeshletCount = 0;
+	result.Meshlets = 0;
+	result.MeshletCullBounds = 0;
+	result.MeshletVertices = 0;
+	result.MeshletTriangles = 0;
+	result.Weld = {};
+	result.Optimize = {};
+	result.Timings = {};
+
+	// Drop whatever an earlier load left behind (including its
+	// cache's mapping), so nothing from it stays reachable
+	result.Data = MeshData();
+	result.Cache.reset();
+}
+
+// Points the result straight into a valid cache, which it then holds onto
+static void UseCache(std::unique_ptr<MeshCache> cache, MeshLoadResult& result)
+{
+	const MeshCacheHeader* header = cache->GetHeader();
+	result.Success = header->IndexCount > 0;
+	result.FromCache = true;
+	result.SourceHash = header->SourceHash;
+	result.SourceSize = header->SourceSize;
+	result.Flags = header->Flags;
+	result.Vertices = cache->GetVertices();
+	result.VertexCount = header->VertexCount;
+	result.Indices = cache->GetIndices();
+	result.IndexCount = header->IndexCount;
+	result.BoundsMin = header->BoundsMin;
+	result.BoundsMax = header->BoundsMax;
+	result.LodCount = header->LodCount;
+	for (unsigned int i = 0; i < result.LodCount; i++)
+	{
+		result.LodIndices[i] = cache->GetLodIndices(i);
+		result.LodIndexCounts[i] = header->LodIndexCounts[i];
+		result.LodErrors[i] = header->LodErrors[i];
+	}
+	result.MeshletCount = header->MeshletCount;
+	result.Meshlets = cache->GetMeshlets();
+	result.MeshletCullBounds = cache->GetMeshletBounds();
+	result.MeshletVertices = cache->GetMeshletVertices();
+	result.MeshletTriangles = cache->GetMeshletTriangles();
+	result.Weld.InputVertices = header->VertexCount;
+	result.Weld.OutputVertices = header->VertexCount;
+	result.Cache = std::move(cache);
+}
+
+
+// --------------------------------------------------------
+// Does all of the CPU work needed before a mesh from an
+// .obj file can be handed to the GPU
+//
+// - Processed geometry is cached in a .meshbin file next to
+//    the .obj, and later loads use that directly (no parsing,
+//    welding or tangents) as long as the .obj hasn't changed
+// - Otherwise the file is parsed, welded into an indexed mesh,
+//    optionally optimized, has tangents and bounds calculated
+//    and optionally LODs and meshlets generated, and the results
+//    are written to the cache
+//
+// objFile - Path to the .obj 3D model file to load
+// result  - Final geometry, stats and timings
+// options - Optional processing steps
+// --------------------------------------------------------
+void LoadMesh(const std::wstring& objFile, MeshLoadResult& result, const MeshLoadOptions& options)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point phaseStart = start;
+	std::chrono::steady_clock::time_point now;
+
+	ResetResult(objFile, result);
+
+	// Map the source file, since we need its hash either way
+	MappedFile obj(objFile);
+	if (!obj.IsOpen())
+		return;
+
+	uint64_t sourceHash = MeshCache::HashData(obj.GetData(), obj.GetSize());
+	result.SourceHash = sourceHash;
+	result.SourceSize = obj.GetSize();
+	std::wstring cacheFile = MeshCache::GetCachePath(objFile);
+	uint32_t cacheFlags = GetMeshCacheFlags(options);
+	result.Flags = cacheFlags;
+
+	now = std::chrono::steady_clock::now();
+	result.Timings.Read = ElapsedMs(phaseStart, now);
+	phaseStart = now;
+
+	// Is the cache still up to date?  If so, hold onto it
+	// and point straight into the mapped data
+	std::unique_ptr<MeshCache> cache = std::make_unique<MeshCache>(cacheFile, sourceHash, obj.GetSize(), cacheFlags);
+	if (cache->IsValid())
+	{
+		UseCache(std::move(cache), result);
+
+		now = std::chrono::steady_clock::now();
+		result.Timings.Cache = ElapsedMs(phaseStart, now);
+		result.Timings.Total = ElapsedMs(start, now);
+		return;
+	}
+
+	// Release the stale cache so it can be replaced below
+	cache.reset();
+
+	// Parse the file into CPU-side geometry
+	MeshData& meshData = result.Data;
+	if (!ParseOBJ(obj.GetData(), obj.GetSize(), meshData) || meshData.Indices.empty())
+		return;
+
+	now = std::chrono::steady_clock::now();
+	result.Timings.Parse = ElapsedMs(phaseStart, now);
+	phaseStart = now;
+
+	// The file gives us a vertex per face corner, so merge
+	// the duplicates into a properly indexed mesh
+	result.Weld = WeldVertices(meshData);
+
+	now = std::chrono::steady_clock::now();
+	result.Timings.Weld = ElapsedMs(phaseStart, now);
+	phaseStart = now;
+
+	// Reorder for the vertex cache and memory locality
+	if (options.Optimize)
+	{
+		result.Optimize = OptimizeMesh(meshData);
+
+		now = std::chrono::steady_clock::now();
+		result.Timings.Optimize = ElapsedMs(phaseStart, now);
+		phaseStart = now;
+	}
+
+	// Finish processing
+	CalculateTangents(
+		&meshData.Vertices[0], meshData.Vertices.size(),
+		&meshData.Indices[0], meshData.Indices.size());
+	CalculateBounds(&meshData.Vertices[0], meshData.Vertices.size(), result.BoundsMin, result.BoundsMax);
+
+	now = std::chrono::steady_clock::now();
+	result.Timings.Tangents = ElapsedMs(phaseStart, now);
+	phaseStart = now;
+
+	// Simplify after everything else, since LODs share the
+	// final vertices (and their tangents)
+	if (options.GenerateLods)
+	{
+		GenerateLods(meshData);
+
+		now = std::chrono::steady_clock::now();
+		result.Timings.Lods = ElapsedMs(phaseStart, now);
+		phaseStart = now;
+	}
+
+	// Meshlets come from the final base mesh, so they're last too
+	if (options.BuildMeshlets)
+	{
+		BuildMeshlets(
+			&meshData.Vertices[0], meshData.Vertices.size(),
+			&meshData.Indices[0], meshData.Indices.size(),
+			meshData.Meshlets);
+
+		now = std::chrono::steady_clock::now();
+		result.Timings.Meshlets = ElapsedMs(phaseStart, now);
+		phaseStart = now;
+	}
+
+	// Save the results for next time
+	MeshCache::Write(cacheFile, meshData, sourceHash, obj.GetSize(), cacheFlags, result.BoundsMin, result.BoundsMax);
+
+	result.Success = true;
+	result.Vertices = meshData.Vertices.data();
+	result.VertexCount = meshData.Vertices.size();
+	result.Indices = meshData.Indices.data();
+	result.IndexCount = meshData.Indices.size();
+	result.LodCount = (unsigned int)meshData.Lods.size();
+	for (unsigned int i = 0; i < result.LodCount; i++)
+	{
+		result.LodIndices[i] = meshData.Lods[i].Indices.data();
+		result.LodIndexCounts[i] = meshData.Lods[i].Indices.size();
+		result.LodErrors[i] = meshData.Lods[i].Error;
+	}
+	if (!meshData.Meshlets.Meshlets.empty())
+	{
+		result.MeshletCount = meshData.Meshlets.Meshlets.size();
+		result.Meshlets = meshData.Meshlets.Meshlets.data();
+		result.MeshletCullBounds = meshData.Meshlets.Bounds.data();
+		result.MeshletVertices = meshData.Meshlets.Vertices.data();
+		result.MeshletTriangles = meshData.Meshlets.Triangles.data();
+	}
+
+	now = std::chrono::steady_clock::now();
+	result.Timings.Cache = ElapsedMs(phaseStart, now);
+	result.Timings.Total = ElapsedMs(start, now);
+}
+
+
+// --------------------------------------------------------
+// Loads a mesh that was processed ahead of time and stored
+// in an asset pack.  There's no parsing or file access, so
+// this is about as fast as a cache hit.
+//
+// pack   - An open pack (must outlive the result)
+// name   - Asset name within the pack, like "Models/cube.obj"
+// result - Final geometry, pointing into the pack
+// --------------------------------------------------------
+void LoadMesh(AssetPack& pack, const std::string& name, MeshLoadResult& result)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	ResetResult(std::wstring(name.begin(), name.end()), result);
+
+	AssetView view = pack.Find(name);
+	if (!view.IsValid() || view.Type != AssetType::Mesh)
+		return;
+
+	std::unique_ptr<MeshCache> cache = std::make_unique<MeshCache>(view.Data, view.Size, pack.GetMeshFlags());
+	if (!cache->IsValid())
+		return;
+
+	UseCache(std::move(cache), result);
+	result.FromPack = true;
+
+	result.Timings.Cache = ElapsedMs(start, std::chrono::steady_clock::now());
+	result.Timings.Total = result.Timings.Cache;
+}
+
+
+// --------------------------------------------------------
+// Which flags a .meshbin built with these options will have
+// --------------------------------------------------------
+uint32_t GetMeshCacheFlags(const MeshLoadOptions& options)
+{
+	return
+		(options.Optimize ? MESH_CACHE_FLAG_OPTIMIZED : 0) |
+		(options.GenerateLods ? MESH_CACHE_FLAG_LODS : 0) |
+		(options.BuildMeshlets ? MESH_CACHE_FLAG_MESHLETS : 0);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <memory>
+#include <string>
+
+#include "MeshData.h"
+#include "MeshCache.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "VertexWelder.h"
+
+// --------------------------------------------------------
+// How long (in milliseconds) each phase of loading a single
+// mesh took.  Phases that were skipped stay at zero.
+// --------------------------------------------------------
+struct MeshLoadTimings
+{
+	double Read;		// Mapping and hashing the source file
+	double Cache;		// Validating or writing the .meshbin
+	double Parse;
+	double Weld;
+	double Optimize;
+	double Tangents;
+	double Lods;
+	double Meshlets;
+	double Total;
+};
+
+// --------------------------------------------------------
+// Optional processing steps when loading a mesh.  These are
+// part of the cache, so changing them rebuilds the .meshbin.
+// --------------------------------------------------------
+struct MeshLoadOptions
+{
+	// Reorder triangles and vertices for the post-transform
+	// cache and memory locality (see MeshOptimizer.h)
+	bool Optimize = true;
+
+	// Build lower detail versions of the mesh for distant
+	// instances (see MeshSimplifier.h)
+	bool GenerateLods = true;
+
+	// Split the base mesh into meshlets with culling bounds
+	// (see MeshletBuilder.h)
+	bool BuildMeshlets = true;
+};
+
+// --------------------------------------------------------
+// Everything needed to create a Mesh, produced entirely on
+// the CPU.  The vertex and index pointers refer to either
+// the parsed data or the mapped cache file below, so they
+// are valid as long as this object is.
+// --------------------------------------------------------
+struct MeshLoadResult
+{
+	bool Success;
+	bool FromCache;
+	bool FromPack;			// SourceFile is then just the asset's name
+	std::wstring SourceFile;
+	uint64_t SourceHash;	// Identifies the contents of the source file
+	uint64_t SourceSize;
+	uint32_t Flags;			// MESH_CACHE_FLAG_ values for how it was processed
+
+	const Vertex* Vertices;
+	size_t VertexCount;
+	const unsigned int* Indices;
+	size_t IndexCount;
+	DirectX::XMFLOAT3 BoundsMin;
+	DirectX::XMFLOAT3 BoundsMax;
+
+	// Lower detail index buffers over the same vertices
+	unsigned int LodCount;
+	const unsigned int* LodIndices[MESH_MAX_LODS - 1];
+	size_t LodIndexCounts[MESH_MAX_LODS - 1];
+	float LodErrors[MESH_MAX_LODS - 1];
+
+	// Meshlets of the base mesh (see MeshletData), if built
+	size_t MeshletCount;
+	const Meshlet* Meshlets;
+	const MeshletBounds* MeshletCullBounds;
+	const unsigned int* MeshletVertices;
+	const uint8_t* MeshletTriangles;
+
+	WeldStats Weld;
+	MeshOptimizeStats Optimize;	// Only filled in when not cached
+	MeshLoadTimings Timings;
+
+	// Storage behind the pointers above (only one is used)
+	MeshData Data;
+	std::unique_ptr<MeshCache> Cache;
+};
+
+class AssetPack;
+
+// Runs every CPU stage of loading an .obj (safe to call from any thread)
+void LoadMesh(const std::wstring& objFile, MeshLoadResult& result, const MeshLoadOptions& options = MeshLoadOptions());
+
+// Grabs an already processed mesh out of a pack (which must outlive the result)
+void LoadMesh(AssetPack& pack, const std::string& name, MeshLoadResult& result);
+
+// The MESH_CACHE_FLAG_ values for a set of options
+uint32_t GetMeshCacheFlags(const MeshLoadOptions& options);
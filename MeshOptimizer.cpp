@@ -0,0 +1,259 @@
+#include "MeshOptimizer.h"
+
+#include <cstring>
+#include <vector>
+
+// Simulated memory cache used to measure vertex fetch locality
+#define FETCH_CACHE_LINE_SIZE 64
+#define FETCH_CACHE_LINES 64
+
+// --------------------------------------------------------
+// Simulates a FIFO post-transform vertex cache over the
+// index buffer and reports how often the vertex shader
+// would have to run
+// --------------------------------------------------------
+VertexCacheStats AnalyzeVertexCache(const unsigned int* indices, size_t indexCount, size_t vertexCount, unsigned int cacheSize)
+{
+	VertexCacheStats stats = {};
+	if (indexCount == 0 || vertexCount == 0)
+		return stats;
+
+	// Each vertex remembers when it entered the cache, which
+	// tells us whether it has been pushed out since
+	std::vector<size_t> cacheTime(vertexCount, 0);
+	size_t time = cacheSize + 1;
+	size_t misses = 0;
+
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		unsigned int v = indices[i];
+		if (time - cacheTime[v] > cacheSize)
+		{
+			cacheTime[v] = time++;
+			misses++;
+		}
+	}
+
+	stats.ACMR = (float)misses / (float)(indexCount / 3);
+	stats.ATVR = (float)misses / (float)vertexCount;
+	return stats;
+}
+
+
+// --------------------------------------------------------
+// Simulates a small FIFO cache of memory lines while reading
+// each vertex the index buffer refers to, and returns the
+// total bytes read relative to the size of the vertex data
+// --------------------------------------------------------
+float AnalyzeVertexFetch(const unsigned int* indices, size_t indexCount, size_t vertexCount, size_t vertexStride)
+{
+	if (indexCount == 0 || vertexCount == 0)
+		return 0.0f;
+
+	size_t lineCount = (vertexCount * vertexStride + FETCH_CACHE_LINE_SIZE - 1) / FETCH_CACHE_LINE_SIZE;
+	std::vector<size_t> cacheTime(lineCount, 0);
+	size_t time = FETCH_CACHE_LINES + 1;
+	size_t linesRead = 0;
+
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		// A vertex may straddle two lines
+		size_t start = indices[i] * vertexStride;
+		size_t firstLine = start / FETCH_CACHE_LINE_SIZE;
+		size_t lastLine = (start + vertexStride - 1) / FETCH_CACHE_LINE_SIZE;
+		for (size_t line = firstLine; line <= lastLine; line++)
+		{
+			if (time - cacheTime[line] > FETCH_CACHE_LINES)
+			{
+				cacheTime[line] = time++;
+				linesRead++;
+			}
+		}
+	}
+
+	return (float)(linesRead * FETCH_CACHE_LINE_SIZE) / (float)(vertexCount * vertexStride);
+}
+
+
+// --------------------------------------------------------
+// Reorders triangles for the post-transform vertex cache
+// using "Tipsify" from Sander, Nehab & Barczak, "Fast
+// Triangle Reordering for Vertex Locality and Reduced
+// Overdraw" (SIGGRAPH 2007)
+//
+// - Fans out every remaining triangle around one vertex at
+//    a time, then moves on to whichever recently used vertex
+//    will still be in the cache after its own triangles
+// - Runs in linear time, and the triangles themselves (and
+//    their winding) are unchanged, just their order
+// --------------------------------------------------------
+void OptimizeVertexCache(unsigned int* indices, size_t indexCount, size_t vertexCount, unsigned int cacheSize)
+{
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount == 0 || vertexCount == 0)
+		return;
+
+	// Build vertex -> triangle adjacency (compressed rows)
+	std::vector<unsigned int> liveCount(vertexCount, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		liveCount[indices[i]]++;
+
+	std::vector<unsigned int> adjacencyStart(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++)
+		adjacencyStart[v + 1] = adjacencyStart[v] + liveCount[v];
+
+	std::vector<unsigned int> adjacency(triangleCount * 3);
+	{
+		std::vector<unsigned int> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+		for (size_t t = 0; t < triangleCount; t++)
+			for (int c = 0; c < 3; c++)
+				adjacency[fill[indices[t * 3 + c]]++] = (unsigned int)t;
+	}
+
+	// Working state
+	std::vector<size_t> cacheTime(vertexCount, 0);
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<unsigned int> deadEnds;
+	std::vector<unsigned int> candidates;
+	std::vector<unsigned int> output;
+	output.reserve(triangleCount * 3);
+	deadEnds.reserve(triangleCount * 3);
+
+	size_t time = cacheSize + 1;
+	size_t cursor = 0;
+	long long fanVertex = 0;
+
+	while (fanVertex >= 0)
+	{
+		// Emit every remaining triangle around the fan vertex
+		candidates.clear();
+		for (unsigned int a = adjacencyStart[fanVertex]; a < adjacencyStart[fanVertex + 1]; a++)
+		{
+			unsigned int t = adjacency[a];
+			if (emitted[t])
+				continue;
+
+			for (int c = 0; c < 3; c++)
+			{
+				unsigned int v = indices[t * 3 + c];
+				output.push_back(v);
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				liveCount[v]--;
+
+				if (time - cacheTime[v] > cacheSize)
+					cacheTime[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// Pick the candidate that will stay in the cache the
+		// longest while its remaining triangles are emitted
+		fanVertex = -1;
+		long long bestPriority = -1;
+		for (unsigned int v : candidates)
+		{
+			if (liveCount[v] == 0)
+				continue;
+
+			long long priority = 0;
+			if (time - cacheTime[v] + 2 * liveCount[v] <= cacheSize)
+				priority = (long long)(time - cacheTime[v]);
+
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				fanVertex = v;
+			}
+		}
+
+		// Dead end, so back up through recent vertices, or
+		// fall back to the next vertex with work left
+		if (fanVertex < 0)
+		{
+			while (!deadEnds.empty() && fanVertex < 0)
+			{
+				unsigned int v = deadEnds.back();
+				deadEnds.pop_back();
+				if (liveCount[v] > 0)
+					fanVertex = v;
+			}
+
+			while (fanVertex < 0 && cursor < vertexCount)
+			{
+				if (liveCount[cursor] > 0)
+					fanVertex = (long long)cursor;
+				cursor++;
+			}
+		}
+	}
+
+	memcpy(indices, output.data(), output.size() * sizeof(unsigned int));
+}
+
+
+// --------------------------------------------------------
+// Reorders the vertices so they appear in the same order the
+// (already optimized) index buffer first uses them, which
+// makes vertex reads close to sequential.  Vertices that are
+// never referenced end up at the back.
+// --------------------------------------------------------
+void OptimizeVertexFetch(MeshData& meshData)
+{
+	std::vector<Vertex>& verts = meshData.Vertices;
+	std::vector<unsigned int>& indices = meshData.Indices;
+
+	const unsigned int unassigned = 0xFFFFFFFF;
+	std::vector<unsigned int> remap(verts.size(), unassigned);
+	std::vector<Vertex> reordered;
+	reordered.reserve(verts.size());
+
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		unsigned int& index = indices[i];
+		if (remap[index] == unassigned)
+		{
+			remap[index] = (unsigned int)reordered.size();
+			reordered.push_back(verts[index]);
+		}
+		index = remap[index];
+	}
+
+	for (size_t v = 0; v < verts.size(); v++)
+	{
+		if (remap[v] == unassigned)
+			reordered.push_back(verts[v]);
+	}
+
+	verts.swap(reordered);
+}
+
+
+// --------------------------------------------------------
+// Optimizes the mesh for both the post-transform cache and
+// vertex fetch locality, which helps both raster and the
+// raytracing hit shader's vertex buffer reads
+//
+// Returns the cache and fetch stats before and after
+// --------------------------------------------------------
+MeshOptimizeStats OptimizeMesh(MeshData& meshData)
+{
+	MeshOptimizeStats stats = {};
+	if (meshData.Indices.empty())
+		return stats;
+
+	unsigned int* indices = meshData.Indices.data();
+	size_t indexCount = meshData.Indices.size();
+
+	stats.CacheBefore = AnalyzeVertexCache(indices, indexCount, meshData.Vertices.size(), VERTEX_CACHE_SIZE);
+	stats.OverfetchBefore = AnalyzeVertexFetch(indices, indexCount, meshData.Vertices.size(), sizeof(Vertex));
+
+	OptimizeVertexCache(indices, indexCount, meshData.Vertices.size(), VERTEX_CACHE_SIZE);
+	OptimizeVertexFetch(meshData);
+
+	indices = meshData.Indices.data();
+	stats.CacheAfter = AnalyzeVertexCache(indices, indexCount, meshData.Vertices.size(), VERTEX_CACHE_SIZE);
+	stats.OverfetchAfter = AnalyzeVertexFetch(indices, indexCount, meshData.Vertices.size(), sizeof(Vertex));
+
+	return stats;
+}
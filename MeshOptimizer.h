@@ -0,0 +1,40 @@
+#pragma once
+
+#include "MeshData.h"
+
+// Post-transform cache size we optimize (and measure) for
+#define VERTEX_CACHE_SIZE 16
+
+// --------------------------------------------------------
+// How well an index buffer uses a FIFO post-transform cache
+//  - ACMR: vertex shader runs per triangle (0.5 is ideal)
+//  - ATVR: vertex shader runs per unique vertex (1.0 is ideal)
+// --------------------------------------------------------
+struct VertexCacheStats
+{
+	float ACMR;
+	float ATVR;
+};
+
+// Before and after results of OptimizeMesh()
+struct MeshOptimizeStats
+{
+	VertexCacheStats CacheBefore;
+	VertexCacheStats CacheAfter;
+
+	// Bytes pulled through a simulated CPU/GPU memory cache per
+	// byte of vertex data (1.0 means every line is read once)
+	float OverfetchBefore;
+	float OverfetchAfter;
+};
+
+// Measurement
+VertexCacheStats AnalyzeVertexCache(const unsigned int* indices, size_t indexCount, size_t vertexCount, unsigned int cacheSize);
+float AnalyzeVertexFetch(const unsigned int* indices, size_t indexCount, size_t vertexCount, size_t vertexStride);
+
+// Individual passes
+void OptimizeVertexCache(unsigned int* indices, size_t indexCount, size_t vertexCount, unsigned int cacheSize);
+void OptimizeVertexFetch(MeshData& meshData);
+
+// Runs both passes (triangle order first, then vertex order)
+MeshOptimizeStats OptimizeMesh(MeshData& meshData);
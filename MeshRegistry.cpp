@@ -0,0 +1,191 @@
+#include "MeshRegistry.h"
+#include "BvhCache.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+
+// Singleton requirement
+MeshRegistry* MeshRegistry::instance;
+
+// --------------------------------------------------------
+// Drops the registry's references.  Meshes still in use
+// elsewhere stay alive until those references go away.
+// --------------------------------------------------------
+MeshRegistry::~MeshRegistry()
+{
+}
+
+
+// --------------------------------------------------------
+// Gets a mesh for the given file.  The file is mapped and
+// hashed either way, but only parsed (or read from its
+// cache) and uploaded if there's no matching mesh already.
+//
+// objFile    - Path to the .obj 3D model file to load
+// options    - Processing steps, if it needs to be loaded
+// bvhOptions - How to build its CPU BVH, if it's new
+//
+// Returns null if the file couldn't be loaded
+// --------------------------------------------------------
+std::shared_ptr<Mesh> MeshRegistry::Load(const std::wstring& objFile, const MeshLoadOptions& options, const BvhBuildOptions& bvhOptions)
+{
+	uint64_t sourceHash = 0;
+	{
+		MappedFile obj(objFile);
+		if (!obj.IsOpen())
+			return 0;
+		sourceHash = MeshCache::HashData(obj.GetData(), obj.GetSize());
+	}
+
+	MeshKey key = { NormalizePath(objFile), sourceHash, GetMeshCacheFlags(options), BvhCache::HashOptions(bvhOptions) };
+	std::shared_ptr<Mesh> mesh = Find(key);
+	if (mesh)
+		return mesh;
+
+	MeshLoadResult loadResult;
+	LoadMesh(objFile, loadResult, options);
+	if (!loadResult.Success || loadResult.IndexCount == 0)
+		return 0;
+
+	// The file could have changed since it was hashed above
+	key.SourceHash = loadResult.SourceHash;
+	mesh = Find(key);
+	return mesh ? mesh : Add(key, loadResult, bvhOptions);
+}
+
+
+// --------------------------------------------------------
+// Gets a mesh for geometry that was already loaded on the
+// CPU (possibly on another thread).  If the same file, with
+// the same contents and options, is already registered, that
+// mesh is returned and the geometry is never uploaded.
+//
+// loadResult - Geometry from LoadMesh()
+// bvhOptions - How to build its CPU BVH, if it's new
+//
+// Returns null if the load failed (or had no triangles)
+// --------------------------------------------------------
+std::shared_ptr<Mesh> MeshRegistry::GetMesh(const MeshLoadResult& loadResult, const BvhBuildOptions& bvhOptions)
+{
+	// A mesh with no triangles would have no levels to draw or trace
+	if (!loadResult.Success || loadResult.IndexCount == 0)
+		return 0;
+
+	MeshKey key = { NormalizePath(loadResult.SourceFile), loadResult.SourceHash, loadResult.Flags, BvhCache::HashOptions(bvhOptions) };
+	std::shared_ptr<Mesh> mesh = Find(key);
+	return mesh ? mesh : Add(key, loadResult, bvhOptions);
+}
+
+
+// --------------------------------------------------------
+// Evicts unused meshes, least recently used first, until
+// the total memory used is under the budget (or nothing
+// else can be evicted).  Meant to be called once per frame,
+// since that's also how recently used meshes are tracked.
+//
+// Evicted meshes are destroyed right away, so the GPU must
+// not be using them anymore.
+// --------------------------------------------------------
+void MeshRegistry::Trim()
+{
+	frameCount++;
+
+	// Anything referenced outside of the registry is in use
+	std::vector<std::map<MeshKey, MeshEntry>::iterator> unused;
+	for (auto it = meshes.begin(); it != meshes.end(); it++)
+	{
+		if (it->second.Geometry.use_count() > 1)
+			it->second.LastUsedFrame = frameCount;
+		else
+			unused.push_back(it);
+	}
+
+	if (memoryUsed <= memoryBudget)
+		return;
+
+	std::sort(unused.begin(), unused.end(),
+		[](const std::map<MeshKey, MeshEntry>::iterator& a, const std::map<MeshKey, MeshEntry>::iterator& b)
+		{
+			return a->second.LastUsedFrame < b->second.LastUsedFrame;
+		});
+
+	for (size_t i = 0; i < unused.size() && memoryUsed > memoryBudget; i++)
+	{
+		MeshEntry& entry = unused[i]->second;
+		entry.Geometry->ReleaseRaytracingData();
+		memoryUsed -= entry.MemorySize;
+		meshes.erase(unused[i]);
+		evictions++;
+	}
+}
+
+
+// --------------------------------------------------------
+// Current memory use and lifetime counters
+// --------------------------------------------------------
+MeshRegistryStats MeshRegistry::GetStats()
+{
+	MeshRegistryStats stats = {};
+	stats.MeshCount = meshes.size();
+	stats.MemoryUsed = memoryUsed;
+	stats.MemoryBudget = memoryBudget;
+	stats.Hits = hits;
+	stats.Misses = misses;
+	stats.Evictions = evictions;
+
+	for (auto& pair : meshes)
+	{
+		if (pair.second.Geometry.use_count() == 1)
+		{
+			stats.UnusedMeshCount++;
+			stats.UnusedMemory += pair.second.MemorySize;
+		}
+	}
+
+	return stats;
+}
+
+
+// --------------------------------------------------------
+// Looks up an existing mesh (null if there isn't one)
+// --------------------------------------------------------
+std::shared_ptr<Mesh> MeshRegistry::Find(const MeshKey& key)
+{
+	auto it = meshes.find(key);
+	if (it == meshes.end())
+		return 0;
+
+	hits++;
+	it->second.LastUsedFrame = frameCount;
+	return it->second.Geometry;
+}
+
+
+// --------------------------------------------------------
+// Creates the GPU side of a new mesh and starts tracking it
+// --------------------------------------------------------
+std::shared_ptr<Mesh> MeshRegistry::Add(const MeshKey& key, const MeshLoadResult& loadResult, const BvhBuildOptions& bvhOptions)
+{
+	misses++;
+
+	MeshEntry entry;
+	entry.Geometry = std::make_shared<Mesh>(loadResult, bvhOptions);
+	entry.MemorySize = entry.Geometry->GetMemorySize();
+	entry.LastUsedFrame = frameCount;
+
+	memoryUsed += entry.MemorySize;
+	meshes[key] = entry;
+	return entry.Geometry;
+}
+
+
+// --------------------------------------------------------
+// Makes different spellings of the same path match, like
+// "Models/../Models/cube.obj" and "Models\cube.obj"
+// --------------------------------------------------------
+std::wstring MeshRegistry::NormalizePath(const std::wstring& file)
+{
+	return std::filesystem::path(file).lexically_normal().make_preferred().wstring();
+}
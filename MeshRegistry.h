@@ -0,0 +1,138 @@
+#pragma once
+
+#include <d3d12.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+
+#include "Mesh.h"
+#include "MeshLoader.h"
+
+// How much GPU memory meshes may take up before unused ones
+// start getting evicted (in bytes)
+#define MESH_REGISTRY_DEFAULT_BUDGET (256ull * 1024 * 1024)
+
+// --------------------------------------------------------
+// Where the registry's memory is going, and how well it's
+// working, since it was created
+// --------------------------------------------------------
+struct MeshRegistryStats
+{
+	size_t MeshCount;
+	size_t UnusedMeshCount;		// Only held by the registry
+	UINT64 MemoryUsed;			// Every mesh, in bytes
+	UINT64 UnusedMemory;		// Meshes that could be evicted
+	UINT64 MemoryBudget;
+	unsigned int Hits;			// Requests handed an existing mesh
+	unsigned int Misses;		// Requests that created a new one
+	unsigned int Evictions;
+};
+
+// --------------------------------------------------------
+// Shares meshes (and their BLAS's) between everything that
+// uses the same file.
+//
+// Meshes are keyed by their source file along with a hash
+// of its contents and the options it was processed with, so
+// loading the same file twice gives back the same Mesh, while
+// a file that changed on disk (or is loaded with different
+// mesh or BVH options) gets a new one.  The registry holds
+// a reference to every mesh it creates; once it's the only
+// one left, the mesh is unused and becomes a candidate for
+// eviction.  Trim() evicts unused meshes, least recently
+// used first, while the total is over the memory budget,
+// which frees their buffers, descriptors and shader table
+// records.
+//
+// Only meant to be used from the main thread.
+// --------------------------------------------------------
+class MeshRegistry
+{
+#pragma region Singleton
+public:
+	// Gets the one and only instance of this class
+	static MeshRegistry& GetInstance()
+	{
+		if (!instance)
+		{
+			instance = new MeshRegistry();
+		}
+
+		return *instance;
+	}
+
+	// Remove these functions (C++ 11 version)
+	MeshRegistry(MeshRegistry const&) = delete;
+	void operator=(MeshRegistry const&) = delete;
+
+private:
+	static MeshRegistry* instance;
+	MeshRegistry() :
+		memoryBudget(MESH_REGISTRY_DEFAULT_BUDGET),
+		memoryUsed(0),
+		frameCount(0),
+		hits(0),
+		misses(0),
+		evictions(0)
+	{};
+#pragma endregion
+
+public:
+	~MeshRegistry();
+
+	// Loads a mesh, or hands back the existing one if the file hasn't changed
+	// and was loaded with the same options
+	std::shared_ptr<Mesh> Load(const std::wstring& objFile, const MeshLoadOptions& options = MeshLoadOptions(), const BvhBuildOptions& bvhOptions = BvhBuildOptions());
+
+	// Same as above, for geometry already loaded on the CPU (like from AssetLoader)
+	std::shared_ptr<Mesh> GetMesh(const MeshLoadResult& loadResult, const BvhBuildOptions& bvhOptions = BvhBuildOptions());
+
+	// Evicts unused meshes until under budget - only call when
+	// the GPU is done with the previous frame
+	void Trim();
+
+	void SetMemoryBudget(UINT64 bytes) { memoryBudget = bytes; }
+	UINT64 GetMemoryBudget() { return memoryBudget; }
+	MeshRegistryStats GetStats();
+
+private:
+	// Source file (normalized), a hash of its contents, and how
+	// it was processed
+	struct MeshKey
+	{
+		std::wstring File;
+		uint64_t SourceHash;
+		uint32_t MeshFlags;		// MESH_CACHE_FLAG_ values
+		uint64_t BvhOptions;	// BvhCache::HashOptions()
+
+		bool operator<(const MeshKey& other) const
+		{
+			return
+				std::tie(File, SourceHash, MeshFlags, BvhOptions) <
+				std::tie(other.File, other.SourceHash, other.MeshFlags, other.BvhOptions);
+		}
+	};
+
+	struct MeshEntry
+	{
+		std::shared_ptr<Mesh> Geometry;
+		UINT64 MemorySize;
+		uint64_t LastUsedFrame;	// Last Trim() that saw it in use
+	};
+
+	std::map<MeshKey, MeshEntry> meshes;
+
+	UINT64 memoryBudget;
+	UINT64 memoryUsed;
+	uint64_t frameCount;
+
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
+
+	std::shared_ptr<Mesh> Find(const MeshKey& key);
+	std::shared_ptr<Mesh> Add(const MeshKey& key, const MeshLoadResult& loadResult, const BvhBuildOptions& bvhOptions);
+	static std::wstring NormalizePath(const std::wstring& file);
+};
@@ -0,0 +1,484 @@
+#include "MeshSimplifier.h"
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+using namespace DirectX;
+
+// How much differences in UVs and normals add to the cost
+// of a collapse, relative to (squared, normalized) distance
+#define LOD_UV_WEIGHT 0.001
+#define LOD_NORMAL_WEIGHT 0.001
+
+// Each LOD must have at most this fraction of the previous
+// one's triangles to be worth keeping
+#define LOD_MIN_REDUCTION 0.75f
+
+// --------------------------------------------------------
+// Symmetric 4x4 matrix measuring the sum of squared
+// distances to a set of planes, weighted by area
+// --------------------------------------------------------
+struct Quadric
+{
+	double a00, a01, a02, a03;
+	double a11, a12, a13;
+	double a22, a23;
+	double a33;
+	double weight;
+
+	void AddPlane(double x, double y, double z, double d, double area)
+	{
+		a00 += area * x * x; a01 += area * x * y; a02 += area * x * z; a03 += area * x * d;
+		a11 += area * y * y; a12 += area * y * z; a13 += area * y * d;
+		a22 += area * z * z; a23 += area * z * d;
+		a33 += area * d * d;
+		weight += area;
+	}
+
+	void Add(const Quadric& q)
+	{
+		a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+		a11 += q.a11; a12 += q.a12; a13 += q.a13;
+		a22 += q.a22; a23 += q.a23;
+		a33 += q.a33;
+		weight += q.weight;
+	}
+
+	// Average squared distance from the point to the planes
+	double Error(const XMFLOAT3& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double error =
+			a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x +
+			a11 * y * y + 2 * a12 * y * z + 2 * a13 * y +
+			a22 * z * z + 2 * a23 * z +
+			a33;
+		return weight > 0 ? fabs(error) / weight : 0;
+	}
+};
+
+// A potential collapse of vertex From onto vertex To
+struct Collapse
+{
+	unsigned int From;
+	unsigned int To;
+	double Cost;
+};
+
+// --------------------------------------------------------
+// Simplifies an index buffer a step at a time, so each LOD
+// picks up where the previous one left off
+// --------------------------------------------------------
+class Simplifier
+{
+public:
+	Simplifier(const std::vector<Vertex>& verts, const std::vector<unsigned int>& indices);
+
+	// Collapses until there are at most targetIndexCount indices
+	// left, or the next collapse would cost more than maxError
+	void Simplify(size_t targetIndexCount, double maxError);
+
+	const std::vector<unsigned int>& GetIndices() { return indices; }
+	double GetError() { return sqrt(error); }
+	float GetScale() { return scale; }
+
+private:
+	const std::vector<Vertex>& verts;
+	std::vector<unsigned int> indices;
+
+	// Positions scaled to fit a unit cube, so errors are relative
+	std::vector<XMFLOAT3> positions;
+	float scale;
+
+	std::vector<Quadric> quadrics;
+	std::vector<bool> collapsible;
+	double error;
+
+	// Vertex -> triangle adjacency for the current indices
+	std::vector<unsigned int> adjacencyStart;
+	std::vector<unsigned int> adjacency;
+
+	// Scratch space for PreservesTopology()
+	std::vector<unsigned int> fromRing;
+	std::vector<unsigned int> toRing;
+
+	void BuildAdjacency();
+	bool PreservesTopology(unsigned int from, unsigned int to);
+	bool FlipsTriangles(unsigned int from, unsigned int to);
+};
+
+
+// --------------------------------------------------------
+// Sets up quadrics and works out which vertices can move
+// --------------------------------------------------------
+Simplifier::Simplifier(const std::vector<Vertex>& verts, const std::vector<unsigned int>& indices) :
+	verts(verts),
+	indices(indices),
+	scale(1.0f),
+	error(0)
+{
+	size_t numVerts = verts.size();
+
+	// Normalize positions
+	XMFLOAT3 boundsMin, boundsMax;
+	CalculateBounds(verts.data(), numVerts, boundsMin, boundsMax);
+	scale = (std::max)((std::max)(boundsMax.x - boundsMin.x, boundsMax.y - boundsMin.y), boundsMax.z - boundsMin.z);
+	float invScale = scale > 0 ? 1.0f / scale : 0.0f;
+
+	positions.resize(numVerts);
+	for (size_t v = 0; v < numVerts; v++)
+	{
+		positions[v] = XMFLOAT3(
+			(verts[v].Position.x - boundsMin.x) * invScale,
+			(verts[v].Position.y - boundsMin.y) * invScale,
+			(verts[v].Position.z - boundsMin.z) * invScale);
+	}
+
+	// Each vertex's quadric is made of its triangles' planes
+	quadrics.assign(numVerts, {});
+	for (size_t t = 0; t + 2 < indices.size(); t += 3)
+	{
+		const XMFLOAT3& p0 = positions[indices[t]];
+		const XMFLOAT3& p1 = positions[indices[t + 1]];
+		const XMFLOAT3& p2 = positions[indices[t + 2]];
+
+		double e1[3] = { p1.x - p0.x, p1.y - p0.y, p1.z - p0.z };
+		double e2[3] = { p2.x - p0.x, p2.y - p0.y, p2.z - p0.z };
+		double n[3] = {
+			e1[1] * e2[2] - e1[2] * e2[1],
+			e1[2] * e2[0] - e1[0] * e2[2],
+			e1[0] * e2[1] - e1[1] * e2[0] };
+		double length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (length == 0)
+			continue;
+
+		n[0] /= length; n[1] /= length; n[2] /= length;
+		double d = -(n[0] * p0.x + n[1] * p0.y + n[2] * p0.z);
+		double area = length * 0.5;
+
+		for (int c = 0; c < 3; c++)
+			quadrics[indices[t + c]].AddPlane(n[0], n[1], n[2], d, area);
+	}
+
+	// Only vertices that are completely surrounded by triangles,
+	// and don't share a position with another vertex (seams), are
+	// free to move.  Every edge around them is used exactly twice.
+	collapsible.assign(numVerts, true);
+
+	std::unordered_map<uint64_t, unsigned int> edgeUses;
+	edgeUses.reserve(indices.size());
+	for (size_t t = 0; t + 2 < indices.size(); t += 3)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			unsigned int a = indices[t + c];
+			unsigned int b = indices[t + (c + 1) % 3];
+			uint64_t key = ((uint64_t)(std::min)(a, b) << 32) | (std::max)(a, b);
+			edgeUses[key]++;
+		}
+	}
+	for (const std::pair<const uint64_t, unsigned int>& edge : edgeUses)
+	{
+		if (edge.second != 2)
+		{
+			collapsible[(unsigned int)(edge.first >> 32)] = false;
+			collapsible[(unsigned int)(edge.first & 0xFFFFFFFF)] = false;
+		}
+	}
+
+	// Sorting by position puts any seam vertices next to each other
+	std::vector<unsigned int> byPosition(numVerts);
+	for (size_t v = 0; v < numVerts; v++)
+		byPosition[v] = (unsigned int)v;
+
+	auto samePosition = [&](unsigned int a, unsigned int b)
+	{
+		return memcmp(&verts[a].Position, &verts[b].Position, sizeof(XMFLOAT3)) == 0;
+	};
+	std::sort(byPosition.begin(), byPosition.end(), [&](unsigned int a, unsigned int b)
+	{
+		return memcmp(&verts[a].Position, &verts[b].Position, sizeof(XMFLOAT3)) < 0;
+	});
+	for (size_t i = 1; i < numVerts; i++)
+	{
+		if (samePosition(byPosition[i - 1], byPosition[i]))
+		{
+			collapsible[byPosition[i - 1]] = false;
+			collapsible[byPosition[i]] = false;
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Rebuilds the vertex -> triangle lists (counting sort)
+// --------------------------------------------------------
+void Simplifier::BuildAdjacency()
+{
+	size_t numVerts = verts.size();
+	adjacencyStart.assign(numVerts + 1, 0);
+	for (unsigned int index : indices)
+		adjacencyStart[index + 1]++;
+	for (size_t v = 0; v < numVerts; v++)
+		adjacencyStart[v + 1] += adjacencyStart[v];
+
+	adjacency.resize(indices.size());
+	std::vector<unsigned int> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (size_t i = 0; i < indices.size(); i++)
+		adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+}
+
+
+// --------------------------------------------------------
+// The "link condition" - the vertices connected to both ends
+// of the edge must be exactly the two opposite corners of
+// the edge's triangles, or the collapse would pinch the
+// surface into a non-manifold mess
+// --------------------------------------------------------
+bool Simplifier::PreservesTopology(unsigned int from, unsigned int to)
+{
+	fromRing.clear();
+	toRing.clear();
+	for (unsigned int a = adjacencyStart[from]; a < adjacencyStart[from + 1]; a++)
+		for (int c = 0; c < 3; c++)
+			fromRing.push_back(indices[adjacency[a] * 3 + c]);
+	for (unsigned int a = adjacencyStart[to]; a < adjacencyStart[to + 1]; a++)
+		for (int c = 0; c < 3; c++)
+			toRing.push_back(indices[adjacency[a] * 3 + c]);
+
+	std::sort(fromRing.begin(), fromRing.end());
+	fromRing.erase(std::unique(fromRing.begin(), fromRing.end()), fromRing.end());
+	std::sort(toRing.begin(), toRing.end());
+	toRing.erase(std::unique(toRing.begin(), toRing.end()), toRing.end());
+
+	size_t shared = 0;
+	for (size_t i = 0, j = 0; i < fromRing.size() && j < toRing.size();)
+	{
+		if (fromRing[i] < toRing[j]) i++;
+		else if (fromRing[i] > toRing[j]) j++;
+		else
+		{
+			if (fromRing[i] != from && fromRing[i] != to)
+				shared++;
+			i++;
+			j++;
+		}
+	}
+
+	return shared == 2;
+}
+
+
+// --------------------------------------------------------
+// Would moving "from" onto "to" flip (or squash) any of the
+// triangles that remain around "from"?
+// --------------------------------------------------------
+bool Simplifier::FlipsTriangles(unsigned int from, unsigned int to)
+{
+	for (unsigned int a = adjacencyStart[from]; a < adjacencyStart[from + 1]; a++)
+	{
+		const unsigned int* tri = &indices[adjacency[a] * 3];
+		if (tri[0] == to || tri[1] == to || tri[2] == to)
+			continue; // This one collapses away
+
+		XMFLOAT3 before[3];
+		XMFLOAT3 after[3];
+		for (int c = 0; c < 3; c++)
+		{
+			before[c] = positions[tri[c]];
+			after[c] = positions[tri[c] == from ? to : tri[c]];
+		}
+
+		double normals[2][3];
+		for (int i = 0; i < 2; i++)
+		{
+			const XMFLOAT3* p = i == 0 ? before : after;
+			double e1[3] = { p[1].x - p[0].x, p[1].y - p[0].y, p[1].z - p[0].z };
+			double e2[3] = { p[2].x - p[0].x, p[2].y - p[0].y, p[2].z - p[0].z };
+			normals[i][0] = e1[1] * e2[2] - e1[2] * e2[1];
+			normals[i][1] = e1[2] * e2[0] - e1[0] * e2[2];
+			normals[i][2] = e1[0] * e2[1] - e1[1] * e2[0];
+		}
+
+		double dot = normals[0][0] * normals[1][0] + normals[0][1] * normals[1][1] + normals[0][2] * normals[1][2];
+		double lengthBefore = sqrt(normals[0][0] * normals[0][0] + normals[0][1] * normals[0][1] + normals[0][2] * normals[0][2]);
+		double lengthAfter = sqrt(normals[1][0] * normals[1][0] + normals[1][1] * normals[1][1] + normals[1][2] * normals[1][2]);
+
+		// Rotating more than ~75 degrees counts as a flip
+		if (dot <= 0.25 * lengthBefore * lengthAfter)
+			return true;
+	}
+
+	return false;
+}
+
+
+// --------------------------------------------------------
+// Runs passes of collapses until we hit the target
+//
+// Each pass finds the cheapest collapse for every vertex,
+// sorts them by cost and applies them in order, skipping any
+// that touch a triangle already changed in this pass
+// --------------------------------------------------------
+void Simplifier::Simplify(size_t targetIndexCount, double maxError)
+{
+	double maxCost = maxError * maxError;
+	std::vector<Collapse> best(verts.size());
+	std::vector<Collapse> collapses;
+	std::vector<unsigned int> remap(verts.size());
+	std::vector<bool> touched(verts.size());
+
+	while (indices.size() > targetIndexCount)
+	{
+		BuildAdjacency();
+
+		// Find the cheapest collapse for each vertex.  Since the
+		// mesh is manifold around collapsible vertices, walking
+		// each triangle's edges in order visits every neighbor.
+		for (size_t v = 0; v < verts.size(); v++)
+			best[v] = { (unsigned int)v, (unsigned int)v, DBL_MAX };
+
+		for (size_t t = 0; t < indices.size(); t += 3)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				unsigned int from = indices[t + c];
+				unsigned int to = indices[t + (c + 1) % 3];
+				if (!collapsible[from])
+					continue;
+
+				const Vertex& vf = verts[from];
+				const Vertex& vt = verts[to];
+				double du = vf.UV.x - vt.UV.x;
+				double dv = vf.UV.y - vt.UV.y;
+				double dnx = vf.Normal.x - vt.Normal.x;
+				double dny = vf.Normal.y - vt.Normal.y;
+				double dnz = vf.Normal.z - vt.Normal.z;
+
+				double cost =
+					quadrics[from].Error(positions[to]) +
+					LOD_UV_WEIGHT * (du * du + dv * dv) +
+					LOD_NORMAL_WEIGHT * (dnx * dnx + dny * dny + dnz * dnz);
+				if (cost < best[from].Cost)
+					best[from] = { from, to, cost };
+			}
+		}
+
+		collapses.clear();
+		for (const Collapse& collapse : best)
+		{
+			if (collapse.Cost <= maxCost)
+				collapses.push_back(collapse);
+		}
+
+		std::sort(collapses.begin(), collapses.end(),
+			[](const Collapse& a, const Collapse& b) { return a.Cost < b.Cost; });
+
+		// Apply as many as we can (or need to)
+		for (size_t v = 0; v < verts.size(); v++)
+			remap[v] = (unsigned int)v;
+		std::fill(touched.begin(), touched.end(), false);
+
+		size_t trianglesToRemove = (indices.size() - targetIndexCount + 2) / 3;
+		size_t trianglesRemoved = 0;
+		for (const Collapse& collapse : collapses)
+		{
+			if (trianglesRemoved >= trianglesToRemove)
+				break;
+
+			if (touched[collapse.From] || touched[collapse.To] ||
+				!PreservesTopology(collapse.From, collapse.To) ||
+				FlipsTriangles(collapse.From, collapse.To))
+				continue;
+
+			// Lock down everything around this collapse for the rest of the pass
+			for (unsigned int a = adjacencyStart[collapse.From]; a < adjacencyStart[collapse.From + 1]; a++)
+			{
+				const unsigned int* tri = &indices[adjacency[a] * 3];
+				touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = true;
+				if (tri[0] == collapse.To || tri[1] == collapse.To || tri[2] == collapse.To)
+					trianglesRemoved++;
+			}
+
+			remap[collapse.From] = collapse.To;
+			quadrics[collapse.To].Add(quadrics[collapse.From]);
+			error = (std::max)(error, collapse.Cost);
+		}
+
+		// Stuck (everything left is too expensive or locked)
+		if (trianglesRemoved == 0)
+			break;
+
+		// Remap and drop the triangles that collapsed away
+		size_t write = 0;
+		for (size_t t = 0; t < indices.size(); t += 3)
+		{
+			unsigned int a = remap[indices[t]];
+			unsigned int b = remap[indices[t + 1]];
+			unsigned int c = remap[indices[t + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+
+			indices[write++] = a;
+			indices[write++] = b;
+			indices[write++] = c;
+		}
+		indices.resize(write);
+	}
+}
+
+
+// --------------------------------------------------------
+// Generates each LOD from the one before, keeping the
+// triangle order cache friendly
+// --------------------------------------------------------
+void GenerateLods(MeshData& meshData, float maxRelativeError)
+{
+	meshData.Lods.clear();
+	if (meshData.Indices.empty())
+		return;
+
+	Simplifier simplifier(meshData.Vertices, meshData.Indices);
+
+	size_t previousCount = meshData.Indices.size();
+	while (meshData.Lods.size() < MESH_MAX_LODS - 1)
+	{
+		size_t target = (previousCount / 2) / 3 * 3;
+		simplifier.Simplify(target, maxRelativeError);
+
+		// Not enough progress to be worth another level
+		const std::vector<unsigned int>& indices = simplifier.GetIndices();
+		if (indices.empty() || indices.size() > previousCount * LOD_MIN_REDUCTION)
+			break;
+
+		MeshLod lod;
+		lod.Indices = indices;
+		lod.Error = (float)(simplifier.GetError() * simplifier.GetScale());
+		OptimizeVertexCache(lod.Indices.data(), lod.Indices.size(), meshData.Vertices.size(), VERTEX_CACHE_SIZE);
+		meshData.Lods.push_back(std::move(lod));
+
+		previousCount = indices.size();
+	}
+}
+
+
+// --------------------------------------------------------
+// Levels get coarser as they go, so this takes the last one
+// that's good enough
+// --------------------------------------------------------
+unsigned int SelectLod(const float* levelErrors, unsigned int levelCount, float pixelsPerUnit)
+{
+	unsigned int lod = 0;
+	for (unsigned int i = 1; i < levelCount; i++)
+	{
+		if (levelErrors[i] * pixelsPerUnit > LOD_MAX_PIXEL_ERROR)
+			break;
+		lod = i;
+	}
+	return lod;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "MeshData.h"
+
+// Largest error (as a fraction of the mesh's size) any LOD
+// is allowed to have
+#define LOD_MAX_RELATIVE_ERROR 0.1f
+
+// How far (in pixels) a lower level of detail may stray from
+// the original mesh before SelectLod sticks with a more
+// detailed one
+#define LOD_MAX_PIXEL_ERROR 1.0f
+
+// --------------------------------------------------------
+// Builds lower detail versions of a mesh, each with about
+// half the triangles of the previous one, and stores them in
+// meshData.Lods (up to MESH_MAX_LODS - 1 of them).
+//
+// - Uses quadric error metrics (Garland & Heckbert, 1997),
+//    collapsing vertices onto their neighbors, with extra cost
+//    for differences in UVs and normals
+// - LODs only use the mesh's existing vertices, so they are
+//    just extra index buffers over the same vertex buffer
+// - Seams and open edges are kept as-is, so LODs never crack
+// - Stops early once the error would be too large or the mesh
+//    can't be reduced any further
+// --------------------------------------------------------
+void GenerateLods(MeshData& meshData, float maxRelativeError = LOD_MAX_RELATIVE_ERROR);
+
+// --------------------------------------------------------
+// Picks the least detailed level whose error stays under
+// LOD_MAX_PIXEL_ERROR on screen, given each level's error
+// (level 0 being the original mesh) and how many pixels one
+// local space unit covers
+// --------------------------------------------------------
+unsigned int SelectLod(const float* levelErrors, unsigned int levelCount, float pixelsPerUnit);
@@ -0,0 +1,320 @@
+#include "MeshletBuilder.h"
+
+#include <cmath>
+
+using namespace DirectX;
+
+// Marks a vertex that isn't in the meshlet being built
+#define MESHLET_NO_VERTEX 0xFF
+
+// Normal cones narrower than this (cosine of the largest
+// angle from the axis) are too wide to be worth testing
+#define MESHLET_MIN_CONE_DOT 0.1f
+
+// --------------------------------------------------------
+// Geometric normal of a triangle, matching the direction of
+// the vertex normals for this project's winding order
+// --------------------------------------------------------
+static XMVECTOR TriangleNormal(const Vertex* verts, const unsigned int* tri)
+{
+	XMVECTOR p0 = XMLoadFloat3(&verts[tri[0]].Position);
+	XMVECTOR p1 = XMLoadFloat3(&verts[tri[1]].Position);
+	XMVECTOR p2 = XMLoadFloat3(&verts[tri[2]].Position);
+	return XMVector3Cross(XMVectorSubtract(p1, p0), XMVectorSubtract(p2, p0));
+}
+
+
+// --------------------------------------------------------
+// Stores the meshlet (and its bounds), frees up its vertices
+// and sets up the next one to start where it ends
+// --------------------------------------------------------
+static void FinishMeshlet(const Vertex* verts, MeshletData& meshletData, Meshlet& meshlet, std::vector<uint8_t>& localIndex)
+{
+	for (uint32_t i = 0; i < meshlet.VertexCount; i++)
+		localIndex[meshletData.Vertices[meshlet.VertexOffset + i]] = MESHLET_NO_VERTEX;
+
+	meshletData.Meshlets.push_back(meshlet);
+	meshletData.Bounds.push_back(CalculateMeshletBounds(verts, meshletData, meshlet));
+
+	meshlet = {};
+	meshlet.VertexOffset = (uint32_t)meshletData.Vertices.size();
+	meshlet.TriangleOffset = (uint32_t)(meshletData.Triangles.size() / 3);
+}
+
+
+// --------------------------------------------------------
+// Splits an index buffer into meshlets
+//
+// - Grows one meshlet at a time, starting from the first
+//    unused triangle, by adding the neighboring triangle that
+//    adds the fewest new vertices (ties go to the one closest
+//    to the meshlet's center, then the lowest index)
+// - A meshlet is finished once it's full or no neighbor fits,
+//    so works best on cache optimized meshes (see MeshOptimizer.h)
+// - No randomness or threading, so the same input always
+//    gives the same meshlets
+//
+// verts       - The mesh's vertices
+// numVerts    - Number of vertices
+// indices     - Triangle list indices into verts
+// numIndices  - Number of indices
+// meshletData - Output (anything in here is replaced)
+// --------------------------------------------------------
+void BuildMeshlets(const Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices, MeshletData& meshletData)
+{
+	meshletData.Meshlets.clear();
+	meshletData.Bounds.clear();
+	meshletData.Vertices.clear();
+	meshletData.Triangles.clear();
+
+	size_t triangleCount = numIndices / 3;
+	if (triangleCount == 0)
+		return;
+
+	// Vertex -> triangle adjacency, where the first liveCount[v]
+	// entries for each vertex are triangles that aren't used yet
+	std::vector<unsigned int> adjacencyStart(numVerts + 1, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		adjacencyStart[indices[i] + 1]++;
+	for (size_t v = 0; v < numVerts; v++)
+		adjacencyStart[v + 1] += adjacencyStart[v];
+
+	std::vector<unsigned int> adjacency(triangleCount * 3);
+	std::vector<unsigned int> liveCount(numVerts, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+	{
+		unsigned int v = indices[i];
+		adjacency[adjacencyStart[v] + liveCount[v]++] = (unsigned int)(i / 3);
+	}
+
+	// Triangle centers, for keeping meshlets compact
+	std::vector<XMFLOAT3> centers(triangleCount);
+	for (size_t t = 0; t < triangleCount; t++)
+	{
+		XMVECTOR sum = XMVectorAdd(
+			XMVectorAdd(XMLoadFloat3(&verts[indices[t * 3]].Position), XMLoadFloat3(&verts[indices[t * 3 + 1]].Position)),
+			XMLoadFloat3(&verts[indices[t * 3 + 2]].Position));
+		XMStoreFloat3(&centers[t], XMVectorScale(sum, 1.0f / 3.0f));
+	}
+
+	std::vector<bool> used(triangleCount, false);
+	std::vector<uint8_t> localIndex(numVerts, MESHLET_NO_VERTEX);
+	size_t nextSeed = 0;
+	size_t trianglesLeft = triangleCount;
+
+	Meshlet meshlet = {};
+	XMVECTOR centerSum = XMVectorZero();
+
+	while (trianglesLeft > 0)
+	{
+		// Find the best triangle to add next
+		size_t best = triangleCount;
+		if (meshlet.TriangleCount == 0)
+		{
+			while (used[nextSeed])
+				nextSeed++;
+			best = nextSeed;
+		}
+		else
+		{
+			XMVECTOR meshletCenter = XMVectorScale(centerSum, 1.0f / meshlet.TriangleCount);
+			unsigned int bestNewVerts = 4;
+			float bestDistance = 0.0f;
+
+			for (uint32_t i = 0; i < meshlet.VertexCount; i++)
+			{
+				unsigned int v = meshletData.Vertices[meshlet.VertexOffset + i];
+				for (unsigned int a = adjacencyStart[v]; a < adjacencyStart[v] + liveCount[v]; a++)
+				{
+					unsigned int t = adjacency[a];
+					const unsigned int* tri = &indices[t * 3];
+					unsigned int newVerts =
+						(localIndex[tri[0]] == MESHLET_NO_VERTEX) +
+						(localIndex[tri[1]] == MESHLET_NO_VERTEX) +
+						(localIndex[tri[2]] == MESHLET_NO_VERTEX);
+					if (meshlet.VertexCount + newVerts > MESHLET_MAX_VERTICES || newVerts > bestNewVerts)
+						continue;
+
+					float distance = XMVectorGetX(XMVector3LengthSq(XMVectorSubtract(XMLoadFloat3(&centers[t]), meshletCenter)));
+					if (newVerts < bestNewVerts ||
+						distance < bestDistance ||
+						(distance == bestDistance && t < best))
+					{
+						best = t;
+						bestNewVerts = newVerts;
+						bestDistance = distance;
+					}
+				}
+			}
+		}
+
+		// Nothing fits, so start a new meshlet
+		if (best == triangleCount)
+		{
+			FinishMeshlet(verts, meshletData, meshlet, localIndex);
+			centerSum = XMVectorZero();
+			continue;
+		}
+
+		// Add it, along with any new vertices
+		const unsigned int* tri = &indices[best * 3];
+		for (int c = 0; c < 3; c++)
+		{
+			unsigned int v = tri[c];
+			if (localIndex[v] == MESHLET_NO_VERTEX)
+			{
+				localIndex[v] = (uint8_t)meshlet.VertexCount++;
+				meshletData.Vertices.push_back(v);
+			}
+			meshletData.Triangles.push_back(localIndex[v]);
+
+			// No longer available from this vertex
+			unsigned int end = adjacencyStart[v] + liveCount[v] - 1;
+			for (unsigned int a = adjacencyStart[v]; a <= end; a++)
+			{
+				if (adjacency[a] == best)
+				{
+					adjacency[a] = adjacency[end];
+					adjacency[end] = (unsigned int)best;
+					liveCount[v]--;
+					break;
+				}
+			}
+		}
+
+		used[best] = true;
+		trianglesLeft--;
+		meshlet.TriangleCount++;
+		centerSum = XMVectorAdd(centerSum, XMLoadFloat3(&centers[best]));
+
+		// Full?  (or last one)
+		if (meshlet.TriangleCount == MESHLET_MAX_TRIANGLES || trianglesLeft == 0)
+		{
+			FinishMeshlet(verts, meshletData, meshlet, localIndex);
+			centerSum = XMVectorZero();
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Calculates a bounding sphere (Ritter's algorithm) and a
+// normal cone for a meshlet
+//
+// The cone's cutoff is rounded up (made more conservative)
+// to cover the error from quantizing the axis
+// --------------------------------------------------------
+MeshletBounds CalculateMeshletBounds(const Vertex* verts, const MeshletData& meshletData, const Meshlet& meshlet)
+{
+	MeshletBounds bounds = {};
+	bounds.ConeCutoff = 127;
+	if (meshlet.VertexCount == 0)
+		return bounds;
+
+	const unsigned int* meshletVerts = &meshletData.Vertices[meshlet.VertexOffset];
+
+	// Start with the two points furthest apart along any axis
+	unsigned int minPoint[3] = { 0, 0, 0 };
+	unsigned int maxPoint[3] = { 0, 0, 0 };
+	for (uint32_t i = 1; i < meshlet.VertexCount; i++)
+	{
+		const float* p = &verts[meshletVerts[i]].Position.x;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (p[axis] < (&verts[meshletVerts[minPoint[axis]]].Position.x)[axis]) minPoint[axis] = i;
+			if (p[axis] > (&verts[meshletVerts[maxPoint[axis]]].Position.x)[axis]) maxPoint[axis] = i;
+		}
+	}
+
+	float bestSpan = -1.0f;
+	XMVECTOR center = XMVectorZero();
+	float radius = 0.0f;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		XMVECTOR a = XMLoadFloat3(&verts[meshletVerts[minPoint[axis]]].Position);
+		XMVECTOR b = XMLoadFloat3(&verts[meshletVerts[maxPoint[axis]]].Position);
+		float span = XMVectorGetX(XMVector3LengthSq(XMVectorSubtract(b, a)));
+		if (span > bestSpan)
+		{
+			bestSpan = span;
+			center = XMVectorScale(XMVectorAdd(a, b), 0.5f);
+			radius = sqrtf(span) * 0.5f;
+		}
+	}
+
+	// Grow to fit anything left outside
+	for (uint32_t i = 0; i < meshlet.VertexCount; i++)
+	{
+		XMVECTOR p = XMLoadFloat3(&verts[meshletVerts[i]].Position);
+		float distance = XMVectorGetX(XMVector3Length(XMVectorSubtract(p, center)));
+		if (distance > radius)
+		{
+			float newRadius = (radius + distance) * 0.5f;
+			center = XMVectorAdd(center, XMVectorScale(XMVectorSubtract(p, center), (newRadius - radius) / distance));
+			radius = newRadius;
+		}
+	}
+
+	XMStoreFloat3(&bounds.Center, center);
+	bounds.Radius = radius;
+
+	// Normal cone from the (unit) triangle normals
+	std::vector<XMFLOAT4> normals;
+	normals.reserve(meshlet.TriangleCount);
+	XMVECTOR normalSum = XMVectorZero();
+	for (uint32_t t = 0; t < meshlet.TriangleCount; t++)
+	{
+		const uint8_t* local = &meshletData.Triangles[(meshlet.TriangleOffset + t) * 3];
+		unsigned int tri[3] = { meshletVerts[local[0]], meshletVerts[local[1]], meshletVerts[local[2]] };
+
+		XMVECTOR normal = TriangleNormal(verts, tri);
+		float length = XMVectorGetX(XMVector3Length(normal));
+		if (length == 0.0f)
+			continue;
+
+		normal = XMVectorScale(normal, 1.0f / length);
+		normals.emplace_back();
+		XMStoreFloat4(&normals.back(), normal);
+		normalSum = XMVectorAdd(normalSum, normal);
+	}
+
+	float sumLength = XMVectorGetX(XMVector3Length(normalSum));
+	if (normals.empty() || sumLength == 0.0f)
+		return bounds;
+
+	XMVECTOR axis = XMVectorScale(normalSum, 1.0f / sumLength);
+	float minDot = 1.0f;
+	for (const XMFLOAT4& normal : normals)
+		minDot = fminf(minDot, XMVectorGetX(XMVector3Dot(axis, XMLoadFloat4(&normal))));
+
+	if (minDot <= MESHLET_MIN_CONE_DOT)
+		return bounds;
+
+	// The test uses the sine of the cone's half angle
+	XMFLOAT3 axisOut;
+	XMStoreFloat3(&axisOut, axis);
+	bounds.ConeAxis[0] = (int8_t)lroundf(axisOut.x * 127.0f);
+	bounds.ConeAxis[1] = (int8_t)lroundf(axisOut.y * 127.0f);
+	bounds.ConeAxis[2] = (int8_t)lroundf(axisOut.z * 127.0f);
+
+	float cutoff = sqrtf(1.0f - minDot * minDot);
+	bounds.ConeCutoff = (int8_t)fminf(ceilf(cutoff * 127.0f) + 1.0f, 127.0f);
+	return bounds;
+}
+
+
+// --------------------------------------------------------
+// Tests the view point against the meshlet's normal cone,
+// expanded by its bounding sphere
+// --------------------------------------------------------
+bool IsMeshletBackFacing(const MeshletBounds& bounds, XMFLOAT3 viewPosition)
+{
+	if (bounds.ConeCutoff == 127)
+		return false;
+
+	XMVECTOR axis = XMVector3Normalize(XMVectorSet(bounds.ConeAxis[0], bounds.ConeAxis[1], bounds.ConeAxis[2], 0.0f));
+	XMVECTOR toCenter = XMVectorSubtract(XMLoadFloat3(&bounds.Center), XMLoadFloat3(&viewPosition));
+	float cutoff = bounds.ConeCutoff / 127.0f;
+
+	return XMVectorGetX(XMVector3Dot(toCenter, axis)) >= cutoff * XMVectorGetX(XMVector3Length(toCenter)) + bounds.Radius;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstdint>
+#include <vector>
+
+#include "Vertex.h"
+
+// Limits for a single meshlet (these match what mesh shaders
+// and most cluster-based renderers expect)
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+// --------------------------------------------------------
+// A small cluster of triangles.  Its vertices are a range of
+// MeshletData::Vertices (indices into the mesh's vertices),
+// and its triangles are a range of MeshletData::Triangles
+// (three bytes each, indexing into the meshlet's vertices).
+// --------------------------------------------------------
+struct Meshlet
+{
+	uint32_t VertexOffset;
+	uint32_t TriangleOffset;	// In triangles, not bytes
+	uint32_t VertexCount;
+	uint32_t TriangleCount;
+};
+
+// --------------------------------------------------------
+// Culling info for a meshlet, 20 bytes each.
+//
+// The normal cone is quantized to snorm8.  A meshlet is
+// entirely back facing (from a point of view) when:
+//   dot(Center - view, axis) >= cutoff * |Center - view| + Radius
+// A cutoff of 127 means the cone is too wide to ever cull.
+// --------------------------------------------------------
+struct MeshletBounds
+{
+	DirectX::XMFLOAT3 Center;
+	float Radius;
+	int8_t ConeAxis[3];
+	int8_t ConeCutoff;
+};
+
+// --------------------------------------------------------
+// A mesh split into meshlets, with the bounds of each kept
+// in a separate array (Bounds[i] belongs to Meshlets[i])
+// --------------------------------------------------------
+struct MeshletData
+{
+	std::vector<Meshlet> Meshlets;
+	std::vector<MeshletBounds> Bounds;
+	std::vector<unsigned int> Vertices;
+	std::vector<uint8_t> Triangles;
+};
+
+// Splits an index buffer into meshlets (always the same
+// result for the same input)
+void BuildMeshlets(const Vertex* verts, size_t numVerts, const unsigned int* indices, size_t numIndices, MeshletData& meshletData);
+
+// Bounds of a single meshlet
+MeshletBounds CalculateMeshletBounds(const Vertex* verts, const MeshletData& meshletData, const Meshlet& meshlet);
+
+// True if every triangle in the meshlet faces away from the given point
+// (in the same space as the vertices)
+bool IsMeshletBackFacing(const MeshletBounds& bounds, DirectX::XMFLOAT3 viewPosition);
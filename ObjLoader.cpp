@@ -0,0 +1,387 @@
+#include "ObjLoader.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+
+#include <charconv>
+#include <cstring>
+
+using namespace DirectX;
+
+// Smallest piece of a file worth handing to its own thread
+#define OBJ_MIN_CHUNK_SIZE (256 * 1024)
+
+// --------------------------------------------------------
+// Resolved (0-based) indices for one corner of a triangle,
+// with -1 for anything the corner doesn't have
+// --------------------------------------------------------
+struct ObjCorner
+{
+	int Position;
+	int UV;
+	int Normal;
+};
+
+// --------------------------------------------------------
+// A range of whole lines from the file, parsed on its own
+// --------------------------------------------------------
+struct ObjChunk
+{
+	const char* Start;
+	const char* End;
+
+	// Line counts for this chunk
+	size_t PositionCount;
+	size_t UVCount;
+	size_t NormalCount;
+	size_t FaceCount;
+
+	// Where this chunk's data starts in the overall arrays
+	size_t PositionOffset;
+	size_t UVOffset;
+	size_t NormalOffset;
+	size_t VertexOffset;
+
+	// Triangle corners, already in final (flipped) winding order
+	std::vector<ObjCorner> Corners;
+};
+
+// --------------------------------------------------------
+// Skips spaces and tabs, stopping at anything else
+// (including the end of the line)
+// --------------------------------------------------------
+static inline const char* SkipSpaces(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+// --------------------------------------------------------
+// Parses a single float in place, leaving the value
+// untouched if there is no number at this position
+// --------------------------------------------------------
+static inline const char* ParseFloat(const char* p, const char* end, float& value)
+{
+	p = SkipSpaces(p, end);
+
+	// from_chars doesn't accept a leading plus sign
+	if (p < end && *p == '+')
+		p++;
+
+	std::from_chars_result result = std::from_chars(p, end, value);
+	return result.ec == std::errc() ? result.ptr : p;
+}
+
+// --------------------------------------------------------
+// Parses a single (possibly negative) integer in place,
+// returning 0 if there is no number at this position
+// --------------------------------------------------------
+static inline const char* ParseInt(const char* p, const char* end, int& value)
+{
+	value = 0;
+	std::from_chars_result result = std::from_chars(p, end, value);
+	return result.ec == std::errc() ? result.ptr : p;
+}
+
+// --------------------------------------------------------
+// Converts a 1-based (or negative, relative) OBJ index into
+// a 0-based index, returning -1 if it doesn't refer to
+// anything that has been read so far
+// --------------------------------------------------------
+static inline int ResolveIndex(int objIndex, size_t count)
+{
+	int index = objIndex > 0 ? objIndex - 1 : (int)count + objIndex;
+	return (objIndex != 0 && index >= 0 && (size_t)index < count) ? index : -1;
+}
+
+// --------------------------------------------------------
+// Creates and returns a fully set up vertex for a face corner
+//
+// The model is most likely in a right-handed space,
+// especially if it came from Maya.  We want to convert
+// to a left-handed space for DirectX.  This means we
+// need to:
+//  - Invert the Z position
+//  - Invert the normal's Z
+//  - Flip the winding order (handled while parsing faces)
+// We also need to flip the UV coordinate since DirectX
+// defines (0,0) as the top left of the texture, and many
+// 3D modeling packages use the bottom left as (0,0)
+// --------------------------------------------------------
+static inline Vertex MakeVertex(
+	const ObjCorner& corner,
+	const XMFLOAT3* positions,
+	const XMFLOAT2* uvs,
+	const XMFLOAT3* normals)
+{
+	Vertex v = {};
+	if (corner.Position >= 0) v.Position = positions[corner.Position];
+	if (corner.UV >= 0) v.UV = uvs[corner.UV];
+	if (corner.Normal >= 0) v.Normal = normals[corner.Normal];
+
+	v.UV.y = 1.0f - v.UV.y;
+	v.Position.z *= -1.0f;
+	v.Normal.z *= -1.0f;
+	return v;
+}
+
+// --------------------------------------------------------
+// Counts each type of line in a chunk
+// --------------------------------------------------------
+static void CountLines(ObjChunk& chunk)
+{
+	chunk.PositionCount = 0;
+	chunk.UVCount = 0;
+	chunk.NormalCount = 0;
+	chunk.FaceCount = 0;
+
+	const char* const end = chunk.End;
+	for (const char* line = chunk.Start; line < end;)
+	{
+		const char* p = SkipSpaces(line, end);
+		if (p + 1 < end && p[0] == 'v')
+		{
+			if (p[1] == 'n') chunk.NormalCount++;
+			else if (p[1] == 't') chunk.UVCount++;
+			else if (p[1] == ' ' || p[1] == '\t') chunk.PositionCount++;
+		}
+		else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			chunk.FaceCount++;
+		}
+
+		const char* next = (const char*)memchr(p, '\n', end - p);
+		line = next ? next + 1 : end;
+	}
+}
+
+// --------------------------------------------------------
+// Parses every line in a chunk
+//
+// - Positions, uvs and normals are written directly into
+//    the overall arrays at this chunk's offsets
+// - Face corners are resolved against everything read up
+//    to that point in the file (the offsets plus what this
+//    chunk has read so far), exactly as a front-to-back
+//    parse would see it
+// --------------------------------------------------------
+static void ParseChunk(ObjChunk& chunk, XMFLOAT3* positions, XMFLOAT2* uvs, XMFLOAT3* normals)
+{
+	size_t positionCount = chunk.PositionOffset;
+	size_t uvCount = chunk.UVOffset;
+	size_t normalCount = chunk.NormalOffset;
+
+	// Assume triangles, which is by far the most common case
+	chunk.Corners.clear();
+	chunk.Corners.reserve(chunk.FaceCount * 3);
+
+	const char* const end = chunk.End;
+	for (const char* line = chunk.Start; line < end;)
+	{
+		const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+		if (!lineEnd) lineEnd = end;
+
+		const char* p = SkipSpaces(line, lineEnd);
+		line = lineEnd + 1;
+		if (p + 1 >= lineEnd)
+			continue;
+
+		// Check the type of line
+		if (p[0] == 'v' && p[1] == 'n')
+		{
+			XMFLOAT3 norm = { 0, 0, 0 };
+			p = ParseFloat(p + 2, lineEnd, norm.x);
+			p = ParseFloat(p, lineEnd, norm.y);
+			p = ParseFloat(p, lineEnd, norm.z);
+			normals[normalCount++] = norm;
+		}
+		else if (p[0] == 'v' && p[1] == 't')
+		{
+			XMFLOAT2 uv = { 0, 0 };
+			p = ParseFloat(p + 2, lineEnd, uv.x);
+			p = ParseFloat(p, lineEnd, uv.y);
+			uvs[uvCount++] = uv;
+		}
+		else if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			XMFLOAT3 pos = { 0, 0, 0 };
+			p = ParseFloat(p + 1, lineEnd, pos.x);
+			p = ParseFloat(p, lineEnd, pos.y);
+			p = ParseFloat(p, lineEnd, pos.z);
+			positions[positionCount++] = pos;
+		}
+		else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			// Walk the corners, fanning out triangles from the
+			// first corner as we go: (0, 1, 2), (0, 2, 3), ...
+			ObjCorner first = {};
+			ObjCorner previous = {};
+			int cornerCount = 0;
+
+			p++;
+			while (true)
+			{
+				p = SkipSpaces(p, lineEnd);
+				if (p >= lineEnd || *p == '\r' || *p == '#')
+					break;
+
+				// Read up to three slash-separated indices
+				int index[3] = { 0, 0, 0 };
+				const char* start = p;
+				p = ParseInt(p, lineEnd, index[0]);
+				for (int i = 1; i < 3 && p < lineEnd && *p == '/'; i++)
+					p = ParseInt(p + 1, lineEnd, index[i]);
+
+				// Skip anything we couldn't make sense of
+				if (p == start)
+				{
+					while (p < lineEnd && *p != ' ' && *p != '\t')
+						p++;
+					continue;
+				}
+
+				ObjCorner current = {
+					ResolveIndex(index[0], positionCount),
+					ResolveIndex(index[1], uvCount),
+					ResolveIndex(index[2], normalCount) };
+
+				if (cornerCount == 0)
+				{
+					first = current;
+				}
+				else if (cornerCount >= 2)
+				{
+					// Add a whole triangle (flipping the winding order)
+					chunk.Corners.push_back(first);
+					chunk.Corners.push_back(current);
+					chunk.Corners.push_back(previous);
+				}
+
+				previous = current;
+				cornerCount++;
+			}
+		}
+	}
+}
+
+
+// --------------------------------------------------------
+// Loads the given .obj file into the mesh data by mapping
+// it into memory and parsing it in place
+//
+// objFile  - Path to the .obj 3D model file to load
+// meshData - Output geometry, one vertex per face corner
+//
+// Returns false if the file couldn't be opened
+// --------------------------------------------------------
+bool LoadOBJ(const std::wstring& objFile, MeshData& meshData)
+{
+	MappedFile file(objFile);
+	if (!file.IsOpen())
+		return false;
+
+	return ParseOBJ(file.GetData(), file.GetSize(), meshData);
+}
+
+
+// --------------------------------------------------------
+// Parses .obj text that is already in memory
+//
+// - The text is split at line boundaries into chunks which
+//    are handled in parallel on the thread pool:
+//    1. Count each type of line per chunk
+//    2. Prefix sum the counts so every chunk knows where its
+//        data goes, then parse all chunks in place
+//    3. Prefix sum the triangle corners and build the final
+//        vertices and indices
+// - The output is identical no matter how many chunks or
+//    threads there are
+// - Tokenizing is done in place with from_chars, so there is
+//    no per-line copying and no limit on line length
+// - Faces may have any number of corners (fan triangulated),
+//    and corners may be v, v/vt, v//vn or v/vt/vn.  Any
+//    missing data is left as zero.
+// --------------------------------------------------------
+bool ParseOBJ(const char* text, size_t length, MeshData& meshData)
+{
+	ThreadPool& threadPool = ThreadPool::GetInstance();
+
+	// Split into roughly even chunks (a few per thread to
+	// balance things out), each ending just after a newline
+	size_t chunkCount = length / OBJ_MIN_CHUNK_SIZE;
+	size_t maxChunks = (size_t)threadPool.GetThreadCount() * 4;
+	if (chunkCount > maxChunks) chunkCount = maxChunks;
+	if (chunkCount < 1) chunkCount = 1;
+
+	std::vector<ObjChunk> chunks;
+	chunks.reserve(chunkCount);
+	const char* const fileEnd = text + length;
+	const char* chunkStart = text;
+	for (size_t i = 1; i <= chunkCount && chunkStart < fileEnd; i++)
+	{
+		const char* chunkEnd = fileEnd;
+		if (i < chunkCount)
+		{
+			const char* target = text + length / chunkCount * i;
+			if (target < chunkStart) target = chunkStart;
+
+			const char* newline = (const char*)memchr(target, '\n', fileEnd - target);
+			chunkEnd = newline ? newline + 1 : fileEnd;
+		}
+
+		ObjChunk chunk = {};
+		chunk.Start = chunkStart;
+		chunk.End = chunkEnd;
+		chunks.push_back(std::move(chunk));
+		chunkStart = chunkEnd;
+	}
+
+	// Count, then work out where each chunk's data goes
+	threadPool.ParallelFor(chunks.size(), [&](size_t i) { CountLines(chunks[i]); });
+
+	size_t positionCount = 0;
+	size_t uvCount = 0;
+	size_t normalCount = 0;
+	for (ObjChunk& chunk : chunks)
+	{
+		chunk.PositionOffset = positionCount;
+		chunk.UVOffset = uvCount;
+		chunk.NormalOffset = normalCount;
+		positionCount += chunk.PositionCount;
+		uvCount += chunk.UVCount;
+		normalCount += chunk.NormalCount;
+	}
+
+	// Parse everything into the final attribute arrays
+	std::vector<XMFLOAT3> positions(positionCount);
+	std::vector<XMFLOAT2> uvs(uvCount);
+	std::vector<XMFLOAT3> normals(normalCount);
+	threadPool.ParallelFor(chunks.size(), [&](size_t i) {
+		ParseChunk(chunks[i], positions.data(), uvs.data(), normals.data());
+	});
+
+	// Work out where each chunk's vertices go
+	size_t vertexCount = 0;
+	for (ObjChunk& chunk : chunks)
+	{
+		chunk.VertexOffset = vertexCount;
+		vertexCount += chunk.Corners.size();
+	}
+
+	// Build the vertex per corner
+	std::vector<Vertex>& verts = meshData.Vertices;
+	std::vector<unsigned int>& indices = meshData.Indices;
+	verts.resize(vertexCount);
+	indices.resize(vertexCount);
+	threadPool.ParallelFor(chunks.size(), [&](size_t i) {
+		const ObjChunk& chunk = chunks[i];
+		for (size_t c = 0; c < chunk.Corners.size(); c++)
+		{
+			size_t vertCounter = chunk.VertexOffset + c;
+			verts[vertCounter] = MakeVertex(chunk.Corners[c], positions.data(), uvs.data(), normals.data());
+			indices[vertCounter] = (unsigned int)vertCounter;
+		}
+	});
+
+	return true;
+}
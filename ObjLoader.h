@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+
+#include "MeshData.h"
+
+// Helpers for turning .obj files into CPU-side mesh data
+bool LoadOBJ(const std::wstring& objFile, MeshData& meshData);
+bool ParseOBJ(const char* text, size_t length, MeshData& meshData);
@@ -1,6 +1,9 @@
 
 // === Defines ===
 
+// Shared with C++ - which layout is in the vertex buffers
+#include "VertexLayout.h"
+
 #define PI 3.141592654f
 #define TEST(x) payload.color = x; return;
 
@@ -14,7 +17,11 @@ struct Vertex
 	float3 normal			: NORMAL;
     float3 tangent			: TANGENT;
 };
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
 static const uint VertexSizeInBytes = 11 * 4; // 11 floats total per vertex * 4 bytes each
+#else
+static const uint VertexSizeInBytes = 20; // Must match sizeof(GPUVertex) in C++
+#endif
 
 
 // Payload for rays (data that is "sent along" with each ray during raytrace)
@@ -45,6 +52,8 @@ cbuffer SceneData : register(b0)
 cbuffer ObjectData : register(b1)
 {
 	float4 entityColor[MAX_INSTANCES_PER_BLAS];
+	float4 positionCenter;		// Vertex quantization (w unused)
+	float4 positionHalfExtent;
 	int type;
 };
 
@@ -74,6 +83,60 @@ uint3 LoadIndices(uint triangleIndex)
 	return IndexBuffer.Load3(indicesStart * 4); // 4 bytes per index
 }
 
+// Unpacks two snorm16 values (low half first), matching D3D rules
+float2 UnpackSnorm16x2(uint packed)
+{
+	int2 values = int2((int)(packed << 16) >> 16, (int)packed >> 16);
+	return max(values / 32767.0f, -1.0f);
+}
+
+// Unpacks two fp16 values (low half first)
+float2 UnpackHalf2(uint packed)
+{
+	return f16tof32(uint2(packed & 0xFFFF, packed >> 16));
+}
+
+// Decodes an octahedral unit vector (see VertexPacking.cpp)
+float3 DecodeOctahedral(float2 encoded)
+{
+	float3 d = float3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+	float t = saturate(-d.z);
+	d.x += d.x >= 0.0f ? -t : t;
+	d.y += d.y >= 0.0f ? -t : t;
+	return normalize(d);
+}
+
+// Loads and unpacks a single vertex from the vertex buffer
+Vertex LoadVertex(uint vertexIndex)
+{
+	uint dataIndex = vertexIndex * VertexSizeInBytes;
+	Vertex vert;
+
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
+	vert.localPosition = asfloat(VertexBuffer.Load3(dataIndex));
+	vert.uv = asfloat(VertexBuffer.Load2(dataIndex + 12));
+	vert.normal = asfloat(VertexBuffer.Load3(dataIndex + 20));
+	vert.tangent = asfloat(VertexBuffer.Load3(dataIndex + 32));
+#else
+	// Position (4 x 16 bits, w unused), normal & tangent, UV
+	uint2 position = VertexBuffer.Load2(dataIndex);
+	uint2 directions = VertexBuffer.Load2(dataIndex + 8);
+	uint uv = VertexBuffer.Load(dataIndex + 16);
+
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_HALF
+	vert.localPosition = float3(UnpackHalf2(position.x), UnpackHalf2(position.y).x);
+#elif VERTEX_LAYOUT == VERTEX_LAYOUT_NORM16
+	float3 relative = float3(UnpackSnorm16x2(position.x), UnpackSnorm16x2(position.y).x);
+	vert.localPosition = positionCenter.xyz + relative * positionHalfExtent.xyz;
+#endif
+	vert.uv = UnpackHalf2(uv);
+	vert.normal = DecodeOctahedral(UnpackSnorm16x2(directions.x));
+	vert.tangent = DecodeOctahedral(UnpackSnorm16x2(directions.y));
+#endif
+
+	return vert;
+}
+
 // Barycentric interpolation of data from the triangle's vertices
 Vertex InterpolateVertices(uint triangleIndex, float3 barycentricData)
 {
@@ -90,23 +153,11 @@ Vertex InterpolateVertices(uint triangleIndex, float3 barycentricData)
 	// Loop through the barycentric data and interpolate
 	for (uint i = 0; i < 3; i++)
 	{
-		// Get the index of the first piece of data for this vertex
-		uint dataIndex = indices[i] * VertexSizeInBytes;
-
-		// Grab the position and offset
-		vert.localPosition += asfloat(VertexBuffer.Load3(dataIndex)) * barycentricData[i];
-		dataIndex += 3 * 4; // 3 floats * 4 bytes per float
-
-		// UV
-		vert.uv += asfloat(VertexBuffer.Load2(dataIndex)) * barycentricData[i];
-		dataIndex += 2 * 4; // 2 floats * 4 bytes per float
-
-		// Normal
-		vert.normal += asfloat(VertexBuffer.Load3(dataIndex)) * barycentricData[i];
-		dataIndex += 3 * 4; // 3 floats * 4 bytes per float
-
-		// Tangent (no offset at the end, since we start over after looping)
-		vert.tangent += asfloat(VertexBuffer.Load3(dataIndex)) * barycentricData[i];
+		Vertex v = LoadVertex(indices[i]);
+		vert.localPosition += v.localPosition * barycentricData[i];
+		vert.uv += v.uv * barycentricData[i];
+		vert.normal += v.normal * barycentricData[i];
+		vert.tangent += v.tangent * barycentricData[i];
 	}
 
 	// Final interpolated vertex data is ready
@@ -1,6 +1,7 @@
 #include "RaytracingHelper.h"
 #include "DX12Helper.h"
 #include "BufferStructs.h"
+#include "MeshSimplifier.h"
 
 #include <d3dcompiler.h>
 #include <DirectXMath.h>
@@ -523,11 +524,12 @@ void RaytracingHelper::ResizeOutputUAV(unsigned int screenWidth, unsigned int sc
 
 
 // --------------------------------------------------------
-// Creates a BLAS for a particular mesh and returns the
-// data associated with it.  Presumably this data will be
-// stored along with the associated mesh.
+// Creates a BLAS for a particular mesh (at a particular
+// level of detail) and returns the data associated with it.
+// Presumably this data will be stored along with the
+// associated mesh.  Each level gets its own hit group.
 // --------------------------------------------------------
-MeshRaytracingData RaytracingHelper::CreateBottomLevelAccelerationStructureForMesh(Mesh* mesh)
+MeshRaytracingData RaytracingHelper::CreateBottomLevelAccelerationStructureForMesh(Mesh* mesh, unsigned int lod)
 {
 	MeshRaytracingData raytracingData = {};
 
@@ -537,11 +539,39 @@ MeshRaytracingData RaytracingHelper::CreateBottomLevelAccelerationStructureForMe
 	geometryDesc.Triangles.VertexBuffer.StartAddress = mesh->GetVBResource()->GetGPUVirtualAddress();
 	geometryDesc.Triangles.VertexBuffer.StrideInBytes = mesh->GetVBView().StrideInBytes;
 	geometryDesc.Triangles.VertexCount = static_cast<UINT>(mesh->GetVertexCount());
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
 	geometryDesc.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
-	geometryDesc.Triangles.IndexBuffer = mesh->GetIBResource()->GetGPUVirtualAddress();
-	geometryDesc.Triangles.IndexFormat = mesh->GetIBView().Format;
-	geometryDesc.Triangles.IndexCount = static_cast<UINT>(mesh->GetIndexCount());
+#elif VERTEX_LAYOUT == VERTEX_LAYOUT_HALF
+	geometryDesc.Triangles.VertexFormat = DXGI_FORMAT_R16G16B16A16_FLOAT; // Alpha is ignored
+#elif VERTEX_LAYOUT == VERTEX_LAYOUT_NORM16
+	geometryDesc.Triangles.VertexFormat = DXGI_FORMAT_R16G16B16A16_SNORM; // Alpha is ignored
+#endif
+	geometryDesc.Triangles.IndexBuffer = mesh->GetIBResource(lod)->GetGPUVirtualAddress();
+	geometryDesc.Triangles.IndexFormat = mesh->GetIBView(lod).Format;
+	geometryDesc.Triangles.IndexCount = static_cast<UINT>(mesh->GetIndexCount(lod));
 	geometryDesc.Triangles.Transform3x4 = 0;
+
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_NORM16
+	// Positions are relative to the mesh bounds, so the build needs
+	// a transform (row major 3x4) to get them back to local space.
+	// Every level shares the same vertices, and so the same transform.
+	if (lod > 0)
+	{
+		raytracingData.BLASTransform = mesh->GetRaytracingData(0).BLASTransform;
+	}
+	else
+	{
+		VertexQuantization q = mesh->GetVertexQuantization();
+		float dequantize[3][4] =
+		{
+			{ q.HalfExtent.x, 0, 0, q.Center.x },
+			{ 0, q.HalfExtent.y, 0, q.Center.y },
+			{ 0, 0, q.HalfExtent.z, q.Center.z },
+		};
+		raytracingData.BLASTransform = DX12Helper::GetInstance().CreateStaticBuffer(sizeof(dequantize), 1, dequantize);
+	}
+	geometryDesc.Triangles.Transform3x4 = raytracingData.BLASTransform->GetGPUVirtualAddress();
+#endif
 	geometryDesc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE; // Performance boost when dealing with opaque geometry
 
 	// Describe our overall input so we can get sizing info
@@ -593,8 +623,10 @@ MeshRaytracingData RaytracingHelper::CreateBottomLevelAccelerationStructureForMe
 	// Note: These must come one after the other in the descriptor heap, and index must come first
 	//       This is due to the way we've set up the root signature (expects a table of these)
 	D3D12_CPU_DESCRIPTOR_HANDLE ib_cpu, vb_cpu;
-	DX12Helper::GetInstance().ReserveSrvUavDescriptorHeapSlot(&ib_cpu, &raytracingData.IndexbufferSRV);
-	DX12Helper::GetInstance().ReserveSrvUavDescriptorHeapSlot(&vb_cpu, &raytracingData.VertexBufferSRV);
+	UINT descriptorSize = dxrDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+	DX12Helper::GetInstance().ReserveSrvUavDescriptorHeapSlots(2, &ib_cpu, &raytracingData.IndexbufferSRV);
+	vb_cpu.ptr = ib_cpu.ptr + descriptorSize;
+	raytracingData.VertexBufferSRV.ptr = raytracingData.IndexbufferSRV.ptr + descriptorSize;
 
 	// Index buffer SRV
 	D3D12_SHADER_RESOURCE_VIEW_DESC indexSRVDesc = {};
@@ -603,9 +635,9 @@ MeshRaytracingData RaytracingHelper::CreateBottomLevelAccelerationStructureForMe
 	indexSRVDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_RAW;
 	indexSRVDesc.Buffer.StructureByteStride = 0;
 	indexSRVDesc.Buffer.FirstElement = 0;
-	indexSRVDesc.Buffer.NumElements = mesh->GetIndexCount();
+	indexSRVDesc.Buffer.NumElements = mesh->GetIndexCount(lod);
 	indexSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-	dxrDevice->CreateShaderResourceView(mesh->GetIBResource().Get(), &indexSRVDesc, ib_cpu);
+	dxrDevice->CreateShaderResourceView(mesh->GetIBResource(lod).Get(), &indexSRVDesc, ib_cpu);
 
 	// Vertex buffer SRV
 	D3D12_SHADER_RESOURCE_VIEW_DESC vertexSRVDesc = {};
@@ -614,21 +646,39 @@ MeshRaytracingData RaytracingHelper::CreateBottomLevelAccelerationStructureForMe
 	vertexSRVDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_RAW;
 	vertexSRVDesc.Buffer.StructureByteStride = 0;
 	vertexSRVDesc.Buffer.FirstElement = 0;
-	vertexSRVDesc.Buffer.NumElements = (mesh->GetVertexCount() * sizeof(Vertex)) / sizeof(float); // How many floats total?
+	vertexSRVDesc.Buffer.NumElements = (mesh->GetVertexCount() * sizeof(GPUVertex)) / sizeof(float); // How many 32-bit values total?
 	vertexSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
 	dxrDevice->CreateShaderResourceView(mesh->GetVBResource().Get(), &vertexSRVDesc, vb_cpu);
 
-	// All done - execute, wait and reset command list
-	dxrCommandList->Close();
-	ID3D12CommandList* lists[] = { dxrCommandList.Get() };
-	commandQueue->ExecuteCommandLists(1, lists);
+	// All done - execute, wait and reset command list, unless
+	// we're batching, in which case the scratch buffer needs to
+	// live until the whole batch has executed
+	if (DX12Helper::GetInstance().IsBatching())
+	{
+		DX12Helper::GetInstance().KeepAliveUntilBatchEnds(blasScratchBuffer);
+	}
+	else
+	{
+		dxrCommandList->Close();
+		ID3D12CommandList* lists[] = { dxrCommandList.Get() };
+		commandQueue->ExecuteCommandLists(1, lists);
 
-	DX12Helper::GetInstance().WaitForGPU();
-	dxrCommandList->Reset(DX12Helper::GetInstance().GetDefaultAllocator().Get(), 0);
+		DX12Helper::GetInstance().WaitForGPU();
+		dxrCommandList->Reset(DX12Helper::GetInstance().GetDefaultAllocator().Get(), 0);
+	}
 
-	// Use the BLAS count as the hit group index for this mesh
-	raytracingData.HitGroupIndex = blasCount;
-	blasCount++;
+	// Reuse a released hit group if there is one, otherwise
+	// use the BLAS count as the hit group index for this mesh (and level)
+	if (!freeHitGroups.empty())
+	{
+		raytracingData.HitGroupIndex = freeHitGroups.back();
+		freeHitGroups.pop_back();
+	}
+	else
+	{
+		raytracingData.HitGroupIndex = blasCount;
+		blasCount++;
+	}
 
 	// Put this mesh's buffer SRVs in the appropriate shader table entry
 	unsigned char* tablePointer = 0;
@@ -647,12 +697,94 @@ MeshRaytracingData RaytracingHelper::CreateBottomLevelAccelerationStructureForMe
 }
 
 
+// --------------------------------------------------------
+// Gives back the hit group and descriptors used by a BLAS
+// so that later meshes can reuse them.  The BLAS itself is
+// freed once the last reference to it goes away.
+//
+// The GPU must be finished with the BLAS, and it must not
+// be part of the next TLAS.
+// --------------------------------------------------------
+void RaytracingHelper::ReleaseBottomLevelAccelerationStructure(MeshRaytracingData& raytracingData)
+{
+	if (!raytracingData.BLAS)
+		return;
+
+	// Clear out the record's SRVs, just in case
+	unsigned char* tablePointer = 0;
+	shaderTable->Map(0, 0, (void**)&tablePointer);
+	{
+		tablePointer += shaderTableRecordSize * 2;
+		tablePointer += shaderTableRecordSize * raytracingData.HitGroupIndex;
+		tablePointer += D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES;
+		tablePointer += 8;
+		memset(tablePointer, 0, 8);
+	}
+	shaderTable->Unmap(0, 0);
+
+	freeHitGroups.push_back(raytracingData.HitGroupIndex);
+	DX12Helper::GetInstance().FreeSrvUavDescriptorHeapSlots(raytracingData.IndexbufferSRV, 2);
+
+	raytracingData = {};
+}
+
+
+// --------------------------------------------------------
+// Picks the least detailed level of an entity's mesh whose
+// error, projected onto the screen, stays under a pixel (see
+// ::SelectLod).  Uses the distance to the entity's bounding
+// sphere, so anything the camera is inside of gets full
+// detail.
+// --------------------------------------------------------
+unsigned int RaytracingHelper::SelectLod(std::shared_ptr<GameEntity> entity, std::shared_ptr<Camera> camera)
+{
+	std::shared_ptr<Mesh> mesh = entity->GetMesh();
+	if (!camera || mesh->GetLodCount() <= 1)
+		return 0;
+
+	// World space bounding sphere, using the largest scale
+	// axis so it's conservative for non-uniform scales
+	XMFLOAT4X4 world = entity->GetTransform()->GetWorldMatrix();
+	XMMATRIX worldMat = XMLoadFloat4x4(&world);
+	XMFLOAT3 boundsMin = mesh->GetBoundsMin();
+	XMFLOAT3 boundsMax = mesh->GetBoundsMax();
+	XMVECTOR localCenter = XMVectorScale(XMVectorAdd(XMLoadFloat3(&boundsMin), XMLoadFloat3(&boundsMax)), 0.5f);
+	float localRadius = XMVectorGetX(XMVector3Length(XMVectorSubtract(XMLoadFloat3(&boundsMax), localCenter)));
+	float maxScale = max(
+		XMVectorGetX(XMVector3Length(worldMat.r[0])), max(
+		XMVectorGetX(XMVector3Length(worldMat.r[1])),
+		XMVectorGetX(XMVector3Length(worldMat.r[2]))));
+
+	XMFLOAT3 cameraPos = camera->GetTransform()->GetPosition();
+	XMVECTOR center = XMVector3Transform(localCenter, worldMat);
+	float distance = XMVectorGetX(XMVector3Length(XMVectorSubtract(center, XMLoadFloat3(&cameraPos)))) - localRadius * maxScale;
+	distance = max(distance, camera->GetNearClip());
+
+	// How many pixels one world space unit covers at that distance
+	float pixelsPerUnit = 0.0f;
+	if (camera->GetProjectionType() == CameraProjectionType::Perspective)
+		pixelsPerUnit = screenHeight / (2.0f * tanf(camera->GetFieldOfView() * 0.5f) * distance);
+	else
+		pixelsPerUnit = screenHeight / (camera->GetOrthographicWidth() / camera->GetAspectRatio());
+
+	float levelErrors[MESH_MAX_LODS] = {};
+	unsigned int levelCount = min(mesh->GetLodCount(), (unsigned int)MESH_MAX_LODS);
+	for (unsigned int i = 0; i < levelCount; i++)
+		levelErrors[i] = mesh->GetLodError(i);
+	return ::SelectLod(levelErrors, levelCount, maxScale * pixelsPerUnit);
+}
+
+
 // --------------------------------------------------------
 // Creates the top level accel structure for a vector of
 // game entities (a "scene"), using the meshes and transforms
 // of each entity for the BLAS instances.
+//
+// If a camera is given, each instance uses the lowest level
+// of detail that looks the same from there (see SelectLod).
+// Secondary rays see the same levels as primary ones.
 // --------------------------------------------------------
-void RaytracingHelper::CreateTopLevelAccelerationStructureForScene(std::vector<std::shared_ptr<GameEntity>> scene)
+void RaytracingHelper::CreateTopLevelAccelerationStructureForScene(std::vector<std::shared_ptr<GameEntity>> scene, std::shared_ptr<Camera> camera)
 {
 	if (scene.size() == 0)
 		return;
@@ -673,9 +805,14 @@ void RaytracingHelper::CreateTopLevelAccelerationStructureForScene(std::vector<s
 		DirectX::XMFLOAT4X4 transform = scene[i]->GetTransform()->GetWorldMatrix();
 		XMStoreFloat4x4(&transform, XMMatrixTranspose(XMLoadFloat4x4(&transform)));
 
-		// Grab this mesh's index in the shader table
+		// Grab this mesh's (and level's) index in the shader table
+		// (entities whose mesh failed to load are left out)
 		std::shared_ptr<Mesh> mesh = scene[i]->GetMesh();
-		unsigned int meshBlasIndex = mesh->GetRaytracingData().HitGroupIndex;
+		if (!mesh)
+			continue;
+		unsigned int lod = SelectLod(scene[i], camera);
+		MeshRaytracingData meshRaytracingData = mesh->GetRaytracingData(lod);
+		unsigned int meshBlasIndex = meshRaytracingData.HitGroupIndex;
 
 		MaterialType type = scene[i]->GetMaterial()->GetType();
 		int typeNum = -1;
@@ -686,9 +823,9 @@ void RaytracingHelper::CreateTopLevelAccelerationStructureForScene(std::vector<s
 		D3D12_RAYTRACING_INSTANCE_DESC id = {};
 		id.InstanceContributionToHitGroupIndex = meshBlasIndex;
 		id.InstanceID = instanceIDs[meshBlasIndex];
-		id.InstanceMask = 0xFF;
+		id.InstanceMask = scene[i]->GetMaterial()->GetInstanceMask();
 		memcpy(&id.Transform, &transform, sizeof(float) * 3 * 4); // Copy first [3][4] elements
-		id.AccelerationStructure = mesh->GetRaytracingData().BLAS->GetGPUVirtualAddress();
+		id.AccelerationStructure = meshRaytracingData.BLAS->GetGPUVirtualAddress();
 		id.Flags = D3D12_RAYTRACING_INSTANCE_FLAG_NONE;
 		instanceDescs.push_back(id);
 
@@ -700,9 +837,16 @@ void RaytracingHelper::CreateTopLevelAccelerationStructureForScene(std::vector<s
 		entityData[meshBlasIndex].color[id.InstanceID] = XMFLOAT4(c.x, c.y, c.z, r); // Using alpha channel as "roughness"
 		entityData[meshBlasIndex].type = typeNum;
 
+		// Hit shaders need this to decode vertex positions
+		VertexQuantization q = mesh->GetVertexQuantization();
+		entityData[meshBlasIndex].positionCenter = XMFLOAT4(q.Center.x, q.Center.y, q.Center.z, 0);
+		entityData[meshBlasIndex].positionHalfExtent = XMFLOAT4(q.HalfExtent.x, q.HalfExtent.y, q.HalfExtent.z, 0);
+
 		// On to the next instance for this mesh
 		instanceIDs[meshBlasIndex]++;
 	}
+	if (instanceDescs.empty())
+		return;
 
 	// Is our current description buffer too small?
 	if (sizeof(D3D12_RAYTRACING_INSTANCE_DESC) * instanceDescs.size() > tlasInstanceDataSizeInBytes)
@@ -63,8 +63,9 @@ public:
 	void ResizeOutputUAV(unsigned int screenWidth, unsigned int screenHeight);
 
 	// Setup process requiring data from outside the helper
-	MeshRaytracingData CreateBottomLevelAccelerationStructureForMesh(Mesh* mesh);
-	void CreateTopLevelAccelerationStructureForScene(std::vector<std::shared_ptr<GameEntity>> scene);
+	MeshRaytracingData CreateBottomLevelAccelerationStructureForMesh(Mesh* mesh, unsigned int lod = 0);
+	void ReleaseBottomLevelAccelerationStructure(MeshRaytracingData& raytracingData);
+	void CreateTopLevelAccelerationStructureForScene(std::vector<std::shared_ptr<GameEntity>> scene, std::shared_ptr<Camera> camera = 0);
 
 	// Actual work
 	void Raytrace(std::shared_ptr<Camera> camera, Microsoft::WRL::ComPtr<ID3D12Resource> currentBackBuffer, bool executeCommandList = true);
@@ -83,7 +84,7 @@ private:
 	// in our shader table, each of which corresponds to
 	// a unique combination of geometry & hit shader.
 	// In a simple demo, this is effectively the maximum
-	// number of unique mesh BLAS's.
+	// number of unique mesh BLAS's (each LOD has its own).
 	const unsigned int MAX_HIT_GROUPS_IN_SHADER_TABLE = 1000;
 
 	// Command queue for processing raytracing commands
@@ -109,8 +110,10 @@ private:
 	UINT64 shaderTableRecordSize;
 	UINT64 shaderTableSize;
 
-	// How many BLAS we've created
+	// How many hit groups we've handed out (one per BLAS),
+	// and which of those have since been released
 	UINT blasCount;
+	std::vector<UINT> freeHitGroups;
 
 	// Accel structure requirements
 	UINT64 tlasBufferSizeInBytes;
@@ -130,5 +133,8 @@ private:
 	void CreateRaytracingPipelineState(std::wstring raytracingShaderLibraryFile);
 	void CreateShaderTable();
 	void CreateRaytracingOutputUAV(unsigned int width, unsigned int height);
+
+	// Picks the level of detail for an entity as seen from the camera
+	unsigned int SelectLod(std::shared_ptr<GameEntity> entity, std::shared_ptr<Camera> camera);
 };
 
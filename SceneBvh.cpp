@@ -0,0 +1,371 @@
+#include "SceneBvh.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+using namespace DirectX;
+
+// --------------------------------------------------------
+// Sets up an instance from its world matrix: the cached
+// inverse, and world space bounds around its BVH's root box.
+// Returns false for instances that can't go in the tree (no
+// BVH, an empty one, or a world matrix with no inverse).
+// --------------------------------------------------------
+bool SceneBvh::SetUpInstance(const XMFLOAT4X4& worldMatrix, const Bvh* blas, SceneBvhInstance& instance, BvhBounds& bounds)
+{
+	instance.Blas = 0;
+	if (!blas || blas->IsEmpty())
+		return false;
+
+	XMMATRIX world = XMLoadFloat4x4(&worldMatrix);
+	XMVECTOR determinant;
+	XMMATRIX worldToObject = XMMatrixInverse(&determinant, world);
+	if (XMVectorGetX(determinant) == 0)
+		return false;
+
+	instance.Blas = blas;
+	XMStoreFloat4x4(&instance.WorldToObject, worldToObject);
+
+	// The world space box around the transformed local box:
+	// its center moves as a point, and each world axis' half
+	// extent picks up every local axis' scaled contribution
+	const BvhNode& root = blas->GetNodes()[0];
+	XMVECTOR localMin = XMLoadFloat3(&root.BoundsMin);
+	XMVECTOR localMax = XMLoadFloat3(&root.BoundsMax);
+	XMVECTOR center = XMVector3TransformCoord(XMVectorScale(XMVectorAdd(localMin, localMax), 0.5f), world);
+	XMVECTOR halfExtent = XMVectorScale(XMVectorSubtract(localMax, localMin), 0.5f);
+
+	XMFLOAT3 h;
+	XMStoreFloat3(&h, halfExtent);
+	XMVECTOR worldHalfExtent = XMVectorAdd(
+		XMVectorScale(XMVectorAbs(world.r[0]), h.x), XMVectorAdd(
+		XMVectorScale(XMVectorAbs(world.r[1]), h.y),
+		XMVectorScale(XMVectorAbs(world.r[2]), h.z)));
+
+	XMStoreFloat3(&bounds.Min, XMVectorSubtract(center, worldHalfExtent));
+	XMStoreFloat3(&bounds.Max, XMVectorAdd(center, worldHalfExtent));
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Starts out empty
+// --------------------------------------------------------
+SceneBvh::SceneBvh() :
+	buildStats{},
+	updateStats{}
+{
+}
+
+
+// --------------------------------------------------------
+// Rebuilds the tree over a set of instances, remembering
+// them so Update() can tell what changed
+//
+// descs - The instances (copied, so only needed during the build)
+// count - Number of instances
+// --------------------------------------------------------
+void SceneBvh::Build(const SceneBvhInstanceDesc* descs, size_t count)
+{
+	BuildInstances(descs, count);
+	trackedEntities.clear();
+	trackedDescs.assign(descs, descs + count);
+}
+
+
+// --------------------------------------------------------
+// Rebuilds the tree over a set of instances.  Each one gets
+// its inverse world matrix and world space bounds (from its
+// BVH's root) in parallel, then the top level tree is built
+// over those bounds.
+//
+// Instances with no BVH, an empty one, or a world matrix
+// that can't be inverted are left out.
+// --------------------------------------------------------
+void SceneBvh::BuildInstances(const SceneBvhInstanceDesc* descs, size_t count)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	instanceScratch.resize(count);
+	instanceBounds.resize(count);
+
+	size_t jobs = (count + SCENE_BVH_INSTANCE_JOB_SIZE - 1) / SCENE_BVH_INSTANCE_JOB_SIZE;
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * SCENE_BVH_INSTANCE_JOB_SIZE, count);
+			for (size_t i = job * SCENE_BVH_INSTANCE_JOB_SIZE; i < end; i++)
+			{
+				instanceScratch[i].InstanceIndex = (uint32_t)i;
+				instanceScratch[i].InstanceMask = descs[i].InstanceMask;
+				SetUpInstance(descs[i].World, descs[i].Blas, instanceScratch[i], instanceBounds[i]);
+			}
+		});
+
+	// Pack down the instances that made it
+	size_t instanceCount = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!instanceScratch[i].Blas)
+			continue;
+
+		instanceScratch[instanceCount] = instanceScratch[i];
+		instanceBounds[instanceCount] = instanceBounds[i];
+		instanceCount++;
+	}
+
+	std::chrono::steady_clock::time_point topLevelStart = std::chrono::steady_clock::now();
+	topLevel.Build(instanceBounds.data(), instanceCount, SCENE_BVH_MAX_LEAF_INSTANCES);
+
+	// Instances go in leaf order, so each leaf's are contiguous
+	BvhArray<uint32_t> order = topLevel.GetTriangleIndices();
+	instances.resize(instanceCount);
+	instanceSlots.assign(count, BVH_NO_HIT);
+	for (size_t i = 0; i < instanceCount; i++)
+	{
+		instances[i] = instanceScratch[order[i]];
+		instanceSlots[instances[i].InstanceIndex] = (uint32_t)i;
+	}
+
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	buildStats.BuildTimeMs = std::chrono::duration<double, std::milli>(end - start).count();
+	buildStats.TopLevelTimeMs = std::chrono::duration<double, std::milli>(end - topLevelStart).count();
+	buildStats.InstanceCount = (uint32_t)instanceCount;
+	buildStats.NodeCount = topLevel.GetBuildStats().NodeCount;
+	buildStats.MaxDepth = topLevel.GetBuildStats().MaxDepth;
+
+	updateStats.RebuildCount++;
+	updateStats.MovedInstances = (uint32_t)instanceCount;
+	updateStats.LastUpdateRebuilt = true;
+	updateStats.SahCost = topLevel.GetBuildStats().SahCost;
+	updateStats.RebuildSahCost = updateStats.SahCost;
+}
+
+
+// --------------------------------------------------------
+// Brings the tree up to date with the same set of instances
+// it was last built (or updated) with, the same way as the
+// entity version: descs whose world matrix is bit for bit
+// the same as last time are skipped, moved ones are set up
+// again in place and refit, and the tree is only rebuilt if
+// the count or any BVH changed, an instance moved in or out
+// of the tree, or the refit wore it down too far.  A new
+// instance mask is just swapped in.
+// --------------------------------------------------------
+void SceneBvh::Update(const SceneBvhInstanceDesc* descs, size_t count)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	bool rebuild = trackedDescs.size() != count || !trackedEntities.empty();
+	if (!rebuild)
+	{
+		changeScratch.resize(count);
+		BvhArray<uint32_t> order = topLevel.GetTriangleIndices();
+
+		size_t jobs = (count + SCENE_BVH_INSTANCE_JOB_SIZE - 1) / SCENE_BVH_INSTANCE_JOB_SIZE;
+		ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+			{
+				size_t end = (std::min)((job + 1) * SCENE_BVH_INSTANCE_JOB_SIZE, count);
+				for (size_t i = job * SCENE_BVH_INSTANCE_JOB_SIZE; i < end; i++)
+				{
+					SceneBvhInstanceDesc& tracked = trackedDescs[i];
+					if (descs[i].Blas != tracked.Blas)
+					{
+						changeScratch[i] = NeedsRebuild;
+						continue;
+					}
+
+					if (descs[i].InstanceMask != tracked.InstanceMask)
+					{
+						tracked.InstanceMask = descs[i].InstanceMask;
+						SetInstanceMask(i, tracked.InstanceMask);
+					}
+
+					if (memcmp(&descs[i].World, &tracked.World, sizeof(XMFLOAT4X4)) == 0)
+					{
+						changeScratch[i] = Unchanged;
+						continue;
+					}
+					tracked.World = descs[i].World;
+					changeScratch[i] = MoveInstance(i, tracked.World, tracked.Blas, tracked.InstanceMask, order);
+				}
+			});
+
+		rebuild = RefitMovedInstances(count);
+	}
+
+	if (rebuild)
+		Build(descs, count);
+
+	updateStats.LastUpdateTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// --------------------------------------------------------
+// Sets an instance up again for a new world matrix, right
+// where it is in the tree, unless that would move it in or
+// out of the tree
+//
+// index - The instance's entity (or desc) index
+// order - The top level tree's leaf order
+// --------------------------------------------------------
+SceneBvh::InstanceChange SceneBvh::MoveInstance(size_t index, const XMFLOAT4X4& worldMatrix, const Bvh* blas, uint8_t instanceMask, const BvhArray<uint32_t>& order)
+{
+	uint32_t slot = instanceSlots[index];
+	SceneBvhInstance instance;
+	BvhBounds bounds;
+	instance.InstanceIndex = (uint32_t)index;
+	instance.InstanceMask = instanceMask;
+	bool inTree = SetUpInstance(worldMatrix, blas, instance, bounds);
+	if (inTree != (slot != BVH_NO_HIT))
+		return NeedsRebuild;
+	if (!inTree)
+		return Unchanged;
+
+	instances[slot] = instance;
+	instanceBounds[order[slot]] = bounds;
+	return Moved;
+}
+
+
+// --------------------------------------------------------
+// Swaps in a new instance mask (which doesn't move anything)
+// --------------------------------------------------------
+void SceneBvh::SetInstanceMask(size_t index, uint8_t instanceMask)
+{
+	if (instanceSlots[index] != BVH_NO_HIT)
+		instances[instanceSlots[index]].InstanceMask = instanceMask;
+}
+
+
+// --------------------------------------------------------
+// Refits the top level tree around every instance marked as
+// moved in changeScratch, unless one needs a rebuild anyway.
+// Returns true if the tree needs a full rebuild instead
+// (including when the refit pushed the SAH cost past the
+// rebuild ratio).
+//
+// count - Number of entities (or descs) in changeScratch
+// --------------------------------------------------------
+bool SceneBvh::RefitMovedInstances(size_t count)
+{
+	BvhArray<uint32_t> order = topLevel.GetTriangleIndices();
+	bool rebuild = false;
+
+	// Gather up the boxes that moved
+	movedScratch.clear();
+	for (size_t i = 0; i < count && !rebuild; i++)
+	{
+		if (changeScratch[i] == NeedsRebuild)
+			rebuild = true;
+		else if (changeScratch[i] == Moved)
+			movedScratch.push_back(order[instanceSlots[i]]);
+	}
+
+	if (!rebuild && !movedScratch.empty())
+	{
+		updateStats.SahCost = topLevel.Refit(instanceBounds.data(), movedScratch.data(), movedScratch.size());
+		rebuild = updateStats.SahCost > updateStats.RebuildSahCost * SCENE_BVH_REBUILD_SAH_RATIO;
+		if (!rebuild)
+			updateStats.RefitCount++;
+	}
+
+	if (!rebuild)
+	{
+		updateStats.MovedInstances = (uint32_t)movedScratch.size();
+		updateStats.LastUpdateRebuilt = false;
+	}
+	return rebuild;
+}
+
+
+// --------------------------------------------------------
+// Moves a world space ray into an instance's object space,
+// without normalizing its direction, so distances along it
+// stay the same
+// --------------------------------------------------------
+static BvhRay ToObjectSpace(XMVECTOR origin, XMVECTOR direction, const BvhRay& ray, const SceneBvhInstance& instance)
+{
+	XMMATRIX worldToObject = XMLoadFloat4x4(&instance.WorldToObject);
+
+	BvhRay objectRay;
+	XMStoreFloat3(&objectRay.Origin, XMVector3TransformCoord(origin, worldToObject));
+	XMStoreFloat3(&objectRay.Direction, XMVector3TransformNormal(direction, worldToObject));
+	objectRay.TMin = ray.TMin;
+	objectRay.TMax = ray.TMax;
+	return objectRay;
+}
+
+
+// --------------------------------------------------------
+// Finds the closest triangle of any instance hit by the ray
+// (within its range), skipping instances the mask leaves
+// out.  The ray is moved into the object space of each
+// instance it reaches.
+// --------------------------------------------------------
+bool SceneBvh::Intersect(const BvhRay& ray, SceneBvhHit& hit, uint8_t instanceMask) const
+{
+	hit.T = ray.TMax;
+	hit.U = 0;
+	hit.V = 0;
+	hit.TriangleIndex = BVH_NO_HIT;
+	hit.InstanceIndex = BVH_NO_HIT;
+	if (instances.empty())
+		return false;
+
+	XMVECTOR origin = XMLoadFloat3(&ray.Origin);
+	XMVECTOR direction = XMLoadFloat3(&ray.Direction);
+
+	TraverseBvh(topLevel.GetNodes().data(), ray, hit.T, [&](uint32_t first, uint32_t count)
+		{
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				const SceneBvhInstance& instance = instances[i];
+				if (!(instance.InstanceMask & instanceMask))
+					continue;
+
+				BvhRay objectRay = ToObjectSpace(origin, direction, ray, instance);
+				objectRay.TMax = hit.T;
+
+				BvhHit objectHit;
+				if (instance.Blas->Intersect(objectRay, objectHit))
+				{
+					hit.T = objectHit.T;
+					hit.U = objectHit.U;
+					hit.V = objectHit.V;
+					hit.TriangleIndex = objectHit.TriangleIndex;
+					hit.InstanceIndex = instance.InstanceIndex;
+				}
+			}
+			return true;
+		});
+
+	return hit.InstanceIndex != BVH_NO_HIT;
+}
+
+
+// --------------------------------------------------------
+// Whether any instance the mask lets through is hit within
+// the ray's range.  Both levels are walked in no particular
+// order, and the first triangle found anywhere ends it.
+// --------------------------------------------------------
+bool SceneBvh::Occluded(const BvhRay& ray, uint8_t instanceMask) const
+{
+	if (instances.empty())
+		return false;
+
+	XMVECTOR origin = XMLoadFloat3(&ray.Origin);
+	XMVECTOR direction = XMLoadFloat3(&ray.Direction);
+
+	return TraverseBvhUnordered(topLevel.GetNodes().data(), ray, [&](uint32_t first, uint32_t count)
+		{
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				const SceneBvhInstance& instance = instances[i];
+				if ((instance.InstanceMask & instanceMask) && instance.Blas->Occluded(ToObjectSpace(origin, direction, ray, instance)))
+					return true;
+			}
+			return false;
+		});
+}
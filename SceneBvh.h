@@ -0,0 +1,188 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Bvh.h"
+#include "MaterialMask.h"
+
+// Only the entity versions of Build() and Update() need to
+// see one (see SceneBvhEntities.cpp)
+class GameEntity;
+
+// Instances per leaf of the top level tree
+#define SCENE_BVH_MAX_LEAF_INSTANCES 1
+
+// Instances are set up in batches of this many per job
+#define SCENE_BVH_INSTANCE_JOB_SIZE 512
+
+// Refitting stops paying off once the top level's SAH cost
+// has grown this much past where the last rebuild left it
+#define SCENE_BVH_REBUILD_SAH_RATIO 1.25f
+
+// --------------------------------------------------------
+// One instance of a mesh's BVH in a scene: the CPU version
+// of a D3D12_RAYTRACING_INSTANCE_DESC
+// --------------------------------------------------------
+struct SceneBvhInstanceDesc
+{
+	DirectX::XMFLOAT4X4 World;	// Object to world, row major (like Transform's)
+	const Bvh* Blas;			// Must be built over triangles, and outlive the scene tree
+	uint8_t InstanceMask = MATERIAL_MASK_ALL;	// Rays only see it if they share a bit (see Material.h)
+};
+
+// --------------------------------------------------------
+// An instance, as stored in the tree.  The inverse of the
+// world matrix is cached, since every ray that reaches the
+// instance needs it.
+// --------------------------------------------------------
+struct SceneBvhInstance
+{
+	DirectX::XMFLOAT4X4 WorldToObject;
+	const Bvh* Blas;
+	uint32_t InstanceIndex;		// Index of the entity (or desc) it was built from
+	uint8_t InstanceMask;
+};
+
+// --------------------------------------------------------
+// The closest hit along a ray through a scene.  T is in
+// world space, and the rest matches BvhHit, for the mesh
+// that was hit.
+// --------------------------------------------------------
+struct SceneBvhHit
+{
+	float T;
+	float U;
+	float V;
+	uint32_t TriangleIndex;		// Triangle in the mesh's original index buffer
+	uint32_t InstanceIndex;		// Entity (or desc) that was hit, or BVH_NO_HIT
+};
+
+// --------------------------------------------------------
+// What an entity looked like at the last build (or update),
+// to tell what changed since
+// --------------------------------------------------------
+struct SceneBvhTrackedEntity
+{
+	const GameEntity* Entity;
+	const Bvh* Blas;
+	unsigned int TransformVersion;
+	uint8_t InstanceMask;
+};
+
+// --------------------------------------------------------
+// How the last build went
+// --------------------------------------------------------
+struct SceneBvhBuildStats
+{
+	double BuildTimeMs;			// All of it, including setting up instances
+	double TopLevelTimeMs;		// Just building the tree over the instances
+	uint32_t InstanceCount;		// Instances that ended up in the tree
+	uint32_t NodeCount;
+	uint32_t MaxDepth;
+};
+
+// --------------------------------------------------------
+// How per-frame updates have been going.  Frames where
+// nothing moved count as neither a rebuild nor a refit.
+// --------------------------------------------------------
+struct SceneBvhUpdateStats
+{
+	uint32_t RebuildCount;		// Full builds, including ones Update() fell back to
+	uint32_t RefitCount;		// Updates that only refit
+	uint32_t MovedInstances;	// Instances the last update refit
+	bool LastUpdateRebuilt;
+	double LastUpdateTimeMs;	// The whole last Update(), whichever it did
+	float SahCost;				// The top level's SAH cost now
+	float RebuildSahCost;		// ...and right after the last rebuild
+};
+
+// --------------------------------------------------------
+// A two level BVH over a whole scene, built entirely on the
+// CPU.  This mirrors the GPU's top level acceleration
+// structure: every mesh has its own BVH (see Mesh::GetBvh),
+// and a top level tree over the world space bounds of each
+// instance points into them.  Rays are moved into each
+// instance's object space, so meshes are never copied or
+// transformed, and the whole tree can cheaply be rebuilt
+// every frame.
+//
+// This gives picking, physics and offline rendering ray
+// queries against the same scene the GPU is drawing.
+// --------------------------------------------------------
+class SceneBvh
+{
+public:
+	SceneBvh();
+
+	// Rebuilds the tree over a scene's entities (like
+	// RaytracingHelper::CreateTopLevelAccelerationStructureForScene)
+	void Build(const std::vector<std::shared_ptr<GameEntity>>& scene);
+
+	// Same as above, for any set of instances
+	void Build(const SceneBvhInstanceDesc* descs, size_t count);
+
+	// Brings the tree up to date with the scene once per frame: only
+	// entities whose transforms changed are refit, and the tree is only
+	// rebuilt when the scene itself changed or refits wore it down
+	void Update(const std::vector<std::shared_ptr<GameEntity>>& scene);
+
+	// Same as above, for the same set of instances as the last Build()
+	// with descs (only ones whose world matrices changed are refit)
+	void Update(const SceneBvhInstanceDesc* descs, size_t count);
+
+	// Finds the closest hit along a (world space) ray, returning false on
+	// a miss.  Like TraceRay's InstanceMask, instances whose mask shares
+	// no bits with instanceMask are invisible to the ray.
+	bool Intersect(const BvhRay& ray, SceneBvhHit& hit, uint8_t instanceMask = MATERIAL_MASK_ALL) const;
+
+	// Whether anything (that the mask lets through) blocks a world space
+	// ray within its range, stopping at the first hit found.  Much
+	// cheaper than Intersect() for shadow and AO rays.
+	bool Occluded(const BvhRay& ray, uint8_t instanceMask = MATERIAL_MASK_ALL) const;
+
+	bool IsEmpty() const { return instances.empty(); }
+	const SceneBvhBuildStats& GetBuildStats() const { return buildStats; }
+	const SceneBvhUpdateStats& GetUpdateStats() const { return updateStats; }
+
+	// The top level tree, and the instances in its leaf order
+	const Bvh& GetTopLevel() const { return topLevel; }
+	const std::vector<SceneBvhInstance>& GetInstances() const { return instances; }
+
+private:
+	Bvh topLevel;
+	std::vector<SceneBvhInstance> instances;
+
+	// For updates: each entity's (or desc's) state when it was last
+	// seen, and where its instance ended up in the tree (or
+	// BVH_NO_HIT).  The boxes the tree was built over also stick around.
+	std::vector<SceneBvhTrackedEntity> trackedEntities;
+	std::vector<SceneBvhInstanceDesc> trackedDescs;
+	std::vector<uint32_t> instanceSlots;
+	std::vector<BvhBounds> instanceBounds;
+
+	// Kept between builds to avoid reallocating every frame
+	std::vector<SceneBvhInstanceDesc> descScratch;
+	std::vector<SceneBvhInstance> instanceScratch;
+	std::vector<uint8_t> changeScratch;
+	std::vector<uint32_t> movedScratch;
+
+	SceneBvhBuildStats buildStats;
+	SceneBvhUpdateStats updateStats;
+
+	// What happened to each instance since the last update
+	enum InstanceChange : uint8_t { Unchanged, Moved, NeedsRebuild };
+
+	// Inverse and world space bounds for an instance, false if it
+	// can't go in the tree
+	static bool SetUpInstance(const DirectX::XMFLOAT4X4& worldMatrix, const Bvh* blas, SceneBvhInstance& instance, BvhBounds& bounds);
+
+	// Shared by both kinds of Build() and Update() (the entity ones
+	// live in SceneBvhEntities.cpp)
+	void BuildInstances(const SceneBvhInstanceDesc* descs, size_t count);
+	InstanceChange MoveInstance(size_t index, const DirectX::XMFLOAT4X4& worldMatrix, const Bvh* blas, uint8_t instanceMask, const BvhArray<uint32_t>& order);
+	void SetInstanceMask(size_t index, uint8_t instanceMask);
+	bool RefitMovedInstances(size_t count);
+};
@@ -0,0 +1,124 @@
+#include "SceneBvh.h"
+#include "GameEntity.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace DirectX;
+
+// --------------------------------------------------------
+// An entity's instance mask, from its material (the same
+// one RaytracingHelper gives the GPU's instance)
+// --------------------------------------------------------
+static uint8_t EntityInstanceMask(GameEntity& entity)
+{
+	std::shared_ptr<Material> material = entity.GetMaterial();
+	return (uint8_t)(material ? material->GetInstanceMask() : MATERIAL_MASK_ALL);
+}
+
+
+// --------------------------------------------------------
+// Rebuilds the tree over every entity in the scene, using
+// each one's current world matrix and its mesh's BVH.
+// Entities without a mesh (or with an empty one) are left
+// out, but hits still report their index in this list.
+//
+// Entities are read in parallel, so each one should only be
+// in the list once.
+// --------------------------------------------------------
+void SceneBvh::Build(const std::vector<std::shared_ptr<GameEntity>>& scene)
+{
+	descScratch.resize(scene.size());
+	std::vector<SceneBvhTrackedEntity> tracked(scene.size());
+
+	size_t jobs = (scene.size() + SCENE_BVH_INSTANCE_JOB_SIZE - 1) / SCENE_BVH_INSTANCE_JOB_SIZE;
+	ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+		{
+			size_t end = (std::min)((job + 1) * SCENE_BVH_INSTANCE_JOB_SIZE, scene.size());
+			for (size_t i = job * SCENE_BVH_INSTANCE_JOB_SIZE; i < end; i++)
+			{
+				std::shared_ptr<Mesh> mesh = scene[i]->GetMesh();
+				Transform* transform = scene[i]->GetTransform();
+				descScratch[i].World = transform->GetWorldMatrix();
+				descScratch[i].Blas = mesh ? &mesh->GetBvh() : 0;
+				descScratch[i].InstanceMask = EntityInstanceMask(*scene[i]);
+
+				tracked[i].Entity = scene[i].get();
+				tracked[i].Blas = descScratch[i].Blas;
+				tracked[i].TransformVersion = transform->GetVersion();
+				tracked[i].InstanceMask = descScratch[i].InstanceMask;
+			}
+		});
+
+	BuildInstances(descScratch.data(), descScratch.size());
+	trackedEntities.swap(tracked);
+	trackedDescs.clear();
+}
+
+
+// --------------------------------------------------------
+// Brings the tree up to date with the scene, as cheaply as
+// possible.  Transforms whose version hasn't changed since
+// the last look are skipped outright.  Moved instances get
+// new inverses and bounds in place, and the top level tree
+// is refit around them.
+//
+// The tree is fully rebuilt instead if it was never built
+// from this list, any entity was added, removed, swapped or
+// given another mesh, an instance moved in or out of the
+// tree (by its matrix becoming invertible or not), or the
+// refit pushed the SAH cost past the rebuild ratio.
+// --------------------------------------------------------
+void SceneBvh::Update(const std::vector<std::shared_ptr<GameEntity>>& scene)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	bool rebuild = trackedEntities.size() != scene.size() || !trackedDescs.empty();
+	if (!rebuild)
+	{
+		changeScratch.resize(scene.size());
+		BvhArray<uint32_t> order = topLevel.GetTriangleIndices();
+
+		size_t jobs = (scene.size() + SCENE_BVH_INSTANCE_JOB_SIZE - 1) / SCENE_BVH_INSTANCE_JOB_SIZE;
+		ThreadPool::GetInstance().ParallelFor(jobs, [&](size_t job)
+			{
+				size_t end = (std::min)((job + 1) * SCENE_BVH_INSTANCE_JOB_SIZE, scene.size());
+				for (size_t i = job * SCENE_BVH_INSTANCE_JOB_SIZE; i < end; i++)
+				{
+					SceneBvhTrackedEntity& tracked = trackedEntities[i];
+					std::shared_ptr<Mesh> mesh = scene[i]->GetMesh();
+					const Bvh* blas = mesh ? &mesh->GetBvh() : 0;
+					if (scene[i].get() != tracked.Entity || blas != tracked.Blas)
+					{
+						changeScratch[i] = NeedsRebuild;
+						continue;
+					}
+
+					uint8_t mask = EntityInstanceMask(*scene[i]);
+					if (mask != tracked.InstanceMask)
+					{
+						tracked.InstanceMask = mask;
+						SetInstanceMask(i, mask);
+					}
+
+					Transform* transform = scene[i]->GetTransform();
+					unsigned int version = transform->GetVersion();
+					if (version == tracked.TransformVersion)
+					{
+						changeScratch[i] = Unchanged;
+						continue;
+					}
+					tracked.TransformVersion = version;
+					changeScratch[i] = MoveInstance(i, transform->GetWorldMatrix(), blas, mask, order);
+				}
+			});
+
+		rebuild = RefitMovedInstances(scene.size());
+	}
+
+	if (rebuild)
+		Build(scene);
+
+	updateStats.LastUpdateTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
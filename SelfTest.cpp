@@ -0,0 +1,3026 @@
+#include "SelfTest.h"
+#include "AssetPack.h"
+#include "Bvh.h"
+#include "Bvh8.h"
+#include "Bvh8Compressed.h"
+#include "BvhCache.h"
+#include "BvhPacket.h"
+#include "BvhStream.h"
+#include "BvhWatertight.h"
+#include "MeshCache.h"
+#include "MeshData.h"
+#include "MeshletBuilder.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "ObjLoader.h"
+#include "SceneBvh.h"
+#include "ThreadPool.h"
+#include "Vertex.h"
+#include "VertexPacking.h"
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace DirectX;
+
+// Fixed, so a failure always reproduces
+#define SELF_TEST_SEED 12345
+
+// How many failures of each check get printed
+#define SELF_TEST_MAX_REPORTS 5
+
+// Largest angle an octahedral round trip may be off by
+#define OCTAHEDRAL_MAX_ERROR_DEGREES 0.01f
+
+// Largest angle the parallel tangents may be off from the serial ones by
+#define TANGENT_MAX_ERROR_DEGREES 0.01f
+
+// --------------------------------------------------------
+// Tallies one group of checks, printing the first few
+// failures so the log stays readable
+// --------------------------------------------------------
+struct SelfTestGroup
+{
+	const char* Name;
+	size_t Checks;
+	size_t Failures;
+};
+
+static bool Check(SelfTestGroup& group, bool passed, const char* what, double value = 0.0)
+{
+	group.Checks++;
+	if (passed) return true;
+
+	if (group.Failures < SELF_TEST_MAX_REPORTS)
+		printf("    FAILED: %s (%g)\n", what, value);
+	group.Failures++;
+	return false;
+}
+
+static bool Report(const SelfTestGroup& group)
+{
+	printf("  %-32s %10zu checks  %s\n", group.Name, group.Checks, group.Failures == 0 ? "ok" : "FAILED");
+	return group.Failures == 0;
+}
+
+// Angle between two directions, in degrees (in doubles, since
+// a float's cosine can't resolve angles this small)
+static float AngleBetween(XMFLOAT3 a, XMFLOAT3 b)
+{
+	double cross[3] =
+	{
+		(double)a.y * b.z - (double)a.z * b.y,
+		(double)a.z * b.x - (double)a.x * b.z,
+		(double)a.x * b.y - (double)a.y * b.x,
+	};
+	double sine = sqrt(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+	double cosine = (double)a.x * b.x + (double)a.y * b.y + (double)a.z * b.z;
+	return (float)(atan2(sine, cosine) * 180.0 / 3.14159265358979323846);
+}
+
+
+// --------------------------------------------------------
+// Every one of the 65536 snorm16 values has to survive a
+// decode/encode round trip (except -32768, which is just
+// another -1), and every float in [-1, 1] has to come back
+// within half a step
+// --------------------------------------------------------
+static bool TestSnorm16()
+{
+	SelfTestGroup group = { "Snorm16 round trip" };
+
+	for (int value = -32768; value <= 32767; value++)
+	{
+		float decoded = DecodeSnorm16((int16_t)value);
+		Check(group, decoded >= -1.0f && decoded <= 1.0f, "decoded value out of [-1, 1]", value);
+
+		int expected = value == -32768 ? -32767 : value;
+		Check(group, EncodeSnorm16(decoded) == expected, "snorm16 didn't survive a round trip", value);
+	}
+
+	// (Plus float rounding, for values right on a half step)
+	const float halfStep = 0.5f / 32767.0f + FLT_EPSILON;
+	for (int i = 0; i <= 1 << 20; i++)
+	{
+		float value = -1.0f + 2.0f * i / (float)(1 << 20);
+		float error = fabsf(DecodeSnorm16(EncodeSnorm16(value)) - value);
+		Check(group, error <= halfStep, "float round trip off by more than half a step", value);
+	}
+
+	// Out of range (and NaN) clamps
+	Check(group, EncodeSnorm16(2.0f) == 32767, "2 didn't clamp to 1");
+	Check(group, EncodeSnorm16(-2.0f) == -32767, "-2 didn't clamp to -1");
+	Check(group, EncodeSnorm16(NAN) == -32767, "NaN didn't clamp to -1");
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Sweeps directions over the whole sphere (including the
+// axes and the fold along the equator), and re-encodes a
+// grid of encoded values, which has to be stable
+// --------------------------------------------------------
+static bool TestOctahedral()
+{
+	SelfTestGroup group = { "Octahedral round trip" };
+
+	const int rings = 1024;
+	const int segments = 2048;
+	float maxError = 0.0f;
+	for (int r = 0; r <= rings; r++)
+	{
+		float theta = XM_PI * r / rings;
+		for (int s = 0; s < segments; s++)
+		{
+			float phi = XM_2PI * s / segments;
+			XMFLOAT3 d(sinf(theta) * cosf(phi), sinf(theta) * sinf(phi), cosf(theta));
+
+			int16_t encoded[2];
+			EncodeOctahedral(d, encoded);
+			float error = AngleBetween(d, DecodeOctahedral(encoded));
+			maxError = (std::max)(maxError, error);
+			Check(group, error <= OCTAHEDRAL_MAX_ERROR_DEGREES, "direction off by too many degrees", error);
+		}
+	}
+
+	// The axes, and tiny & unnormalized vectors, must all decode to unit length
+	XMFLOAT3 special[] =
+	{
+		XMFLOAT3(1, 0, 0), XMFLOAT3(-1, 0, 0), XMFLOAT3(0, 1, 0),
+		XMFLOAT3(0, -1, 0), XMFLOAT3(0, 0, 1), XMFLOAT3(0, 0, -1),
+		XMFLOAT3(1e-20f, -1e-20f, 1e-20f), XMFLOAT3(10, -20, -30),
+	};
+	for (XMFLOAT3 d : special)
+	{
+		int16_t encoded[2];
+		EncodeOctahedral(d, encoded);
+		XMFLOAT3 decoded = DecodeOctahedral(encoded);
+		float error = AngleBetween(d, decoded);
+		Check(group, error <= OCTAHEDRAL_MAX_ERROR_DEGREES, "special direction off by too many degrees", error);
+	}
+
+	// Every 16th encoded value: decoding and re-encoding lands within a
+	// step, and decodes to a unit vector
+	for (int x = -32767; x <= 32767; x += 16)
+	{
+		for (int y = -32767; y <= 32767; y += 16)
+		{
+			int16_t encoded[2] = { (int16_t)x, (int16_t)y };
+			XMFLOAT3 decoded = DecodeOctahedral(encoded);
+			float length = sqrtf(decoded.x * decoded.x + decoded.y * decoded.y + decoded.z * decoded.z);
+			Check(group, fabsf(length - 1.0f) < 1e-5f, "decoded direction isn't unit length", length);
+
+			int16_t again[2];
+			EncodeOctahedral(decoded, again);
+			float error = AngleBetween(decoded, DecodeOctahedral(again));
+			Check(group, error <= OCTAHEDRAL_MAX_ERROR_DEGREES, "re-encoding moved the direction", error);
+		}
+	}
+
+	printf("    max error %.5f degrees\n", maxError);
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Whole vertices, through both packed layouts, with random
+// data inside of a few sets of bounds - including flat
+// (zero extent) axes, like a quad's, and a single point
+// --------------------------------------------------------
+template<typename Layout>
+static void CheckVertexRoundTrip(SelfTestGroup& group, const Vertex& v, const VertexQuantization& q, const float positionTolerance[3])
+{
+	Vertex decoded = DecodeVertex<Layout>(EncodeVertex<Layout>(v, q), q);
+
+	const float* in = &v.Position.x;
+	const float* out = &decoded.Position.x;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float error = fabsf(out[axis] - in[axis]);
+		Check(group, error <= positionTolerance[axis], "position off by too much", error);
+	}
+
+	// fp16 UVs in [0, 1] are good to 11 bits
+	float uvError = (std::max)(fabsf(decoded.UV.x - v.UV.x), fabsf(decoded.UV.y - v.UV.y));
+	Check(group, uvError <= 1.0f / 2048.0f, "UV off by too much", uvError);
+
+	float normalError = AngleBetween(v.Normal, decoded.Normal);
+	float tangentError = AngleBetween(v.Tangent, decoded.Tangent);
+	Check(group, normalError <= OCTAHEDRAL_MAX_ERROR_DEGREES, "normal off by too many degrees", normalError);
+	Check(group, tangentError <= OCTAHEDRAL_MAX_ERROR_DEGREES, "tangent off by too many degrees", tangentError);
+}
+
+static bool TestVertexPacking()
+{
+	SelfTestGroup group = { "Vertex packing round trip" };
+	std::mt19937 rng(SELF_TEST_SEED);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+
+	struct Bounds { XMFLOAT3 Min; XMFLOAT3 Max; };
+	Bounds bounds[] =
+	{
+		{ XMFLOAT3(-1, -1, -1), XMFLOAT3(1, 1, 1) },
+		{ XMFLOAT3(-500, 2, 0.25f), XMFLOAT3(1500, 3, 0.5f) },	// Uneven axes
+		{ XMFLOAT3(-1, 0, -1), XMFLOAT3(1, 0, 1) },				// Quad (flat Y)
+		{ XMFLOAT3(5, 5, -2), XMFLOAT3(5, 5, 2) },				// Line (flat X & Y)
+		{ XMFLOAT3(3, -4, 7), XMFLOAT3(3, -4, 7) },				// Single point
+	};
+
+	for (const Bounds& b : bounds)
+	{
+		VertexQuantization q = CalculateQuantization(b.Min, b.Max);
+		const float* halfExtent = &q.HalfExtent.x;
+
+		// Norm16 is good to half a step of the bounds (and exact on flat
+		// axes); Half is good to 11 bits of the position's own magnitude
+		float norm16Tolerance[3];
+		float halfTolerance[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float* lo = &b.Min.x;
+			const float* hi = &b.Max.x;
+			float magnitude = (std::max)(fabsf(lo[axis]), fabsf(hi[axis]));
+			norm16Tolerance[axis] = halfExtent[axis] * (0.5f / 32767.0f) * 1.001f + magnitude * 1e-6f;
+			halfTolerance[axis] = magnitude / 2048.0f;
+		}
+
+		for (int i = 0; i < 10000; i++)
+		{
+			Vertex v = {};
+			v.Position = XMFLOAT3(
+				b.Min.x + (b.Max.x - b.Min.x) * unit(rng),
+				b.Min.y + (b.Max.y - b.Min.y) * unit(rng),
+				b.Min.z + (b.Max.z - b.Min.z) * unit(rng));
+
+			// Hit the corners of the bounds exactly, too
+			if (i < 8)
+			{
+				v.Position.x = (i & 1) ? b.Max.x : b.Min.x;
+				v.Position.y = (i & 2) ? b.Max.y : b.Min.y;
+				v.Position.z = (i & 4) ? b.Max.z : b.Min.z;
+			}
+
+			v.UV = XMFLOAT2(unit(rng), unit(rng));
+			v.Normal = XMFLOAT3(direction(rng), direction(rng), direction(rng));
+			v.Tangent = XMFLOAT3(direction(rng), direction(rng), direction(rng));
+			XMStoreFloat3(&v.Normal, XMVector3Normalize(XMLoadFloat3(&v.Normal)));
+			XMStoreFloat3(&v.Tangent, XMVector3Normalize(XMLoadFloat3(&v.Tangent)));
+
+			CheckVertexRoundTrip<VertexNorm16>(group, v, q, norm16Tolerance);
+			CheckVertexRoundTrip<VertexHalf>(group, v, q, halfTolerance);
+
+			// Flat axes have to come back as exactly the center
+			Vertex decoded = DecodeVertex<VertexNorm16>(EncodeVertex<VertexNorm16>(v, q), q);
+			const float* center = &q.Center.x;
+			const float* out = &decoded.Position.x;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (halfExtent[axis] == 0.0f)
+					Check(group, out[axis] == center[axis], "flat axis didn't decode to exactly the center", out[axis]);
+			}
+		}
+	}
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Small procedural meshes for the mesh tests, several of
+// them pushing the meshlet builder toward one of its limits
+// --------------------------------------------------------
+static void AddVertex(MeshData& mesh, float x, float y, float z)
+{
+	Vertex v = {};
+	v.Position = XMFLOAT3(x, y, z);
+	mesh.Vertices.push_back(v);
+}
+
+static void AddTriangle(MeshData& mesh, unsigned int a, unsigned int b, unsigned int c)
+{
+	mesh.Indices.push_back(a);
+	mesh.Indices.push_back(b);
+	mesh.Indices.push_back(c);
+}
+
+// Bumpy grid in the XZ plane (mostly shared vertices)
+static MeshData MakeGrid(int size)
+{
+	MeshData mesh;
+	for (int z = 0; z <= size; z++)
+		for (int x = 0; x <= size; x++)
+			AddVertex(mesh, (float)x, 0.3f * sinf(x * 0.7f) * cosf(z * 0.4f), (float)z);
+
+	for (int z = 0; z < size; z++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			unsigned int i = z * (size + 1) + x;
+			AddTriangle(mesh, i, i + size + 1, i + 1);
+			AddTriangle(mesh, i + 1, i + size + 1, i + size + 2);
+		}
+	}
+	return mesh;
+}
+
+// Closed sphere (normals all the way around)
+static MeshData MakeSphere(int rings, int segments)
+{
+	MeshData mesh;
+	for (int r = 0; r <= rings; r++)
+	{
+		float theta = XM_PI * r / rings;
+		for (int s = 0; s <= segments; s++)
+		{
+			float phi = XM_2PI * s / segments;
+			AddVertex(mesh, sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+		}
+	}
+
+	for (int r = 0; r < rings; r++)
+	{
+		for (int s = 0; s < segments; s++)
+		{
+			unsigned int i = r * (segments + 1) + s;
+			AddTriangle(mesh, i, i + 1, i + segments + 1);
+			AddTriangle(mesh, i + 1, i + segments + 2, i + segments + 1);
+		}
+	}
+	return mesh;
+}
+
+// One vertex shared by every triangle (hits the vertex limit)
+static MeshData MakeFan(int triangles)
+{
+	MeshData mesh;
+	AddVertex(mesh, 0, 0, 0);
+	for (int i = 0; i <= triangles; i++)
+	{
+		float angle = XM_2PI * i / triangles;
+		AddVertex(mesh, cosf(angle), 0, sinf(angle));
+	}
+
+	for (int i = 0; i < triangles; i++)
+		AddTriangle(mesh, 0, i + 2, i + 1);
+	return mesh;
+}
+
+// The same triangle over and over (hits the triangle limit,
+// which a single layer of triangles can't quite reach)
+static MeshData MakeStack(int triangles)
+{
+	MeshData mesh;
+	AddVertex(mesh, 0, 0, 0);
+	AddVertex(mesh, 0, 0, 1);
+	AddVertex(mesh, 1, 0, 0);
+	for (int i = 0; i < triangles; i++)
+		AddTriangle(mesh, 0, 1, 2);
+	return mesh;
+}
+
+// Nothing shared at all (every triangle is its own meshlet)
+static MeshData MakeSoup(int triangles, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+	MeshData mesh;
+	for (int i = 0; i < triangles * 3; i++)
+		AddVertex(mesh, position(rng), position(rng), position(rng));
+
+	for (int i = 0; i < triangles; i++)
+		AddTriangle(mesh, i * 3, i * 3 + 1, i * 3 + 2);
+	return mesh;
+}
+
+
+// --------------------------------------------------------
+// Pads a .meshbin (without meshlets) before its vertex and
+// index arrays, moving their offsets along, and checks it
+// --------------------------------------------------------
+static bool PaddedCacheIsValid(const std::vector<char>& bytes, uint32_t vertexPadding, uint32_t indexPadding)
+{
+	MeshCacheHeader header;
+	memcpy(&header, bytes.data(), sizeof(header));
+
+	std::vector<char> padded(bytes.begin(), bytes.begin() + header.VertexOffset);
+	padded.resize(padded.size() + vertexPadding);
+	padded.insert(padded.end(), bytes.begin() + header.VertexOffset, bytes.begin() + header.IndexOffset);
+	padded.resize(padded.size() + indexPadding);
+	padded.insert(padded.end(), bytes.begin() + header.IndexOffset, bytes.end());
+
+	header.VertexOffset += vertexPadding;
+	header.IndexOffset += vertexPadding + indexPadding;
+	memcpy(padded.data(), &header, sizeof(header));
+	return MeshCache(padded.data(), padded.size(), 0).IsValid();
+}
+
+
+// --------------------------------------------------------
+// Meshlets have to respect the 64 vertex / 124 triangle
+// limits, cover every triangle exactly once (same winding),
+// have spheres around all of their vertices and cones that
+// never cull a front facing triangle - and be the same every
+// time.  Also round trips them through a .meshbin (and the
+// mesh through one with its arrays moved around).
+//
+// Returns the most vertices and triangles any one meshlet had
+// --------------------------------------------------------
+static Meshlet CheckMeshlets(SelfTestGroup& group, const MeshData& mesh, std::mt19937& rng, size_t& culled)
+{
+	Meshlet largest = {};
+	MeshletData meshlets;
+	BuildMeshlets(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), meshlets);
+
+	Check(group, !meshlets.Meshlets.empty(), "no meshlets");
+	Check(group, meshlets.Bounds.size() == meshlets.Meshlets.size(), "bounds don't match meshlets");
+	if (meshlets.Bounds.size() != meshlets.Meshlets.size())
+		return largest;
+
+	// Triangles, rotated so the smallest index is first (which
+	// keeps the winding), to compare against the original
+	typedef std::array<unsigned int, 3> Triangle;
+	auto rotated = [](unsigned int a, unsigned int b, unsigned int c)
+		{
+			if (b < a && b < c) return Triangle{ b, c, a };
+			if (c < a && c < b) return Triangle{ c, a, b };
+			return Triangle{ a, b, c };
+		};
+
+	std::vector<Triangle> expected;
+	for (size_t i = 0; i < mesh.Indices.size(); i += 3)
+		expected.push_back(rotated(mesh.Indices[i], mesh.Indices[i + 1], mesh.Indices[i + 2]));
+
+	std::vector<Triangle> found;
+	std::uniform_real_distribution<float> offset(-50.0f, 50.0f);
+	for (size_t m = 0; m < meshlets.Meshlets.size(); m++)
+	{
+		const Meshlet& meshlet = meshlets.Meshlets[m];
+		const MeshletBounds& bounds = meshlets.Bounds[m];
+		largest.VertexCount = (std::max)(largest.VertexCount, meshlet.VertexCount);
+		largest.TriangleCount = (std::max)(largest.TriangleCount, meshlet.TriangleCount);
+		Check(group, meshlet.VertexCount > 0 && meshlet.VertexCount <= MESHLET_MAX_VERTICES, "vertex count out of range", meshlet.VertexCount);
+		Check(group, meshlet.TriangleCount > 0 && meshlet.TriangleCount <= MESHLET_MAX_TRIANGLES, "triangle count out of range", meshlet.TriangleCount);
+		if (!Check(group, meshlet.VertexOffset + meshlet.VertexCount <= meshlets.Vertices.size() &&
+			(meshlet.TriangleOffset + meshlet.TriangleCount) * 3 <= meshlets.Triangles.size(), "meshlet past the end of its arrays"))
+			continue;
+
+		const unsigned int* verts = &meshlets.Vertices[meshlet.VertexOffset];
+		const uint8_t* local = &meshlets.Triangles[meshlet.TriangleOffset * 3];
+		for (uint32_t i = 0; i < meshlet.TriangleCount * 3; i++)
+			Check(group, local[i] < meshlet.VertexCount, "local index out of range", local[i]);
+		for (uint32_t t = 0; t < meshlet.TriangleCount; t++)
+			found.push_back(rotated(verts[local[t * 3]], verts[local[t * 3 + 1]], verts[local[t * 3 + 2]]));
+
+		// Sphere around every vertex
+		XMVECTOR center = XMLoadFloat3(&bounds.Center);
+		for (uint32_t v = 0; v < meshlet.VertexCount; v++)
+		{
+			float distance = XMVectorGetX(XMVector3Length(XMVectorSubtract(XMLoadFloat3(&mesh.Vertices[verts[v]].Position), center)));
+			Check(group, distance <= bounds.Radius * 1.0001f + 1e-5f, "vertex outside the bounding sphere", distance - bounds.Radius);
+		}
+
+		// Anything the cone culls has to be back facing, triangle by triangle
+		for (int view = 0; view < 64; view++)
+		{
+			XMFLOAT3 viewPosition(
+				bounds.Center.x + offset(rng),
+				bounds.Center.y + offset(rng),
+				bounds.Center.z + offset(rng));
+			if (!IsMeshletBackFacing(bounds, viewPosition))
+				continue;
+
+			culled++;
+			XMVECTOR eye = XMLoadFloat3(&viewPosition);
+			for (uint32_t t = 0; t < meshlet.TriangleCount; t++)
+			{
+				XMVECTOR p0 = XMLoadFloat3(&mesh.Vertices[verts[local[t * 3]]].Position);
+				XMVECTOR p1 = XMLoadFloat3(&mesh.Vertices[verts[local[t * 3 + 1]]].Position);
+				XMVECTOR p2 = XMLoadFloat3(&mesh.Vertices[verts[local[t * 3 + 2]]].Position);
+				XMVECTOR normal = XMVector3Cross(XMVectorSubtract(p1, p0), XMVectorSubtract(p2, p0));
+				XMVECTOR toTriangle = XMVectorSubtract(p0, eye);
+				float facing = XMVectorGetX(XMVector3Dot(normal, toTriangle));
+				float scale = XMVectorGetX(XMVector3Length(normal)) * XMVectorGetX(XMVector3Length(toTriangle));
+				Check(group, facing >= -1e-5f * scale, "cone culled a front facing triangle", facing / scale);
+			}
+		}
+	}
+
+	std::sort(expected.begin(), expected.end());
+	std::sort(found.begin(), found.end());
+	Check(group, found == expected, "meshlets don't hold exactly the mesh's triangles");
+
+	// Same input, same meshlets (down to the bytes)
+	MeshletData again;
+	std::vector<Vertex> copy = mesh.Vertices;
+	BuildMeshlets(copy.data(), copy.size(), mesh.Indices.data(), mesh.Indices.size(), again);
+	Check(group,
+		again.Meshlets.size() == meshlets.Meshlets.size() &&
+		again.Vertices == meshlets.Vertices &&
+		again.Triangles == meshlets.Triangles &&
+		memcmp(again.Meshlets.data(), meshlets.Meshlets.data(), meshlets.Meshlets.size() * sizeof(Meshlet)) == 0 &&
+		memcmp(again.Bounds.data(), meshlets.Bounds.data(), meshlets.Bounds.size() * sizeof(MeshletBounds)) == 0,
+		"building twice gave different meshlets");
+
+	// Through a .meshbin and back
+	MeshData cached = mesh;
+	cached.Meshlets = meshlets;
+	std::vector<char> bytes = MeshCache::Serialize(cached, 0, 0, MESH_CACHE_FLAG_MESHLETS, XMFLOAT3(0, 0, 0), XMFLOAT3(0, 0, 0));
+	MeshCache cache(bytes.data(), bytes.size(), MESH_CACHE_FLAG_MESHLETS);
+	if (Check(group, cache.IsValid() && cache.GetHeader()->MeshletCount == meshlets.Meshlets.size(), "meshlets didn't survive the cache"))
+	{
+		Check(group,
+			memcmp(cache.GetMeshlets(), meshlets.Meshlets.data(), meshlets.Meshlets.size() * sizeof(Meshlet)) == 0 &&
+			memcmp(cache.GetMeshletBounds(), meshlets.Bounds.data(), meshlets.Bounds.size() * sizeof(MeshletBounds)) == 0 &&
+			memcmp(cache.GetMeshletVertices(), meshlets.Vertices.data(), meshlets.Vertices.size() * sizeof(unsigned int)) == 0 &&
+			memcmp(cache.GetMeshletTriangles(), meshlets.Triangles.data(), meshlets.Triangles.size()) == 0,
+			"cached meshlets differ");
+
+		// A local index past the meshlet's vertices has to be rejected
+		const MeshCacheHeader* header = cache.GetHeader();
+		size_t triangleOffset = (const char*)cache.GetMeshletTriangles() - bytes.data();
+		std::vector<char> corrupt = bytes;
+		corrupt[triangleOffset] = (char)MESHLET_MAX_VERTICES;
+		Check(group, !MeshCache(corrupt.data(), corrupt.size(), MESH_CACHE_FLAG_MESHLETS).IsValid(), "corrupt meshlet triangle accepted");
+
+		// As does a meshlet past the end of the vertex array
+		corrupt = bytes;
+		Meshlet* first = (Meshlet*)(corrupt.data() + header->MeshletOffset);
+		first->VertexOffset = header->MeshletVertexCount;
+		Check(group, !MeshCache(corrupt.data(), corrupt.size(), MESH_CACHE_FLAG_MESHLETS).IsValid(), "corrupt meshlet range accepted");
+	}
+
+	// Arrays that are read in place have to stay aligned, even when
+	// the file has room for them wherever they start
+	std::vector<char> plain = MeshCache::Serialize(mesh, 0, 0, 0, XMFLOAT3(0, 0, 0), XMFLOAT3(0, 0, 0));
+	Check(group, PaddedCacheIsValid(plain, 0, 0), "plain cache rejected");
+	Check(group, PaddedCacheIsValid(plain, 16, 0), "aligned vertices rejected");
+	Check(group, !PaddedCacheIsValid(plain, 4, 12), "misaligned vertices accepted");
+	Check(group, !PaddedCacheIsValid(plain, 0, 4), "misaligned indices accepted");
+
+	return largest;
+}
+
+static bool TestMeshlets()
+{
+	SelfTestGroup group = { "Meshlets" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	size_t culled = 0;
+	CheckMeshlets(group, MakeGrid(100), rng, culled);
+	CheckMeshlets(group, MakeSphere(40, 80), rng, culled);
+	CheckMeshlets(group, MakeSoup(1000, rng), rng, culled);
+	Meshlet fan = CheckMeshlets(group, MakeFan(1000), rng, culled);
+	Meshlet stack = CheckMeshlets(group, MakeStack(1000), rng, culled);
+
+	// Those two should fill meshlets right up to each limit
+	Check(group, fan.VertexCount == MESHLET_MAX_VERTICES, "fan never reached the vertex limit", fan.VertexCount);
+	Check(group, stack.TriangleCount == MESHLET_MAX_TRIANGLES, "stack never reached the triangle limit", stack.TriangleCount);
+
+	// The cone test has to actually cull something, too
+	Check(group, culled > 0, "no meshlet was ever culled");
+	printf("    %zu back facing (meshlet, view) pairs\n", culled);
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Trees from every kind of build have to survive a trip
+// through a .bvhbin (tracing exactly the same), while files
+// whose nodes point outside their arrays, loop back on
+// themselves or nest deeper than the traversal stacks have
+// to be turned away (so the mesh builds a new tree instead)
+// --------------------------------------------------------
+static bool WriteBytes(const std::filesystem::path& path, const std::vector<char>& bytes)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out.write(bytes.data(), bytes.size());
+	return out.good();
+}
+
+static void CheckBvhCache(SelfTestGroup& group, const MeshData& mesh, const BvhBuildOptions& options, std::mt19937& rng)
+{
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "SelfTest.bvhbin";
+	uint64_t hash = BvhCache::HashGeometry(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size());
+
+	Bvh built;
+	built.Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), options);
+	std::vector<char> bytes = BvhCache::Serialize(built, hash, options);
+
+	// Straight through, tracing the same as the original
+	Bvh loaded;
+	if (Check(group, WriteBytes(path, bytes) && loaded.Load(path.wstring(), hash, options), "valid cache rejected"))
+	{
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+		for (int i = 0; i < 256; i++)
+		{
+			BvhRay ray = {};
+			ray.Origin = XMFLOAT3(unit(rng) * 200.0f, unit(rng) * 200.0f, unit(rng) * 200.0f);
+			XMStoreFloat3(&ray.Direction, XMVector3Normalize(XMVectorSubtract(
+				XMVectorSet(unit(rng) * 50.0f, unit(rng) * 2.0f, unit(rng) * 50.0f, 0), XMLoadFloat3(&ray.Origin))));
+			ray.TMin = 0.0f;
+
+			BvhHit a = {};
+			BvhHit b = {};
+			a.T = b.T = FLT_MAX;
+			bool hitA = built.Intersect(ray, a);
+			bool hitB = loaded.Intersect(ray, b);
+			Check(group, hitA == hitB && (!hitA || (a.T == b.T && a.TriangleIndex == b.TriangleIndex)), "loaded tree traced differently");
+		}
+	}
+
+	// Each corruption on its own copy of the file
+	const BvhCacheHeader* header = (const BvhCacheHeader*)bytes.data();
+	uint32_t nodeCount = header->NodeCount;
+	uint32_t referenceCount = header->ReferenceCount;
+	auto nodesOf = [&](std::vector<char>& file) { return (BvhNode*)(file.data() + header->NodeOffset); };
+	auto rejected = [&](const std::vector<char>& file)
+		{
+			Bvh corrupt;
+			return WriteBytes(path, file) && !corrupt.Load(path.wstring(), hash, options) && corrupt.IsEmpty();
+		};
+
+	uint32_t leaf = 0;
+	uint32_t interior = 0;
+	const BvhNode* original = nodesOf(bytes);
+	while (leaf < nodeCount && !original[leaf].IsLeaf()) leaf++;
+	while (interior < nodeCount && original[interior].IsLeaf()) interior++;
+
+	std::vector<char> corrupt = bytes;
+	nodesOf(corrupt)[leaf].LeftFirst = referenceCount;
+	Check(group, rejected(corrupt), "leaf past the triangles accepted");
+
+	if (interior < nodeCount)
+	{
+		corrupt = bytes;
+		nodesOf(corrupt)[interior].LeftFirst = nodeCount - 1;
+		Check(group, rejected(corrupt), "children past the nodes accepted");
+
+		corrupt = bytes;
+		nodesOf(corrupt)[interior].LeftFirst = 0;
+		Check(group, rejected(corrupt), "cycle back to the root accepted");
+
+		corrupt = bytes;
+		nodesOf(corrupt)[interior].LeftFirst = nodesOf(corrupt)[0].LeftFirst;
+		Check(group, interior == 0 || rejected(corrupt), "shared subtree accepted");
+	}
+
+	// Every node rewired into one long chain, each interior node
+	// having a leaf on one side, while the header still claims the
+	// real tree's depth.  Only short chains fit the stacks.
+	corrupt = bytes;
+	BvhNode* chain = nodesOf(corrupt);
+	for (uint32_t n = 0; n < nodeCount; n++)
+	{
+		bool isInterior = n % 2 == 0 && n + 2 < nodeCount;
+		chain[n].LeftFirst = isInterior ? n + 1 : 0;
+		chain[n].TriangleCount = isInterior ? 0 : 1;
+	}
+	uint32_t chainDepth = (nodeCount - 1) / 2 + 1;
+	Bvh chained;
+	bool chainLoaded = WriteBytes(path, corrupt) && chained.Load(path.wstring(), hash, options);
+	Check(group, chainLoaded == (chainDepth <= BVH_MAX_DEPTH), "chain depth check wrong", chainDepth);
+
+	std::error_code error;
+	std::filesystem::remove(path, error);
+}
+
+static bool TestBvhCache()
+{
+	SelfTestGroup group = { "BVH cache validation" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	BvhBuildOptions sah;
+	BvhBuildOptions spatial;
+	spatial.SpatialSplits = true;
+	BvhBuildOptions linear;
+	linear.Linear = true;
+	BvhBuildOptions treelets;
+	treelets.Linear = true;
+	treelets.TreeletPasses = 2;
+
+	MeshData meshes[] = { MakeGrid(60), MakeSphere(30, 60), MakeSoup(500, rng), MakeFan(40) };
+	for (const MeshData& mesh : meshes)
+	{
+		for (const BvhBuildOptions* options : { &sah, &spatial, &linear, &treelets })
+			CheckBvhCache(group, mesh, *options, rng);
+	}
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Builds a pack from a folder full of the files loading
+// leaves next to assets (mesh and BVH caches, half written
+// temporary files, an older pack) and checks that only the
+// real assets made it in.  Then checks that packs with a
+// table of contents or assets outside the file, or hashes
+// out of order, are turned away.
+// --------------------------------------------------------
+static bool TestAssetPack()
+{
+	SelfTestGroup group = { "Asset pack contents" };
+
+	std::error_code error;
+	std::filesystem::path folder = std::filesystem::temp_directory_path() / "SelfTestAssets";
+	std::filesystem::path packFile = std::filesystem::temp_directory_path() / "SelfTest.pak";
+	std::filesystem::remove_all(folder, error);
+	std::filesystem::create_directories(folder / "Models", error);
+	std::filesystem::create_directories(folder / "Textures", error);
+
+	std::string quad =
+		"v -1 0 -1\nv -1 0 1\nv 1 0 1\nv 1 0 -1\n"
+		"vt 0 0\nvt 0 1\nvt 1 1\nvt 1 0\n"
+		"vn 0 1 0\n"
+		"f 1/1/1 2/2/1 3/3/1\nf 1/1/1 3/3/1 4/4/1\n";
+	std::vector<char> junk(100, 'x');
+	WriteBytes(folder / "Models" / "quad.obj", std::vector<char>(quad.begin(), quad.end()));
+	WriteBytes(folder / "Textures" / "white.png", junk);
+
+	// Real sidecars: a mesh cache, and BVH caches for two sets of options
+	MeshLoadResult result;
+	LoadMesh((folder / "Models" / "quad.obj").wstring(), result);
+	Check(group, result.Success && std::filesystem::exists(folder / "Models" / "quad.meshbin"), "quad didn't load and cache");
+
+	BvhBuildOptions spatial;
+	spatial.SpatialSplits = true;
+	for (const BvhBuildOptions& options : { BvhBuildOptions(), spatial })
+	{
+		Bvh bvh;
+		bvh.Build(result.Vertices, result.VertexCount, result.Indices, result.IndexCount, options);
+		uint64_t hash = BvhCache::HashGeometry(result.Vertices, result.VertexCount, result.Indices, result.IndexCount);
+		std::wstring cachePath = BvhCache::GetCachePath((folder / "Models" / "quad.obj").wstring(), options);
+		Check(group, BvhCache::Write(cachePath, bvh, hash, options), "couldn't write a BVH cache");
+	}
+
+	// Leftovers from interrupted writes, and an old pack
+	WriteBytes(folder / "Models" / "quad.meshbin.tmp", junk);
+	WriteBytes(folder / "Models" / "quad.bvhbin.tmp", junk);
+	WriteBytes(folder / "old.pak", junk);
+
+	Check(group, AssetPack::Build(folder.wstring(), packFile.wstring()), "pack build failed");
+	{
+		AssetPack pack(packFile.wstring());
+		Check(group, pack.IsOpen(), "pack didn't open");
+		Check(group, pack.GetAssetCount() == 2, "pack has extra (or missing) assets", pack.GetAssetCount());
+		Check(group, pack.Find("Models/quad.obj").IsValid(), "mesh missing from the pack");
+		Check(group, pack.Find("Textures/white.png").IsValid(), "texture missing from the pack");
+
+		// And none of the sidecars, by whatever name they might have gotten
+		for (std::filesystem::recursive_directory_iterator it(folder, error), end; !error && it != end; it.increment(error))
+		{
+			if (!it->is_regular_file())
+				continue;
+
+			std::string name = AssetPack::GetAssetName(std::filesystem::relative(it->path(), folder).generic_string());
+			std::string extension = it->path().extension().string();
+			bool asset = extension == ".obj" || extension == ".png";
+			Check(group, pack.Find(name).IsValid() == asset, asset ? "asset missing from the pack" : "sidecar file was packed");
+		}
+	}
+
+	// Each corruption on its own copy of the pack
+	std::vector<char> bytes(std::filesystem::file_size(packFile, error));
+	std::ifstream(packFile, std::ios::binary).read(bytes.data(), bytes.size());
+	std::filesystem::path corruptFile = std::filesystem::temp_directory_path() / "SelfTestCorrupt.pak";
+	auto headerOf = [](std::vector<char>& file) { return (AssetPackHeader*)file.data(); };
+	auto tocOf = [](std::vector<char>& file) { return (AssetPackEntry*)(file.data() + ((AssetPackHeader*)file.data())->TocOffset); };
+	auto rejected = [&](const std::vector<char>& file)
+		{
+			return WriteBytes(corruptFile, file) && !AssetPack(corruptFile.wstring()).IsOpen();
+		};
+
+	Check(group, !rejected(bytes), "valid pack rejected");
+
+	std::vector<char> corrupt = bytes;
+	headerOf(corrupt)->TocOffset = 0;
+	Check(group, rejected(corrupt), "table of contents over the header accepted");
+
+	corrupt = bytes;
+	headerOf(corrupt)->TocOffset += 8;
+	Check(group, rejected(corrupt), "misaligned table of contents accepted");
+
+	corrupt = bytes;
+	headerOf(corrupt)->TocOffset = ~0ull - ASSET_PACK_ALIGNMENT + 1;
+	Check(group, rejected(corrupt), "table of contents past the end accepted");
+
+	corrupt = bytes;
+	tocOf(corrupt)[0].DataOffset = bytes.size() + 1;
+	Check(group, rejected(corrupt), "asset starting past the end accepted");
+
+	corrupt = bytes;
+	tocOf(corrupt)[0].DataSize = ~0ull - tocOf(corrupt)[0].DataOffset + 1;
+	Check(group, rejected(corrupt), "asset size wrapping past the end accepted");
+
+	corrupt = bytes;
+	std::swap(tocOf(corrupt)[0], tocOf(corrupt)[1]);
+	Check(group, tocOf(corrupt)[0].NameHash == tocOf(corrupt)[1].NameHash || rejected(corrupt), "unsorted table of contents accepted");
+
+	std::filesystem::remove(corruptFile, error);
+	std::filesystem::remove_all(folder, error);
+	std::filesystem::remove(packFile, error);
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Fuzzes the watertight kernels: random leaves of triangles
+// (neighbours sharing edges and vertices, zero area ones,
+// and ones with NaN or infinite coordinates, some of them
+// on a coarse grid so edge functions come out exactly zero)
+// against rays aimed right at their vertices and edges.
+// Every kernel has to give bit for bit the hit the reference
+// test finds one triangle at a time.  Also checks that rays
+// through the edge two triangles share never slip between
+// them.
+// --------------------------------------------------------
+enum class FuzzVertex
+{
+	Random,
+	SharedEdge,
+	SharedVertex,
+	Repeated,
+	Collinear,
+	NotANumber,
+	Infinite,
+	Count
+};
+
+static XMFLOAT3 Lerp3(const XMFLOAT3& a, const XMFLOAT3& b, float s)
+{
+	return XMFLOAT3(a.x + (b.x - a.x) * s, a.y + (b.y - a.y) * s, a.z + (b.z - a.z) * s);
+}
+
+static float Coordinate(std::mt19937& rng, bool grid)
+{
+	// Quarters in [-2, 2] on the grid
+	if (grid)
+		return (int)(rng() % 17 - 8) * 0.25f;
+	return std::uniform_real_distribution<float>(-2.0f, 2.0f)(rng);
+}
+
+static XMFLOAT3 RandomPoint(std::mt19937& rng, bool grid)
+{
+	return XMFLOAT3(Coordinate(rng, grid), Coordinate(rng, grid), Coordinate(rng, grid));
+}
+
+// A point somewhere on a triangle: a vertex, an edge's midpoint,
+// anywhere along an edge, or anywhere inside
+static XMFLOAT3 PointOnTriangle(const XMFLOAT3* v, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	uint32_t corner = rng() % 3;
+	const XMFLOAT3& a = v[corner];
+	const XMFLOAT3& b = v[(corner + 1) % 3];
+	switch (rng() % 4)
+	{
+	case 0: return a;
+	case 1: return Lerp3(a, b, 0.5f);
+	case 2: return Lerp3(a, b, unit(rng));
+	default:
+	{
+		float s = unit(rng);
+		float r = unit(rng);
+		if (s + r > 1) { s = 1 - s; r = 1 - r; }
+		return Lerp3(Lerp3(a, b, s), v[(corner + 2) % 3], r);
+	}
+	}
+}
+
+// The closest hit, checking each triangle against the hit from
+// before the leaf and keeping the earliest of any ties
+static void IntersectLeafReference(const std::vector<std::array<XMFLOAT3, 3>>& leaf, const BvhWatertightRay& ray, BvhHit& hit)
+{
+	const float tMax = hit.T;
+	bool found = false;
+	for (size_t i = 0; i < leaf.size(); i++)
+	{
+		float t, u, v;
+		if (!IntersectTriangleWatertight(ray, leaf[i][0], leaf[i][1], leaf[i][2], tMax, t, u, v))
+			continue;
+		if (found && !(t < hit.T))
+			continue;
+
+		found = true;
+		hit = { t, u, v, (uint32_t)i };
+	}
+}
+
+// Packs a leaf into groups, between two groups of decoys (the
+// leaf's own triangles under other indices) that kernels reading
+// past either end would hit
+static std::vector<BvhTriangle4> PackLeaf(const std::vector<std::array<XMFLOAT3, 3>>& leaf)
+{
+	const uint32_t groupCount = ((uint32_t)leaf.size() + BVH_TRIANGLE4_WIDTH - 1) / BVH_TRIANGLE4_WIDTH;
+	const float empty = std::numeric_limits<float>::quiet_NaN();
+	std::vector<BvhTriangle4> groups(groupCount + 2);
+	for (uint32_t g = 0; g < groups.size(); g++)
+	{
+		bool decoy = g == 0 || g == groupCount + 1;
+		for (uint32_t lane = 0; lane < BVH_TRIANGLE4_WIDTH; lane++)
+		{
+			uint32_t i = decoy ? lane % leaf.size() : (g - 1) * BVH_TRIANGLE4_WIDTH + lane;
+			bool used = i < leaf.size();
+			for (int axis = 0; axis < 3; axis++)
+			{
+				groups[g].V0[axis][lane] = used ? (&leaf[i][0].x)[axis] : empty;
+				groups[g].V1[axis][lane] = used ? (&leaf[i][1].x)[axis] : empty;
+				groups[g].V2[axis][lane] = used ? (&leaf[i][2].x)[axis] : empty;
+			}
+			groups[g].TriangleIndex[lane] = !used ? BVH_NO_HIT : decoy ? 1000 + i : i;
+		}
+	}
+	return groups;
+}
+
+static bool SameHit(const BvhHit& a, const BvhHit& b)
+{
+	return memcmp(&a.T, &b.T, sizeof(float)) == 0 &&
+		memcmp(&a.U, &b.U, sizeof(float)) == 0 &&
+		memcmp(&a.V, &b.V, sizeof(float)) == 0 &&
+		a.TriangleIndex == b.TriangleIndex;
+}
+
+static bool TestWatertight()
+{
+	SelfTestGroup group = { "Watertight kernels" };
+	std::mt19937 rng(SELF_TEST_SEED);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	typedef void (*Kernel)(const BvhTriangle4*, uint32_t, uint32_t, const BvhWatertightRay&, BvhHit&);
+	struct NamedKernel { Kernel Function; const char* Mismatch; };
+	std::vector<NamedKernel> kernels =
+	{
+		{ IntersectBvhTriangle4Scalar, "scalar kernel disagrees with the reference" },
+		{ IntersectBvhTriangle4Sse, "SSE kernel disagrees with the reference" },
+	};
+	if (Bvh8::IsAvx2Supported())
+		kernels.push_back({ IntersectBvhTriangle4Avx2, "AVX2 kernel disagrees with the reference" });
+	else
+		printf("    No AVX2, skipping that kernel\n");
+
+	const int leaves = 20000;
+	const int raysPerLeaf = 16;
+	size_t hits = 0;
+	size_t edgeHits = 0;
+	for (int l = 0; l < leaves; l++)
+	{
+		bool grid = rng() % 2 == 0;
+		std::vector<std::array<XMFLOAT3, 3>> leaf(1 + rng() % (3 * BVH_TRIANGLE4_WIDTH));
+		for (size_t i = 0; i < leaf.size(); i++)
+		{
+			std::array<XMFLOAT3, 3>& v = leaf[i];
+			v = { RandomPoint(rng, grid), RandomPoint(rng, grid), RandomPoint(rng, grid) };
+
+			FuzzVertex kind = (FuzzVertex)(rng() % (uint32_t)FuzzVertex::Count);
+			if (i == 0 && (kind == FuzzVertex::SharedEdge || kind == FuzzVertex::SharedVertex))
+				kind = FuzzVertex::Random;
+			switch (kind)
+			{
+			case FuzzVertex::SharedEdge:
+				// Opposite winding, like a neighbour in a closed mesh
+				v[0] = leaf[i - 1][1];
+				v[1] = leaf[i - 1][0];
+				break;
+			case FuzzVertex::SharedVertex:
+				v[rng() % 3] = leaf[rng() % i][rng() % 3];
+				break;
+			case FuzzVertex::Repeated:
+				v[2] = v[rng() % 2];
+				break;
+			case FuzzVertex::Collinear:
+				v[2] = Lerp3(v[0], v[1], grid ? 0.5f : unit(rng) * 2.0f - 0.5f);
+				break;
+			case FuzzVertex::NotANumber:
+				(&v[rng() % 3].x)[rng() % 3] = std::numeric_limits<float>::quiet_NaN();
+				break;
+			case FuzzVertex::Infinite:
+				(&v[rng() % 3].x)[rng() % 3] = (rng() % 2 ? 1.0f : -1.0f) * std::numeric_limits<float>::infinity();
+				break;
+			default:
+				break;
+			}
+		}
+		std::vector<BvhTriangle4> groups = PackLeaf(leaf);
+
+		for (int r = 0; r < raysPerLeaf; r++)
+		{
+			// Aimed at a point on one of the triangles, from anywhere or
+			// straight down an axis (where grid points land exactly)
+			XMFLOAT3 target = PointOnTriangle(leaf[rng() % leaf.size()].data(), rng);
+			BvhRay ray;
+			ray.Origin = RandomPoint(rng, grid);
+			if (rng() % 4 == 0)
+			{
+				int axis = rng() % 3;
+				ray.Origin = target;
+				(&ray.Origin.x)[axis] += rng() % 2 ? 3.0f : -3.0f;
+			}
+			ray.Direction = XMFLOAT3(target.x - ray.Origin.x, target.y - ray.Origin.y, target.z - ray.Origin.z);
+			if (ray.Direction.x == 0 && ray.Direction.y == 0 && ray.Direction.z == 0)
+				ray.Direction.z = 1.0f;
+			ray.TMin = rng() % 4 == 0 ? unit(rng) : 0.0f;
+			ray.TMax = FLT_MAX;
+
+			BvhWatertightRay prepared;
+			PrepareBvhWatertightRay(ray, prepared);
+
+			// Sometimes there's already a (closer or further) hit
+			BvhHit before = { std::numeric_limits<float>::infinity(), 0.0f, 0.0f, BVH_NO_HIT };
+			if (rng() % 4 == 0)
+				before = { unit(rng) * 1.5f, 0.25f, 0.25f, 2000 };
+
+			BvhHit expected = before;
+			IntersectLeafReference(leaf, prepared, expected);
+			if (expected.TriangleIndex != before.TriangleIndex)
+			{
+				hits++;
+				if (expected.U == 0 || expected.V == 0 || expected.U + expected.V == 1)
+					edgeHits++;
+			}
+
+			for (const NamedKernel& kernel : kernels)
+			{
+				BvhHit hit = before;
+				kernel.Function(groups.data(), 1, (uint32_t)leaf.size(), prepared, hit);
+				Check(group, SameHit(hit, expected), kernel.Mismatch, l);
+			}
+		}
+	}
+
+	// The fuzzing has to actually get to the edges
+	Check(group, hits > 0, "no ray ever hit a triangle");
+	Check(group, edgeHits > 0, "no ray ever hit an edge or vertex");
+	printf("    %zu hits, %zu on an edge or vertex\n", hits, edgeHits);
+
+	// Two triangles making a quad in a random plane, and rays from
+	// well off that plane through their shared diagonal
+	for (int q = 0; q < leaves; q++)
+	{
+		XMFLOAT3 corner[4];
+		XMFLOAT3 center = RandomPoint(rng, false);
+		XMFLOAT3 edgeA = RandomPoint(rng, false);
+		XMFLOAT3 edgeB = RandomPoint(rng, false);
+		for (int c = 0; c < 4; c++)
+		{
+			float a = (c == 1 || c == 2) ? 1.0f : -1.0f;
+			float b = c >= 2 ? 1.0f : -1.0f;
+			corner[c] = XMFLOAT3(center.x + a * edgeA.x + b * edgeB.x, center.y + a * edgeA.y + b * edgeB.y, center.z + a * edgeA.z + b * edgeB.z);
+		}
+		XMFLOAT3 normal(
+			edgeA.y * edgeB.z - edgeA.z * edgeB.y,
+			edgeA.z * edgeB.x - edgeA.x * edgeB.z,
+			edgeA.x * edgeB.y - edgeA.y * edgeB.x);
+		float length = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+		if (length < 0.1f)
+			continue;
+
+		std::vector<std::array<XMFLOAT3, 3>> quad = { { { corner[0], corner[1], corner[2] } }, { { corner[0], corner[2], corner[3] } } };
+		std::vector<BvhTriangle4> groups = PackLeaf(quad);
+		for (int r = 0; r < raysPerLeaf; r++)
+		{
+			XMFLOAT3 target = Lerp3(corner[0], corner[2], 0.1f + 0.8f * unit(rng));
+			float side = (rng() % 2 ? 1.0f : -1.0f) * (0.5f + unit(rng)) / length;
+			XMFLOAT3 offset = RandomPoint(rng, false);
+			BvhRay ray;
+			ray.Origin = XMFLOAT3(target.x + normal.x * side + offset.x * 0.25f, target.y + normal.y * side + offset.y * 0.25f, target.z + normal.z * side + offset.z * 0.25f);
+			ray.Direction = XMFLOAT3(target.x - ray.Origin.x, target.y - ray.Origin.y, target.z - ray.Origin.z);
+			ray.TMin = 0.0f;
+			ray.TMax = FLT_MAX;
+
+			BvhWatertightRay prepared;
+			PrepareBvhWatertightRay(ray, prepared);
+			BvhHit expected = { std::numeric_limits<float>::infinity(), 0.0f, 0.0f, BVH_NO_HIT };
+			IntersectLeafReference(quad, prepared, expected);
+			Check(group, expected.TriangleIndex != BVH_NO_HIT, "ray slipped between two triangles", q);
+
+			for (const NamedKernel& kernel : kernels)
+			{
+				BvhHit hit = { std::numeric_limits<float>::infinity(), 0.0f, 0.0f, BVH_NO_HIT };
+				kernel.Function(groups.data(), 1, (uint32_t)quad.size(), prepared, hit);
+				Check(group, SameHit(hit, expected), kernel.Mismatch, q);
+			}
+		}
+	}
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Parses one big generated .obj (well past a megabyte, so
+// it splits into chunks even on one thread) with the pool
+// capped at one thread and then uncapped, and checks that
+// both give exactly the vertices the file describes, byte
+// for byte the same.  Faces mix absolute and negative
+// indices reaching far back into earlier chunks, every
+// corner format, and quads.
+// --------------------------------------------------------
+static XMFLOAT3 ObjPosition(int i) { return XMFLOAT3((float)(i % 1000), (float)(i / 1000), i * 0.5f); }
+static XMFLOAT2 ObjUV(int i) { return XMFLOAT2((i % 8) * 0.125f, (i % 5) * 0.25f); }
+static XMFLOAT3 ObjNormal(int i) { return XMFLOAT3((float)(i % 3), (float)(i % 7), -1.0f); }
+
+static void MakeObjText(std::mt19937& rng, std::string& text, std::vector<Vertex>& expected)
+{
+	const int blocks = 400;
+	const int blockSize = 64;
+	char line[256];
+	int count = 0;
+	for (int b = 0; b < blocks; b++)
+	{
+		for (int i = count; i < count + blockSize; i++)
+		{
+			XMFLOAT3 p = ObjPosition(i);
+			XMFLOAT2 uv = ObjUV(i);
+			XMFLOAT3 n = ObjNormal(i);
+			snprintf(line, sizeof(line), "v %g %g %g\nvt %g %g\nvn %g %g %g\n", p.x, p.y, p.z, uv.x, uv.y, n.x, n.y, n.z);
+			text += line;
+		}
+		count += blockSize;
+
+		for (int f = 0; f < blockSize; f++)
+		{
+			int corners[4];
+			int cornerCount = 3 + rng() % 2;
+			int format = rng() % 4;
+			text += "f";
+			for (int c = 0; c < cornerCount; c++)
+			{
+				corners[c] = rng() % count;
+				int index = rng() % 2 ? corners[c] + 1 : corners[c] - count;
+				switch (format)
+				{
+				case 0: snprintf(line, sizeof(line), " %d", index); break;
+				case 1: snprintf(line, sizeof(line), " %d/%d", index, index); break;
+				case 2: snprintf(line, sizeof(line), " %d//%d", index, index); break;
+				default: snprintf(line, sizeof(line), " %d/%d/%d", index, index, index); break;
+				}
+				text += line;
+			}
+			text += "\n";
+
+			// Fanned out from the first corner, winding flipped
+			for (int c = 2; c < cornerCount; c++)
+			{
+				for (int corner : { corners[0], corners[c], corners[c - 1] })
+				{
+					Vertex v = {};
+					v.Position = ObjPosition(corner);
+					v.Position.z *= -1.0f;
+					if (format == 1 || format == 3)
+						v.UV = ObjUV(corner);
+					v.UV.y = 1.0f - v.UV.y;
+					if (format >= 2)
+						v.Normal = ObjNormal(corner);
+					v.Normal.z *= -1.0f;
+					expected.push_back(v);
+				}
+			}
+		}
+	}
+}
+
+static bool TestObjParse()
+{
+	SelfTestGroup group = { "OBJ parse determinism" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	std::string text;
+	std::vector<Vertex> expected;
+	MakeObjText(rng, text, expected);
+	Check(group, text.size() > (1 << 20), "generated .obj too small to split", (double)text.size());
+
+	ThreadPool& threadPool = ThreadPool::GetInstance();
+	unsigned int limits[] = { 1, 0 };
+	MeshData parsed[2];
+	for (int i = 0; i < 2; i++)
+	{
+		threadPool.SetThreadLimit(limits[i]);
+		Check(group, ParseOBJ(text.data(), text.size(), parsed[i]), "parse failed", limits[i]);
+	}
+	threadPool.SetThreadLimit(0);
+
+	// What the file says
+	const MeshData& one = parsed[0];
+	if (Check(group, one.Vertices.size() == expected.size() && one.Indices.size() == expected.size(), "wrong number of vertices", (double)one.Vertices.size()))
+	{
+		for (size_t i = 0; i < expected.size(); i++)
+		{
+			const Vertex& a = one.Vertices[i];
+			const Vertex& b = expected[i];
+			Check(group,
+				a.Position.x == b.Position.x && a.Position.y == b.Position.y && a.Position.z == b.Position.z &&
+				a.UV.x == b.UV.x && a.UV.y == b.UV.y &&
+				a.Normal.x == b.Normal.x && a.Normal.y == b.Normal.y && a.Normal.z == b.Normal.z,
+				"vertex doesn't match the file", (double)i);
+			Check(group, one.Indices[i] == i, "index out of order", (double)i);
+		}
+	}
+
+	// And the same bytes however many threads split it up
+	const MeshData& all = parsed[1];
+	Check(group,
+		all.Vertices.size() == one.Vertices.size() &&
+		memcmp(all.Vertices.data(), one.Vertices.data(), one.Vertices.size() * sizeof(Vertex)) == 0 &&
+		all.Indices == one.Indices,
+		"thread count changed the parse", threadPool.GetThreadCount());
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Tipsify has to hand back exactly the triangles it was
+// given (same winding, just reordered), and never use the
+// vertex cache worse than the file's own order.  The whole
+// optimizer (vertex order too) has to keep every triangle's
+// positions.
+// --------------------------------------------------------
+typedef std::array<unsigned int, 3> TriangleKey;
+
+// Rotated so the smallest index comes first (keeping the winding)
+static std::vector<TriangleKey> SortedTriangles(const std::vector<unsigned int>& indices)
+{
+	std::vector<TriangleKey> triangles;
+	for (size_t i = 0; i + 2 < indices.size(); i += 3)
+	{
+		TriangleKey t = { indices[i], indices[i + 1], indices[i + 2] };
+		std::rotate(t.begin(), std::min_element(t.begin(), t.end()), t.end());
+		triangles.push_back(t);
+	}
+	std::sort(triangles.begin(), triangles.end());
+	return triangles;
+}
+
+// Each triangle's corner positions, in the same rotation-free form
+static std::vector<std::array<float, 9>> SortedTrianglePositions(const MeshData& mesh)
+{
+	std::vector<std::array<float, 9>> triangles;
+	for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3)
+	{
+		std::array<XMFLOAT3, 3> corners = {
+			mesh.Vertices[mesh.Indices[i]].Position,
+			mesh.Vertices[mesh.Indices[i + 1]].Position,
+			mesh.Vertices[mesh.Indices[i + 2]].Position };
+		std::array<std::array<float, 9>, 3> rotations;
+		for (int r = 0; r < 3; r++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				const XMFLOAT3& p = corners[(r + c) % 3];
+				rotations[r][c * 3] = p.x;
+				rotations[r][c * 3 + 1] = p.y;
+				rotations[r][c * 3 + 2] = p.z;
+			}
+		}
+		triangles.push_back(*std::min_element(rotations.begin(), rotations.end()));
+	}
+	std::sort(triangles.begin(), triangles.end());
+	return triangles;
+}
+
+static void CheckMeshOptimizer(SelfTestGroup& group, const MeshData& mesh)
+{
+	std::vector<unsigned int> indices = mesh.Indices;
+	OptimizeVertexCache(indices.data(), indices.size(), mesh.Vertices.size(), VERTEX_CACHE_SIZE);
+	Check(group, SortedTriangles(indices) == SortedTriangles(mesh.Indices), "triangle order isn't a permutation of the input");
+
+	VertexCacheStats before = AnalyzeVertexCache(mesh.Indices.data(), mesh.Indices.size(), mesh.Vertices.size(), VERTEX_CACHE_SIZE);
+	VertexCacheStats after = AnalyzeVertexCache(indices.data(), indices.size(), mesh.Vertices.size(), VERTEX_CACHE_SIZE);
+	Check(group, after.ACMR <= before.ACMR, "ACMR worse than file order", after.ACMR - before.ACMR);
+
+	MeshData optimized = mesh;
+	MeshOptimizeStats stats = OptimizeMesh(optimized);
+	Check(group, optimized.Vertices.size() == mesh.Vertices.size(), "optimizing changed the vertex count", (double)optimized.Vertices.size());
+	Check(group, SortedTrianglePositions(optimized) == SortedTrianglePositions(mesh), "optimizing changed the triangles");
+	Check(group, stats.CacheAfter.ACMR <= stats.CacheBefore.ACMR, "optimized mesh's ACMR got worse", stats.CacheAfter.ACMR - stats.CacheBefore.ACMR);
+}
+
+static bool TestMeshOptimizer()
+{
+	SelfTestGroup group = { "Mesh optimizer" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	// A grid with its triangles shuffled is about as bad as file order gets
+	MeshData shuffled = MakeGrid(80);
+	std::vector<TriangleKey> triangles;
+	for (size_t i = 0; i < shuffled.Indices.size(); i += 3)
+		triangles.push_back({ shuffled.Indices[i], shuffled.Indices[i + 1], shuffled.Indices[i + 2] });
+	std::shuffle(triangles.begin(), triangles.end(), rng);
+	for (size_t t = 0; t < triangles.size(); t++)
+		std::copy(triangles[t].begin(), triangles[t].end(), shuffled.Indices.begin() + t * 3);
+
+	CheckMeshOptimizer(group, MakeGrid(80));
+	CheckMeshOptimizer(group, MakeSphere(40, 80));
+	CheckMeshOptimizer(group, MakeFan(200));
+	CheckMeshOptimizer(group, MakeSoup(500, rng));
+	CheckMeshOptimizer(group, shuffled);
+
+	// ...and Tipsify should undo most of that
+	std::vector<unsigned int> indices = shuffled.Indices;
+	OptimizeVertexCache(indices.data(), indices.size(), shuffled.Vertices.size(), VERTEX_CACHE_SIZE);
+	VertexCacheStats before = AnalyzeVertexCache(shuffled.Indices.data(), shuffled.Indices.size(), shuffled.Vertices.size(), VERTEX_CACHE_SIZE);
+	VertexCacheStats after = AnalyzeVertexCache(indices.data(), indices.size(), shuffled.Vertices.size(), VERTEX_CACHE_SIZE);
+	Check(group, after.ACMR < before.ACMR * 0.5f, "Tipsify barely helped a shuffled grid", after.ACMR);
+	printf("    shuffled grid ACMR %.3f -> %.3f\n", before.ACMR, after.ACMR);
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// The parallel tangent path has to agree with the serial
+// loop (to within the SIMD math's rounding) on meshes that
+// span several jobs and don't fill their last SIMD batch,
+// however many threads it gets
+// --------------------------------------------------------
+static void CheckTangents(SelfTestGroup& group, const MeshData& mesh)
+{
+	std::vector<Vertex> serial = mesh.Vertices;
+	CalculateTangentsSerial(serial.data(), serial.size(), mesh.Indices.data(), mesh.Indices.size());
+
+	ThreadPool& threadPool = ThreadPool::GetInstance();
+	for (unsigned int limit : { 1u, 0u })
+	{
+		threadPool.SetThreadLimit(limit);
+		std::vector<Vertex> parallel = mesh.Vertices;
+		CalculateTangentsParallel(parallel.data(), parallel.size(), mesh.Indices.data(), mesh.Indices.size());
+
+		float maxError = 0.0f;
+		for (size_t i = 0; i < serial.size(); i++)
+		{
+			float error = AngleBetween(serial[i].Tangent, parallel[i].Tangent);
+			maxError = (std::max)(maxError, error);
+			Check(group, error <= TANGENT_MAX_ERROR_DEGREES, "parallel tangent off by too many degrees", error);
+		}
+	}
+	threadPool.SetThreadLimit(0);
+}
+
+static bool TestTangents()
+{
+	SelfTestGroup group = { "Tangents" };
+	std::mt19937 rng(SELF_TEST_SEED);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	// Planar UVs on a grid (over 16K triangles, so several jobs)
+	const int size = 301;
+	MeshData grid = MakeGrid(size);
+	for (Vertex& v : grid.Vertices)
+	{
+		v.UV = XMFLOAT2(v.Position.x / size, v.Position.z / size);
+		v.Normal = XMFLOAT3(0, 1, 0);
+	}
+	CheckTangents(group, grid);
+
+	// Scrambled UVs on a sphere, and on unconnected triangles
+	MeshData meshes[] = { MakeSphere(50, 99), MakeSoup(10001, rng) };
+	for (MeshData& mesh : meshes)
+	{
+		for (Vertex& v : mesh.Vertices)
+		{
+			v.UV = XMFLOAT2(unit(rng), unit(rng));
+			XMStoreFloat3(&v.Normal, XMVector3Normalize(XMLoadFloat3(&v.Position)));
+		}
+		CheckTangents(group, mesh);
+	}
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Each LOD has to have fewer triangles than the one before
+// it, errors that only grow (and stay under the limit), and
+// exactly the open edges the mesh started with - including
+// both sides of every UV seam, which are open edges to the
+// index buffer - so levels never crack.  Level selection
+// has to go coarser the fewer pixels the mesh covers.
+// --------------------------------------------------------
+typedef std::pair<unsigned int, unsigned int> DirectedEdge;
+
+// Edges only one triangle uses, in that triangle's direction
+static std::vector<DirectedEdge> OpenEdges(const std::vector<unsigned int>& indices)
+{
+	std::map<DirectedEdge, int> uses;
+	for (size_t t = 0; t + 2 < indices.size(); t += 3)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			unsigned int a = indices[t + c];
+			unsigned int b = indices[t + (c + 1) % 3];
+			uses[DirectedEdge(a, b)]++;
+		}
+	}
+
+	std::vector<DirectedEdge> open;
+	for (const std::pair<const DirectedEdge, int>& edge : uses)
+	{
+		if (uses.count(DirectedEdge(edge.first.second, edge.first.first)) == 0)
+			open.push_back(edge.first);
+	}
+	return open;
+}
+
+static void CheckLods(SelfTestGroup& group, MeshData mesh, size_t minLevels)
+{
+	XMFLOAT3 boundsMin, boundsMax;
+	CalculateBounds(mesh.Vertices.data(), mesh.Vertices.size(), boundsMin, boundsMax);
+	float size = (std::max)((std::max)(boundsMax.x - boundsMin.x, boundsMax.y - boundsMin.y), boundsMax.z - boundsMin.z);
+
+	GenerateLods(mesh);
+	Check(group, mesh.Lods.size() >= minLevels, "too few LODs", (double)mesh.Lods.size());
+
+	std::vector<DirectedEdge> open = OpenEdges(mesh.Indices);
+	size_t previousCount = mesh.Indices.size();
+	float previousError = 0.0f;
+	for (const MeshLod& lod : mesh.Lods)
+	{
+		Check(group, lod.Indices.size() % 3 == 0 && lod.Indices.size() < previousCount, "LOD didn't lose triangles", (double)lod.Indices.size());
+		Check(group, lod.Error >= previousError, "LOD error went down", lod.Error - previousError);
+		Check(group, lod.Error <= LOD_MAX_RELATIVE_ERROR * size, "LOD error over the limit", lod.Error / size);
+		Check(group, OpenEdges(lod.Indices) == open, "LOD changed the open edges or seams");
+
+		bool inRange = true;
+		for (unsigned int index : lod.Indices)
+			inRange &= index < mesh.Vertices.size();
+		Check(group, inRange, "LOD index out of range");
+
+		previousCount = lod.Indices.size();
+		previousError = lod.Error;
+	}
+}
+
+static bool TestLods()
+{
+	SelfTestGroup group = { "LOD chains" };
+
+	// UVs wrapping around a sphere (a seam down one side, and
+	// another ring of them at each pole)
+	const int rings = 40;
+	const int segments = 80;
+	MeshData sphere = MakeSphere(rings, segments);
+	for (int r = 0; r <= rings; r++)
+	{
+		for (int s = 0; s <= segments; s++)
+		{
+			Vertex& v = sphere.Vertices[r * (segments + 1) + s];
+			v.UV = XMFLOAT2((float)s / segments, (float)r / rings);
+			v.Normal = v.Position;
+		}
+	}
+	CheckLods(group, sphere, 2);
+
+	// An open grid, whose whole border has to stay put
+	MeshData grid = MakeGrid(80);
+	for (Vertex& v : grid.Vertices)
+	{
+		v.UV = XMFLOAT2(v.Position.x / 80, v.Position.z / 80);
+		v.Normal = XMFLOAT3(0, 1, 0);
+	}
+	CheckLods(group, grid, 2);
+
+	// Level selection: errors of a typical chain, in local units
+	// (powers of two, so limits land exactly)
+	float errors[] = { 0.0f, 1.0f / 128, 1.0f / 32, 1.0f / 8, 1.0f };
+	unsigned int levels = (unsigned int)(sizeof(errors) / sizeof(errors[0]));
+	Check(group, SelectLod(errors, levels, 0.0f) == levels - 1, "far away mesh didn't get the coarsest level");
+	Check(group, SelectLod(errors, levels, 1e6f) == 0, "close up mesh didn't get full detail");
+	Check(group, SelectLod(errors, 1, 0.0f) == 0, "mesh without LODs got one");
+	Check(group, SelectLod(errors, levels, 32.0f) == 2, "error of exactly the limit wasn't allowed");
+	Check(group, SelectLod(errors, levels, 33.0f) == 1, "error just past the limit was allowed");
+
+	unsigned int previous = levels - 1;
+	for (float pixelsPerUnit = 0.01f; pixelsPerUnit < 1e6f; pixelsPerUnit *= 1.1f)
+	{
+		unsigned int lod = SelectLod(errors, levels, pixelsPerUnit);
+		Check(group, lod <= previous, "closer mesh got a coarser level", pixelsPerUnit);
+		Check(group, errors[lod] * pixelsPerUnit <= LOD_MAX_PIXEL_ERROR, "selected level's error over a pixel", pixelsPerUnit);
+		Check(group, lod + 1 == levels || errors[lod + 1] * pixelsPerUnit > LOD_MAX_PIXEL_ERROR, "a coarser level would have done", pixelsPerUnit);
+		previous = lod;
+	}
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Helpers for the BVH tests: a mesh's triangles in index
+// buffer order, rays aimed at them, the hit every tree has
+// to agree with (testing each triangle in turn, with the
+// same math the trees use), and checks on a tree's shape
+// --------------------------------------------------------
+static std::vector<BvhTriangle> MeshTriangles(const MeshData& mesh)
+{
+	std::vector<BvhTriangle> triangles(mesh.Indices.size() / 3);
+	for (size_t t = 0; t < triangles.size(); t++)
+	{
+		triangles[t].V0 = mesh.Vertices[mesh.Indices[t * 3 + 0]].Position;
+		triangles[t].V1 = mesh.Vertices[mesh.Indices[t * 3 + 1]].Position;
+		triangles[t].V2 = mesh.Vertices[mesh.Indices[t * 3 + 2]].Position;
+	}
+	return triangles;
+}
+
+static BvhBounds TriangleBounds(const BvhTriangle& triangle)
+{
+	BvhBounds box;
+	XMStoreFloat3(&box.Min, XMVectorMin(XMLoadFloat3(&triangle.V0), XMVectorMin(XMLoadFloat3(&triangle.V1), XMLoadFloat3(&triangle.V2))));
+	XMStoreFloat3(&box.Max, XMVectorMax(XMLoadFloat3(&triangle.V0), XMVectorMax(XMLoadFloat3(&triangle.V1), XMLoadFloat3(&triangle.V2))));
+	return box;
+}
+
+static void GrowBounds(BvhBounds& box, const BvhBounds& other)
+{
+	XMStoreFloat3(&box.Min, XMVectorMin(XMLoadFloat3(&box.Min), XMLoadFloat3(&other.Min)));
+	XMStoreFloat3(&box.Max, XMVectorMax(XMLoadFloat3(&box.Max), XMLoadFloat3(&other.Max)));
+}
+
+static bool BoxContains(const XMFLOAT3& outerMin, const XMFLOAT3& outerMax, const XMFLOAT3& innerMin, const XMFLOAT3& innerMax)
+{
+	return outerMin.x <= innerMin.x && outerMin.y <= innerMin.y && outerMin.z <= innerMin.z &&
+		outerMax.x >= innerMax.x && outerMax.y >= innerMax.y && outerMax.z >= innerMax.z;
+}
+
+static BvhBounds MeshBounds(const std::vector<BvhTriangle>& triangles)
+{
+	BvhBounds bounds = TriangleBounds(triangles[0]);
+	for (const BvhTriangle& triangle : triangles)
+		GrowBounds(bounds, TriangleBounds(triangle));
+	return bounds;
+}
+
+// From somewhere around the mesh toward a random point on one
+// of its triangles (so most rays hit), every eighth one along
+// an axis, and some with their range cut short
+static BvhRay RandomRay(const std::vector<BvhTriangle>& triangles, const BvhBounds& bounds, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	XMVECTOR boundsMin = XMLoadFloat3(&bounds.Min);
+	XMVECTOR boundsMax = XMLoadFloat3(&bounds.Max);
+	XMVECTOR center = XMVectorScale(XMVectorAdd(boundsMin, boundsMax), 0.5f);
+	float radius = XMVectorGetX(XMVector3Length(XMVectorSubtract(boundsMax, boundsMin))) * 0.5f + 1.0f;
+
+	const BvhTriangle& triangle = triangles[rng() % triangles.size()];
+	float u = unit(rng);
+	float v = unit(rng);
+	if (u + v > 1)
+	{
+		u = 1 - u;
+		v = 1 - v;
+	}
+	XMVECTOR v0 = XMLoadFloat3(&triangle.V0);
+	XMVECTOR target = XMVectorAdd(v0, XMVectorAdd(
+		XMVectorScale(XMVectorSubtract(XMLoadFloat3(&triangle.V1), v0), u),
+		XMVectorScale(XMVectorSubtract(XMLoadFloat3(&triangle.V2), v0), v)));
+
+	XMVECTOR direction;
+	if (rng() % 8 == 0)
+	{
+		float axis[3] = {};
+		axis[rng() % 3] = rng() % 2 ? 1.0f : -1.0f;
+		direction = XMVectorSet(axis[0], axis[1], axis[2], 0);
+	}
+	else
+	{
+		XMVECTOR onSphere = XMVector3Normalize(XMVectorSet(unit(rng) - 0.5f, unit(rng) - 0.5f, unit(rng) - 0.5f, 0));
+		direction = XMVector3Normalize(XMVectorSubtract(target, XMVectorAdd(center, XMVectorScale(onSphere, radius))));
+	}
+
+	BvhRay ray = {};
+	XMStoreFloat3(&ray.Origin, XMVectorSubtract(target, XMVectorScale(direction, radius * 2.0f)));
+	XMStoreFloat3(&ray.Direction, direction);
+	ray.TMin = rng() % 4 == 0 ? unit(rng) * radius : 0.0f;
+	ray.TMax = rng() % 4 == 0 ? radius * (1.0f + unit(rng) * 2.0f) : FLT_MAX;
+	return ray;
+}
+
+static BvhHit BruteForceHit(const std::vector<BvhTriangle>& triangles, const BvhRay& ray)
+{
+	BvhHit hit = { ray.TMax, 0, 0, BVH_NO_HIT };
+	for (uint32_t t = 0; t < (uint32_t)triangles.size(); t++)
+		IntersectBvhTriangles(&triangles[t], &t, 0, 1, ray, hit);
+	return hit;
+}
+
+// Whether a tree's hit is as good as the brute force one: the
+// same distance, and the same triangle unless another one is
+// hit at exactly that distance
+static bool MatchesBruteForce(const std::vector<BvhTriangle>& triangles, const BvhRay& ray, const BvhHit& expected, bool found, const BvhHit& hit)
+{
+	if (found != (expected.TriangleIndex != BVH_NO_HIT))
+		return false;
+	if (!found)
+		return hit.TriangleIndex == BVH_NO_HIT;
+	if (hit.T != expected.T || hit.TriangleIndex >= triangles.size())
+		return false;
+	if (hit.TriangleIndex == expected.TriangleIndex)
+		return hit.U == expected.U && hit.V == expected.V;
+
+	BvhHit tie = { ray.TMax, 0, 0, BVH_NO_HIT };
+	IntersectBvhTriangles(&triangles[hit.TriangleIndex], &hit.TriangleIndex, 0, 1, ray, tie);
+	return tie.T == hit.T;
+}
+
+// --------------------------------------------------------
+// Walks a whole tree from the root, checking that every
+// node is reached exactly once, within BVH_MAX_DEPTH, with
+// children inside their parents.  Leaves have to cover the
+// references exactly once, hold no more than the limit,
+// and fit around their triangles (which are copies of the
+// mesh's).  Without spatial splits, every triangle has to
+// be referenced exactly once.
+// --------------------------------------------------------
+static void CheckBvhShape(SelfTestGroup& group, const Bvh& bvh, const std::vector<BvhTriangle>& triangles, bool spatialSplits)
+{
+	BvhArray<BvhNode> nodes = bvh.GetNodes();
+	BvhArray<BvhTriangle> treeTriangles = bvh.GetTriangles();
+	BvhArray<uint32_t> treeIndices = bvh.GetTriangleIndices();
+	if (!Check(group, !nodes.empty() && treeTriangles.size() == treeIndices.size(), "tree is empty or its arrays don't match"))
+		return;
+
+	std::vector<uint32_t> nodeVisits(nodes.size(), 0);
+	std::vector<uint32_t> referenceVisits(treeIndices.size(), 0);
+	std::vector<uint32_t> triangleReferences(triangles.size(), 0);
+	bool shapeOk = true;
+	bool leavesOk = true;
+	bool referencesOk = true;
+	uint32_t maxDepth = 0;
+
+	struct Entry { uint32_t Node; uint32_t Depth; };
+	std::vector<Entry> stack = { { 0, 1 } };
+	while (!stack.empty() && shapeOk)
+	{
+		Entry entry = stack.back();
+		stack.pop_back();
+		const BvhNode& node = nodes[entry.Node];
+		maxDepth = (std::max)(maxDepth, entry.Depth);
+		if (nodeVisits[entry.Node]++ > 0 || entry.Depth > BVH_MAX_DEPTH)
+		{
+			shapeOk = false;
+			break;
+		}
+
+		if (!node.IsLeaf())
+		{
+			for (uint32_t c = node.LeftFirst; c < node.LeftFirst + 2; c++)
+			{
+				if (node.LeftFirst + 1 >= nodes.size() || node.LeftFirst == 0 ||
+					!BoxContains(node.BoundsMin, node.BoundsMax, nodes[c].BoundsMin, nodes[c].BoundsMax))
+				{
+					shapeOk = false;
+					break;
+				}
+				stack.push_back({ c, entry.Depth + 1 });
+			}
+			continue;
+		}
+
+		if (node.TriangleCount > BVH_MAX_LEAF_TRIANGLES || node.LeftFirst + node.TriangleCount > treeIndices.size())
+		{
+			leavesOk = false;
+			continue;
+		}
+
+		for (uint32_t r = node.LeftFirst; r < node.LeftFirst + node.TriangleCount; r++)
+		{
+			referenceVisits[r]++;
+			uint32_t t = treeIndices[r];
+			if (t >= triangles.size() || memcmp(&treeTriangles[r], &triangles[t], sizeof(BvhTriangle)) != 0)
+			{
+				referencesOk = false;
+				continue;
+			}
+			triangleReferences[t]++;
+
+			BvhBounds box = TriangleBounds(triangles[t]);
+			if (!spatialSplits && !BoxContains(node.BoundsMin, node.BoundsMax, box.Min, box.Max))
+				leavesOk = false;
+		}
+	}
+
+	Check(group, shapeOk, "node reached twice, too deep, or sticking out of its parent", maxDepth);
+	Check(group, maxDepth == bvh.GetBuildStats().MaxDepth, "build stats depth is wrong", maxDepth);
+	Check(group, leavesOk, "leaf too big, out of range, or not around its triangles");
+	Check(group, referencesOk, "leaf triangle isn't the mesh's");
+	Check(group, std::count(nodeVisits.begin(), nodeVisits.end(), 1u) == (ptrdiff_t)nodes.size(), "node never reached");
+	Check(group, std::count(referenceVisits.begin(), referenceVisits.end(), 1u) == (ptrdiff_t)referenceVisits.size(), "reference in no leaf, or in two");
+	for (uint32_t count : triangleReferences)
+	{
+		if (!Check(group, spatialSplits ? count >= 1 : count == 1, "triangle missing from the tree, or in it twice", count))
+			break;
+	}
+}
+
+// Builds a tree with the given options, checks its shape, then
+// that random rays hit exactly what brute force finds
+static void CheckBvhHits(SelfTestGroup& group, const MeshData& mesh, const BvhBuildOptions& options, std::mt19937& rng, int rays)
+{
+	std::vector<BvhTriangle> triangles = MeshTriangles(mesh);
+	BvhBounds bounds = MeshBounds(triangles);
+
+	Bvh bvh;
+	bvh.Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), options);
+	CheckBvhShape(group, bvh, triangles, options.SpatialSplits && !options.Linear);
+
+	for (int i = 0; i < rays; i++)
+	{
+		BvhRay ray = RandomRay(triangles, bounds, rng);
+		BvhHit expected = BruteForceHit(triangles, ray);
+		BvhHit hit;
+		bool found = bvh.Intersect(ray, hit);
+		Check(group, MatchesBruteForce(triangles, ray, expected, found, hit), "tree hit differs from brute force", hit.T);
+		Check(group, bvh.Occluded(ray) == found, "tree occlusion differs from its closest hit");
+	}
+}
+
+
+// --------------------------------------------------------
+// Checks binary trees built with the SAH: their shape, and
+// their hits against brute force.  A line of zero area
+// triangles would send the SAH far deeper than
+// BVH_MAX_DEPTH, so the build has to fall back to median
+// splits near the bottom.  Also checks that a box tree
+// refit after boxes move finds the same boxes as a tree
+// built from scratch around them.
+// --------------------------------------------------------
+
+// A sphere, then a line of zero area triangles (which
+// collapsed meshes have plenty of) off to one side.  Their
+// boxes have no area either, so to the SAH every split of
+// them is free, and it keeps taking the first: a sixteenth
+// of them on one side, the rest on the other.
+static MeshData MakeSphereAndLine(int lineTriangles)
+{
+	MeshData mesh = MakeSphere(20, 40);
+	for (int i = 0; i < lineTriangles; i++)
+	{
+		unsigned int base = (unsigned int)mesh.Vertices.size();
+		float x = 2.0f + i * 0.01f;
+		AddVertex(mesh, x, 0, 0);
+		AddVertex(mesh, x + 0.005f, 0, 0);
+		AddVertex(mesh, x + 0.02f, 0, 0);
+		AddTriangle(mesh, base, base + 1, base + 2);
+	}
+	return mesh;
+}
+
+// Every box the ray passes through, by the same slab test the
+// walks use (so a box is only in the list if its tree's nodes
+// are reached too), sorted
+static std::vector<uint32_t> BoxesHit(const std::vector<BvhBounds>& boxes, const uint32_t* candidates, uint32_t count, const BvhRay& ray)
+{
+	BvhNode box = {};
+	box.TriangleCount = 1;
+	std::vector<uint32_t> hits;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t b = candidates ? candidates[i] : i;
+		box.BoundsMin = boxes[b].Min;
+		box.BoundsMax = boxes[b].Max;
+		if (TraverseBvhUnordered(&box, ray, [](uint32_t, uint32_t) { return true; }))
+			hits.push_back(b);
+	}
+	std::sort(hits.begin(), hits.end());
+	return hits;
+}
+
+static std::vector<uint32_t> TreeBoxesHit(const Bvh& bvh, const std::vector<BvhBounds>& boxes, const BvhRay& ray)
+{
+	std::vector<uint32_t> hits;
+	const uint32_t* order = bvh.GetTriangleIndices().data();
+	TraverseBvhUnordered(bvh.GetNodes().data(), ray, [&](uint32_t first, uint32_t count)
+		{
+			std::vector<uint32_t> leafHits = BoxesHit(boxes, order + first, count, ray);
+			hits.insert(hits.end(), leafHits.begin(), leafHits.end());
+			return false;
+		});
+	std::sort(hits.begin(), hits.end());
+	return hits;
+}
+
+static void CheckRefit(SelfTestGroup& group, size_t boxCount, size_t movedCount, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+	std::uniform_real_distribution<float> extent(0.1f, 4.0f);
+	auto randomBox = [&]()
+		{
+			XMFLOAT3 center(position(rng), position(rng), position(rng));
+			BvhBounds box;
+			box.Min = XMFLOAT3(center.x - extent(rng), center.y - extent(rng), center.z - extent(rng));
+			box.Max = XMFLOAT3(center.x + extent(rng), center.y + extent(rng), center.z + extent(rng));
+			return box;
+		};
+
+	std::vector<BvhBounds> boxes(boxCount);
+	for (BvhBounds& box : boxes)
+		box = randomBox();
+
+	Bvh refit;
+	refit.Build(boxes.data(), boxes.size(), 4);
+
+	std::vector<uint32_t> moved(boxCount);
+	for (uint32_t i = 0; i < boxCount; i++)
+		moved[i] = i;
+	std::shuffle(moved.begin(), moved.end(), rng);
+	moved.resize(movedCount);
+	for (uint32_t b : moved)
+		boxes[b] = randomBox();
+
+	float cost = refit.Refit(boxes.data(), moved.data(), moved.size());
+	Bvh fresh;
+	fresh.Build(boxes.data(), boxes.size(), 4);
+
+	float expectedCost = refit.CalculateSahCost();
+	Check(group, fabsf(cost - expectedCost) <= expectedCost * 1e-4f, "refit SAH cost is off", cost - expectedCost);
+	const BvhNode& refitRoot = refit.GetNodes()[0];
+	const BvhNode& freshRoot = fresh.GetNodes()[0];
+	Check(group, memcmp(&refitRoot.BoundsMin, &freshRoot.BoundsMin, sizeof(XMFLOAT3)) == 0 &&
+		memcmp(&refitRoot.BoundsMax, &freshRoot.BoundsMax, sizeof(XMFLOAT3)) == 0, "refit root doesn't match a fresh build");
+
+	// Every node still has to be around what's under it
+	BvhArray<BvhNode> nodes = refit.GetNodes();
+	BvhArray<uint32_t> order = refit.GetTriangleIndices();
+	bool fits = true;
+	for (const BvhNode& node : nodes)
+	{
+		if (node.IsLeaf())
+		{
+			for (uint32_t i = node.LeftFirst; i < node.LeftFirst + node.TriangleCount; i++)
+				fits &= BoxContains(node.BoundsMin, node.BoundsMax, boxes[order[i]].Min, boxes[order[i]].Max);
+		}
+		else
+		{
+			for (uint32_t c = node.LeftFirst; c < node.LeftFirst + 2; c++)
+				fits &= BoxContains(node.BoundsMin, node.BoundsMax, nodes[c].BoundsMin, nodes[c].BoundsMax);
+		}
+	}
+	Check(group, fits, "refit node doesn't fit what's under it", (double)movedCount);
+
+	for (int i = 0; i < 256; i++)
+	{
+		BvhRay ray = {};
+		ray.Origin = XMFLOAT3(position(rng) * 2.0f, position(rng) * 2.0f, position(rng) * 2.0f);
+		XMStoreFloat3(&ray.Direction, XMVector3Normalize(XMVectorSet(position(rng), position(rng), position(rng), 0)));
+		ray.TMax = FLT_MAX;
+
+		std::vector<uint32_t> expected = BoxesHit(boxes, 0, (uint32_t)boxes.size(), ray);
+		Check(group, TreeBoxesHit(fresh, boxes, ray) == expected, "fresh box tree misses boxes");
+		Check(group, TreeBoxesHit(refit, boxes, ray) == expected, "refit box tree misses boxes", (double)movedCount);
+	}
+}
+
+static bool TestBvh()
+{
+	SelfTestGroup group = { "BVH against brute force" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	MeshData meshes[] = { MakeGrid(40), MakeSphere(20, 40), MakeSoup(1000, rng), MakeFan(64), MakeStack(40) };
+	for (const MeshData& mesh : meshes)
+		CheckBvhHits(group, mesh, BvhBuildOptions(), rng, 1000);
+
+	// Too deep for the SAH alone
+	MeshData line = MakeSphereAndLine(1000);
+	Bvh deep;
+	deep.Build(line.Vertices.data(), line.Vertices.size(), line.Indices.data(), line.Indices.size());
+	Check(group, deep.GetBuildStats().MaxDepth >= BVH_MAX_DEPTH - 1, "line didn't reach the depth cap", deep.GetBuildStats().MaxDepth);
+	CheckBvhHits(group, line, BvhBuildOptions(), rng, 1000);
+
+	// A few boxes moved (refit walks up from each), and most of
+	// them (a single pass over every node)
+	CheckRefit(group, 2000, 10, rng);
+	CheckRefit(group, 2000, 1500, rng);
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Checks trees built with spatial splits.  The part of a
+// triangle each reference was clipped to has to lie inside
+// the triangle's own box, so each leaf has to fit inside its
+// triangles' boxes, and between them a triangle's leaves
+// have to cover all of it.  Hits have to match brute force,
+// on meshes of long thin triangles that actually get split.
+// --------------------------------------------------------
+
+// Long, thin triangles in every direction through a cube
+static MeshData MakeSlivers(int triangles, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+	std::uniform_real_distribution<float> width(-0.05f, 0.05f);
+	MeshData mesh;
+	for (int i = 0; i < triangles; i++)
+	{
+		XMFLOAT3 a(position(rng), position(rng), position(rng));
+		XMFLOAT3 b(position(rng), position(rng), position(rng));
+		AddVertex(mesh, a.x, a.y, a.z);
+		AddVertex(mesh, b.x, b.y, b.z);
+		AddVertex(mesh, b.x + width(rng), b.y + width(rng), b.z + width(rng));
+		AddTriangle(mesh, i * 3, i * 3 + 1, i * 3 + 2);
+	}
+	return mesh;
+}
+
+// Returns the build's stats
+static BvhBuildStats CheckSpatialSplits(SelfTestGroup& group, const MeshData& mesh, std::mt19937& rng)
+{
+	BvhBuildOptions options;
+	options.SpatialSplits = true;
+	CheckBvhHits(group, mesh, options, rng, 1000);
+
+	std::vector<BvhTriangle> triangles = MeshTriangles(mesh);
+	Bvh bvh;
+	bvh.Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), options);
+	BvhArray<BvhNode> nodes = bvh.GetNodes();
+	BvhArray<uint32_t> order = bvh.GetTriangleIndices();
+
+	// Each leaf inside the union of its triangles' boxes
+	std::vector<std::vector<uint32_t>> triangleLeaves(triangles.size());
+	bool leavesInside = true;
+	for (uint32_t n = 0; n < (uint32_t)nodes.size(); n++)
+	{
+		const BvhNode& node = nodes[n];
+		if (!node.IsLeaf())
+			continue;
+
+		BvhBounds triangleBounds = TriangleBounds(triangles[order[node.LeftFirst]]);
+		for (uint32_t r = node.LeftFirst; r < node.LeftFirst + node.TriangleCount; r++)
+		{
+			GrowBounds(triangleBounds, TriangleBounds(triangles[order[r]]));
+			triangleLeaves[order[r]].push_back(n);
+		}
+		leavesInside &= BoxContains(triangleBounds.Min, triangleBounds.Max, node.BoundsMin, node.BoundsMax);
+	}
+	Check(group, leavesInside, "clipped reference outside its triangle's box");
+
+	// Every point of a triangle in at least one of its leaves
+	// (give or take rounding where the clipping was done)
+	BvhBounds bounds = MeshBounds(triangles);
+	float tolerance = XMVectorGetX(XMVector3Length(XMVectorSubtract(XMLoadFloat3(&bounds.Max), XMLoadFloat3(&bounds.Min)))) * 1e-6f;
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	size_t uncovered = 0;
+	for (size_t t = 0; t < triangles.size(); t++)
+	{
+		const BvhTriangle& triangle = triangles[t];
+		for (int s = 0; s < 16; s++)
+		{
+			float u = s == 1 ? 1.0f : s < 3 ? 0.0f : unit(rng);
+			float v = s == 2 ? 1.0f : s < 3 ? 0.0f : unit(rng) * (1 - u);
+			XMFLOAT3 point;
+			XMVECTOR v0 = XMLoadFloat3(&triangle.V0);
+			XMStoreFloat3(&point, XMVectorAdd(v0, XMVectorAdd(
+				XMVectorScale(XMVectorSubtract(XMLoadFloat3(&triangle.V1), v0), u),
+				XMVectorScale(XMVectorSubtract(XMLoadFloat3(&triangle.V2), v0), v))));
+
+			bool covered = false;
+			for (uint32_t n : triangleLeaves[t])
+			{
+				const BvhNode& leaf = nodes[n];
+				covered |=
+					point.x + tolerance >= leaf.BoundsMin.x && point.x - tolerance <= leaf.BoundsMax.x &&
+					point.y + tolerance >= leaf.BoundsMin.y && point.y - tolerance <= leaf.BoundsMax.y &&
+					point.z + tolerance >= leaf.BoundsMin.z && point.z - tolerance <= leaf.BoundsMax.z;
+			}
+			uncovered += covered ? 0 : 1;
+		}
+	}
+	Check(group, uncovered == 0, "part of a triangle in none of its leaves", (double)uncovered);
+
+	return bvh.GetBuildStats();
+}
+
+static bool TestSpatialSplits()
+{
+	SelfTestGroup group = { "Spatial split BVH" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	BvhBuildStats stats = CheckSpatialSplits(group, MakeSlivers(2000, rng), rng);
+	printf("    %u spatial splits, %u references to 2000 slivers\n", stats.SpatialSplits, stats.ReferenceCount);
+	Check(group, stats.SpatialSplits > 0 && stats.ReferenceCount > 2000, "slivers weren't split");
+
+	MeshData meshes[] = { MakeGrid(40), MakeSphere(20, 40), MakeSoup(1000, rng), MakeFan(64), MakeSphereAndLine(1000) };
+	for (const MeshData& mesh : meshes)
+		CheckSpatialSplits(group, mesh, rng);
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Checks linear trees, with and without treelet passes:
+// their shape (every triangle in exactly one leaf, parents
+// around their children) and their hits against brute
+// force.  Each treelet is only swapped in when it's cheaper,
+// so the passes can never make the SAH cost worse.  The big
+// grid is past BVH_LINEAR_WIDE_CODE_TRIANGLES, so it's sorted
+// by the 63-bit codes.
+// --------------------------------------------------------
+static bool TestLinearBvh()
+{
+	SelfTestGroup group = { "Linear BVH" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	MeshData meshes[] = { MakeGrid(40), MakeSphere(20, 40), MakeSoup(1000, rng), MakeFan(64), MakeStack(40), MakeSphereAndLine(1000), MakeSlivers(2000, rng) };
+	for (const MeshData& mesh : meshes)
+	{
+		float previousCost = FLT_MAX;
+		for (uint32_t passes = 0; passes <= 2; passes++)
+		{
+			BvhBuildOptions options;
+			options.Linear = true;
+			options.TreeletPasses = passes;
+			CheckBvhHits(group, mesh, options, rng, 500);
+
+			Bvh bvh;
+			bvh.Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), options);
+			float cost = bvh.GetBuildStats().SahCost;
+			Check(group, cost <= previousCost * (1 + 1e-5f), "treelet pass made the tree worse", cost - previousCost);
+			previousCost = cost;
+		}
+	}
+
+	MeshData big = MakeGrid(363);
+	Check(group, big.Indices.size() / 3 > BVH_LINEAR_WIDE_CODE_TRIANGLES, "grid too small for wide codes", (double)(big.Indices.size() / 3));
+	BvhBuildOptions options;
+	options.Linear = true;
+	options.TreeletPasses = 1;
+	CheckBvhHits(group, big, options, rng, 64);
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Checks 8-wide trees collapsed from every kind of binary
+// tree: both kernels (the scalar one forced, and AVX2 where
+// the CPU has it) have to give the binary tree's hits, and
+// so brute force's, for the same rays.  Without AVX2, asking
+// for it has to leave the tree on the scalar fallback.
+// --------------------------------------------------------
+static bool TestBvh8()
+{
+	SelfTestGroup group = { "8-wide BVH" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	std::vector<Bvh8Kernel> kernels = { Bvh8Kernel::Scalar };
+	if (Bvh8::IsAvx2Supported())
+		kernels.push_back(Bvh8Kernel::Avx2);
+	else
+		printf("    No AVX2, only checking the scalar kernel\n");
+
+	BvhBuildOptions sah;
+	BvhBuildOptions spatial;
+	spatial.SpatialSplits = true;
+	BvhBuildOptions linear;
+	linear.Linear = true;
+	linear.TreeletPasses = 1;
+
+	MeshData meshes[] = { MakeGrid(40), MakeSphere(20, 40), MakeSoup(1000, rng), MakeFan(64), MakeSphereAndLine(1000), MakeSlivers(2000, rng) };
+	for (const MeshData& mesh : meshes)
+	{
+		std::vector<BvhTriangle> triangles = MeshTriangles(mesh);
+		BvhBounds bounds = MeshBounds(triangles);
+		for (const BvhBuildOptions* options : { &sah, &spatial, &linear })
+		{
+			Bvh bvh;
+			bvh.Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), *options);
+			Bvh8 wide;
+			wide.Build(bvh);
+			Check(group, wide.GetTriangleIndices().size() == bvh.GetTriangleIndices().size(), "collapsed tree lost triangles");
+
+			for (Bvh8Kernel kernel : kernels)
+			{
+				wide.SetKernel(kernel);
+				if (!Check(group, wide.GetKernel() == kernel, "kernel wasn't set"))
+					continue;
+
+				for (int i = 0; i < 500; i++)
+				{
+					BvhRay ray = RandomRay(triangles, bounds, rng);
+					BvhHit expected;
+					bool binaryFound = bvh.Intersect(ray, expected);
+					BvhHit hit;
+					bool found = wide.Intersect(ray, hit);
+					Check(group, found == binaryFound && MatchesBruteForce(triangles, ray, expected, found, hit),
+						kernel == Bvh8Kernel::Avx2 ? "AVX2 kernel hit differs from the binary tree" : "scalar kernel hit differs from the binary tree", hit.T);
+					Check(group, MatchesBruteForce(triangles, ray, BruteForceHit(triangles, ray), found, hit), "8-wide hit differs from brute force", hit.T);
+				}
+			}
+		}
+	}
+
+	// Asking for AVX2 without it falls back
+	Bvh8 fallback;
+	fallback.SetKernel(Bvh8Kernel::Avx2);
+	Check(group, (fallback.GetKernel() == Bvh8Kernel::Avx2) == Bvh8::IsAvx2Supported(), "AVX2 kernel picked without AVX2");
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Checks compressed 8-wide trees against the uncompressed
+// ones they came from.  Walking both together, every child
+// box decoded from the quantized grid has to contain the
+// exact box from the Bvh8 (and lead to the same child, or
+// the same triangles), and both kernels have to give the
+// uncompressed tree's hits, and so brute force's.
+// --------------------------------------------------------
+
+// Returns false at the first child whose decoded box
+// doesn't contain its exact one, or that doesn't match
+static bool CompressedNodeMatches(const Bvh8& wide, uint32_t wideIndex, const Bvh8Compressed& compressed, uint32_t index, size_t& visited)
+{
+	const Bvh8Node& source = wide.GetNodes()[wideIndex];
+	const Bvh8CompressedNode& node = compressed.GetNodes()[index];
+	visited++;
+
+	float steps[3];
+	for (int a = 0; a < 3; a++)
+		steps[a] = ldexpf(1.0f, node.Exponents[a]);
+
+	for (unsigned int c = 0; c < BVH8_WIDTH; c++)
+	{
+		if (source.Children[c] == BVH8_EMPTY)
+		{
+			// Inside out, so nothing can hit it
+			if (node.LeafCounts[c] != 0 || (node.InternalMask & (1u << c)) || node.QuantizedMinX[c] <= node.QuantizedMaxX[c])
+				return false;
+			continue;
+		}
+
+		// Decoded the same way the kernels do
+		XMFLOAT3 decodedMin(
+			node.Origin.x + node.QuantizedMinX[c] * steps[0],
+			node.Origin.y + node.QuantizedMinY[c] * steps[1],
+			node.Origin.z + node.QuantizedMinZ[c] * steps[2]);
+		XMFLOAT3 decodedMax(
+			node.Origin.x + node.QuantizedMaxX[c] * steps[0],
+			node.Origin.y + node.QuantizedMaxY[c] * steps[1],
+			node.Origin.z + node.QuantizedMaxZ[c] * steps[2]);
+		XMFLOAT3 exactMin(source.MinX[c], source.MinY[c], source.MinZ[c]);
+		XMFLOAT3 exactMax(source.MaxX[c], source.MaxY[c], source.MaxZ[c]);
+		if (!BoxContains(decodedMin, decodedMax, exactMin, exactMax))
+			return false;
+
+		uint32_t child = GetBvh8CompressedChild(node, c);
+		if ((child & BVH8_LEAF_BIT) != (source.Children[c] & BVH8_LEAF_BIT))
+			return false;
+
+		if (child & BVH8_LEAF_BIT)
+		{
+			// Same triangles, just moved
+			uint32_t count = ((child >> BVH8_LEAF_COUNT_SHIFT) & 7) + 1;
+			if (count != ((source.Children[c] >> BVH8_LEAF_COUNT_SHIFT) & 7) + 1)
+				return false;
+			uint32_t first = child & BVH8_LEAF_FIRST_MASK;
+			uint32_t sourceFirst = source.Children[c] & BVH8_LEAF_FIRST_MASK;
+			for (uint32_t t = 0; t < count; t++)
+			{
+				if (compressed.GetTriangleIndices()[first + t] != wide.GetTriangleIndices()[sourceFirst + t])
+					return false;
+			}
+		}
+		else if (!CompressedNodeMatches(wide, source.Children[c], compressed, child, visited))
+			return false;
+	}
+	return true;
+}
+
+static bool TestBvh8Compressed()
+{
+	SelfTestGroup group = { "Compressed 8-wide BVH" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	std::vector<Bvh8Kernel> kernels = { Bvh8Kernel::Scalar };
+	if (Bvh8::IsAvx2Supported())
+		kernels.push_back(Bvh8Kernel::Avx2);
+	else
+		printf("    No AVX2, only checking the scalar kernel\n");
+
+	BvhBuildOptions sah;
+	BvhBuildOptions spatial;
+	spatial.SpatialSplits = true;
+	BvhBuildOptions linear;
+	linear.Linear = true;
+	linear.TreeletPasses = 1;
+
+	MeshData meshes[] = { MakeGrid(40), MakeSphere(20, 40), MakeSoup(1000, rng), MakeFan(64), MakeSphereAndLine(1000), MakeSlivers(2000, rng) };
+	for (const MeshData& mesh : meshes)
+	{
+		std::vector<BvhTriangle> triangles = MeshTriangles(mesh);
+		BvhBounds bounds = MeshBounds(triangles);
+		for (const BvhBuildOptions* options : { &sah, &spatial, &linear })
+		{
+			Bvh bvh;
+			bvh.Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), *options);
+			Bvh8 wide;
+			wide.Build(bvh);
+			Bvh8Compressed compressed;
+			compressed.Build(bvh);
+
+			size_t visited = 0;
+			if (Check(group, CompressedNodeMatches(wide, 0, compressed, 0, visited), "decoded child box doesn't contain the exact one"))
+				Check(group, visited == compressed.GetNodes().size() && visited == wide.GetNodes().size(), "compressed tree has a different shape", (double)visited);
+			Check(group, compressed.GetMemorySize() < wide.GetMemorySize(), "compressed tree isn't smaller", (double)compressed.GetMemorySize());
+
+			for (Bvh8Kernel kernel : kernels)
+			{
+				wide.SetKernel(kernel);
+				compressed.SetKernel(kernel);
+				if (!Check(group, compressed.GetKernel() == kernel, "kernel wasn't set"))
+					continue;
+
+				for (int i = 0; i < 500; i++)
+				{
+					BvhRay ray = RandomRay(triangles, bounds, rng);
+					BvhHit expected;
+					bool wideFound = wide.Intersect(ray, expected);
+					BvhHit hit;
+					bool found = compressed.Intersect(ray, hit);
+					Check(group, found == wideFound && MatchesBruteForce(triangles, ray, expected, found, hit),
+						kernel == Bvh8Kernel::Avx2 ? "AVX2 kernel hit differs from the uncompressed tree" : "scalar kernel hit differs from the uncompressed tree", hit.T);
+					Check(group, MatchesBruteForce(triangles, ray, BruteForceHit(triangles, ray), found, hit), "compressed hit differs from brute force", hit.T);
+				}
+			}
+		}
+	}
+
+	// Nothing to hit in an empty tree
+	Bvh8Compressed empty;
+	empty.Build(Bvh());
+	BvhRay ray = { XMFLOAT3(0, 0, 0), 0.0f, XMFLOAT3(0, 0, 1), FLT_MAX };
+	BvhHit hit;
+	Check(group, empty.IsEmpty() && !empty.Intersect(ray, hit) && hit.TriangleIndex == BVH_NO_HIT, "empty tree hit something");
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Checks packet tracing against tracing one ray at a time,
+// which it has to match exactly (down to which triangle a
+// ray on a shared edge gets).  Packets come in every shape:
+// coherent ones from a shared origin, ones that run along
+// an axis right through the mesh's vertices (so origins
+// sit on box planes, where the slab test sees NaNs), ones
+// with zero, NaN or empty-range rays mixed in, ones that
+// point different ways (traced one ray at a time), and
+// partly filled ones.  Scenes are traced a tile at a time,
+// the way IntersectBvhImage traces a camera's view.
+// --------------------------------------------------------
+
+// A few meshes, and instances of them scattered around (in
+// front of a camera looking down +Z from z = -60), turned,
+// scaled (some mirrored) and moved, for scene tests
+struct TestScene
+{
+	MeshData Meshes[4];
+	Bvh Bvhs[4];
+	std::vector<BvhTriangle> Triangles[4];
+	std::vector<SceneBvhInstanceDesc> Descs;
+	std::vector<unsigned int> DescMeshes;
+};
+
+static XMFLOAT4X4 RandomWorld(std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	float scale = 0.3f + unit(rng) * 1.2f;
+	float mirror = rng() % 4 == 0 ? -1.0f : 1.0f;
+	XMFLOAT4X4 world;
+	XMStoreFloat4x4(&world,
+		XMMatrixScaling(scale * mirror, scale * (0.5f + unit(rng)), scale) *
+		XMMatrixRotationRollPitchYaw(unit(rng) * XM_2PI, unit(rng) * XM_2PI, unit(rng) * XM_2PI) *
+		XMMatrixTranslation(unit(rng) * 40 - 20, unit(rng) * 30 - 15, unit(rng) * 10 - 5));
+	return world;
+}
+
+static void MakeTestScene(TestScene& scene, unsigned int instances, std::mt19937& rng)
+{
+	scene.Meshes[0] = MakeGrid(8);
+	scene.Meshes[1] = MakeSphere(12, 24);
+	scene.Meshes[2] = MakeSoup(200, rng);
+	scene.Meshes[3] = MakeFan(32);
+	for (int m = 0; m < 4; m++)
+	{
+		const MeshData& mesh = scene.Meshes[m];
+		scene.Bvhs[m].Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), BvhBuildOptions());
+		scene.Triangles[m] = MeshTriangles(mesh);
+	}
+
+	scene.Descs.resize(instances);
+	scene.DescMeshes.resize(instances);
+	for (unsigned int i = 0; i < instances; i++)
+	{
+		scene.DescMeshes[i] = rng() % 4;
+		scene.Descs[i].World = RandomWorld(rng);
+		scene.Descs[i].Blas = &scene.Bvhs[scene.DescMeshes[i]];
+	}
+}
+
+// Whether a scene hit matches the expected one: the same T,
+// and the same triangle of the same instance, unless that's
+// a tie (the hit's own triangle, moved into object space the
+// way the scene does it, gives the same T)
+static bool SceneHitMatches(const TestScene& scene, const SceneBvh& tree, const BvhRay& ray, const SceneBvhHit& expected, bool found, const SceneBvhHit& hit)
+{
+	if (found != (expected.InstanceIndex != BVH_NO_HIT))
+		return false;
+	if (!found)
+		return hit.InstanceIndex == BVH_NO_HIT && hit.TriangleIndex == BVH_NO_HIT;
+	if (hit.T != expected.T || hit.InstanceIndex >= scene.Descs.size())
+		return false;
+	if (hit.InstanceIndex == expected.InstanceIndex && hit.TriangleIndex == expected.TriangleIndex)
+		return hit.U == expected.U && hit.V == expected.V;
+
+	const std::vector<BvhTriangle>& triangles = scene.Triangles[scene.DescMeshes[hit.InstanceIndex]];
+	if (hit.TriangleIndex >= triangles.size())
+		return false;
+	for (const SceneBvhInstance& instance : tree.GetInstances())
+	{
+		if (instance.InstanceIndex != hit.InstanceIndex)
+			continue;
+
+		XMMATRIX worldToObject = XMLoadFloat4x4(&instance.WorldToObject);
+		BvhRay objectRay = ray;
+		XMStoreFloat3(&objectRay.Origin, XMVector3TransformCoord(XMLoadFloat3(&ray.Origin), worldToObject));
+		XMStoreFloat3(&objectRay.Direction, XMVector3TransformNormal(XMLoadFloat3(&ray.Direction), worldToObject));
+		BvhHit tie = { ray.TMax, 0, 0, BVH_NO_HIT };
+		IntersectBvhTriangles(&triangles[hit.TriangleIndex], &hit.TriangleIndex, 0, 1, objectRay, tie);
+		return tie.T == hit.T;
+	}
+	return false;
+}
+
+// A camera's rays, from z = -60 across the scene
+static std::vector<BvhRay> MakeTestCameraRays(unsigned int width, unsigned int height)
+{
+	std::vector<BvhRay> rays((size_t)width * height);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			XMVECTOR target = XMVectorSet((x + 0.5f) / width * 60 - 30, 25 - (y + 0.5f) / height * 50, 0, 0);
+			XMVECTOR origin = XMVectorSet(0, 0, -60, 0);
+			BvhRay& ray = rays[(size_t)y * width + x];
+			XMStoreFloat3(&ray.Origin, origin);
+			XMStoreFloat3(&ray.Direction, XMVector3Normalize(XMVectorSubtract(target, origin)));
+			ray.TMin = 0;
+			ray.TMax = FLT_MAX;
+		}
+	}
+	return rays;
+}
+
+// A ray along an axis, in the plane of one of a vertex's
+// coordinates (so it starts right on box planes, where the
+// slab test gets NaNs), through a random point on the mesh
+// along the other.  Rays right through a vertex are left
+// out: Moller-Trumbore rounds each triangle around it its
+// own way, some a hair before the box the triangle is in,
+// so which one a walk finds depends on the order it visits
+// boxes in (a limit of the test, not of the packets).
+static BvhRay AxisRay(const std::vector<BvhTriangle>& triangles, const BvhBounds& bounds, int axis, bool negative, bool negativeZeros, std::mt19937& rng)
+{
+	// RandomRay aims at a point on the mesh from two radii away
+	BvhRay through = RandomRay(triangles, bounds, rng);
+	float radius = XMVectorGetX(XMVector3Length(XMVectorSubtract(XMLoadFloat3(&bounds.Max), XMLoadFloat3(&bounds.Min)))) * 0.5f + 1.0f;
+	XMFLOAT3 point;
+	XMStoreFloat3(&point, XMVectorAdd(XMLoadFloat3(&through.Origin), XMVectorScale(XMLoadFloat3(&through.Direction), radius * 2.0f)));
+	float target[3] = { point.x, point.y, point.z };
+
+	const XMFLOAT3& vertex = triangles[rng() % triangles.size()].V1;
+	int onPlane = (axis + 1 + rng() % 2) % 3;
+	target[onPlane] = (&vertex.x)[onPlane];
+	target[axis] = negative ? (&bounds.Max.x)[axis] + 1 : (&bounds.Min.x)[axis] - 1;
+
+	float zero = negativeZeros ? -0.0f : 0.0f;
+	float direction[3] = { zero, zero, zero };
+	direction[axis] = negative ? -1.0f : 1.0f;
+
+	BvhRay ray = {};
+	ray.Origin = XMFLOAT3(target[0], target[1], target[2]);
+	ray.Direction = XMFLOAT3(direction[0], direction[1], direction[2]);
+	ray.TMax = FLT_MAX;
+	return ray;
+}
+
+// Fills a packet with one of its shapes (see above)
+static void MakeTestPacket(BvhRayPacket& packet, const std::vector<BvhTriangle>& triangles, const BvhBounds& bounds, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	packet.Count = rng() % 4 == 0 ? 1 + rng() % BVH_PACKET_SIZE : BVH_PACKET_SIZE;
+
+	int shape = rng() % 5;
+	BvhRay base = RandomRay(triangles, bounds, rng);
+	int axis = rng() % 3;
+	bool negative = rng() % 2 == 0;
+	bool negativeZeros = rng() % 2 == 0;
+	for (unsigned int i = 0; i < packet.Count; i++)
+	{
+		BvhRay ray = RandomRay(triangles, bounds, rng);
+		switch (shape)
+		{
+		case 0:
+			// From the same place, fanning out a little
+			ray = base;
+			XMStoreFloat3(&ray.Direction, XMVector3Normalize(XMVectorAdd(XMLoadFloat3(&base.Direction),
+				XMVectorSet(unit(rng) * 0.1f - 0.05f, unit(rng) * 0.1f - 0.05f, unit(rng) * 0.1f - 0.05f, 0))));
+			break;
+		case 1:
+			// Side by side, all the same way
+			ray = base;
+			ray.Origin.x += unit(rng) - 0.5f;
+			ray.Origin.y += unit(rng) - 0.5f;
+			ray.Origin.z += unit(rng) - 0.5f;
+			break;
+		case 2:
+			ray = AxisRay(triangles, bounds, axis, negative, negativeZeros, rng);
+			break;
+		case 3:
+			// Side by side, with some degenerate rays mixed in
+			ray = base;
+			ray.Origin.x += unit(rng) - 0.5f;
+			ray.Origin.y += unit(rng) - 0.5f;
+			if (rng() % 3 == 0)
+			{
+				switch (rng() % 4)
+				{
+				case 0: ray.Direction = XMFLOAT3(0, 0, 0); break;
+				case 1: ray.Direction.y = NAN; break;
+				case 2: ray.TMin = ray.TMax = 10.0f; break;
+				default: ray.TMin = 20.0f; ray.TMax = 10.0f; break;
+				}
+			}
+			break;
+		default:
+			// Every which way
+			break;
+		}
+		packet.SetRay(i, ray);
+	}
+}
+
+static bool TestBvhPackets()
+{
+	SelfTestGroup group = { "BVH packets" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	// Single meshes.  Packets only stay together when their
+	// rays all head the same way along every axis.
+	unsigned int packets = 0;
+	unsigned int together = 0;
+	MeshData meshes[] = { MakeGrid(40), MakeSphere(20, 40), MakeSoup(1000, rng), MakeFan(64), MakeSphereAndLine(1000), MakeSlivers(2000, rng) };
+	for (const MeshData& mesh : meshes)
+	{
+		std::vector<BvhTriangle> triangles = MeshTriangles(mesh);
+		BvhBounds bounds = MeshBounds(triangles);
+		Bvh bvh;
+		bvh.Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), BvhBuildOptions());
+
+		for (int p = 0; p < 300; p++)
+		{
+			BvhRayPacket packet;
+			MakeTestPacket(packet, triangles, bounds, rng);
+			uint32_t negative[3] = {};
+			for (unsigned int i = 0; i < packet.Count; i++)
+			{
+				negative[0] |= (1.0f / packet.DirectionX[i] < 0 ? 2 : 1);
+				negative[1] |= (1.0f / packet.DirectionY[i] < 0 ? 2 : 1);
+				negative[2] |= (1.0f / packet.DirectionZ[i] < 0 ? 2 : 1);
+			}
+			packets++;
+			together += negative[0] != 3 && negative[1] != 3 && negative[2] != 3 ? 1 : 0;
+
+			BvhPacketHit packetHit;
+			uint32_t hitLanes = IntersectBvhPacket(bvh, packet, packetHit);
+			Check(group, hitLanes >> packet.Count == 0, "packet hit a lane it doesn't have", (double)hitLanes);
+
+			for (unsigned int i = 0; i < packet.Count; i++)
+			{
+				BvhRay ray = packet.GetRay(i);
+				BvhHit expected;
+				bool expectedFound = bvh.Intersect(ray, expected);
+				BvhHit hit = { packetHit.T[i], packetHit.U[i], packetHit.V[i], packetHit.TriangleIndex[i] };
+				bool found = (hitLanes >> i) & 1;
+				Check(group, found == expectedFound && MatchesBruteForce(triangles, ray, expected, found, hit), "packet hit differs from a single ray's", hit.T);
+			}
+		}
+	}
+
+	// A NaN ray can't narrow the bounds that whole boxes get
+	// culled with: the first group's rays pass over this
+	// triangle, and only lane 4's shallower slope hits it,
+	// which a NaN in the same slot of a later group would
+	// drop from the packet's bounds if it weren't caught
+	MeshData wall;
+	AddVertex(wall, 10, 4.5f, -1);
+	AddVertex(wall, 10, 5.5f, -1);
+	AddVertex(wall, 10, 5, 1);
+	AddTriangle(wall, 0, 1, 2);
+	Bvh wallBvh;
+	wallBvh.Build(wall.Vertices.data(), wall.Vertices.size(), wall.Indices.data(), wall.Indices.size(), BvhBuildOptions());
+	BvhRayPacket nanPacket;
+	nanPacket.Count = BVH_PACKET_SIZE;
+	for (unsigned int i = 0; i < BVH_PACKET_SIZE; i++)
+		nanPacket.SetRay(i, { XMFLOAT3(0, 0, 0), 0.0f, XMFLOAT3(1, i == 4 ? 0.5f : i == 8 ? NAN : 2.0f, 0.001f), FLT_MAX });
+	BvhPacketHit nanHit;
+	Check(group, IntersectBvhPacket(wallBvh, nanPacket, nanHit) == 1u << 4, "NaN ray hid another ray's hit");
+
+	printf("    %u of %u packets traced together\n", together, packets);
+	Check(group, together > packets / 2 && together < packets, "packets weren't both traced together and apart", (double)together);
+
+	// Scenes, through both the packet path and the one ray
+	// at a time fallback (for instances few rays reach)
+	TestScene scene;
+	MakeTestScene(scene, 60, rng);
+	SceneBvh tree;
+	tree.Build(scene.Descs.data(), scene.Descs.size());
+
+	const unsigned int width = 96;
+	const unsigned int height = 80;
+	std::vector<BvhRay> rays = MakeTestCameraRays(width, height);
+	std::vector<SceneBvhHit> hits(rays.size());
+	size_t hitCount = IntersectBvhImage(tree, rays.data(), width, height, hits.data());
+	size_t expectedHits = 0;
+	for (size_t i = 0; i < rays.size(); i++)
+	{
+		SceneBvhHit expected;
+		bool found = tree.Intersect(rays[i], expected);
+		expectedHits += found ? 1 : 0;
+		Check(group, SceneHitMatches(scene, tree, rays[i], expected, found, hits[i]), "image pixel differs from a single ray's", (double)i);
+	}
+	Check(group, hitCount == expectedHits, "image hit count is off", (double)hitCount);
+	Check(group, expectedHits > rays.size() / 10 && expectedHits < rays.size(), "camera doesn't see the scene", (double)expectedHits);
+
+	// And a mesh's tree on its own, looking down at the grid
+	const Bvh& grid = scene.Bvhs[0];
+	std::vector<BvhRay> gridRays = rays;
+	for (unsigned int i = 0; i < width * height; i++)
+	{
+		XMVECTOR origin = XMVectorSet(4, 6, -4, 0);
+		XMVECTOR target = XMVectorSet((i % width + 0.5f) / width * 10 - 1, 0, (i / width + 0.5f) / height * 10 - 1, 0);
+		XMStoreFloat3(&gridRays[i].Origin, origin);
+		XMStoreFloat3(&gridRays[i].Direction, XMVector3Normalize(XMVectorSubtract(target, origin)));
+	}
+	std::vector<BvhHit> gridHits(gridRays.size());
+	size_t gridHitCount = IntersectBvhImage(grid, gridRays.data(), width, height, gridHits.data());
+	for (size_t i = 0; i < gridRays.size(); i++)
+	{
+		BvhHit expected;
+		bool found = grid.Intersect(gridRays[i], expected);
+		Check(group, MatchesBruteForce(scene.Triangles[0], gridRays[i], expected, found, gridHits[i]), "mesh image pixel differs from a single ray's", (double)i);
+	}
+	Check(group, gridHitCount > gridRays.size() / 2, "camera doesn't see the grid", (double)gridHitCount);
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Checks ray streams against tracing each ray on its own.
+// Rays are queued in a shuffled order (camera rays, bounces
+// every which way, and a few degenerate ones), so sorting
+// really moves them, and enough of them that tracing takes
+// several batches.  Hits have to come back in the order the
+// rays went in, next to their ids, for scenes and single
+// meshes, and again after the stream is cleared and reused.
+// --------------------------------------------------------
+static bool TestBvhStream()
+{
+	SelfTestGroup group = { "BVH ray streams" };
+	std::mt19937 rng(SELF_TEST_SEED);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	TestScene scene;
+	MakeTestScene(scene, 60, rng);
+	SceneBvh tree;
+	tree.Build(scene.Descs.data(), scene.Descs.size());
+
+	std::vector<BvhRay> rays = MakeTestCameraRays(96, 80);
+	for (int i = 0; i < 4000; i++)
+	{
+		BvhRay ray = {};
+		ray.Origin = XMFLOAT3(unit(rng) * 50 - 25, unit(rng) * 40 - 20, unit(rng) * 20 - 10);
+		XMStoreFloat3(&ray.Direction, XMVector3Normalize(XMVectorSet(unit(rng) - 0.5f, unit(rng) - 0.5f, unit(rng) - 0.5f, 0)));
+		ray.TMin = rng() % 4 == 0 ? unit(rng) : 0.0f;
+		ray.TMax = rng() % 4 == 0 ? unit(rng) * 20 : FLT_MAX;
+		switch (rng() % 50)
+		{
+		case 0: ray.Direction = XMFLOAT3(0, 0, 0); break;
+		case 1: ray.Direction = XMFLOAT3(-0.0f, 1, 0); break;
+		case 2: ray.TMin = ray.TMax = 1.0f; break;
+		default: break;
+		}
+		rays.push_back(ray);
+	}
+
+	std::vector<uint32_t> pushOrder(rays.size());
+	for (uint32_t i = 0; i < (uint32_t)pushOrder.size(); i++)
+		pushOrder[i] = i;
+	std::shuffle(pushOrder.begin(), pushOrder.end(), rng);
+
+	BvhRayStream stream(rays.size());
+	for (int pass = 0; pass < 2; pass++)
+	{
+		// The second time around, reusing the same stream
+		stream.Clear();
+		for (uint32_t id : pushOrder)
+			Check(group, stream.Push(rays[id], id), "stream ran out of room early");
+		Check(group, stream.IsFull() && !stream.Push(rays[0], 0) && stream.GetCount() == rays.size(), "full stream took another ray");
+
+		stream.Trace(tree);
+		const BvhStreamStats& stats = stream.GetStats();
+		Check(group, stream.GetHits().size() == rays.size() && stats.RayCount == rays.size(), "stream lost rays", (double)stats.RayCount);
+
+		uint32_t expectedHits = 0;
+		for (size_t i = 0; i < stream.GetCount() && i < stream.GetHits().size(); i++)
+		{
+			uint32_t id = stream.GetIds()[i];
+			Check(group, id == pushOrder[i] && memcmp(&stream.GetRays()[i], &rays[id], sizeof(BvhRay)) == 0, "queued ray moved", (double)i);
+
+			SceneBvhHit expected;
+			bool found = tree.Intersect(rays[id], expected);
+			expectedHits += found ? 1 : 0;
+			Check(group, SceneHitMatches(scene, tree, rays[id], expected, found, stream.GetHits()[i]), "stream hit differs from a single ray's", (double)id);
+		}
+		Check(group, stats.HitCount == expectedHits, "stream hit count is off", (double)stats.HitCount);
+		Check(group, stats.PacketRays > rays.size() / 2, "stream rays weren't traced as packets", (double)stats.PacketRays);
+	}
+
+	// A single mesh, in whatever order its rays come
+	MeshData sphere = MakeSphere(20, 40);
+	std::vector<BvhTriangle> triangles = MeshTriangles(sphere);
+	BvhBounds bounds = MeshBounds(triangles);
+	Bvh bvh;
+	bvh.Build(sphere.Vertices.data(), sphere.Vertices.size(), sphere.Indices.data(), sphere.Indices.size(), BvhBuildOptions());
+
+	std::vector<BvhRay> meshRays;
+	for (int i = 0; i < 5000; i++)
+		meshRays.push_back(RandomRay(triangles, bounds, rng));
+	stream.Clear();
+	for (uint32_t i = 0; i < (uint32_t)meshRays.size(); i++)
+		stream.Push(meshRays[i], i * 7);
+	stream.Trace(bvh);
+	for (size_t i = 0; i < stream.GetCount(); i++)
+	{
+		uint32_t id = stream.GetIds()[i];
+		const SceneBvhHit& streamHit = stream.GetHits()[i];
+		BvhHit expected;
+		bool found = bvh.Intersect(meshRays[i], expected);
+		BvhHit hit = { streamHit.T, streamHit.U, streamHit.V, streamHit.TriangleIndex };
+		Check(group, id == i * 7 && streamHit.InstanceIndex == BVH_NO_HIT && MatchesBruteForce(triangles, meshRays[i], expected, found, hit), "mesh stream hit differs from a single ray's", (double)i);
+	}
+
+	// Nothing queued, nothing traced
+	stream.Clear();
+	stream.Trace(tree);
+	Check(group, stream.GetHits().empty() && stream.GetStats().RayCount == 0 && stream.GetStats().HitCount == 0, "empty stream traced something");
+	Check(group, stream.GetCapacity() == rays.size(), "clearing changed the capacity", (double)stream.GetCapacity());
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Checks scene tree updates.  After instances move (or get
+// a new mask), an updated tree has to find the same hits as
+// one freshly built over the same instances, whether the
+// update only refit the tree or fell back to a rebuild, and
+// it has to say which one it did.
+// --------------------------------------------------------
+
+// Random rays through the scene, from anywhere around it
+static std::vector<BvhRay> MakeTestSceneRays(size_t count, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::vector<BvhRay> rays(count);
+	for (BvhRay& ray : rays)
+	{
+		ray.Origin = XMFLOAT3(unit(rng) * 30, unit(rng) * 25, unit(rng) * 20);
+		XMVECTOR direction = XMVectorSet(unit(rng), unit(rng), unit(rng), 0);
+		XMStoreFloat3(&ray.Direction, XMVector3Normalize(XMVectorAdd(direction, XMVectorSet(0, 0, 0.01f, 0))));
+		ray.TMin = 0;
+		ray.TMax = FLT_MAX;
+	}
+	return rays;
+}
+
+// Moves an instance a little (a nudge and a slight turn)
+static void NudgeInstance(SceneBvhInstanceDesc& desc, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	XMFLOAT4X4 world;
+	XMStoreFloat4x4(&world, XMLoadFloat4x4(&desc.World) *
+		XMMatrixRotationRollPitchYaw(0, unit(rng) * 0.1f, 0) *
+		XMMatrixTranslation(unit(rng) * 0.5f, unit(rng) * 0.5f, unit(rng) * 0.5f));
+	desc.World = world;
+}
+
+// Compares an updated tree against a fresh build, both with
+// every instance visible and with only opaque ones
+static void CheckSceneUpdate(SelfTestGroup& group, const TestScene& scene, const SceneBvh& updated, const std::vector<BvhRay>& rays, const char* what)
+{
+	SceneBvh fresh;
+	fresh.Build(scene.Descs.data(), scene.Descs.size());
+	Check(group, updated.GetInstances().size() == fresh.GetInstances().size(), "updated tree has the wrong instances", (double)updated.GetInstances().size());
+
+	size_t mismatches = 0;
+	size_t occlusionMismatches = 0;
+	size_t hitCount = 0;
+	for (uint8_t mask : { (uint8_t)MATERIAL_MASK_ALL, (uint8_t)MATERIAL_MASK_OPAQUE })
+	{
+		for (const BvhRay& ray : rays)
+		{
+			SceneBvhHit expected, hit;
+			bool expectedFound = fresh.Intersect(ray, expected, mask);
+			bool found = updated.Intersect(ray, hit, mask);
+			hitCount += found ? 1 : 0;
+			mismatches += SceneHitMatches(scene, updated, ray, expected, found, hit) ? 0 : 1;
+
+			// And shadow rays that stop partway
+			BvhRay shadow = ray;
+			shadow.TMax = 40.0f;
+			occlusionMismatches += fresh.Occluded(shadow, mask) != updated.Occluded(shadow, mask) ? 1 : 0;
+		}
+	}
+	printf("    %s: %zu of %zu rays hit\n", what, hitCount, rays.size() * 2);
+	Check(group, mismatches == 0, "updated tree's hit differs from a fresh build's", (double)mismatches);
+	Check(group, occlusionMismatches == 0, "updated tree's occlusion differs from a fresh build's", (double)occlusionMismatches);
+	Check(group, hitCount > 0 && hitCount < rays.size() * 2, "rays don't see the scene", (double)hitCount);
+}
+
+static bool TestSceneBvhUpdate()
+{
+	SelfTestGroup group = { "Scene BVH updates" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	TestScene scene;
+	MakeTestScene(scene, 200, rng);
+	SceneBvh tree;
+	tree.Build(scene.Descs.data(), scene.Descs.size());
+
+	std::vector<BvhRay> rays = MakeTestCameraRays(64, 48);
+	std::vector<BvhRay> randomRays = MakeTestSceneRays(2000, rng);
+	rays.insert(rays.end(), randomRays.begin(), randomRays.end());
+
+	// Nothing changed, so nothing moves
+	tree.Update(scene.Descs.data(), scene.Descs.size());
+	SceneBvhUpdateStats stats = tree.GetUpdateStats();
+	Check(group, !stats.LastUpdateRebuilt && stats.MovedInstances == 0 && stats.RefitCount == 0 && stats.RebuildCount == 1, "unchanged update did something");
+
+	// A few frames of small moves (and some new masks) only refit
+	for (uint32_t frame = 1; frame <= 3; frame++)
+	{
+		std::vector<bool> moved(scene.Descs.size());
+		uint32_t movedCount = 0;
+		for (int m = 0; m < 20; m++)
+		{
+			size_t i = rng() % scene.Descs.size();
+			NudgeInstance(scene.Descs[i], rng);
+			movedCount += moved[i] ? 0 : 1;
+			moved[i] = true;
+		}
+		for (int m = 0; m < 10; m++)
+			scene.Descs[rng() % scene.Descs.size()].InstanceMask = rng() % 2 ? MATERIAL_MASK_REFRACTIVE : MATERIAL_MASK_ALL;
+
+		tree.Update(scene.Descs.data(), scene.Descs.size());
+		stats = tree.GetUpdateStats();
+		Check(group, !stats.LastUpdateRebuilt && stats.RefitCount == frame && stats.RebuildCount == 1, "small moves didn't refit", (double)frame);
+		Check(group, stats.MovedInstances == movedCount, "refit the wrong number of instances", (double)stats.MovedInstances);
+		CheckSceneUpdate(group, scene, tree, rays, "refit");
+	}
+
+	// Everything moving far wears the refit tree down too far
+	for (SceneBvhInstanceDesc& desc : scene.Descs)
+		desc.World = RandomWorld(rng);
+	tree.Update(scene.Descs.data(), scene.Descs.size());
+	stats = tree.GetUpdateStats();
+	Check(group, stats.LastUpdateRebuilt && stats.RebuildCount == 2 && stats.RefitCount == 3, "big moves didn't rebuild");
+	CheckSceneUpdate(group, scene, tree, rays, "rebuilt after big moves");
+
+	// So do a new BVH, an instance dropping out of the tree
+	// (its matrix can't be inverted) and a new instance count
+	size_t swapped = rng() % scene.Descs.size();
+	scene.DescMeshes[swapped] = (scene.DescMeshes[swapped] + 1) % 4;
+	scene.Descs[swapped].Blas = &scene.Bvhs[scene.DescMeshes[swapped]];
+	tree.Update(scene.Descs.data(), scene.Descs.size());
+	Check(group, tree.GetUpdateStats().LastUpdateRebuilt && tree.GetUpdateStats().RebuildCount == 3, "new BVH didn't rebuild");
+	CheckSceneUpdate(group, scene, tree, rays, "rebuilt for a new BVH");
+
+	size_t dropped = rng() % scene.Descs.size();
+	XMStoreFloat4x4(&scene.Descs[dropped].World, XMMatrixScaling(0, 0, 0));
+	tree.Update(scene.Descs.data(), scene.Descs.size());
+	Check(group, tree.GetUpdateStats().LastUpdateRebuilt && tree.GetUpdateStats().RebuildCount == 4, "dropped instance didn't rebuild");
+	CheckSceneUpdate(group, scene, tree, rays, "rebuilt for a dropped instance");
+
+	scene.Descs.pop_back();
+	scene.DescMeshes.pop_back();
+	tree.Update(scene.Descs.data(), scene.Descs.size());
+	Check(group, tree.GetUpdateStats().LastUpdateRebuilt && tree.GetUpdateStats().RebuildCount == 5, "new count didn't rebuild");
+	CheckSceneUpdate(group, scene, tree, rays, "rebuilt for a new count");
+
+	// And refits still work after a fallback
+	NudgeInstance(scene.Descs[dropped == 0 ? 1 : 0], rng);
+	tree.Update(scene.Descs.data(), scene.Descs.size());
+	Check(group, !tree.GetUpdateStats().LastUpdateRebuilt && tree.GetUpdateStats().MovedInstances == 1, "moving one instance after a rebuild didn't refit");
+	CheckSceneUpdate(group, scene, tree, rays, "refit after a rebuild");
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Checks occlusion queries.  A ray has to be occluded
+// exactly when Intersect() finds a hit, over the same
+// [TMin, TMax) range: a hit right at TMax doesn't count, one
+// a hair before it does.  In scenes, instances whose mask
+// shares no bits with the ray's are invisible to both, so
+// hits also have to match brute force over just the
+// instances the mask lets through.
+// --------------------------------------------------------
+
+// Cuts a ray's range off right at a distance, and just past
+// it.  "Just past" is a few dozen ulps, not one: the slab test
+// and Moller-Trumbore round a hit on a flat box's face their
+// own ways, and the box can start a few ulps after the hit,
+// so a range ending in between culls the box (and the hit)
+// for both queries alike.
+static BvhRay EndingAt(const BvhRay& ray, float t)
+{
+	BvhRay cut = ray;
+	cut.TMax = t;
+	return cut;
+}
+
+static BvhRay EndingPast(const BvhRay& ray, float t)
+{
+	return EndingAt(ray, t * (1 + 64 * FLT_EPSILON));
+}
+
+// Every instance the mask lets through, one at a time
+static SceneBvhHit SceneBruteForceHit(const TestScene& scene, const SceneBvh& tree, const BvhRay& ray, uint8_t instanceMask)
+{
+	SceneBvhHit hit = { ray.TMax, 0, 0, BVH_NO_HIT, BVH_NO_HIT };
+	for (const SceneBvhInstance& instance : tree.GetInstances())
+	{
+		if (!(instance.InstanceMask & instanceMask))
+			continue;
+
+		XMMATRIX worldToObject = XMLoadFloat4x4(&instance.WorldToObject);
+		BvhRay objectRay = ray;
+		XMStoreFloat3(&objectRay.Origin, XMVector3TransformCoord(XMLoadFloat3(&ray.Origin), worldToObject));
+		XMStoreFloat3(&objectRay.Direction, XMVector3TransformNormal(XMLoadFloat3(&ray.Direction), worldToObject));
+		objectRay.TMax = hit.T;
+		BvhHit objectHit = BruteForceHit(scene.Triangles[scene.DescMeshes[instance.InstanceIndex]], objectRay);
+		if (objectHit.TriangleIndex != BVH_NO_HIT)
+			hit = { objectHit.T, objectHit.U, objectHit.V, objectHit.TriangleIndex, instance.InstanceIndex };
+	}
+	return hit;
+}
+
+static bool TestOcclusion()
+{
+	SelfTestGroup group = { "Occlusion queries" };
+	std::mt19937 rng(SELF_TEST_SEED);
+
+	// Meshes on their own, against their closest hits
+	MeshData meshes[] = { MakeGrid(20), MakeSphere(16, 32), MakeSoup(500, rng), MakeFan(64), MakeSphereAndLine(500) };
+	for (const MeshData& mesh : meshes)
+	{
+		std::vector<BvhTriangle> triangles = MeshTriangles(mesh);
+		BvhBounds bounds = MeshBounds(triangles);
+		Bvh bvh;
+		bvh.Build(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), mesh.Indices.size(), BvhBuildOptions());
+
+		size_t mismatches = 0;
+		size_t edgeMismatches = 0;
+		for (int r = 0; r < 2000; r++)
+		{
+			BvhRay ray = RandomRay(triangles, bounds, rng);
+			BvhHit hit;
+			bool found = bvh.Intersect(ray, hit);
+			bool expected = BruteForceHit(triangles, ray).TriangleIndex != BVH_NO_HIT;
+			mismatches += bvh.Occluded(ray) != found || found != expected ? 1 : 0;
+			if (!found)
+				continue;
+
+			// Nothing is nearer than the closest hit, and it
+			// only counts once it's inside the range
+			BvhHit cutHit;
+			edgeMismatches += bvh.Occluded(EndingAt(ray, hit.T)) || bvh.Intersect(EndingAt(ray, hit.T), cutHit) ? 1 : 0;
+			edgeMismatches += !bvh.Occluded(EndingPast(ray, hit.T)) || !bvh.Intersect(EndingPast(ray, hit.T), cutHit) || cutHit.T != hit.T ? 1 : 0;
+		}
+		Check(group, mismatches == 0, "mesh occlusion differs from its closest hit", (double)mismatches);
+		Check(group, edgeMismatches == 0, "mesh hit right at TMax is off", (double)edgeMismatches);
+	}
+
+	// A scene with some glass (seen by refractive rays, not
+	// opaque ones), some instances every ray sees, and its
+	// camera's view and random rays through it
+	TestScene scene;
+	MakeTestScene(scene, 80, rng);
+	for (SceneBvhInstanceDesc& desc : scene.Descs)
+	{
+		uint32_t kind = rng() % 4;
+		desc.InstanceMask = kind == 0 ? MATERIAL_MASK_REFRACTIVE : kind == 1 ? MATERIAL_MASK_ALL : MATERIAL_MASK_OPAQUE;
+	}
+	SceneBvh tree;
+	tree.Build(scene.Descs.data(), scene.Descs.size());
+
+	std::vector<BvhRay> rays = MakeTestCameraRays(48, 40);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (int r = 0; r < 1000; r++)
+	{
+		BvhRay ray = {};
+		ray.Origin = XMFLOAT3(unit(rng) * 60 - 30, unit(rng) * 50 - 25, unit(rng) * 40 - 20);
+		XMStoreFloat3(&ray.Direction, XMVector3Normalize(XMVectorSet(unit(rng) - 0.5f, unit(rng) - 0.5f, unit(rng) - 0.5f, 0)));
+		ray.TMin = rng() % 4 == 0 ? unit(rng) * 10 : 0.0f;
+		ray.TMax = rng() % 4 == 0 ? 10 + unit(rng) * 40 : FLT_MAX;
+		rays.push_back(ray);
+	}
+
+	const uint8_t masks[] = { MATERIAL_MASK_ALL, MATERIAL_MASK_OPAQUE, MATERIAL_MASK_REFRACTIVE, 0 };
+	size_t hidden = 0;
+	for (const BvhRay& ray : rays)
+	{
+		SceneBvhHit allHit;
+		bool allFound = tree.Intersect(ray, allHit);
+		for (uint8_t mask : masks)
+		{
+			SceneBvhHit hit;
+			bool found = tree.Intersect(ray, hit, mask);
+			Check(group, SceneHitMatches(scene, tree, ray, SceneBruteForceHit(scene, tree, ray, mask), found, hit), "masked scene hit differs from brute force", (double)mask);
+			Check(group, tree.Occluded(ray, mask) == found, "scene occlusion differs from its closest hit", (double)mask);
+			Check(group, !found || (scene.Descs[hit.InstanceIndex].InstanceMask & mask), "ray hit an instance its mask hides", (double)mask);
+
+			// A hidden instance in front doesn't stop the ray
+			// (the mask is what hides it, not its range)
+			if (allFound && !(scene.Descs[allHit.InstanceIndex].InstanceMask & mask))
+			{
+				hidden++;
+				BvhRay past = EndingPast(ray, allHit.T);
+				Check(group, !tree.Occluded(past, mask) || (found && hit.T < past.TMax), "hidden instance occluded a ray", (double)mask);
+			}
+
+			if (found)
+			{
+				SceneBvhHit cutHit;
+				Check(group, !tree.Occluded(EndingAt(ray, hit.T), mask) && !tree.Intersect(EndingAt(ray, hit.T), cutHit, mask), "scene hit right at TMax counted", (double)mask);
+				Check(group, tree.Occluded(EndingPast(ray, hit.T), mask) && tree.Intersect(EndingPast(ray, hit.T), cutHit, mask) && cutHit.T == hit.T, "scene hit just before TMax missed", (double)mask);
+			}
+		}
+	}
+	printf("    %zu rays had their nearest instance hidden by a mask\n", hidden);
+	Check(group, hidden > rays.size() / 10, "masks hid too few hits to test", (double)hidden);
+
+	return Report(group);
+}
+
+
+// --------------------------------------------------------
+// Runs every group (even after a failure, so one run shows
+// everything that's broken)
+// --------------------------------------------------------
+bool RunSelfTests()
+{
+	printf("Self tests (seed %d):\n", SELF_TEST_SEED);
+
+	bool passed = true;
+	passed &= TestSnorm16();
+	passed &= TestOctahedral();
+	passed &= TestVertexPacking();
+	passed &= TestMeshlets();
+	passed &= TestBvhCache();
+	passed &= TestAssetPack();
+	passed &= TestWatertight();
+	passed &= TestObjParse();
+	passed &= TestMeshOptimizer();
+	passed &= TestTangents();
+	passed &= TestLods();
+	passed &= TestBvh();
+	passed &= TestSpatialSplits();
+	passed &= TestLinearBvh();
+	passed &= TestBvh8();
+	passed &= TestBvh8Compressed();
+	passed &= TestBvhPackets();
+	passed &= TestBvhStream();
+	passed &= TestSceneBvhUpdate();
+	passed &= TestOcclusion();
+
+	printf("%s\n", passed ? "All self tests passed" : "SELF TESTS FAILED");
+	return passed;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Runs the CPU-side correctness checks (no GPU needed), printing
+// each group's result.  Returns true if everything passed.
+bool RunSelfTests();
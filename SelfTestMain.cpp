@@ -0,0 +1,11 @@
+#include "SelfTest.h"
+
+// --------------------------------------------------------
+// Entry point for the headless build (see CMakeLists.txt),
+// which only runs the self tests.  The game runs them with
+// -selftest instead.
+// --------------------------------------------------------
+int main()
+{
+	return RunSelfTests() ? 0 : 1;
+}
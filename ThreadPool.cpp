@@ -0,0 +1,139 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <memory>
+
+// Singleton requirement
+ThreadPool* ThreadPool::instance;
+
+// --------------------------------------------------------
+// Shared state for a single ParallelFor call.  Helpers hold
+// a reference to this, so one that only gets scheduled after
+// the call has returned simply finds no work left.
+// --------------------------------------------------------
+struct ParallelForState
+{
+	std::atomic<size_t> next;
+	std::atomic<size_t> completed;
+	size_t count;
+	const std::function<void(size_t)>* job;
+
+	std::mutex doneMutex;
+	std::condition_variable doneCondition;
+
+	// Grabs and runs indices until there are none left
+	void Work()
+	{
+		size_t finished = 0;
+		for (size_t i = next++; i < count; i = next++)
+		{
+			(*job)(i);
+			finished++;
+		}
+
+		if (finished > 0 && (completed += finished) == count)
+		{
+			std::lock_guard<std::mutex> lock(doneMutex);
+			doneCondition.notify_all();
+		}
+	}
+};
+
+
+// --------------------------------------------------------
+// Starts one worker per hardware thread, minus one for the
+// thread that calls ParallelFor (which helps out)
+// --------------------------------------------------------
+ThreadPool::ThreadPool() :
+	stopping(false),
+	threadLimit(UINT_MAX)
+{
+	unsigned int hardwareThreads = std::thread::hardware_concurrency();
+	unsigned int workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+
+	for (unsigned int i = 0; i < workerCount; i++)
+		workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+
+// --------------------------------------------------------
+// Lets the workers finish what's queued and joins them
+// --------------------------------------------------------
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueCondition.notify_all();
+
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+
+// --------------------------------------------------------
+// Runs job(i) for every i in [0, count) across the pool
+//
+// - The calling thread works too, so this is safe to call
+//    from inside another job without deadlocking
+// - Indices are handed out dynamically, so uneven jobs
+//    still balance across threads
+// --------------------------------------------------------
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& job)
+{
+	if (count == 0)
+		return;
+
+	// Nothing to gain from waking anyone up
+	if (count == 1 || workers.empty() || threadLimit == 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			job(i);
+		return;
+	}
+
+	std::shared_ptr<ParallelForState> state = std::make_shared<ParallelForState>();
+	state->next = 0;
+	state->completed = 0;
+	state->count = count;
+	state->job = &job;
+
+	// Wake up as many helpers as could possibly be useful
+	size_t helpers = (std::min)({ count - 1, workers.size(), (size_t)threadLimit - 1 });
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		for (size_t i = 0; i < helpers; i++)
+			queue.push_back([state]() { state->Work(); });
+	}
+	queueCondition.notify_all();
+
+	// Pitch in, then wait for any stragglers
+	state->Work();
+
+	std::unique_lock<std::mutex> lock(state->doneMutex);
+	state->doneCondition.wait(lock, [&]() { return state->completed == count; });
+}
+
+
+// --------------------------------------------------------
+// Each worker pulls jobs off the queue until shutdown
+// --------------------------------------------------------
+void ThreadPool::WorkerLoop()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueCondition.wait(lock, [&]() { return stopping || !queue.empty(); });
+			if (stopping && queue.empty())
+				return;
+
+			task = std::move(queue.front());
+			queue.pop_front();
+		}
+
+		task();
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+#pragma region Singleton
+public:
+	// Gets the one and only instance of this class
+	static ThreadPool& GetInstance()
+	{
+		if (!instance)
+		{
+			instance = new ThreadPool();
+		}
+
+		return *instance;
+	}
+
+	// Remove these functions (C++ 11 version)
+	ThreadPool(ThreadPool const&) = delete;
+	void operator=(ThreadPool const&) = delete;
+
+private:
+	static ThreadPool* instance;
+	ThreadPool();
+#pragma endregion
+
+public:
+	~ThreadPool();
+
+	// Total threads that work on a ParallelFor (workers + caller)
+	unsigned int GetThreadCount() { return (unsigned int)workers.size() + 1 < threadLimit ? (unsigned int)workers.size() + 1 : threadLimit; }
+
+	// Caps how many threads (counting the caller) each ParallelFor
+	// uses from now on, for measuring scaling.  Zero lifts the cap.
+	void SetThreadLimit(unsigned int limit) { threadLimit = limit > 0 ? limit : UINT_MAX; }
+
+	// Runs job(i) for every i in [0, count), blocking until all are done
+	void ParallelFor(size_t count, const std::function<void(size_t)>& job);
+
+	// Queues a single job, returning a future for its result
+	template<typename Function>
+	std::future<decltype(std::declval<Function>()())> Submit(Function job);
+
+private:
+	std::vector<std::thread> workers;
+
+	// Pending work, protected by the mutex
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	std::deque<std::function<void()>> queue;
+	bool stopping;
+	unsigned int threadLimit;
+
+	void WorkerLoop();
+};
+
+
+// --------------------------------------------------------
+// Queues a job to run on a worker and returns a future that
+// holds its result (or exception) once it has run.  With no
+// workers (single core machines), the job runs right away.
+//
+// Note: Don't block on one of these futures from inside
+// another queued job, as it may still be in the queue.
+// --------------------------------------------------------
+template<typename Function>
+std::future<decltype(std::declval<Function>()())> ThreadPool::Submit(Function job)
+{
+	typedef decltype(std::declval<Function>()()) Result;
+	std::shared_ptr<std::packaged_task<Result()>> task =
+		std::make_shared<std::packaged_task<Result()>>(std::move(job));
+	std::future<Result> result = task->get_future();
+
+	if (workers.empty())
+	{
+		(*task)();
+		return result;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		queue.push_back([task]() { (*task)(); });
+	}
+	queueCondition.notify_one();
+	return result;
+}
@@ -41,6 +41,10 @@ public:
 	DirectX::XMFLOAT4X4 GetWorldMatrix();
 	DirectX::XMFLOAT4X4 GetWorldInverseTransposeMatrix();
 
+	// Goes up every time the transform changes, so others can
+	// tell whether it moved since they last looked
+	unsigned int GetVersion() { return version; }
+
 private:
 	// Raw transformation data
 	DirectX::XMFLOAT3 position;
@@ -57,6 +61,7 @@ private:
 	bool matricesDirty;
 	DirectX::XMFLOAT4X4 worldMatrix;
 	DirectX::XMFLOAT4X4 worldInverseTransposeMatrix;
+	unsigned int version;
 
 	// Helper to update both matrices if necessary
 	void UpdateMatrices();
@@ -0,0 +1,21 @@
+#pragma once
+
+// --------------------------------------------------------
+// Which vertex layout ends up in GPU vertex buffers.
+//
+// This file is included by both C++ and Raytracing.hlsl, so
+// it must only ever contain preprocessor defines.
+//
+//  - FULL:   The 44 byte Vertex struct, as-is
+//  - HALF:   20 bytes - fp16 positions and UVs, octahedral
+//             snorm16 normals and tangents
+//  - NORM16: 20 bytes - Same as HALF, but positions are snorm16
+//             relative to the mesh's bounding box, which gives
+//             even precision across the whole mesh
+// --------------------------------------------------------
+#define VERTEX_LAYOUT_FULL		0
+#define VERTEX_LAYOUT_HALF		1
+#define VERTEX_LAYOUT_NORM16	2
+
+// Change this (and rebuild) to switch layouts
+#define VERTEX_LAYOUT VERTEX_LAYOUT_NORM16
@@ -0,0 +1,175 @@
+#include "VertexPacking.h"
+
+#include <DirectXPackedVector.h>
+#include <cmath>
+
+using namespace DirectX;
+using namespace DirectX::PackedVector;
+
+// --------------------------------------------------------
+// Centers the quantization on the bounding box.  Flat axes
+// (like the Y of a quad) get a zero extent, so every vertex
+// decodes to exactly the center on that axis.
+// --------------------------------------------------------
+VertexQuantization CalculateQuantization(XMFLOAT3 boundsMin, XMFLOAT3 boundsMax)
+{
+	VertexQuantization q = {};
+	q.Center = XMFLOAT3(
+		(boundsMin.x + boundsMax.x) * 0.5f,
+		(boundsMin.y + boundsMax.y) * 0.5f,
+		(boundsMin.z + boundsMax.z) * 0.5f);
+	q.HalfExtent = XMFLOAT3(
+		(boundsMax.x - boundsMin.x) * 0.5f,
+		(boundsMax.y - boundsMin.y) * 0.5f,
+		(boundsMax.z - boundsMin.z) * 0.5f);
+	return q;
+}
+
+
+// --------------------------------------------------------
+// Signed normalized 16-bit values, matching the D3D rules
+// (-32768 and -32767 both decode to -1)
+// --------------------------------------------------------
+int16_t EncodeSnorm16(float value)
+{
+	if (!(value > -1.0f)) value = -1.0f; // Also catches NaN
+	if (value > 1.0f) value = 1.0f;
+	return (int16_t)std::lround(value * 32767.0f);
+}
+
+float DecodeSnorm16(int16_t value)
+{
+	float result = value / 32767.0f;
+	return result < -1.0f ? -1.0f : result;
+}
+
+
+// --------------------------------------------------------
+// Octahedral encoding of a unit vector into two snorm16s.
+// Projects onto the octahedron |x|+|y|+|z| = 1 and folds the
+// lower half over the upper, for an error well under 0.01
+// degrees.
+//
+// See: Cigolle et al., "A Survey of Efficient Representations
+//      for Independent Unit Vectors" (JCGT 2014)
+// --------------------------------------------------------
+void EncodeOctahedral(XMFLOAT3 d, int16_t encoded[2])
+{
+	float sum = fabsf(d.x) + fabsf(d.y) + fabsf(d.z);
+	if (sum == 0.0f)
+	{
+		encoded[0] = 0;
+		encoded[1] = 0;
+		return;
+	}
+
+	float x = d.x / sum;
+	float y = d.y / sum;
+	if (d.z < 0.0f)
+	{
+		float foldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float foldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+
+	encoded[0] = EncodeSnorm16(x);
+	encoded[1] = EncodeSnorm16(y);
+}
+
+XMFLOAT3 DecodeOctahedral(const int16_t encoded[2])
+{
+	float x = DecodeSnorm16(encoded[0]);
+	float y = DecodeSnorm16(encoded[1]);
+	float z = 1.0f - fabsf(x) - fabsf(y);
+
+	// Unfold the lower half
+	float t = z < 0.0f ? -z : 0.0f;
+	x += x >= 0.0f ? -t : t;
+	y += y >= 0.0f ? -t : t;
+
+	XMFLOAT3 d(x, y, z);
+	XMStoreFloat3(&d, XMVector3Normalize(XMLoadFloat3(&d)));
+	return d;
+}
+
+
+// --------------------------------------------------------
+// Full precision layout, which is just a copy
+// --------------------------------------------------------
+template<> Vertex EncodeVertex<Vertex>(const Vertex& vertex, const VertexQuantization&)
+{
+	return vertex;
+}
+
+template<> Vertex DecodeVertex<Vertex>(const Vertex& packed, const VertexQuantization&)
+{
+	return packed;
+}
+
+
+// --------------------------------------------------------
+// Half layout - positions are stored as-is in fp16, which is
+// plenty for small meshes near their origin
+// --------------------------------------------------------
+template<> VertexHalf EncodeVertex<VertexHalf>(const Vertex& vertex, const VertexQuantization&)
+{
+	VertexHalf packed = {};
+	packed.Position[0] = XMConvertFloatToHalf(vertex.Position.x);
+	packed.Position[1] = XMConvertFloatToHalf(vertex.Position.y);
+	packed.Position[2] = XMConvertFloatToHalf(vertex.Position.z);
+	EncodeOctahedral(vertex.Normal, packed.Normal);
+	EncodeOctahedral(vertex.Tangent, packed.Tangent);
+	packed.UV[0] = XMConvertFloatToHalf(vertex.UV.x);
+	packed.UV[1] = XMConvertFloatToHalf(vertex.UV.y);
+	return packed;
+}
+
+template<> Vertex DecodeVertex<VertexHalf>(const VertexHalf& packed, const VertexQuantization&)
+{
+	Vertex vertex = {};
+	vertex.Position.x = XMConvertHalfToFloat(packed.Position[0]);
+	vertex.Position.y = XMConvertHalfToFloat(packed.Position[1]);
+	vertex.Position.z = XMConvertHalfToFloat(packed.Position[2]);
+	vertex.UV.x = XMConvertHalfToFloat(packed.UV[0]);
+	vertex.UV.y = XMConvertHalfToFloat(packed.UV[1]);
+	vertex.Normal = DecodeOctahedral(packed.Normal);
+	vertex.Tangent = DecodeOctahedral(packed.Tangent);
+	return vertex;
+}
+
+
+// --------------------------------------------------------
+// Norm16 layout - positions are relative to the bounds, so
+// the error is at most 1/65534th of the mesh's size
+// --------------------------------------------------------
+static int16_t EncodeBoundsRelative(float value, float center, float halfExtent)
+{
+	return halfExtent > 0.0f ? EncodeSnorm16((value - center) / halfExtent) : 0;
+}
+
+template<> VertexNorm16 EncodeVertex<VertexNorm16>(const Vertex& vertex, const VertexQuantization& q)
+{
+	VertexNorm16 packed = {};
+	packed.Position[0] = EncodeBoundsRelative(vertex.Position.x, q.Center.x, q.HalfExtent.x);
+	packed.Position[1] = EncodeBoundsRelative(vertex.Position.y, q.Center.y, q.HalfExtent.y);
+	packed.Position[2] = EncodeBoundsRelative(vertex.Position.z, q.Center.z, q.HalfExtent.z);
+	EncodeOctahedral(vertex.Normal, packed.Normal);
+	EncodeOctahedral(vertex.Tangent, packed.Tangent);
+	packed.UV[0] = XMConvertFloatToHalf(vertex.UV.x);
+	packed.UV[1] = XMConvertFloatToHalf(vertex.UV.y);
+	return packed;
+}
+
+template<> Vertex DecodeVertex<VertexNorm16>(const VertexNorm16& packed, const VertexQuantization& q)
+{
+	Vertex vertex = {};
+	vertex.Position.x = q.Center.x + DecodeSnorm16(packed.Position[0]) * q.HalfExtent.x;
+	vertex.Position.y = q.Center.y + DecodeSnorm16(packed.Position[1]) * q.HalfExtent.y;
+	vertex.Position.z = q.Center.z + DecodeSnorm16(packed.Position[2]) * q.HalfExtent.z;
+	vertex.UV.x = XMConvertHalfToFloat(packed.UV[0]);
+	vertex.UV.y = XMConvertHalfToFloat(packed.UV[1]);
+	vertex.Normal = DecodeOctahedral(packed.Normal);
+	vertex.Tangent = DecodeOctahedral(packed.Tangent);
+	return vertex;
+}
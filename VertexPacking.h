@@ -0,0 +1,80 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstdint>
+
+#include "Vertex.h"
+#include "VertexLayout.h"
+
+// --------------------------------------------------------
+// How positions are mapped into [-1, 1] for layouts that
+// store them relative to the mesh's bounds:
+//   position = Center + packed * HalfExtent
+// --------------------------------------------------------
+struct VertexQuantization
+{
+	DirectX::XMFLOAT3 Center;
+	DirectX::XMFLOAT3 HalfExtent;
+};
+
+// --------------------------------------------------------
+// Packed vertex layouts (see VertexLayout.h).  Both are 20
+// bytes, and the position is always first and 4 components
+// wide, since that's what DXR accepts for 16-bit positions
+// (the 4th component is ignored).
+// --------------------------------------------------------
+struct VertexHalf
+{
+	uint16_t Position[4];	// fp16, w unused
+	int16_t Normal[2];		// Octahedral, snorm16
+	int16_t Tangent[2];		// Octahedral, snorm16
+	uint16_t UV[2];			// fp16
+};
+
+struct VertexNorm16
+{
+	int16_t Position[4];	// snorm16 relative to bounds, w unused
+	int16_t Normal[2];		// Octahedral, snorm16
+	int16_t Tangent[2];		// Octahedral, snorm16
+	uint16_t UV[2];			// fp16
+};
+
+// The layout that actually goes to the GPU
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
+typedef Vertex GPUVertex;
+#elif VERTEX_LAYOUT == VERTEX_LAYOUT_HALF
+typedef VertexHalf GPUVertex;
+#elif VERTEX_LAYOUT == VERTEX_LAYOUT_NORM16
+typedef VertexNorm16 GPUVertex;
+#endif
+
+// Quantization that covers the given bounding box
+VertexQuantization CalculateQuantization(DirectX::XMFLOAT3 boundsMin, DirectX::XMFLOAT3 boundsMax);
+
+// Scalar building blocks (shared by every layout)
+int16_t EncodeSnorm16(float value);
+float DecodeSnorm16(int16_t value);
+void EncodeOctahedral(DirectX::XMFLOAT3 direction, int16_t encoded[2]);
+DirectX::XMFLOAT3 DecodeOctahedral(const int16_t encoded[2]);
+
+// Conversion of a single vertex to and from a layout
+template<typename Layout> Layout EncodeVertex(const Vertex& vertex, const VertexQuantization& quantization);
+template<typename Layout> Vertex DecodeVertex(const Layout& packed, const VertexQuantization& quantization);
+
+template<> Vertex EncodeVertex<Vertex>(const Vertex& vertex, const VertexQuantization& quantization);
+template<> Vertex DecodeVertex<Vertex>(const Vertex& packed, const VertexQuantization& quantization);
+template<> VertexHalf EncodeVertex<VertexHalf>(const Vertex& vertex, const VertexQuantization& quantization);
+template<> Vertex DecodeVertex<VertexHalf>(const VertexHalf& packed, const VertexQuantization& quantization);
+template<> VertexNorm16 EncodeVertex<VertexNorm16>(const Vertex& vertex, const VertexQuantization& quantization);
+template<> Vertex DecodeVertex<VertexNorm16>(const VertexNorm16& packed, const VertexQuantization& quantization);
+
+
+// --------------------------------------------------------
+// Encodes an array of vertices into the given layout
+// --------------------------------------------------------
+template<typename Layout>
+void EncodeVertices(const Vertex* verts, size_t numVerts, const VertexQuantization& quantization, Layout* packed)
+{
+	for (size_t i = 0; i < numVerts; i++)
+		packed[i] = EncodeVertex<Layout>(verts[i], quantization);
+}
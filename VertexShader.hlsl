@@ -1,9 +1,14 @@
+// Shared with C++ - which layout is in the vertex buffers
+#include "VertexLayout.h"
+
 cbuffer ExternalData: register(b0)
 {
 	matrix world;
 	matrix wit;	//World Inverse Transpose
 	matrix view;
 	matrix proj;
+	float4 positionCenter;		// Vertex quantization (w unused)
+	float4 positionHalfExtent;
 }
 
 // Struct representing a single vertex worth of data
@@ -18,10 +23,17 @@ struct VertexShaderInput
 	//  |   Name          Semantic
 	//  |    |                |
 	//  v    v                v
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
 	float3 localPosition	: POSITION;     // XYZ position
 	float2 uv				: TEXCOORD;
 	float3 normal			: NORMAL;   
 	float3 tangent			: TANGENT;
+#else
+	float4 localPosition	: POSITION;     // fp16 or bounds-relative snorm16, w unused
+	float2 normal			: NORMAL;		// Octahedral
+	float2 tangent			: TANGENT;		// Octahedral
+	float2 uv				: TEXCOORD;
+#endif
 };
 
 // Struct representing the data we're sending down the pipeline
@@ -43,6 +55,18 @@ struct VertexToPixel
 	float3 worldPos			: POSITION;
 };
 
+// --------------------------------------------------------
+// Decodes an octahedral unit vector (see VertexPacking.cpp)
+// --------------------------------------------------------
+float3 DecodeOctahedral(float2 encoded)
+{
+	float3 d = float3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+	float t = saturate(-d.z);
+	d.x += d.x >= 0.0f ? -t : t;
+	d.y += d.y >= 0.0f ? -t : t;
+	return normalize(d);
+}
+
 // --------------------------------------------------------
 // The entry point (main method) for our vertex shader
 // 
@@ -55,13 +79,29 @@ VertexToPixel main( VertexShaderInput input )
 	// Set up output struct
 	VertexToPixel output;
 
+	// Unpack the vertex (the input layout has already
+	// converted the 16-bit values to floats)
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
+	float3 localPosition = input.localPosition;
+	float3 normal = input.normal;
+	float3 tangent = input.tangent;
+#else
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_HALF
+	float3 localPosition = input.localPosition.xyz;
+#elif VERTEX_LAYOUT == VERTEX_LAYOUT_NORM16
+	float3 localPosition = positionCenter.xyz + input.localPosition.xyz * positionHalfExtent.xyz;
+#endif
+	float3 normal = DecodeOctahedral(input.normal);
+	float3 tangent = DecodeOctahedral(input.tangent);
+#endif
+
 	matrix wvp = mul(proj, mul(view, world));
-	output.screenPosition = mul(wvp, float4(input.localPosition, 1.0f));
+	output.screenPosition = mul(wvp, float4(localPosition, 1.0f));
 
-	output.normal = normalize(mul((float3x3)wit, input.normal));
-	output.tangent = normalize(mul((float3x3)world, input.tangent));
+	output.normal = normalize(mul((float3x3)wit, normal));
+	output.tangent = normalize(mul((float3x3)world, tangent));
 
-	output.worldPos = mul(world, float4(input.localPosition, 1.0f)).xyz;
+	output.worldPos = mul(world, float4(localPosition, 1.0f)).xyz;
 
 	output.uv = input.uv;
 
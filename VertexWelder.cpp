@@ -0,0 +1,127 @@
+#include "VertexWelder.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Marks an unused slot in the hash table
+static const unsigned int EMPTY_SLOT = 0xFFFFFFFF;
+
+// --------------------------------------------------------
+// Gets the bits of a float, treating -0 and +0 as the same
+// value so they weld together
+// --------------------------------------------------------
+static inline uint32_t FloatBits(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return (bits << 1) == 0 ? 0 : bits;
+}
+
+// --------------------------------------------------------
+// Hashes the attributes that make a vertex unique before
+// tangents exist: position, uv and normal
+// --------------------------------------------------------
+static inline uint32_t HashVertex(const Vertex& v)
+{
+	const float values[8] = {
+		v.Position.x, v.Position.y, v.Position.z,
+		v.UV.x, v.UV.y,
+		v.Normal.x, v.Normal.y, v.Normal.z };
+
+	// FNV-1a over each 32-bit value
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < 8; i++)
+	{
+		hash ^= FloatBits(values[i]);
+		hash *= 16777619u;
+	}
+
+	// Fold the high bits down since the table masks off the low ones
+	return hash ^ (hash >> 15);
+}
+
+// --------------------------------------------------------
+// Are two vertices the same (ignoring tangents)?
+// --------------------------------------------------------
+static inline bool SameVertex(const Vertex& a, const Vertex& b)
+{
+	return
+		FloatBits(a.Position.x) == FloatBits(b.Position.x) &&
+		FloatBits(a.Position.y) == FloatBits(b.Position.y) &&
+		FloatBits(a.Position.z) == FloatBits(b.Position.z) &&
+		FloatBits(a.UV.x) == FloatBits(b.UV.x) &&
+		FloatBits(a.UV.y) == FloatBits(b.UV.y) &&
+		FloatBits(a.Normal.x) == FloatBits(b.Normal.x) &&
+		FloatBits(a.Normal.y) == FloatBits(b.Normal.y) &&
+		FloatBits(a.Normal.z) == FloatBits(b.Normal.z);
+}
+
+
+// --------------------------------------------------------
+// Welds the mesh's vertices in place
+//
+// - Vertices with bit-identical position, uv and normal are
+//    merged into one, so a file that creates a vertex per
+//    face corner becomes a properly indexed mesh
+// - Unique vertices keep the order they first appear in,
+//    so the output is deterministic
+// - Should run before tangents are calculated, since those
+//    are accumulated across shared vertices
+//
+// Returns the vertex counts before and after welding
+// --------------------------------------------------------
+WeldStats WeldVertices(MeshData& meshData)
+{
+	std::vector<Vertex>& verts = meshData.Vertices;
+	std::vector<unsigned int>& indices = meshData.Indices;
+
+	WeldStats stats = {};
+	stats.InputVertices = verts.size();
+	if (verts.empty())
+		return stats;
+
+	// Open addressing table, kept at most half full
+	size_t tableSize = 1;
+	while (tableSize < verts.size() * 2)
+		tableSize <<= 1;
+	std::vector<unsigned int> table(tableSize, EMPTY_SLOT);
+
+	// Maps each old vertex to its new (welded) index
+	std::vector<unsigned int> remap(verts.size());
+	unsigned int uniqueCount = 0;
+
+	for (size_t i = 0; i < verts.size(); i++)
+	{
+		size_t slot = HashVertex(verts[i]) & (tableSize - 1);
+		while (true)
+		{
+			unsigned int existing = table[slot];
+			if (existing == EMPTY_SLOT)
+			{
+				// First time seeing this vertex, so compact it
+				// toward the front (never overwrites anything
+				// we still need to read)
+				verts[uniqueCount] = verts[i];
+				table[slot] = uniqueCount;
+				remap[i] = uniqueCount++;
+				break;
+			}
+
+			if (SameVertex(verts[existing], verts[i]))
+			{
+				remap[i] = existing;
+				break;
+			}
+
+			slot = (slot + 1) & (tableSize - 1);
+		}
+	}
+
+	verts.resize(uniqueCount);
+	verts.shrink_to_fit();
+	for (size_t i = 0; i < indices.size(); i++)
+		indices[i] = remap[indices[i]];
+
+	stats.OutputVertices = uniqueCount;
+	return stats;
+}
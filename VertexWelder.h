@@ -0,0 +1,13 @@
+#pragma once
+
+#include "MeshData.h"
+
+// Results of welding a single mesh
+struct WeldStats
+{
+	size_t InputVertices;
+	size_t OutputVertices;
+};
+
+// Merges identical vertices and rewrites the index buffer to match
+WeldStats WeldVertices(MeshData& meshData);